@@ -0,0 +1,201 @@
+/*
+ * Copyright (c) 2013 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "project.h"
+
+/*
+ * Blit kernel microbenchmark: GB/s written by each kernel of blit.c, for
+ * every instruction set the CPU supports, and the speedup over the scalar
+ * kernels. Buffers are one 32bpp frame, so the copies run from and to
+ * memory rather than cache, as refreshes do.
+ *
+ *   blit-bench [seconds per run] [width] [height]
+ */
+
+static const char *isas[] = { "scalar", "sse2", "avx2" };
+
+enum kernel
+{
+  KERNEL_COPY,
+  KERNEL_RECT,
+  KERNEL_SWIZZLE,
+  KERNEL_FORCE_ALPHA,
+  KERNEL_EXPAND_565,
+  KERNEL_BLEND_ROWS,
+  KERNEL_SCALE_ROW,
+  KERNEL_COUNT
+};
+
+static const char *kernel_names[KERNEL_COUNT] = {
+  "copy", "rect", "swizzle", "force_alpha", "expand_565", "blend_rows",
+  "scale_row",
+};
+
+static unsigned int width = 1920;
+static unsigned int height = 1080;
+
+static uint32_t *src32, *src32b, *dst32;
+static uint16_t *src16;
+static uint32_t *scale_idx;
+static uint16_t *scale_w;
+
+static double
+now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *
+buffer_new (size_t size)
+{
+  void *p;
+
+  if (posix_memalign (&p, 64, size))
+    {
+      perror ("posix_memalign");
+      exit (1);
+    }
+  memset (p, 0x5a, size);       /* Fault the pages in. */
+
+  return p;
+}
+
+/* Run the kernel over one frame, return the bytes written. */
+static size_t
+kernel_run (enum kernel k)
+{
+  size_t pixels = (size_t) width * height;
+  size_t pitch = (size_t) width * 4;
+  unsigned int y;
+
+  switch (k)
+    {
+    case KERNEL_COPY:
+      blit_copy (dst32, src32, pixels * 4);
+      break;
+    case KERNEL_RECT:
+      /* A window in the middle of the frame, line by line. */
+      blit_rect (dst32 + width / 4, pitch, src32 + width / 4, pitch,
+                 pitch / 2, height);
+      return pitch / 2 * height;
+    case KERNEL_SWIZZLE:
+      blit_swizzle (dst32, src32, pixels);
+      break;
+    case KERNEL_FORCE_ALPHA:
+      blit_force_alpha (dst32, src32, pixels);
+      break;
+    case KERNEL_EXPAND_565:
+      blit_expand_565 (dst32, src16, pixels);
+      break;
+    case KERNEL_BLEND_ROWS:
+      blit_blend_rows (dst32, src32, src32b, 160, 96, pixels);
+      break;
+    case KERNEL_SCALE_ROW:
+      for (y = 0; y < height; y++)
+        blit_scale_row (dst32 + y * width, src32 + y * width, scale_idx,
+                        scale_w, width);
+      break;
+    default:
+      return 0;
+    }
+
+  return pixels * 4;
+}
+
+static double
+bench (enum kernel k, double seconds)
+{
+  unsigned long long bytes = 0;
+  double t0, t;
+
+  kernel_run (k);               /* Warm up. */
+
+  t0 = now ();
+  do
+    {
+      bytes += kernel_run (k);
+      t = now () - t0;
+    }
+  while (t < seconds);
+
+  return bytes / t / 1e9;
+}
+
+int
+main (int argc, char **argv)
+{
+  double seconds = argc > 1 ? atof (argv[1]) : 0.5;
+  double scalar[KERNEL_COUNT];
+  size_t pixels;
+  unsigned int i, k;
+
+  if (argc > 3)
+    {
+      width = strtoul (argv[2], NULL, 0);
+      height = strtoul (argv[3], NULL, 0);
+    }
+  if (width < 2 || !height)
+    {
+      fprintf (stderr, "usage: %s [seconds] [width height]\n", argv[0]);
+      return 1;
+    }
+  pixels = (size_t) width * height;
+
+  src32 = buffer_new (pixels * 4);
+  src32b = buffer_new (pixels * 4);
+  dst32 = buffer_new (pixels * 4);
+  src16 = buffer_new (pixels * 2);
+  scale_idx = buffer_new (width * sizeof (*scale_idx));
+  scale_w = buffer_new (width * sizeof (*scale_w));
+
+  /* Horizontal downscale by 1.5, the last source pixel is never crossed. */
+  for (i = 0; i < width; i++)
+    {
+      unsigned int x = (i * 3 / 2) % (width - 1);
+
+      scale_idx[i] = x;
+      scale_w[i] = (i * 3 % 2) * 128;
+    }
+
+  printf ("%ux%u, %.1f MB per frame, library default: %s\n", width, height,
+          pixels * 4 / 1e6, blit_isa ());
+  printf ("%-8s %-12s %10s %8s\n", "isa", "kernel", "GB/s", "speedup");
+
+  for (i = 0; i < sizeof (isas) / sizeof (isas[0]); i++)
+    {
+      if (blit_set_isa (isas[i]))
+        {
+          printf ("%-8s (not supported)\n", isas[i]);
+          continue;
+        }
+
+      for (k = 0; k < KERNEL_COUNT; k++)
+        {
+          double gbs = bench (k, seconds);
+
+          if (!i)
+            scalar[k] = gbs;
+          printf ("%-8s %-12s %10.2f %7.2fx\n", isas[i], kernel_names[k],
+                  gbs, gbs / scalar[k]);
+        }
+    }
+
+  return 0;
+}
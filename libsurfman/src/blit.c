@@ -0,0 +1,674 @@
+/*
+ * Copyright (c) 2013 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "project.h"
+
+#if defined (__x86_64__) || defined (__i386__)
+# define BLIT_X86 1
+# include <immintrin.h>
+#endif
+
+/*
+ * Framebuffer blit kernels.
+ *
+ * Scalar, SSE2 and AVX2 versions of each kernel; the best one the CPU
+ * supports is picked once when the library is loaded.
+ *
+ * blit_copy() and blit_rect() write to scanout memory (dumb buffers, VESA
+ * aperture, PBOs), which is usually write-combined and never read back by
+ * the CPU: copies of at least BLIT_STREAM_MIN bytes use non-temporal stores
+ * so they bypass the cache and fill whole WC lines.
+ *
+ * BGR565 pixels are read the way glgfx uploads them (GL_BGR with
+ * GL_UNSIGNED_SHORT_5_6_5): blue in the top 5 bits, red in the low 5 bits.
+ *
+ * The blend and scale kernels work on 32bpp pixels, channel by channel,
+ * with 8-bit fractional weights (256 is 1.0).
+ */
+
+#define BLIT_STREAM_MIN 256
+
+struct blit_ops
+{
+  const char *isa;
+
+  void (*copy) (uint8_t *dst, const uint8_t *src, size_t len);
+  void (*fence) (void);
+  void (*swizzle) (uint32_t *dst, const uint32_t *src, size_t n);
+  void (*force_alpha) (uint32_t *dst, const uint32_t *src, size_t n);
+  void (*expand_565) (uint32_t *dst, const uint16_t *src, size_t n);
+  void (*blend_rows) (uint32_t *dst, const uint32_t *a, const uint32_t *b,
+                      unsigned int wa, unsigned int wb, size_t n);
+  void (*scale_row) (uint32_t *dst, const uint32_t *src, const uint32_t *idx,
+                     const uint16_t *w, size_t n);
+};
+
+/*
+ * Scalar kernels, also used for the head and tail of the vector ones.
+ */
+static inline uint32_t
+swizzle_1 (uint32_t p)
+{
+  return (p & 0xff00ff00) | ((p >> 16) & 0xff) | ((p & 0xff) << 16);
+}
+
+static inline uint32_t
+expand_565_1 (uint16_t p)
+{
+  uint32_t b = p >> 11;
+  uint32_t g = (p >> 5) & 0x3f;
+  uint32_t r = p & 0x1f;
+
+  b = (b << 3) | (b >> 2);
+  g = (g << 2) | (g >> 4);
+  r = (r << 3) | (r >> 2);
+
+  return 0xff000000 | (r << 16) | (g << 8) | b;
+}
+
+static inline uint32_t
+blend_1 (uint32_t a, uint32_t b, unsigned int wa, unsigned int wb)
+{
+  uint32_t rb = ((a & 0x00ff00ff) * wa + (b & 0x00ff00ff) * wb) >> 8;
+  uint32_t ag = ((a >> 8) & 0x00ff00ff) * wa + ((b >> 8) & 0x00ff00ff) * wb;
+
+  return (rb & 0x00ff00ff) | (ag & 0xff00ff00);
+}
+
+static void
+copy_c (uint8_t *dst, const uint8_t *src, size_t len)
+{
+  memcpy (dst, src, len);
+}
+
+static void
+fence_c (void)
+{
+}
+
+static void
+swizzle_c (uint32_t *dst, const uint32_t *src, size_t n)
+{
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    dst[i] = swizzle_1 (src[i]);
+}
+
+static void
+force_alpha_c (uint32_t *dst, const uint32_t *src, size_t n)
+{
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    dst[i] = src[i] | 0xff000000;
+}
+
+static void
+expand_565_c (uint32_t *dst, const uint16_t *src, size_t n)
+{
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    dst[i] = expand_565_1 (src[i]);
+}
+
+static void
+blend_rows_c (uint32_t *dst, const uint32_t *a, const uint32_t *b,
+              unsigned int wa, unsigned int wb, size_t n)
+{
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    dst[i] = blend_1 (a[i], b[i], wa, wb);
+}
+
+static void
+scale_row_c (uint32_t *dst, const uint32_t *src, const uint32_t *idx,
+             const uint16_t *w, size_t n)
+{
+  size_t i;
+
+  for (i = 0; i < n; i++)
+    dst[i] = blend_1 (src[idx[i]], src[idx[i] + 1], 256 - w[i], w[i]);
+}
+
+static const struct blit_ops blit_ops_c = {
+  .isa = "scalar",
+  .copy = copy_c,
+  .fence = fence_c,
+  .swizzle = swizzle_c,
+  .force_alpha = force_alpha_c,
+  .expand_565 = expand_565_c,
+  .blend_rows = blend_rows_c,
+  .scale_row = scale_row_c,
+};
+
+#ifdef BLIT_X86
+
+/*
+ * SSE2 kernels.
+ */
+__attribute__ ((target ("sse2"))) static void
+copy_sse2 (uint8_t *dst, const uint8_t *src, size_t len)
+{
+  size_t head;
+
+  if (len < BLIT_STREAM_MIN)
+    {
+      memcpy (dst, src, len);
+      return;
+    }
+
+  head = -(uintptr_t) dst & 15;
+  memcpy (dst, src, head);
+  dst += head;
+  src += head;
+  len -= head;
+
+  for (; len >= 64; len -= 64, dst += 64, src += 64)
+    {
+      __m128i a = _mm_loadu_si128 ((const __m128i *) src);
+      __m128i b = _mm_loadu_si128 ((const __m128i *) (src + 16));
+      __m128i c = _mm_loadu_si128 ((const __m128i *) (src + 32));
+      __m128i d = _mm_loadu_si128 ((const __m128i *) (src + 48));
+
+      _mm_stream_si128 ((__m128i *) dst, a);
+      _mm_stream_si128 ((__m128i *) (dst + 16), b);
+      _mm_stream_si128 ((__m128i *) (dst + 32), c);
+      _mm_stream_si128 ((__m128i *) (dst + 48), d);
+    }
+  memcpy (dst, src, len);
+}
+
+__attribute__ ((target ("sse2"))) static void
+fence_sse2 (void)
+{
+  _mm_sfence ();
+}
+
+__attribute__ ((target ("sse2"))) static void
+swizzle_sse2 (uint32_t *dst, const uint32_t *src, size_t n)
+{
+  const __m128i ag = _mm_set1_epi32 (0xff00ff00);
+  const __m128i lo = _mm_set1_epi32 (0x000000ff);
+  size_t i;
+
+  for (i = 0; i + 4 <= n; i += 4)
+    {
+      __m128i p = _mm_loadu_si128 ((const __m128i *) (src + i));
+      __m128i r = _mm_and_si128 (_mm_srli_epi32 (p, 16), lo);
+      __m128i b = _mm_slli_epi32 (_mm_and_si128 (p, lo), 16);
+
+      p = _mm_or_si128 (_mm_and_si128 (p, ag), _mm_or_si128 (r, b));
+      _mm_storeu_si128 ((__m128i *) (dst + i), p);
+    }
+  swizzle_c (dst + i, src + i, n - i);
+}
+
+__attribute__ ((target ("sse2"))) static void
+force_alpha_sse2 (uint32_t *dst, const uint32_t *src, size_t n)
+{
+  const __m128i a = _mm_set1_epi32 (0xff000000);
+  size_t i;
+
+  for (i = 0; i + 4 <= n; i += 4)
+    {
+      __m128i p = _mm_loadu_si128 ((const __m128i *) (src + i));
+
+      _mm_storeu_si128 ((__m128i *) (dst + i), _mm_or_si128 (p, a));
+    }
+  force_alpha_c (dst + i, src + i, n - i);
+}
+
+/* 4 BGR565 pixels, zero-extended to 32 bits, to BGRX8888. */
+__attribute__ ((target ("sse2"))) static inline __m128i
+expand_565_x4_sse2 (__m128i p)
+{
+  const __m128i m5 = _mm_set1_epi32 (0x1f);
+  const __m128i m6 = _mm_set1_epi32 (0x3f);
+  const __m128i a = _mm_set1_epi32 (0xff000000);
+  __m128i b = _mm_srli_epi32 (p, 11);
+  __m128i g = _mm_and_si128 (_mm_srli_epi32 (p, 5), m6);
+  __m128i r = _mm_and_si128 (p, m5);
+
+  b = _mm_or_si128 (_mm_slli_epi32 (b, 3), _mm_srli_epi32 (b, 2));
+  g = _mm_or_si128 (_mm_slli_epi32 (g, 2), _mm_srli_epi32 (g, 4));
+  r = _mm_or_si128 (_mm_slli_epi32 (r, 3), _mm_srli_epi32 (r, 2));
+
+  return _mm_or_si128 (_mm_or_si128 (a, _mm_slli_epi32 (r, 16)),
+                       _mm_or_si128 (_mm_slli_epi32 (g, 8), b));
+}
+
+__attribute__ ((target ("sse2"))) static void
+expand_565_sse2 (uint32_t *dst, const uint16_t *src, size_t n)
+{
+  const __m128i zero = _mm_setzero_si128 ();
+  size_t i;
+
+  for (i = 0; i + 8 <= n; i += 8)
+    {
+      __m128i p = _mm_loadu_si128 ((const __m128i *) (src + i));
+
+      _mm_storeu_si128 ((__m128i *) (dst + i),
+                        expand_565_x4_sse2 (_mm_unpacklo_epi16 (p, zero)));
+      _mm_storeu_si128 ((__m128i *) (dst + i + 4),
+                        expand_565_x4_sse2 (_mm_unpackhi_epi16 (p, zero)));
+    }
+  expand_565_c (dst + i, src + i, n - i);
+}
+
+/* (a * wa + b * wb) >> 8 on 16-bit lanes, wa + wb <= 256 never overflows. */
+__attribute__ ((target ("sse2"))) static inline __m128i
+blend_x8_sse2 (__m128i a, __m128i b, __m128i wa, __m128i wb)
+{
+  return _mm_srli_epi16 (_mm_add_epi16 (_mm_mullo_epi16 (a, wa),
+                                        _mm_mullo_epi16 (b, wb)), 8);
+}
+
+__attribute__ ((target ("sse2"))) static void
+blend_rows_sse2 (uint32_t *dst, const uint32_t *a, const uint32_t *b,
+                 unsigned int wa, unsigned int wb, size_t n)
+{
+  const __m128i zero = _mm_setzero_si128 ();
+  const __m128i va = _mm_set1_epi16 (wa);
+  const __m128i vb = _mm_set1_epi16 (wb);
+  size_t i;
+
+  for (i = 0; i + 4 <= n; i += 4)
+    {
+      __m128i pa = _mm_loadu_si128 ((const __m128i *) (a + i));
+      __m128i pb = _mm_loadu_si128 ((const __m128i *) (b + i));
+      __m128i lo = blend_x8_sse2 (_mm_unpacklo_epi8 (pa, zero),
+                                  _mm_unpacklo_epi8 (pb, zero), va, vb);
+      __m128i hi = blend_x8_sse2 (_mm_unpackhi_epi8 (pa, zero),
+                                  _mm_unpackhi_epi8 (pb, zero), va, vb);
+
+      _mm_storeu_si128 ((__m128i *) (dst + i), _mm_packus_epi16 (lo, hi));
+    }
+  blend_rows_c (dst + i, a + i, b + i, wa, wb, n - i);
+}
+
+/*
+ * Interleave the two source pixels of each destination pixel channel by
+ * channel, so that one pmaddwd per pixel weights and sums them: with
+ * /pair/ holding a0 a1 b0 b1, the 16-bit lanes of /lo/ are a0.B b0.B a0.G
+ * b0.G ... and those of /hi/ the same for pixel 1.
+ */
+__attribute__ ((target ("sse2"))) static inline void
+scale_pairs_sse2 (__m128i pair, __m128i *lo, __m128i *hi)
+{
+  const __m128i zero = _mm_setzero_si128 ();
+  __m128i ab = _mm_unpacklo_epi8 (pair, _mm_srli_si128 (pair, 8));
+
+  *lo = _mm_unpacklo_epi8 (ab, zero);
+  *hi = _mm_unpackhi_epi8 (ab, zero);
+}
+
+/*
+ * Four destination pixels per step. Each source pair is one 64-bit load,
+ * the weights (256 - w, w) of each pixel one 32-bit lane.
+ */
+__attribute__ ((target ("sse2"))) static void
+scale_row_sse2 (uint32_t *dst, const uint32_t *src, const uint32_t *idx,
+                const uint16_t *w, size_t n)
+{
+  const __m128i one = _mm_set1_epi16 (256);
+  size_t i;
+
+  for (i = 0; i + 4 <= n; i += 4)
+    {
+      __m128i wb = _mm_loadl_epi64 ((const __m128i *) (w + i));
+      __m128i wab = _mm_unpacklo_epi16 (_mm_sub_epi16 (one, wb), wb);
+      __m128i p0 = _mm_loadl_epi64 ((const __m128i *) (src + idx[i]));
+      __m128i p1 = _mm_loadl_epi64 ((const __m128i *) (src + idx[i + 1]));
+      __m128i p2 = _mm_loadl_epi64 ((const __m128i *) (src + idx[i + 2]));
+      __m128i p3 = _mm_loadl_epi64 ((const __m128i *) (src + idx[i + 3]));
+      __m128i x0, x1, x2, x3, lo, hi;
+
+      scale_pairs_sse2 (_mm_unpacklo_epi32 (p0, p1), &x0, &x1);
+      scale_pairs_sse2 (_mm_unpacklo_epi32 (p2, p3), &x2, &x3);
+
+      x0 = _mm_madd_epi16 (x0, _mm_shuffle_epi32 (wab, 0x00));
+      x1 = _mm_madd_epi16 (x1, _mm_shuffle_epi32 (wab, 0x55));
+      x2 = _mm_madd_epi16 (x2, _mm_shuffle_epi32 (wab, 0xaa));
+      x3 = _mm_madd_epi16 (x3, _mm_shuffle_epi32 (wab, 0xff));
+
+      lo = _mm_packs_epi32 (_mm_srli_epi32 (x0, 8), _mm_srli_epi32 (x1, 8));
+      hi = _mm_packs_epi32 (_mm_srli_epi32 (x2, 8), _mm_srli_epi32 (x3, 8));
+      _mm_storeu_si128 ((__m128i *) (dst + i), _mm_packus_epi16 (lo, hi));
+    }
+  scale_row_c (dst + i, src, idx + i, w + i, n - i);
+}
+
+static const struct blit_ops blit_ops_sse2 = {
+  .isa = "sse2",
+  .copy = copy_sse2,
+  .fence = fence_sse2,
+  .swizzle = swizzle_sse2,
+  .force_alpha = force_alpha_sse2,
+  .expand_565 = expand_565_sse2,
+  .blend_rows = blend_rows_sse2,
+  .scale_row = scale_row_sse2,
+};
+
+/*
+ * AVX2 kernels.
+ */
+__attribute__ ((target ("avx2"))) static void
+copy_avx2 (uint8_t *dst, const uint8_t *src, size_t len)
+{
+  size_t head;
+
+  if (len < BLIT_STREAM_MIN)
+    {
+      memcpy (dst, src, len);
+      return;
+    }
+
+  head = -(uintptr_t) dst & 31;
+  memcpy (dst, src, head);
+  dst += head;
+  src += head;
+  len -= head;
+
+  for (; len >= 128; len -= 128, dst += 128, src += 128)
+    {
+      __m256i a = _mm256_loadu_si256 ((const __m256i *) src);
+      __m256i b = _mm256_loadu_si256 ((const __m256i *) (src + 32));
+      __m256i c = _mm256_loadu_si256 ((const __m256i *) (src + 64));
+      __m256i d = _mm256_loadu_si256 ((const __m256i *) (src + 96));
+
+      _mm256_stream_si256 ((__m256i *) dst, a);
+      _mm256_stream_si256 ((__m256i *) (dst + 32), b);
+      _mm256_stream_si256 ((__m256i *) (dst + 64), c);
+      _mm256_stream_si256 ((__m256i *) (dst + 96), d);
+    }
+  for (; len >= 32; len -= 32, dst += 32, src += 32)
+    _mm256_stream_si256 ((__m256i *) dst,
+                         _mm256_loadu_si256 ((const __m256i *) src));
+  memcpy (dst, src, len);
+}
+
+__attribute__ ((target ("avx2"))) static void
+swizzle_avx2 (uint32_t *dst, const uint32_t *src, size_t n)
+{
+  const __m256i shuf = _mm256_setr_epi8 (2, 1, 0, 3, 6, 5, 4, 7,
+                                         10, 9, 8, 11, 14, 13, 12, 15,
+                                         2, 1, 0, 3, 6, 5, 4, 7,
+                                         10, 9, 8, 11, 14, 13, 12, 15);
+  size_t i;
+
+  for (i = 0; i + 8 <= n; i += 8)
+    {
+      __m256i p = _mm256_loadu_si256 ((const __m256i *) (src + i));
+
+      _mm256_storeu_si256 ((__m256i *) (dst + i), _mm256_shuffle_epi8 (p, shuf));
+    }
+  swizzle_c (dst + i, src + i, n - i);
+}
+
+__attribute__ ((target ("avx2"))) static void
+force_alpha_avx2 (uint32_t *dst, const uint32_t *src, size_t n)
+{
+  const __m256i a = _mm256_set1_epi32 (0xff000000);
+  size_t i;
+
+  for (i = 0; i + 8 <= n; i += 8)
+    {
+      __m256i p = _mm256_loadu_si256 ((const __m256i *) (src + i));
+
+      _mm256_storeu_si256 ((__m256i *) (dst + i), _mm256_or_si256 (p, a));
+    }
+  force_alpha_c (dst + i, src + i, n - i);
+}
+
+__attribute__ ((target ("avx2"))) static void
+expand_565_avx2 (uint32_t *dst, const uint16_t *src, size_t n)
+{
+  const __m256i m5 = _mm256_set1_epi32 (0x1f);
+  const __m256i m6 = _mm256_set1_epi32 (0x3f);
+  const __m256i a = _mm256_set1_epi32 (0xff000000);
+  size_t i;
+
+  for (i = 0; i + 8 <= n; i += 8)
+    {
+      __m256i p = _mm256_cvtepu16_epi32 (_mm_loadu_si128 ((const __m128i *) (src + i)));
+      __m256i b = _mm256_srli_epi32 (p, 11);
+      __m256i g = _mm256_and_si256 (_mm256_srli_epi32 (p, 5), m6);
+      __m256i r = _mm256_and_si256 (p, m5);
+
+      b = _mm256_or_si256 (_mm256_slli_epi32 (b, 3), _mm256_srli_epi32 (b, 2));
+      g = _mm256_or_si256 (_mm256_slli_epi32 (g, 2), _mm256_srli_epi32 (g, 4));
+      r = _mm256_or_si256 (_mm256_slli_epi32 (r, 3), _mm256_srli_epi32 (r, 2));
+
+      p = _mm256_or_si256 (_mm256_or_si256 (a, _mm256_slli_epi32 (r, 16)),
+                           _mm256_or_si256 (_mm256_slli_epi32 (g, 8), b));
+      _mm256_storeu_si256 ((__m256i *) (dst + i), p);
+    }
+  expand_565_c (dst + i, src + i, n - i);
+}
+
+__attribute__ ((target ("avx2"))) static void
+blend_rows_avx2 (uint32_t *dst, const uint32_t *a, const uint32_t *b,
+                 unsigned int wa, unsigned int wb, size_t n)
+{
+  const __m256i zero = _mm256_setzero_si256 ();
+  const __m256i va = _mm256_set1_epi16 (wa);
+  const __m256i vb = _mm256_set1_epi16 (wb);
+  size_t i;
+
+  /* unpack and pack both work within 128-bit lanes, so they cancel out. */
+  for (i = 0; i + 8 <= n; i += 8)
+    {
+      __m256i pa = _mm256_loadu_si256 ((const __m256i *) (a + i));
+      __m256i pb = _mm256_loadu_si256 ((const __m256i *) (b + i));
+      __m256i lo = _mm256_add_epi16 (
+          _mm256_mullo_epi16 (_mm256_unpacklo_epi8 (pa, zero), va),
+          _mm256_mullo_epi16 (_mm256_unpacklo_epi8 (pb, zero), vb));
+      __m256i hi = _mm256_add_epi16 (
+          _mm256_mullo_epi16 (_mm256_unpackhi_epi8 (pa, zero), va),
+          _mm256_mullo_epi16 (_mm256_unpackhi_epi8 (pb, zero), vb));
+
+      _mm256_storeu_si256 ((__m256i *) (dst + i),
+                           _mm256_packus_epi16 (_mm256_srli_epi16 (lo, 8),
+                                                _mm256_srli_epi16 (hi, 8)));
+    }
+  blend_rows_c (dst + i, a + i, b + i, wa, wb, n - i);
+}
+
+/*
+ * Four of the eight destination pixels of a step: the source pairs of
+ * pixels 0 1 in the low 128-bit lane, of 2 3 in the high one, each lane
+ * then goes through the SSE2 steps. Loading the pairs one by one beats
+ * vpgatherqq.
+ */
+__attribute__ ((target ("avx2"))) static inline __m256i
+scale_x4_avx2 (const uint32_t *src, const uint32_t *idx, const uint16_t *w)
+{
+  const __m256i zero = _mm256_setzero_si256 ();
+  const __m256i one = _mm256_set1_epi32 (256);
+  const __m256i even = _mm256_setr_epi32 (0, 0, 0, 0, 2, 2, 2, 2);
+  const __m256i odd = _mm256_setr_epi32 (1, 1, 1, 1, 3, 3, 3, 3);
+  __m256i wb = _mm256_cvtepu16_epi32 (_mm_loadl_epi64 ((const __m128i *) w));
+  __m256i wab = _mm256_or_si256 (_mm256_sub_epi32 (one, wb),
+                                 _mm256_slli_epi32 (wb, 16));
+  __m256i pairs, ab, lo, hi;
+
+  /* a0 a1 b0 b1 | a2 a3 b2 b3 */
+  pairs = _mm256_inserti128_si256 (
+      _mm256_castsi128_si256 (
+          _mm_unpacklo_epi32 (_mm_loadl_epi64 ((const __m128i *) (src + idx[0])),
+                              _mm_loadl_epi64 ((const __m128i *) (src + idx[1])))),
+      _mm_unpacklo_epi32 (_mm_loadl_epi64 ((const __m128i *) (src + idx[2])),
+                          _mm_loadl_epi64 ((const __m128i *) (src + idx[3]))),
+      1);
+  ab = _mm256_unpacklo_epi8 (pairs, _mm256_srli_si256 (pairs, 8));
+
+  lo = _mm256_madd_epi16 (_mm256_unpacklo_epi8 (ab, zero),
+                          _mm256_permutevar8x32_epi32 (wab, even));
+  hi = _mm256_madd_epi16 (_mm256_unpackhi_epi8 (ab, zero),
+                          _mm256_permutevar8x32_epi32 (wab, odd));
+
+  /* Pixels 0 1 | 2 3, on 16-bit lanes. */
+  return _mm256_packs_epi32 (_mm256_srli_epi32 (lo, 8),
+                             _mm256_srli_epi32 (hi, 8));
+}
+
+__attribute__ ((target ("avx2"))) static void
+scale_row_avx2 (uint32_t *dst, const uint32_t *src, const uint32_t *idx,
+                const uint16_t *w, size_t n)
+{
+  size_t i;
+
+  for (i = 0; i + 8 <= n; i += 8)
+    {
+      __m256i p = _mm256_packus_epi16 (scale_x4_avx2 (src, idx + i, w + i),
+                                       scale_x4_avx2 (src, idx + i + 4,
+                                                      w + i + 4));
+
+      /* 0 1 4 5 | 2 3 6 7 back in order. */
+      _mm256_storeu_si256 ((__m256i *) (dst + i),
+                           _mm256_permute4x64_epi64 (p, 0xd8));
+    }
+  scale_row_c (dst + i, src, idx + i, w + i, n - i);
+}
+
+static const struct blit_ops blit_ops_avx2 = {
+  .isa = "avx2",
+  .copy = copy_avx2,
+  .fence = fence_sse2,
+  .swizzle = swizzle_avx2,
+  .force_alpha = force_alpha_avx2,
+  .expand_565 = expand_565_avx2,
+  .blend_rows = blend_rows_avx2,
+  .scale_row = scale_row_avx2,
+};
+
+#endif /* BLIT_X86 */
+
+static const struct blit_ops *blit_ops = &blit_ops_c;
+
+/* Uses CPUID (and XGETBV for AVX state) through the compiler builtins. */
+__attribute__ ((constructor)) static void
+blit_init (void)
+{
+#ifdef BLIT_X86
+  __builtin_cpu_init ();
+
+  if (__builtin_cpu_supports ("avx2"))
+    blit_ops = &blit_ops_avx2;
+  else if (__builtin_cpu_supports ("sse2"))
+    blit_ops = &blit_ops_sse2;
+#endif
+}
+
+const char *
+blit_isa (void)
+{
+  return blit_ops->isa;
+}
+
+/*
+ * Force the kernels of /isa/ ("scalar", "sse2" or "avx2"), for comparisons.
+ * Return -1 if they are not built in or the CPU lacks them.
+ */
+int
+blit_set_isa (const char *isa)
+{
+  if (!strcmp (isa, blit_ops_c.isa))
+    {
+      blit_ops = &blit_ops_c;
+      return 0;
+    }
+#ifdef BLIT_X86
+  if (!strcmp (isa, blit_ops_sse2.isa) && __builtin_cpu_supports ("sse2"))
+    {
+      blit_ops = &blit_ops_sse2;
+      return 0;
+    }
+  if (!strcmp (isa, blit_ops_avx2.isa) && __builtin_cpu_supports ("avx2"))
+    {
+      blit_ops = &blit_ops_avx2;
+      return 0;
+    }
+#endif
+
+  return -1;
+}
+
+void
+blit_copy (void *dst, const void *src, size_t len)
+{
+  blit_ops->copy (dst, src, len);
+  blit_ops->fence ();
+}
+
+void
+blit_rect (void *dst, size_t dst_pitch, const void *src, size_t src_pitch,
+           size_t line_len, unsigned int lines)
+{
+  uint8_t *d = dst;
+  const uint8_t *s = src;
+  unsigned int i;
+
+  if (!lines || !line_len)
+    return;
+
+  /* Whole lines with matching pitches are one contiguous copy. */
+  if (dst_pitch == src_pitch && line_len == src_pitch)
+    {
+      blit_copy (dst, src, line_len * lines);
+      return;
+    }
+
+  for (i = 0; i < lines; i++, d += dst_pitch, s += src_pitch)
+    blit_ops->copy (d, s, line_len);
+  blit_ops->fence ();
+}
+
+void
+blit_swizzle (uint32_t *dst, const uint32_t *src, size_t n)
+{
+  blit_ops->swizzle (dst, src, n);
+}
+
+void
+blit_force_alpha (uint32_t *dst, const uint32_t *src, size_t n)
+{
+  blit_ops->force_alpha (dst, src, n);
+}
+
+void
+blit_expand_565 (uint32_t *dst, const uint16_t *src, size_t n)
+{
+  blit_ops->expand_565 (dst, src, n);
+}
+
+void
+blit_blend_rows (uint32_t *dst, const uint32_t *a, const uint32_t *b,
+                 unsigned int wa, unsigned int wb, size_t n)
+{
+  blit_ops->blend_rows (dst, a, b, wa, wb, n);
+}
+
+void
+blit_scale_row (uint32_t *dst, const uint32_t *src, const uint32_t *idx,
+                const uint16_t *w, size_t n)
+{
+  blit_ops->scale_row (dst, src, idx, w, n);
+}
@@ -73,6 +73,43 @@ const char *config_get (const char *prefix, const char *key)
   return v;
 }
 
+/*
+ * Unsigned value of prefix.key, def if it is unset or invalid, max if it is
+ * larger. Both cases are warned about.
+ */
+unsigned int config_get_uint_max (const char *prefix, const char *key,
+                                  unsigned int def, unsigned int max)
+{
+  const char *v = config_get (prefix, key);
+  char *end;
+  unsigned long n;
+
+  if (!v || !*v)
+    return def;
+
+  n = strtoul (v, &end, 0);
+  if (*end || *v == '-')
+    {
+      surfman_warning ("Invalid value \"%s\" for %s.%s, using %u",
+                       v, prefix, key, def);
+      return def;
+    }
+  if (n > max)
+    {
+      surfman_warning ("Value %s for %s.%s is larger than %u, using %u",
+                       v, prefix, key, max, max);
+      return max;
+    }
+
+  return n;
+}
+
+unsigned int config_get_uint (const char *prefix, const char *key,
+                              unsigned int def)
+{
+  return config_get_uint_max (prefix, key, def, UINT_MAX);
+}
+
 const char *config_dump (void)
 {
   struct config_entry *e;
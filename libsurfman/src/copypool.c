@@ -0,0 +1,419 @@
+/*
+ * Copyright (c) 2013 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE            /* pipe2, CPU affinity */
+#endif
+#include <sched.h>
+#include <event.h>
+
+#include "project.h"
+
+/*
+ * Copy worker pool.
+ *
+ * Plugins copying pixels on the CPU hand rectangles over to a pool of
+ * threads instead of blocking the event loop. Each rectangle is split in
+ * row bands spread across the workers. A fence gathers the copies of one
+ * refresh; once submitted, its done() callback runs in the event loop after
+ * the last band was copied.
+ *
+ * surfman.conf, [surfman] section:
+ *   copy_threads: number of workers (default: one less than the online
+ *                 CPUs, at most COPY_THREADS_MAX). 0 copies inline.
+ *   copy_cpus:    CPUs the workers are pinned to, e.g. "2,3,6-7"
+ *                 (worker i runs on the i-th CPU of the list, modulo its
+ *                 length). Unset leaves scheduling to the kernel.
+ */
+
+#define COPY_THREADS_MAX 8
+/* Smallest band worth another thread (bytes). */
+#define COPY_BAND_MIN (64 * 1024)
+
+struct copy_job
+{
+  struct copy_job *next;
+  copy_fence_t *fence;
+
+  uint8_t *dst;
+  size_t dst_pitch;
+  const uint8_t *src;
+  size_t src_pitch;
+  size_t line_len;
+  unsigned int lines;
+};
+
+struct copy_fence
+{
+  struct copy_fence *next;      /* Completion queue */
+
+  unsigned int pending;         /* Bands not copied yet */
+  unsigned int refs;
+  int submitted;
+
+  void (*done) (void *opaque);
+  void *opaque;
+};
+
+static struct
+{
+  pthread_once_t once;
+  pthread_mutex_t lock;
+  pthread_cond_t work;          /* Jobs were queued */
+  pthread_cond_t idle;          /* A fence has no pending band left */
+
+  struct copy_job *head;
+  struct copy_job **tail;
+  copy_fence_t *completed;
+
+  unsigned int threads;
+  int pipe[2];
+  struct event event;
+} pool = {
+  .once = PTHREAD_ONCE_INIT,
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .work = PTHREAD_COND_INITIALIZER,
+  .idle = PTHREAD_COND_INITIALIZER,
+  .pipe = { -1, -1 },
+};
+
+/* Caller holds pool.lock. */
+static void
+copy_fence_complete (copy_fence_t *f)
+{
+  char c = 0;
+
+  pthread_cond_broadcast (&pool.idle);
+  if (!f->submitted)
+    return;
+
+  f->next = pool.completed;
+  pool.completed = f;
+  if (!f->next && write (pool.pipe[1], &c, 1) != 1)
+    surfman_warning ("Could not signal copy completion: %s", strerror (errno));
+}
+
+static void *
+copy_worker (void *opaque)
+{
+  struct copy_job *job;
+
+  (void) opaque;
+
+  pthread_mutex_lock (&pool.lock);
+  for (;;)
+    {
+      while (!pool.head)
+        pthread_cond_wait (&pool.work, &pool.lock);
+
+      job = pool.head;
+      pool.head = job->next;
+      if (!pool.head)
+        pool.tail = &pool.head;
+      pthread_mutex_unlock (&pool.lock);
+
+      blit_rect (job->dst, job->dst_pitch, job->src, job->src_pitch,
+                 job->line_len, job->lines);
+
+      pthread_mutex_lock (&pool.lock);
+      if (!--job->fence->pending)
+        copy_fence_complete (job->fence);
+      free (job);
+    }
+
+  return NULL;
+}
+
+/* Deliver completed fences in the event loop. */
+static void
+copy_pool_handler (int fd, short event, void *opaque)
+{
+  copy_fence_t *f, *next;
+  char buf[16];
+
+  (void) event;
+  (void) opaque;
+
+  while (read (fd, buf, sizeof (buf)) > 0)
+    continue;
+
+  pthread_mutex_lock (&pool.lock);
+  f = pool.completed;
+  pool.completed = NULL;
+  pthread_mutex_unlock (&pool.lock);
+
+  for (; f; f = next)
+    {
+      next = f->next;
+      if (f->done)
+        f->done (f->opaque);
+      copy_fence_put (f);
+    }
+}
+
+/*
+ * Parse a "2,3,6-7" CPU list. Parsing stops, with a warning, at the first
+ * entry that is not a valid CPU or range of CPUs.
+ */
+static unsigned int
+copy_parse_cpus (const char *list, int *cpus, unsigned int max)
+{
+  const char *s = list;
+  unsigned int n = 0;
+  char *end;
+  long a, b;
+
+  while (*s && n < max)
+    {
+      a = strtol (s, &end, 10);
+      if (end == s || a < 0)
+        break;
+      b = a;
+      if (*end == '-')
+        {
+          const char *r = end + 1;
+
+          b = strtol (r, &end, 10);
+          if (end == r || b < a)
+            break;
+        }
+      if (b >= CPU_SETSIZE)
+        break;
+      for (; a <= b && n < max; a++)
+        cpus[n++] = a;
+      s = end;
+      while (*s == ',' || *s == ' ')
+        s++;
+    }
+
+  if (*s && n < max)
+    surfman_warning ("Invalid CPU list \"%s\" for surfman.copy_cpus, "
+                     "ignoring \"%s\"", list, s);
+
+  return n;
+}
+
+static void
+copy_pool_init (void)
+{
+  const char *cpu_list = config_get ("surfman", "copy_cpus");
+  int cpus[CPU_SETSIZE];
+  unsigned int i, ncpus = 0;
+  long online;
+
+  pool.tail = &pool.head;
+
+  online = sysconf (_SC_NPROCESSORS_ONLN);
+  pool.threads = online > 1 ? online - 1 : 0;
+  if (pool.threads > COPY_THREADS_MAX)
+    pool.threads = COPY_THREADS_MAX;
+  pool.threads = config_get_uint_max ("surfman", "copy_threads", pool.threads,
+                                      COPY_THREADS_MAX);
+  if (!pool.threads)
+    return;
+
+  if (pipe2 (pool.pipe, O_CLOEXEC | O_NONBLOCK))
+    {
+      surfman_error ("Could not create copy pool pipe: %s", strerror (errno));
+      pool.threads = 0;
+      return;
+    }
+  event_set (&pool.event, pool.pipe[0], EV_READ | EV_PERSIST,
+             copy_pool_handler, NULL);
+  event_add (&pool.event, NULL);
+
+  if (cpu_list)
+    ncpus = copy_parse_cpus (cpu_list, cpus, CPU_SETSIZE);
+
+  for (i = 0; i < pool.threads; i++)
+    {
+      pthread_t t;
+
+      if (pthread_create (&t, NULL, copy_worker, NULL))
+        {
+          surfman_error ("Could not start copy worker %u: %s", i,
+                         strerror (errno));
+          break;
+        }
+      pthread_detach (t);
+
+      if (ncpus)
+        {
+          cpu_set_t set;
+
+          CPU_ZERO (&set);
+          CPU_SET (cpus[i % ncpus], &set);
+          if (pthread_setaffinity_np (t, sizeof (set), &set))
+            surfman_warning ("Could not pin copy worker %u to CPU %d", i,
+                             cpus[i % ncpus]);
+        }
+    }
+  pool.threads = i;
+
+  surfman_info ("Copy pool: %u workers.", pool.threads);
+}
+
+/*
+ * Number of copy workers, 0 if copies happen inline.
+ */
+unsigned int
+copy_pool_threads (void)
+{
+  pthread_once (&pool.once, copy_pool_init);
+  return pool.threads;
+}
+
+/*
+ * Create a fence to gather copies. done(opaque), if not NULL, is called
+ * from the event loop once the fence is submitted and its copies are over.
+ * The caller owns a reference, dropped with copy_fence_put().
+ */
+copy_fence_t *
+copy_fence_new (void (*done) (void *opaque), void *opaque)
+{
+  copy_fence_t *f;
+
+  pthread_once (&pool.once, copy_pool_init);
+
+  f = xcalloc (1, sizeof (*f));
+  f->refs = 1;
+  f->done = done;
+  f->opaque = opaque;
+
+  return f;
+}
+
+/*
+ * Copy a rectangle (see blit_rect()) on behalf of fence.
+ * Memory on both sides must stay mapped until the fence is over.
+ */
+void
+copy_rect (copy_fence_t *fence, void *dst, size_t dst_pitch,
+           const void *src, size_t src_pitch, size_t line_len,
+           unsigned int lines)
+{
+  struct copy_job *job;
+  unsigned int bands, band, i;
+
+  assert (!fence->submitted);
+
+  if (!pool.threads)
+    {
+      blit_rect (dst, dst_pitch, src, src_pitch, line_len, lines);
+      return;
+    }
+  if (!lines || !line_len)
+    return;
+
+  bands = (line_len * lines) / COPY_BAND_MIN;
+  if (bands > pool.threads)
+    bands = pool.threads;
+  if (bands > lines)
+    bands = lines;
+  if (!bands)
+    bands = 1;
+  band = (lines + bands - 1) / bands;
+
+  pthread_mutex_lock (&pool.lock);
+  for (i = 0; i < lines; i += band)
+    {
+      job = xmalloc (sizeof (*job));
+      job->next = NULL;
+      job->fence = fence;
+      job->dst = (uint8_t *) dst + i * dst_pitch;
+      job->dst_pitch = dst_pitch;
+      job->src = (const uint8_t *) src + i * src_pitch;
+      job->src_pitch = src_pitch;
+      job->line_len = line_len;
+      job->lines = lines - i < band ? lines - i : band;
+
+      *pool.tail = job;
+      pool.tail = &job->next;
+      fence->pending++;
+    }
+  pthread_cond_broadcast (&pool.work);
+  pthread_mutex_unlock (&pool.lock);
+}
+
+/*
+ * No more copies will be added to fence: have done() called when they are
+ * over. Without workers, done() is called right away.
+ */
+void
+copy_fence_submit (copy_fence_t *fence)
+{
+  assert (!fence->submitted);
+
+  if (!pool.threads)
+    {
+      fence->submitted = 1;
+      if (fence->done)
+        fence->done (fence->opaque);
+      return;
+    }
+
+  pthread_mutex_lock (&pool.lock);
+  fence->submitted = 1;
+  fence->refs++;                /* Held until delivered */
+  if (!fence->pending)
+    copy_fence_complete (fence);
+  pthread_mutex_unlock (&pool.lock);
+}
+
+/*
+ * Have done() not called for fence, e.g. because its opaque goes away. The
+ * copies are still carried out.
+ */
+void
+copy_fence_cancel (copy_fence_t *fence)
+{
+  pthread_mutex_lock (&pool.lock);
+  fence->done = NULL;
+  pthread_mutex_unlock (&pool.lock);
+}
+
+int
+copy_fence_submitted (copy_fence_t *fence)
+{
+  return fence->submitted;
+}
+
+/*
+ * Wait for the copies queued on fence so far.
+ */
+void
+copy_fence_wait (copy_fence_t *fence)
+{
+  pthread_mutex_lock (&pool.lock);
+  while (fence->pending)
+    pthread_cond_wait (&pool.idle, &pool.lock);
+  pthread_mutex_unlock (&pool.lock);
+}
+
+void
+copy_fence_put (copy_fence_t *fence)
+{
+  unsigned int refs;
+
+  pthread_mutex_lock (&pool.lock);
+  refs = --fence->refs;
+  pthread_mutex_unlock (&pool.lock);
+
+  if (!refs)
+    free (fence);
+}
@@ -31,6 +31,7 @@
 # include <limits.h>
 
 # include <errno.h>
+# include <endian.h>
 # include <assert.h>
 
 # include <unistd.h>
@@ -44,6 +45,7 @@
 # include <string.h>
 
 # include <syslog.h>
+# include <time.h>
 
 # include <sys/mman.h>
 # include <sys/stat.h>
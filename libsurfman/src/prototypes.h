@@ -28,12 +28,45 @@ extern void xc_init(void);
 extern int xc_domid_exists(int domid);
 extern void *xc_mmap_foreign(void *addr, size_t length, int prot, int domid, xen_pfn_t *pages);
 int xc_translate_gpfn_to_mfn (int domid, size_t pfn_count, xen_pfn_t *pfns, pfn_t *mfns);
+/* surface.c, exported to surfman only */
+extern int surfman_surface_init(surfman_surface_t *surface);
+extern void surfman_surface_cleanup(surfman_surface_t *surface);
+extern void surfman_surface_update_mmap(surfman_surface_t *surface, int fd, size_t off);
+extern void surfman_surface_update_pfn_arr(surfman_surface_t *surface, const xen_pfn_t *pfns);
+extern void surfman_surface_update_pfn_linear(surfman_surface_t *surface, xen_pfn_t base);
 /* rect.c */
-extern int rect_from_dirty_bitmap(uint8_t *dirty, unsigned int width, unsigned int height, unsigned int stride, enum surfman_surface_format format, surfman_rect_t *rect);
+extern unsigned int rects_merge_gap(const char *prefix);
+extern unsigned int rects_from_dirty_bitmap(const uint8_t *dirty, unsigned int width, unsigned int height, unsigned int stride, enum surfman_surface_format format, unsigned int merge_gap, surfman_rect_t *rects, unsigned int max_rects);
+/* blit.c */
+extern const char *blit_isa(void);
+extern int blit_set_isa(const char *isa);
+extern void blit_copy(void *dst, const void *src, size_t len);
+extern void blit_rect(void *dst, size_t dst_pitch, const void *src, size_t src_pitch, size_t line_len, unsigned int lines);
+extern void blit_swizzle(uint32_t *dst, const uint32_t *src, size_t n);
+extern void blit_force_alpha(uint32_t *dst, const uint32_t *src, size_t n);
+extern void blit_expand_565(uint32_t *dst, const uint16_t *src, size_t n);
+extern void blit_blend_rows(uint32_t *dst, const uint32_t *a, const uint32_t *b, unsigned int wa, unsigned int wb, size_t n);
+extern void blit_scale_row(uint32_t *dst, const uint32_t *src, const uint32_t *idx, const uint16_t *w, size_t n);
+/* copypool.c */
+extern unsigned int copy_pool_threads(void);
+extern copy_fence_t *copy_fence_new(void (*done)(void *opaque), void *opaque);
+extern void copy_rect(copy_fence_t *fence, void *dst, size_t dst_pitch, const void *src, size_t src_pitch, size_t line_len, unsigned int lines);
+extern void copy_fence_submit(copy_fence_t *fence);
+extern void copy_fence_cancel(copy_fence_t *fence);
+extern int copy_fence_submitted(copy_fence_t *fence);
+extern void copy_fence_wait(copy_fence_t *fence);
+extern void copy_fence_put(copy_fence_t *fence);
+/* trace.c */
+extern void surfman_trace_enable(int enable);
+extern void surfman_trace_event(char phase, const char *name, const char *arg);
+extern int surfman_trace_dump(int fd);
 /* configfile.c */
 extern const char *config_get(const char *prefix, const char *key);
+extern unsigned int config_get_uint_max(const char *prefix, const char *key, unsigned int def, unsigned int max);
+extern unsigned int config_get_uint(const char *prefix, const char *key, unsigned int def);
 extern const char *config_dump(void);
 extern int config_load_file(const char *filename);
 /* surface.c */
 extern void *surface_map(surfman_surface_t *surface);
 extern void surface_unmap(surfman_surface_t *surface);
+extern void surface_map_stats(surfman_map_stats_t *stats);
@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2013 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "project.h"
+
+/*
+ * Dirty bitmap scan microbenchmark: bitmaps turned into rectangles per
+ * second by rects_from_dirty_bitmap(), for 32bpp surfaces at 1080p, 1440p
+ * and 4K and the dirty patterns a refresh usually sees.
+ *
+ *   rect-bench [seconds per run] [merge gap]
+ */
+
+struct geometry
+{
+  const char *name;
+  unsigned int width;
+  unsigned int height;
+};
+
+static const struct geometry geometries[] = {
+  { "1080p", 1920, 1080 },
+  { "1440p", 2560, 1440 },
+  { "4K", 3840, 2160 },
+};
+
+enum pattern
+{
+  PATTERN_CLEAN,
+  PATTERN_CURSOR,
+  PATTERN_SCATTERED,
+  PATTERN_BANDS,
+  PATTERN_FULL,
+  PATTERN_COUNT
+};
+
+static const char *pattern_names[PATTERN_COUNT] = {
+  "clean", "cursor", "scattered", "bands", "full",
+};
+
+static void
+bitmap_set (uint8_t *dirty, size_t page)
+{
+  dirty[page / 8] |= 1 << (page % 8);
+}
+
+static void
+bitmap_fill (uint8_t *dirty, size_t npages, unsigned int stride,
+             enum pattern pattern)
+{
+  size_t nbytes = (npages + 7) / 8;
+  size_t i, line_pages = (stride + XC_PAGE_SIZE - 1) / XC_PAGE_SIZE;
+
+  memset (dirty, 0, nbytes);
+
+  switch (pattern)
+    {
+    case PATTERN_CLEAN:
+      break;
+    case PATTERN_CURSOR:
+      /* A 64x64 cursor in the middle of the screen. */
+      for (i = 0; i < 64; i++)
+        bitmap_set (dirty, (npages / 2 + i * line_pages) % npages);
+      break;
+    case PATTERN_SCATTERED:
+      /* About one page in 20, as blinking carets and small widgets do. */
+      srand (1);
+      for (i = 0; i < npages; i++)
+        if (!(rand () % 20))
+          bitmap_set (dirty, i);
+      break;
+    case PATTERN_BANDS:
+      /* Every other 32-line band, as a scrolling terminal does. */
+      for (i = 0; i < npages; i++)
+        if (!((i / (line_pages * 32)) % 2))
+          bitmap_set (dirty, i);
+      break;
+    case PATTERN_FULL:
+      memset (dirty, 0xff, nbytes);
+      break;
+    default:
+      break;
+    }
+}
+
+static double
+now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+bench (const struct geometry *g, enum pattern pattern, double seconds,
+       unsigned int merge_gap)
+{
+  unsigned int stride = g->width * 4;
+  size_t npages = ((size_t) stride * g->height + XC_PAGE_SIZE - 1) /
+                  XC_PAGE_SIZE;
+  uint8_t *dirty = malloc ((npages + 63) / 64 * 8);
+  surfman_rect_t rects[SURFMAN_DIRTY_RECTS_MAX];
+  unsigned long long runs = 0;
+  unsigned int n = 0;
+  double t0, t;
+
+  if (!dirty)
+    {
+      perror ("malloc");
+      exit (1);
+    }
+  bitmap_fill (dirty, npages, stride, pattern);
+
+  t0 = now ();
+  do
+    {
+      unsigned int i;
+
+      for (i = 0; i < 1000; i++)
+        n = rects_from_dirty_bitmap (dirty, g->width, g->height, stride,
+                                     SURFMAN_FORMAT_BGRX8888, merge_gap,
+                                     rects, SURFMAN_DIRTY_RECTS_MAX);
+      runs += 1000;
+      t = now () - t0;
+    }
+  while (t < seconds);
+
+  printf ("%-6s %-10s %12.0f %10.1f %6u\n", g->name, pattern_names[pattern],
+          runs / t, t * 1e9 / runs, n);
+
+  free (dirty);
+}
+
+int
+main (int argc, char **argv)
+{
+  double seconds = argc > 1 ? atof (argv[1]) : 0.5;
+  unsigned int merge_gap = argc > 2 ? strtoul (argv[2], NULL, 0) :
+                           SURFMAN_DIRTY_MERGE_GAP;
+  unsigned int i, p;
+
+  printf ("%-6s %-10s %12s %10s %6s\n", "size", "pattern", "bitmaps/s",
+          "ns/bitmap", "rects");
+  for (i = 0; i < sizeof (geometries) / sizeof (geometries[0]); i++)
+    for (p = 0; p < PATTERN_COUNT; p++)
+      bench (&geometries[i], p, seconds, merge_gap);
+
+  return 0;
+}
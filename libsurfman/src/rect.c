@@ -0,0 +1,231 @@
+/*
+ * Copyright (c) 2013 Citrix Systems, Inc.
+ * 
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "project.h"
+
+/*
+ * Dirty bitmap to rectangles.
+ *
+ * The bitmap has one bit per page of the framebuffer, page i being bit
+ * (i % 8) of byte (i / 8). It is scanned 64 pages at a time: clean words
+ * and words in the middle of a dirty run are skipped whole, and run
+ * boundaries are found with ctz on the word (start) or its complement (end).
+ *
+ * Each run of dirty pages becomes the rectangle covering the lines it
+ * touches; a run within a single line only covers the columns it touches.
+ * Consecutive rectangles separated by at most merge_gap clean lines are
+ * coalesced, which trades a few clean lines for fewer, larger copies.
+ */
+
+struct rect_ctx
+{
+  unsigned int width;
+  unsigned int height;
+  unsigned int stride;
+  unsigned int Bpp;
+  unsigned int merge_gap;
+
+  surfman_rect_t *rects;
+  unsigned int max;
+  unsigned int count;
+};
+
+static unsigned int
+format_Bpp (enum surfman_surface_format format)
+{
+  switch (format)
+    {
+    case SURFMAN_FORMAT_BGR565:
+      return 2;
+    case SURFMAN_FORMAT_BGRX8888:
+    case SURFMAN_FORMAT_RGBX8888:
+      return 4;
+    default:
+      return 0;
+    }
+}
+
+static inline uint64_t
+bitmap_word (const uint8_t *dirty, size_t i, size_t nbytes)
+{
+  uint64_t w = 0;
+
+  if ((i + 1) * 8 <= nbytes)
+    memcpy (&w, dirty + i * 8, 8);
+  else
+    memcpy (&w, dirty + i * 8, nbytes - i * 8);
+
+  return le64toh (w);
+}
+
+static void
+rect_add (struct rect_ctx *ctx, unsigned int x0, unsigned int y0,
+          unsigned int x1, unsigned int y1)
+{
+  surfman_rect_t *last = ctx->count ? &ctx->rects[ctx->count - 1] : NULL;
+
+  /* Runs come in increasing order, only the last rectangle can be merged. */
+  if (last && (y0 <= last->y + last->h + ctx->merge_gap ||
+               ctx->count == ctx->max))
+    {
+      unsigned int lx1 = last->x + last->w;
+      unsigned int ly1 = last->y + last->h;
+
+      if (x0 > last->x)
+        x0 = last->x;
+      if (x1 < lx1)
+        x1 = lx1;
+      if (y1 < ly1)
+        y1 = ly1;
+
+      last->x = x0;
+      last->w = x1 - x0;
+      last->h = y1 - last->y;
+      return;
+    }
+
+  ctx->rects[ctx->count].x = x0;
+  ctx->rects[ctx->count].y = y0;
+  ctx->rects[ctx->count].w = x1 - x0;
+  ctx->rects[ctx->count].h = y1 - y0;
+  ctx->count++;
+}
+
+/* Pages [first, last) are dirty. Return 0 once past the framebuffer. */
+static int
+rect_add_run (struct rect_ctx *ctx, size_t first, size_t last)
+{
+  uint64_t start = (uint64_t) first * XC_PAGE_SIZE;
+  uint64_t end = (uint64_t) last * XC_PAGE_SIZE - 1;
+  unsigned int y0 = start / ctx->stride;
+  unsigned int y1 = end / ctx->stride;
+  unsigned int x0 = 0;
+  unsigned int x1 = ctx->width;
+
+  if (y0 >= ctx->height)
+    return 0;
+
+  if (y0 == y1 && ctx->Bpp)
+    {
+      x0 = (start % ctx->stride) / ctx->Bpp;
+      x1 = (end % ctx->stride) / ctx->Bpp + 1;
+      if (x0 >= ctx->width)
+        return 1;               /* Stride padding only */
+      if (x1 > ctx->width)
+        x1 = ctx->width;
+    }
+  if (y1 >= ctx->height)
+    y1 = ctx->height - 1;
+
+  rect_add (ctx, x0, y0, x1, y1 + 1);
+
+  return 1;
+}
+
+/*
+ * Merge gap configured for /prefix/ (a plugin name) with "dirty_merge_gap",
+ * SURFMAN_DIRTY_MERGE_GAP otherwise.
+ */
+unsigned int
+rects_merge_gap (const char *prefix)
+{
+  return config_get_uint (prefix, "dirty_merge_gap", SURFMAN_DIRTY_MERGE_GAP);
+}
+
+/*
+ * Fill up to max_rects rectangles covering the dirty regions of a surface.
+ * The last rectangle absorbs whatever does not fit.
+ * Return the number of rectangles, 0 if nothing is dirty.
+ */
+unsigned int
+rects_from_dirty_bitmap (const uint8_t *dirty,
+                         unsigned int width,
+                         unsigned int height,
+                         unsigned int stride,
+                         enum surfman_surface_format format,
+                         unsigned int merge_gap,
+                         surfman_rect_t *rects,
+                         unsigned int max_rects)
+{
+  struct rect_ctx ctx;
+  size_t npages, nbytes, nwords, i;
+  size_t run = 0;
+  int in_run = 0;
+
+  if (!width || !height || !stride || !max_rects)
+    return 0;
+
+  ctx.width = width;
+  ctx.height = height;
+  ctx.stride = stride;
+  ctx.Bpp = format_Bpp (format);
+  ctx.merge_gap = merge_gap;
+  ctx.rects = rects;
+  ctx.max = max_rects;
+  ctx.count = 0;
+
+  if (!dirty)
+    {
+      rect_add (&ctx, 0, 0, width, height);
+      return ctx.count;
+    }
+
+  npages = ((size_t) stride * height + XC_PAGE_SIZE - 1) / XC_PAGE_SIZE;
+  nbytes = (npages + 7) / 8;
+  nwords = (npages + 63) / 64;
+
+  for (i = 0; i < nwords; i++)
+    {
+      uint64_t w = bitmap_word (dirty, i, nbytes);
+      unsigned int bit = 0;
+
+      if (i == nwords - 1 && (npages % 64))
+        w &= (1ULL << (npages % 64)) - 1;
+
+      /* Nothing starts nor ends in this word. */
+      if ((!in_run && !w) || (in_run && w == ~0ULL))
+        continue;
+
+      while (bit < 64)
+        {
+          uint64_t rest;
+
+          if (!in_run)
+            {
+              rest = w >> bit;
+              if (!rest)
+                break;
+              bit += __builtin_ctzll (rest);
+              run = i * 64 + bit;
+              in_run = 1;
+            }
+
+          rest = ~w >> bit;
+          if (!rest)
+            break;              /* The run goes on in the next word. */
+          bit += __builtin_ctzll (rest);
+          in_run = 0;
+          if (!rect_add_run (&ctx, run, i * 64 + bit))
+            return ctx.count;
+        }
+    }
+
+  if (in_run)
+    rect_add_run (&ctx, run, npages);
+
+  return ctx.count;
+}
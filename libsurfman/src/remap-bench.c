@@ -0,0 +1,211 @@
+/*
+ * Copyright (c) 2013 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "project.h"
+#include "surfman-memfd.h"
+
+/*
+ * Remap cost against the number of guest pages that changed: time of a
+ * surfman_surface_update_pfn_arr() on a mapped surface, which maps again
+ * only the ranges that differ (see remap_changed_pages() in surface.c),
+ * against unmapping and mapping the whole surface. Guest memory is the
+ * memfd of xc-memfd.c: frames are mapped and populated one by one as privcmd
+ * does, without the hypercalls.
+ *
+ * - run: the changed pages are contiguous, one range;
+ * - scattered: they are spread evenly, one range each, which falls back to
+ *   a whole remap past MAP_RUNS_MAX ranges.
+ * Every page of the mapping is checked against its frame after each run.
+ *
+ *   remap-bench [seconds per run] [width height]
+ */
+
+static unsigned int width = 1920;
+static unsigned int height = 1080;
+static double whole_us;
+
+static double
+now (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Each surface page i is backed by frame i or frame npages + i; changing a
+ * page flips it to the other one. Frames hold their number.
+ */
+static void
+change_pages (xen_pfn_t *pfns, size_t npages, size_t changed, int scattered,
+              unsigned int iter)
+{
+  size_t i, first = (iter * 7919) % npages;
+
+  for (i = 0; i < changed; i++)
+    {
+      size_t page = scattered ? (first + i * (npages / changed)) % npages
+                              : (first + i) % npages;
+
+      pfns[page] = pfns[page] < npages ? pfns[page] + npages
+                                       : pfns[page] - npages;
+    }
+}
+
+/* Return the number of pages whose mapping does not show their frame. */
+static size_t
+check_mapping (surfman_surface_t *s, const xen_pfn_t *pfns)
+{
+  uint8_t *fb = surface_map (s);
+  size_t i, bad = 0;
+
+  if (!fb)
+    return s->page_count;
+  for (i = 0; i < s->page_count; i++)
+    bad += *(uint64_t *) (fb + i * XC_PAGE_SIZE) != pfns[i];
+  surface_unmap (s);
+
+  return bad;
+}
+
+static void
+bench (surfman_surface_t *s, xen_pfn_t *pfns, size_t changed, int scattered,
+       double seconds)
+{
+  surfman_map_stats_t before, after;
+  unsigned int iter = 0;
+  double t0, t;
+  uint64_t remaps, pages;
+  size_t bad;
+
+  surface_map_stats (&before);
+  t0 = now ();
+  do
+    {
+      change_pages (pfns, s->page_count, changed, scattered, iter++);
+      surfman_surface_update_pfn_arr (s, pfns);
+      t = now () - t0;
+    }
+  while (t < seconds);
+  surface_map_stats (&after);
+
+  remaps = after.remaps - before.remaps;
+  pages = after.pages_mapped - before.pages_mapped;
+  bad = check_mapping (s, pfns);
+
+  printf ("%-10s %8zu %10.1f %10.1f %8s %8.1fx %s\n",
+          scattered ? "scattered" : "run", changed, t * 1e6 / iter,
+          (double) pages / iter,
+          remaps ? (remaps == iter ? "whole" : "mixed") : "partial",
+          whole_us / (t * 1e6 / iter), bad ? "MISMATCH" : "ok");
+}
+
+/* Baseline: drop the mapping and map the whole surface again. */
+static void
+bench_whole (surfman_surface_t *s, double seconds)
+{
+  unsigned int iter = 0;
+  double t0, t;
+
+  t0 = now ();
+  do
+    {
+      surface_unmap (s);
+      if (!surface_map (s))
+        {
+          printf ("%-10s failed to map\n", "whole");
+          return;
+        }
+      iter++;
+      t = now () - t0;
+    }
+  while (t < seconds);
+
+  whole_us = t * 1e6 / iter;
+  printf ("%-10s %8u %10.1f %10.1f %8s %8.1fx\n", "whole", s->page_count,
+          whole_us, (double) s->page_count, "whole", 1.0);
+}
+
+int
+main (int argc, char **argv)
+{
+  double seconds = argc > 1 ? atof (argv[1]) : 0.2;
+  surfman_surface_t s;
+  xen_pfn_t *pfns;
+  size_t npages, changed, i;
+  int fd, scattered;
+
+  if (argc > 3)
+    {
+      width = strtoul (argv[2], NULL, 0);
+      height = strtoul (argv[3], NULL, 0);
+    }
+  if (!width || !height)
+    {
+      fprintf (stderr, "usage: %s [seconds] [width height]\n", argv[0]);
+      return 1;
+    }
+
+  memset (&s, 0, sizeof (s));
+  s.width = width;
+  s.height = height;
+  s.stride = width * 4;
+  s.format = SURFMAN_FORMAT_BGRX8888;
+  s.pages_domid = 1;
+  s.page_count = npages = ((size_t) s.stride * height + XC_PAGE_SIZE - 1) /
+                          XC_PAGE_SIZE;
+
+  fd = xc_memfd (npages * 2);
+  for (i = 0; i < npages * 2; i++)
+    {
+      uint64_t frame = i;
+
+      if (pwrite (fd, &frame, sizeof (frame), i * XC_PAGE_SIZE) !=
+          sizeof (frame))
+        {
+          perror ("pwrite");
+          return 1;
+        }
+    }
+
+  pfns = xcalloc (npages, sizeof (*pfns));
+  for (i = 0; i < npages; i++)
+    pfns[i] = i;
+  if (surfman_surface_init (&s))
+    return 1;
+  surfman_surface_update_pfn_arr (&s, pfns);
+  if (!surface_map (&s))
+    {
+      fprintf (stderr, "failed to map the surface\n");
+      return 1;
+    }
+
+  printf ("%ux%u, %zu pages\n", width, height, npages);
+  printf ("%-10s %8s %10s %10s %8s %9s\n", "layout", "changed", "us/update",
+          "pages", "mapping", "speedup");
+  bench_whole (&s, seconds);
+  for (scattered = 0; scattered < 2; scattered++)
+    for (changed = 1; changed <= npages; changed *= 4)
+      bench (&s, pfns, changed, scattered, seconds);
+
+  surface_unmap (&s);
+  surfman_surface_cleanup (&s);
+  free (pfns);
+
+  return 0;
+}
@@ -53,8 +53,62 @@ struct surface_priv
   pthread_mutex_t lock;
   char *baseptr;
   size_t len;
+  size_t window;                /* Address space reserved at baseptr */
+  int refs;                     /* surface_map() not matched by surface_unmap() */
+
+  /* Backing of the current mapping, to keep it when it does not change. */
+  int mapped_type;
+  domid_t mapped_domid;
+  int mapped_fd;
+  off_t mapped_offset;
+  xen_pfn_t *mapped_pfns;
+  xen_pfn_t *scratch;           /* Handed to xc, which may write to it */
+  size_t pfns_size;
 };
 
+/*
+ * Mapping cache.
+ *
+ * A surface is mapped once, on the first surface_map(), and the mapping is
+ * shared by surfman and every plugin until the last surface_unmap(). When the
+ * backing of a mapped surface is updated, the mapping is kept if the pages did
+ * not actually change (offset or format updates).
+ *
+ * Guest pages are mapped at the start of a reserved window of address space,
+ * rounded up to a power of two. When some of the pages change, or the surface
+ * grows within its window, only the ranges that differ are mapped again, in
+ * place, over the old ones: resizing a 4K framebuffer by a few lines no longer
+ * maps its 8192 pages again, and the address does not move. Past MAP_RUNS_MAX
+ * ranges, to keep the number of VMAs in check, or when the window is too
+ * small, the whole surface is mapped again somewhere else and the users get
+ * the new address on their next surface_map().
+ */
+#define MAP_RUNS_MAX 32
+static struct
+{
+  pthread_mutex_t lock;
+  surfman_map_stats_t s;
+} map_stats = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static uint64_t now_us (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+#define MAP_STAT_ADD(field, n)                    \
+  do                                              \
+    {                                             \
+      pthread_mutex_lock (&map_stats.lock);       \
+      map_stats.s.field += (n);                   \
+      pthread_mutex_unlock (&map_stats.lock);     \
+    }                                             \
+  while (0)
+
 static void surface_update_mfn_list (surfman_surface_t * surface)
 {
   struct surface_priv *p = PRIV(surface);
@@ -96,53 +150,190 @@ static void surface_update_mfn_arr (surfman_surface_t * surface)
   free(pfns);
 }
 
+static void release_mapping (struct surface_priv *p)
+{
+  if (!p->baseptr)
+    return;
+
+  munmap (p->baseptr, p->window);
+  p->baseptr = NULL;
+  MAP_STAT_ADD (unmaps, 1);
+  MAP_STAT_ADD (bytes_mapped, -(uint64_t) p->len);
+}
+
+/* Frames backing the first npages of the surface, in p->scratch. */
+static void fill_pfns (struct surface_priv *p, size_t npages)
+{
+  size_t i;
+
+  if (npages > p->pfns_size)
+    {
+      p->mapped_pfns = xrealloc (p->mapped_pfns, npages * sizeof (xen_pfn_t));
+      p->scratch = xrealloc (p->scratch, npages * sizeof (xen_pfn_t));
+      p->pfns_size = npages;
+    }
+
+  if (p->type == TYPE_PFN_ARR)
+    memcpy (p->scratch, p->u.pfn_arr.arr, npages * sizeof (xen_pfn_t));
+  else
+    for (i = 0; i < npages; i++)
+      p->scratch[i] = p->u.pfn_linear.base + i;
+}
+
+static domid_t mapping_domid (struct surface_priv *p)
+{
+  return p->type == TYPE_PFN_ARR ? p->u.pfn_arr.domid : p->u.pfn_linear.domid;
+}
+
+static size_t mapping_window (size_t len)
+{
+  size_t window = XC_PAGE_SIZE;
+
+  while (window < len)
+    window <<= 1;
+
+  return window;
+}
+
+/*
+ * Map again, in place, the pages of p->scratch that differ from the current
+ * mapping, now npages long. Return the number of pages mapped, or -1 if the
+ * surface has to be mapped again as a whole.
+ */
+static ssize_t remap_changed_pages (struct surface_priv *p, size_t npages)
+{
+  size_t old = p->len / XC_PAGE_SIZE;
+  size_t i, j, runs = 0, changed = 0;
+
+  if (!p->baseptr || p->mapped_type == TYPE_MMAP ||
+      p->mapped_domid != mapping_domid (p) ||
+      npages * XC_PAGE_SIZE > p->window)
+    return -1;
+
+#define SAME_PAGE(i) ((i) < old && p->mapped_pfns[i] == p->scratch[i])
+  for (i = 0; i < npages; i = j)
+    {
+      for (j = i + 1; j < npages && SAME_PAGE (i) == SAME_PAGE (j); ++j)
+        continue;
+      if (!SAME_PAGE (i))
+        {
+          runs++;
+          changed += j - i;
+        }
+    }
+  if (runs > MAP_RUNS_MAX)
+    return -1;
+
+  for (i = 0; i < npages; i = j)
+    {
+      for (j = i + 1; j < npages && SAME_PAGE (i) == SAME_PAGE (j); ++j)
+        continue;
+      if (SAME_PAGE (i))
+        continue;
+
+      memcpy (p->mapped_pfns + i, p->scratch + i, (j - i) * sizeof (xen_pfn_t));
+      if (!xc_mmap_foreign (p->baseptr + i * XC_PAGE_SIZE,
+                            (j - i) * XC_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                            p->mapped_domid, p->scratch + i))
+        return -1;
+    }
+#undef SAME_PAGE
+
+  /* Shrinking: give the tail back to the window. */
+  if (npages < old)
+    mmap (p->baseptr + npages * XC_PAGE_SIZE, (old - npages) * XC_PAGE_SIZE,
+          PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+          -1, 0);
+
+  p->mapped_type = p->type;
+  MAP_STAT_ADD (bytes_mapped, (int64_t) (npages - old) * XC_PAGE_SIZE);
+
+  return changed;
+}
+
 static void update_mapping (struct surface_priv *p, size_t len)
 {
   size_t npages = (len + XC_PAGE_SIZE - 1) / XC_PAGE_SIZE;
-  xen_pfn_t *pfns;
-  size_t i;
+  uint64_t t = now_us ();
+  ssize_t changed;
+  char *window;
 
-  if (p->baseptr)
-    munmap (p->baseptr, p->len);
+  if (p->type == TYPE_MMAP && p->baseptr && p->mapped_type == TYPE_MMAP &&
+      p->len == len && p->mapped_fd == p->u.mmap.fd &&
+      p->mapped_offset == p->u.mmap.offset)
+    {
+      MAP_STAT_ADD (reuses, 1);
+      return;
+    }
+
+  if (p->type == TYPE_PFN_ARR || p->type == TYPE_PFN_LINEAR)
+    {
+      fill_pfns (p, npages);
+      changed = remap_changed_pages (p, npages);
+      if (changed >= 0)
+        {
+          p->len = len;
+          if (changed)
+            {
+              MAP_STAT_ADD (partial, 1);
+              MAP_STAT_ADD (pages_mapped, changed);
+              MAP_STAT_ADD (bytes_total, changed * XC_PAGE_SIZE);
+              MAP_STAT_ADD (map_us, now_us () - t);
+            }
+          else
+            MAP_STAT_ADD (reuses, 1);
+          return;
+        }
+    }
+
+  release_mapping (p);
 
+  p->mapped_type = p->type;
   switch (p->type)
     {
       case TYPE_MMAP:
-        p->baseptr = mmap (p->baseptr, len,
+        p->baseptr = mmap (NULL, len,
                            PROT_READ | PROT_WRITE,
                            MAP_SHARED,
                            p->u.mmap.fd,
                            p->u.mmap.offset);
+        if (p->baseptr == MAP_FAILED)
+          p->baseptr = NULL;
+        p->window = len;
+        p->mapped_fd = p->u.mmap.fd;
+        p->mapped_offset = p->u.mmap.offset;
         break;
       case TYPE_PFN_ARR:
-        pfns = xcalloc (npages, sizeof (*pfns));
-        memcpy(pfns, p->u.pfn_arr.arr, npages * sizeof (*pfns));
-        p->baseptr = xc_mmap_foreign (p->baseptr, len,
-                                      PROT_READ | PROT_WRITE,
-                                      p->u.pfn_arr.domid, pfns);
-        free (pfns);
-        break;
       case TYPE_PFN_LINEAR:
-        pfns = xcalloc (npages, sizeof (*pfns));
-        for (i = 0; i < npages; i++)
-          pfns[i] = p->u.pfn_linear.base + i;
-
-        p->baseptr = xc_mmap_foreign (p->baseptr, len,
+        memcpy (p->mapped_pfns, p->scratch, npages * sizeof (xen_pfn_t));
+        p->mapped_domid = mapping_domid (p);
+        p->window = mapping_window (len);
+        window = mmap (NULL, p->window, PROT_NONE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (window == MAP_FAILED)
+          break;
+        p->baseptr = xc_mmap_foreign (window, len,
                                       PROT_READ | PROT_WRITE,
-                                      p->u.pfn_linear.domid, pfns);
-        free (pfns);
+                                      p->mapped_domid, p->scratch);
+        if (!p->baseptr)
+          munmap (window, p->window);
         break;
       default:
         surfman_error ("invalid surface type %d", p->type);
     }
 
-  if (p->baseptr == MAP_FAILED)
-    {
-      p->baseptr = NULL;
-      surfman_error ("failed to map.");
-    }
+  if (!p->baseptr)
+    surfman_error ("failed to map.");
 
   p->len = len;
+  if (p->baseptr)
+    {
+      MAP_STAT_ADD (remaps, 1);
+      MAP_STAT_ADD (pages_mapped, npages);
+      MAP_STAT_ADD (bytes_mapped, len);
+      MAP_STAT_ADD (bytes_total, len);
+      MAP_STAT_ADD (map_us, now_us () - t);
+    }
 }
 
 static int compare_pfns(const void *a, const void *b)
@@ -198,16 +389,28 @@ static int surface_pin_cacheattr(surfman_surface_t * surface,
   return 0;
 }
 
+/*
+ * Take a reference on the mapping of the surface, mapping it if needed.
+ * Return NULL, without a reference, if it cannot be mapped.
+ */
 void *surface_map (surfman_surface_t * surface)
 {
   struct surface_priv *p = PRIV(surface);
+  void *ret;
 
   pthread_mutex_lock (&p->lock);
-  if (!p->baseptr)
+  MAP_STAT_ADD (maps, 1);
+  if (p->baseptr)
+    MAP_STAT_ADD (hits, 1);
+  else
     update_mapping (p, surface->page_count * XC_PAGE_SIZE);
 
+  ret = p->baseptr;
+  if (ret)
+    p->refs++;
   pthread_mutex_unlock (&p->lock);
-  return p->baseptr;
+
+  return ret;
 }
 
 xen_pfn_t surface_get_base_gfn(surfman_surface_t * surface)
@@ -219,19 +422,24 @@ xen_pfn_t surface_get_base_gfn(surfman_surface_t * surface)
   return p->u.pfn_linear.base;
 }
 
+/* Drop a reference taken by surface_map(), unmapping after the last one. */
 void surface_unmap (surfman_surface_t * surface)
 {
   struct surface_priv *p = PRIV(surface);
 
   pthread_mutex_lock (&p->lock);
-  if (p->baseptr)
-    {
-      munmap (p->baseptr, p->len);
-      p->baseptr = NULL;
-    }
+  if (p->refs > 0 && --p->refs == 0)
+    release_mapping (p);
   pthread_mutex_unlock (&p->lock);
 }
 
+void surface_map_stats (surfman_map_stats_t *stats)
+{
+  pthread_mutex_lock (&map_stats.lock);
+  *stats = map_stats.s;
+  pthread_mutex_unlock (&map_stats.lock);
+}
+
 /*
  * Export these only to surfman and not the plugins
  */
@@ -255,7 +463,12 @@ void surfman_surface_cleanup (surfman_surface_t * surface)
 {
   struct surface_priv *p = PRIV(surface);
 
-  surface_unmap (surface);
+  if (p->refs)
+    surfman_warning ("Surface %p released with %d mapping references.",
+                     surface, p->refs);
+  release_mapping (p);
+  free (p->mapped_pfns);
+  free (p->scratch);
   free (p);
 }
 
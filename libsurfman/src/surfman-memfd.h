@@ -0,0 +1,33 @@
+/*
+ * Copyright (c) 2013 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef SURFMAN_MEMFD_H_
+# define SURFMAN_MEMFD_H_
+
+/*
+ * libsurfman-memfd only, see xc-memfd.c: libsurfman with guest memory in a
+ * memfd instead of Xen, for benchmarks and tests. Include after surfman.h.
+ */
+
+int xc_memfd (size_t frames);
+void xc_memfd_dirty (xen_pfn_t pfn, size_t n);
+surfman_surface_t *xc_memfd_surface_new (unsigned int width,
+                                         unsigned int height,
+                                         enum surfman_surface_format format);
+
+#endif /* SURFMAN_MEMFD_H_ */
@@ -94,7 +94,7 @@ extern "C"
     ** Surfman will retrieve this variable to know which API is currently
     ** used by the plugin.
     */
-# define SURFMAN_API_VERSION SURFMAN_VERSION(2, 1, 2)
+# define SURFMAN_API_VERSION SURFMAN_VERSION(2, 2, 2)
 
     /*
     ** Type used for storing Page Frame Numbers.
@@ -183,6 +183,9 @@ extern "C"
                 **
                 ** viewport of the monitor in pixel: x, y, w, h
                 **   This describe the destination retangle on the monitor
+                **
+                ** A zero sized viewport leaves the placement of the psurface
+                ** to the plugin.
                 */
                 unsigned int    psurface_x;
                 unsigned int    psurface_y;
@@ -352,6 +355,23 @@ extern "C"
         unsigned int h;
     } surfman_rect_t;
 
+    typedef struct
+    {
+        /*
+        ** Counters of the shared surface mappings, see surface_map()
+        */
+        uint64_t maps;              /* surface_map() calls */
+        uint64_t hits;              /* ... that found the surface mapped */
+        uint64_t remaps;            /* Mappings created */
+        uint64_t reuses;            /* Page updates that kept the mapping */
+        uint64_t unmaps;            /* Mappings released */
+        uint64_t bytes_mapped;      /* Currently mapped */
+        uint64_t bytes_total;       /* Mapped since startup */
+        uint64_t partial;           /* Page updates that only mapped the pages that changed */
+        uint64_t pages_mapped;      /* Pages mapped, as a whole or in place */
+        uint64_t map_us;            /* Time spent mapping */
+    } surfman_map_stats_t;
+
     typedef struct surfman_plugin
     {
         /*
@@ -577,6 +597,31 @@ extern "C"
 # define SURFMAN_FEATURE_NEED_REFRESH   (1 << 1)
 # define SURFMAN_FEATURE_PAGES_MAPPED   (1 << 2)
 # define SURFMAN_FEATURE_FB_CACHING     (1 << 3)
+/*
+** The plugin applies the effects of surfman_display_t itself. Without it,
+** surfman renders non-trivial effects into a monitor sized surface and
+** displays that one instead.
+*/
+# define SURFMAN_FEATURE_EFFECTS        (1 << 4)
+/*
+** The plugin implements refresh_psurface_rects and takes the damage as
+** rectangles instead of a dirty bitmap (API 2.2.0).
+*/
+# define SURFMAN_FEATURE_REFRESH_RECTS  (1 << 5)
+/*
+** refresh_psurface and refresh_psurface_rects may be called from a thread
+** dedicated to the plugin, concurrently with its other methods, which is then
+** up to the plugin to lock (API 2.2.1). Refreshes come one at a time, and
+** none is pending or running for a psurface while update_psurface or
+** free_psurface is called on it.
+*/
+# define SURFMAN_FEATURE_THREADED_REFRESH (1 << 6)
+/*
+** The plugin only scans out surfaces of its monitor's size (API 2.2.2).
+** Surfman centres any other surface on black, cropped if larger, into a
+** monitor sized surface and displays that one instead.
+*/
+# define SURFMAN_FEATURE_MONITOR_SIZED  (1 << 7)
                 int                 features;
         }                           options;
 
@@ -605,6 +650,68 @@ extern "C"
          */
         void                        (*dpms_off)(struct surfman_plugin *plugin);
 
+        /*
+         * get_vblank_fd : get a pollable source of vblank events (OPTIONAL)
+         *
+         * monitor: Monitor the vblank events are wanted for.
+         * Return: A file descriptor that becomes readable once a vblank
+         *         armed with request_vblank occured, or SURFMAN_ERROR if the
+         *         monitor has no vblank source. Several monitors can share
+         *         the same file descriptor.
+         */
+        int                         (*get_vblank_fd)(struct surfman_plugin *plugin,
+                                                     surfman_monitor_t monitor);
+
+        /*
+         * request_vblank : arm a one-shot vblank event on a monitor (OPTIONAL)
+         *
+         * Return: SURFMAN_SUCCESS or SURFMAN_ERROR
+         */
+        int                         (*request_vblank)(struct surfman_plugin *plugin,
+                                                      surfman_monitor_t monitor);
+
+        /*
+         * handle_vblank : consume the events pending on a vblank fd (OPTIONAL)
+         *
+         * fd: File descriptor returned by get_vblank_fd that became readable.
+         * monitors: Array to fill with the monitors that reached vblank.
+         * size: Size of the array.
+         * Return: Number of monitors filled up, or SURFMAN_ERROR.
+         */
+        int                         (*handle_vblank)(struct surfman_plugin *plugin,
+                                                     int fd,
+                                                     surfman_monitor_t *monitors,
+                                                     size_t size);
+
+        /*
+         * get_notify_fd : file descriptor signalling the notify field (OPTIONAL)
+         *
+         * The plugin makes it readable (e.g. writes to an eventfd) after
+         * setting notify, and surfman handles the notification straight away
+         * instead of polling for it every second. The fd must be non-blocking,
+         * surfman reads it until empty.
+         *
+         * Return: File descriptor, or SURFMAN_ERROR to be polled.
+         */
+        int                         (*get_notify_fd)(struct surfman_plugin *plugin);
+
+        /*
+         * refresh_psurface_rects : refresh the damaged parts of a psurface (OPTIONAL)
+         *
+         * Called instead of refresh_psurface if the plugin has
+         * SURFMAN_FEATURE_REFRESH_RECTS. Surfman builds the list once per
+         * refresh and hands it to every plugin displaying the surface; it is
+         * only valid during the call.
+         *
+         * rects: Rectangles covering the pixels that changed, in pixels of
+         *        the surface.
+         * count: Number of rectangles, never 0.
+         */
+        void                        (*refresh_psurface_rects)(struct surfman_plugin *plugin,
+                                                              surfman_psurface_t psurface,
+                                                              const surfman_rect_t *rects,
+                                                              size_t count);
+
     } surfman_plugin_t;
 
 /* util.c */
@@ -621,12 +728,60 @@ int xc_hvm_get_dirty_vram(int domid, uint64_t base_pfn, size_t n, unsigned long
 int xc_hvm_pin_memory_cacheattr(int domid, uint64_t pfn_start, uint64_t pfn_end, uint32_t type);
 /* configfile.c */
 const char *config_get(const char *prefix, const char *key);
+unsigned int config_get_uint(const char *prefix, const char *key, unsigned int def);
+unsigned int config_get_uint_max(const char *prefix, const char *key, unsigned int def, unsigned int max);
 const char *config_dump(void);
 int config_load_file(const char *filename);
 /* surface.c */
 void *surface_map(surfman_surface_t *surface);
 xen_pfn_t surface_get_base_gfn(surfman_surface_t * surface);
 void surface_unmap(surfman_surface_t *surface);
+void surface_map_stats(surfman_map_stats_t *stats);
+/* rect.c */
+/* Dirty rectangles handled per refresh (the last one absorbs the overflow). */
+#define SURFMAN_DIRTY_RECTS_MAX 32
+/* Clean lines allowed between two coalesced rectangles, unless configured. */
+#define SURFMAN_DIRTY_MERGE_GAP 8
+unsigned int rects_merge_gap(const char *prefix);
+unsigned int rects_from_dirty_bitmap(const uint8_t *dirty, unsigned int width, unsigned int height, unsigned int stride, enum surfman_surface_format format, unsigned int merge_gap, surfman_rect_t *rects, unsigned int max_rects);
+/* blit.c */
+const char *blit_isa(void);
+int blit_set_isa(const char *isa);
+void blit_copy(void *dst, const void *src, size_t len);
+void blit_rect(void *dst, size_t dst_pitch, const void *src, size_t src_pitch, size_t line_len, unsigned int lines);
+void blit_swizzle(uint32_t *dst, const uint32_t *src, size_t n);
+void blit_force_alpha(uint32_t *dst, const uint32_t *src, size_t n);
+void blit_expand_565(uint32_t *dst, const uint16_t *src, size_t n);
+void blit_blend_rows(uint32_t *dst, const uint32_t *a, const uint32_t *b, unsigned int wa, unsigned int wb, size_t n);
+void blit_scale_row(uint32_t *dst, const uint32_t *src, const uint32_t *idx, const uint16_t *w, size_t n);
+/* copypool.c */
+typedef struct copy_fence copy_fence_t;
+unsigned int copy_pool_threads(void);
+copy_fence_t *copy_fence_new(void (*done)(void *opaque), void *opaque);
+void copy_rect(copy_fence_t *fence, void *dst, size_t dst_pitch, const void *src, size_t src_pitch, size_t line_len, unsigned int lines);
+void copy_fence_submit(copy_fence_t *fence);
+void copy_fence_cancel(copy_fence_t *fence);
+int copy_fence_submitted(copy_fence_t *fence);
+void copy_fence_wait(copy_fence_t *fence);
+void copy_fence_put(copy_fence_t *fence);
+/* trace.c */
+extern int surfman_trace_enabled;
+void surfman_trace_enable(int enable);
+void surfman_trace_event(char phase, const char *name, const char *arg);
+int surfman_trace_dump(int fd);
+
+/*
+ * Trace points, see trace.c. /name/ must be a string literal, /arg/ is a
+ * string or NULL.
+ */
+#define SURFMAN_TRACE(phase, name, arg)                                 \
+    do {                                                                \
+        if (__builtin_expect (surfman_trace_enabled, 0))                \
+            surfman_trace_event ((phase), (name), (arg));               \
+    } while (0)
+#define SURFMAN_TRACE_BEGIN(name, arg) SURFMAN_TRACE ('B', name, arg)
+#define SURFMAN_TRACE_END(name, arg) SURFMAN_TRACE ('E', name, arg)
+#define SURFMAN_TRACE_MARK(name, arg) SURFMAN_TRACE ('i', name, arg)
 
 #ifdef __cplusplus
 }
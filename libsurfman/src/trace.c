@@ -0,0 +1,185 @@
+/*
+ * Copyright (c) 2014 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include <sys/syscall.h>
+
+#include "project.h"
+
+/*
+ * Event tracing.
+ *
+ * SURFMAN_TRACE_BEGIN/END/MARK record a timestamped event in a ring of the
+ * last TRACE_RING_SIZE events, shared by surfman and the plugins. Writers
+ * claim a slot with an atomic increment and publish it with a sequence
+ * number, so any thread can trace without a lock; the dump skips slots being
+ * written. While tracing is disabled, a trace point costs a load and a
+ * branch.
+ *
+ * Event names must be string literals (they are kept by address); the
+ * argument is copied, truncated to TRACE_ARG_MAX - 1 characters.
+ *
+ * The dump is in the Chrome trace event format (chrome://tracing, Perfetto).
+ */
+
+#define TRACE_RING_SIZE 8192    /* Power of 2 */
+#define TRACE_ARG_MAX 32
+
+struct trace_event
+{
+  uint32_t seq;                 /* Index + 1 once written, 0 while writing */
+  char phase;                   /* 'B'egin, 'E'nd or 'i'nstant */
+  pid_t tid;
+  uint64_t ts_us;
+  const char *name;
+  char arg[TRACE_ARG_MAX];
+};
+
+int surfman_trace_enabled = 0;
+
+static struct trace_event *ring;
+static uint32_t ring_head;
+
+static __thread pid_t trace_tid;
+
+static uint64_t trace_now_us (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void surfman_trace_enable (int enable)
+{
+  if (enable && !ring)
+    ring = xcalloc (TRACE_RING_SIZE, sizeof (*ring));
+
+  __sync_synchronize ();
+  surfman_trace_enabled = enable && ring;
+}
+
+void surfman_trace_event (char phase, const char *name, const char *arg)
+{
+  struct trace_event *e;
+  uint32_t i;
+
+  if (!ring)
+    return;
+  if (!trace_tid)
+    trace_tid = syscall (SYS_gettid);
+
+  i = __sync_fetch_and_add (&ring_head, 1);
+  e = &ring[i & (TRACE_RING_SIZE - 1)];
+
+  e->seq = 0;
+  __sync_synchronize ();
+  e->phase = phase;
+  e->tid = trace_tid;
+  e->ts_us = trace_now_us ();
+  e->name = name;
+  if (arg)
+    snprintf (e->arg, sizeof (e->arg), "%s", arg);
+  else
+    e->arg[0] = '\0';
+  __sync_synchronize ();
+  e->seq = i + 1;
+}
+
+static void trace_json_string (FILE *f, const char *s)
+{
+  fputc ('"', f);
+  for (; *s; s++)
+    {
+      if (*s == '"' || *s == '\\')
+        fprintf (f, "\\%c", *s);
+      else if ((unsigned char) *s < 0x20)
+        fprintf (f, "\\u%04x", *s);
+      else
+        fputc (*s, f);
+    }
+  fputc ('"', f);
+}
+
+/*
+ * Write the events in the ring to /fd/, oldest first. The caller opens the
+ * file and closes /fd/, the library never picks a path.
+ * Return the number of events written, -1 on error.
+ */
+int surfman_trace_dump (int fd)
+{
+  uint32_t head, i;
+  pid_t pid = getpid ();
+  int n = 0;
+  FILE *f;
+
+  if (!ring)
+    {
+      surfman_warning ("Tracing was never enabled, nothing to dump.");
+      return -1;
+    }
+
+  fd = dup (fd);
+  f = fd < 0 ? NULL : fdopen (fd, "w");
+  if (!f)
+    {
+      surfman_error ("Cannot write the trace: %s", strerror (errno));
+      if (fd >= 0)
+        close (fd);
+      return -1;
+    }
+
+  head = ring_head;
+  fprintf (f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+  for (i = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0; i != head; i++)
+    {
+      struct trace_event *slot = &ring[i & (TRACE_RING_SIZE - 1)];
+      struct trace_event e;
+      uint32_t seq;
+
+      seq = slot->seq;
+      __sync_synchronize ();
+      e = *slot;
+      __sync_synchronize ();
+      if (seq != i + 1 || slot->seq != i + 1)
+        continue;               /* Being written, or already recycled */
+      e.arg[TRACE_ARG_MAX - 1] = '\0';
+
+      fprintf (f, "%s\n{\"ph\":\"%c\",\"pid\":%d,\"tid\":%d,"
+               "\"ts\":%" PRIu64 ",\"cat\":\"surfman\",\"name\":",
+               n ? "," : "", e.phase, pid, e.tid, e.ts_us);
+      trace_json_string (f, e.name);
+      if (e.phase == 'i')
+        fprintf (f, ",\"s\":\"t\"");
+      if (e.arg[0])
+        {
+          fprintf (f, ",\"args\":{\"arg\":");
+          trace_json_string (f, e.arg);
+          fputc ('}', f);
+        }
+      fputc ('}', f);
+      n++;
+    }
+  fprintf (f, "\n]}\n");
+
+  if (fclose (f))
+    {
+      surfman_error ("Cannot write the trace: %s", strerror (errno));
+      return -1;
+    }
+
+  return n;
+}
@@ -0,0 +1,227 @@
+/*
+ * Copyright (c) 2013 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "project.h"
+#include "surfman-memfd.h"
+#include <sys/syscall.h>
+
+/*
+ * Stand-in for xc.c in benchmarks and tests, without Xen: guest memory is a
+ * memfd, frame n being the page at n * XC_PAGE_SIZE, shared by every domain.
+ * Mappings are mmap()s of that memfd, one per page as privcmd maps each frame
+ * of a batch, populated up front, so their cost grows with the number of
+ * pages whatever the frames. Domains are HVM-less and always exist, translations are the
+ * identity.
+ *
+ * xc_memfd() returns the memfd, to read and write guest frames directly.
+ * Log-dirty is up to the writer: xc_memfd_dirty() marks frames, which
+ * xc_hvm_get_dirty_vram() reports and clears as the hypervisor would.
+ *
+ * xc_memfd_surface_new() gives tests a surface of their own to hand plugins
+ * directly, without a device.
+ */
+
+static int guest_fd = -1;
+static size_t guest_frames;
+static uint8_t *guest_dirty;
+
+int xc_memfd (size_t frames)
+{
+  if (guest_fd < 0)
+    {
+      guest_fd = syscall (SYS_memfd_create, "surfman-guest", 0);
+      if (guest_fd < 0)
+        surfman_fatal ("Failed to create the guest memfd (%s).",
+                       strerror (errno));
+    }
+
+  if (frames > guest_frames)
+    {
+      if (ftruncate (guest_fd, (off_t) frames * XC_PAGE_SIZE))
+        surfman_fatal ("Failed to grow the guest memfd to %zu frames (%s).",
+                       frames, strerror (errno));
+      guest_dirty = xrealloc (guest_dirty, (frames + 7) / 8);
+      memset (guest_dirty + (guest_frames + 7) / 8, 0,
+              (frames + 7) / 8 - (guest_frames + 7) / 8);
+      guest_frames = frames;
+    }
+
+  return guest_fd;
+}
+
+void xc_memfd_dirty (xen_pfn_t pfn, size_t n)
+{
+  for (; n && pfn < guest_frames; n--, pfn++)
+    guest_dirty[pfn / 8] |= 1 << (pfn % 8);
+}
+
+/*
+ * Surface backed by a memfd of its own, mapped at offset 0, packed lines.
+ * It lives until the process exits. Return NULL on failure.
+ */
+surfman_surface_t *xc_memfd_surface_new (unsigned int width,
+                                         unsigned int height,
+                                         enum surfman_surface_format format)
+{
+  surfman_surface_t *s;
+  unsigned int Bpp = (format == SURFMAN_FORMAT_BGR565) ? 2 : 4;
+  size_t npages;
+  int fd;
+
+  npages = ((size_t) width * Bpp * height + XC_PAGE_SIZE - 1) >> XC_PAGE_SHIFT;
+
+  fd = syscall (SYS_memfd_create, "surfman-surface", 0);
+  if (fd < 0)
+    {
+      surfman_error ("Failed to create a surface memfd (%s).", strerror (errno));
+      return NULL;
+    }
+  if (ftruncate (fd, (off_t) npages << XC_PAGE_SHIFT))
+    {
+      surfman_error ("Failed to size a %ux%u surface memfd (%s).",
+                     width, height, strerror (errno));
+      close (fd);
+      return NULL;
+    }
+
+  s = xcalloc (1, sizeof (*s));
+  if (surfman_surface_init (s))
+    {
+      free (s);
+      close (fd);
+      return NULL;
+    }
+  s->width = width;
+  s->height = height;
+  s->stride = width * Bpp;
+  s->format = format;
+  s->page_count = npages;
+  surfman_surface_update_mmap (s, fd, 0);
+
+  return s;
+}
+
+void xc_init (void)
+{
+  xc_memfd (0);
+}
+
+int xc_domid_getinfo(int domid, xc_dominfo_t *info)
+{
+  memset (info, 0, sizeof (*info));
+  info->domid = domid;
+
+  return 1;
+}
+
+int xc_domid_exists(int domid)
+{
+  return 1;
+}
+
+/*
+ * Map the frames at addr, MAP_FIXED style, or anywhere if addr is NULL.
+ * Return NULL on failure.
+ */
+void *xc_mmap_foreign(void *addr, size_t length, int prot,
+                      int domid, xen_pfn_t *pages)
+{
+  size_t npages = (length + XC_PAGE_SIZE - 1) >> XC_PAGE_SHIFT;
+  size_t len = npages << XC_PAGE_SHIFT;
+  char *p = addr;
+  size_t i;
+
+  assert(length > 0);
+  assert(pages != NULL);
+
+  xc_memfd (0);
+  for (i = 0; i < npages; ++i)
+    if (pages[i] >= guest_frames)
+      {
+        surfman_error ("dom%d frame %#lx is not backed.", domid, pages[i]);
+        return NULL;
+      }
+
+  if (!p)
+    {
+      p = mmap (NULL, len, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (p == MAP_FAILED)
+        return NULL;
+    }
+
+  for (i = 0; i < npages; ++i)
+    if (mmap (p + (i << XC_PAGE_SHIFT), XC_PAGE_SIZE, prot,
+              MAP_SHARED | MAP_FIXED | MAP_POPULATE, guest_fd,
+              (off_t) pages[i] << XC_PAGE_SHIFT) == MAP_FAILED)
+      {
+        surfman_error ("Failed to map frame %#lx of dom%d at %p (%s).",
+                       pages[i], domid, p, strerror (errno));
+        if (addr)
+          mmap (addr, len, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED,
+                -1, 0);
+        else
+          munmap (p, len);
+        return NULL;
+      }
+
+  return p;
+}
+
+int xc_translate_gpfn_to_mfn (int domid, size_t pfn_count,
+			      xen_pfn_t *pfns, pfn_t *mfns)
+{
+  size_t i;
+
+  for (i = 0; i < pfn_count; ++i)
+    mfns[i] = pfns[i];
+
+  return 0;
+}
+
+int xc_hvm_get_dirty_vram(int domid, uint64_t base_pfn, size_t n,
+                          unsigned long *db)
+{
+  uint8_t *bits = (uint8_t *) db;
+  size_t i;
+
+  if (base_pfn + n > guest_frames)
+    {
+      errno = EINVAL;
+      return -1;
+    }
+
+  memset (bits, 0, (n + 7) / 8);
+  for (i = 0; i < n; ++i)
+    {
+      uint64_t pfn = base_pfn + i;
+
+      if (guest_dirty[pfn / 8] & (1 << (pfn % 8)))
+        {
+          guest_dirty[pfn / 8] &= ~(1 << (pfn % 8));
+          bits[i / 8] |= 1 << (i % 8);
+        }
+    }
+
+  return 0;
+}
+
+int xc_hvm_pin_memory_cacheattr(int domid, uint64_t pfn_start, uint64_t pfn_end, uint32_t type)
+{
+  return 0;
+}
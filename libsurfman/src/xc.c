@@ -54,17 +54,72 @@ int xc_domid_exists(int domid)
   return !!xc_domid_getinfo(domid, &info);
 }
 
+/*
+ * Map pages of a foreign domain at addr, replacing whatever was there, through
+ * privcmd directly: libxc always picks the address. The range is left
+ * reserved but inaccessible if a page cannot be mapped.
+ */
+static void *xc_mmap_foreign_fixed(void *addr, size_t npages, int prot,
+                                   int domid, xen_pfn_t *pages)
+{
+  privcmd_mmapbatch_v2_t batch;
+  size_t len = npages << XC_PAGE_SHIFT;
+  int *err;
+  void *p;
+  size_t i;
+  int rc;
+
+  assert(privcmd_fd >= 0);
+
+  p = mmap (addr, len, prot, MAP_SHARED | MAP_FIXED, privcmd_fd, 0);
+  if (p == MAP_FAILED)
+    {
+      surfman_error ("Failed to reserve %zu pages for dom%d (%s).",
+                     npages, domid, strerror (errno));
+      return NULL;
+    }
+
+  err = xcalloc (npages, sizeof (*err));
+  batch.num = npages;
+  batch.dom = domid;
+  batch.addr = (unsigned long) p;
+  batch.arr = pages;
+  batch.err = err;
+
+  rc = ioctl (privcmd_fd, IOCTL_PRIVCMD_MMAPBATCH_V2, &batch) ? -errno : 0;
+  for (i = 0; !rc && i < npages; ++i)
+    rc = err[i];        /* -errno per page */
+  free (err);
+
+  if (rc)
+    {
+      surfman_error ("Failed to map %zu pages of dom%d at %p (%s).",
+                     npages, domid, addr, strerror (-rc));
+      mmap (addr, len, PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+      return NULL;
+    }
+
+  return p;
+}
+
+/*
+ * Map the pages at addr, MAP_FIXED style, or anywhere if addr is NULL.
+ * Return NULL on failure.
+ */
 void *xc_mmap_foreign(void *addr, size_t length, int prot,
                       int domid, xen_pfn_t *pages)
 {
-  (void) addr; /* This is munmaped in update_mappings. */
+  size_t npages = (length + XC_PAGE_SIZE - 1) >> XC_PAGE_SHIFT;
 
   assert(xch != NULL);
   assert(length > 0);
   assert(pages != NULL); /* It's actually an array of pfns... */
 
-  return xc_map_foreign_pages (xch, domid, prot, pages,
-                              (length + XC_PAGE_SIZE - 1 >> XC_PAGE_SHIFT));
+  if (addr)
+    return xc_mmap_foreign_fixed (addr, npages, prot, domid, pages);
+
+  return xc_map_foreign_pages (xch, domid, prot, pages, npages);
 }
 
 int xc_translate_gpfn_to_mfn (int domid, size_t pfn_count,
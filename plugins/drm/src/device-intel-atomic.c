@@ -0,0 +1,406 @@
+/*
+ * Copyright (c) 2014 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "project.h"
+
+/*
+ * Atomic modesetting for i915.
+ *
+ * drmp_display() brackets its set() calls with begin() and commit(): every monitor it switches
+ * is staged in one atomic request, checked with TEST_ONLY and committed non-blocking. The
+ * page-flip event of each CRTC completes the commit (see vblank.c).
+ *
+ * Only framebuffers matching one of the connector modes are scanned out by the primary plane.
+ * Others (upscaled through an overlay plane or the panel fitter, or cropped) go through the
+ * legacy i915_ops, and so does a staged configuration the driver rejects.
+ */
+
+/* A commit whose flips did not complete after that long is considered done. */
+#define ATOMIC_FLIP_TIMEOUT_US 1000000
+
+/* Latency of atomic commits, from submission to the last CRTC flip. */
+struct latency_histogram atomic_commit_latency = { .name = "Atomic commit" };
+
+static const struct {
+    uint32_t type;
+    const char *name;
+} atomic_props[ATOMIC_PROP_COUNT] = {
+    [ATOMIC_CONNECTOR_CRTC_ID] = { DRM_MODE_OBJECT_CONNECTOR, "CRTC_ID" },
+    [ATOMIC_CRTC_MODE_ID]      = { DRM_MODE_OBJECT_CRTC, "MODE_ID" },
+    [ATOMIC_CRTC_ACTIVE]       = { DRM_MODE_OBJECT_CRTC, "ACTIVE" },
+    [ATOMIC_PLANE_FB_ID]       = { DRM_MODE_OBJECT_PLANE, "FB_ID" },
+    [ATOMIC_PLANE_CRTC_ID]     = { DRM_MODE_OBJECT_PLANE, "CRTC_ID" },
+    [ATOMIC_PLANE_SRC_X]       = { DRM_MODE_OBJECT_PLANE, "SRC_X" },
+    [ATOMIC_PLANE_SRC_Y]       = { DRM_MODE_OBJECT_PLANE, "SRC_Y" },
+    [ATOMIC_PLANE_SRC_W]       = { DRM_MODE_OBJECT_PLANE, "SRC_W" },
+    [ATOMIC_PLANE_SRC_H]       = { DRM_MODE_OBJECT_PLANE, "SRC_H" },
+    [ATOMIC_PLANE_CRTC_X]      = { DRM_MODE_OBJECT_PLANE, "CRTC_X" },
+    [ATOMIC_PLANE_CRTC_Y]      = { DRM_MODE_OBJECT_PLANE, "CRTC_Y" },
+    [ATOMIC_PLANE_CRTC_W]      = { DRM_MODE_OBJECT_PLANE, "CRTC_W" },
+    [ATOMIC_PLANE_CRTC_H]      = { DRM_MODE_OBJECT_PLANE, "CRTC_H" },
+};
+
+/* Find property /name/ of DRM object /id/.
+ * Return its id (and its value in /value/, if not NULL), 0 if there is no such property. */
+INTERNAL uint32_t drm_object_property(int fd, uint32_t id, uint32_t type, const char *name,
+                                      uint64_t *value)
+{
+    drmModeObjectPropertiesPtr props;
+    uint32_t prop_id = 0;
+    unsigned int i;
+
+    props = drmModeObjectGetProperties(fd, id, type);
+    if (!props) {
+        return 0;
+    }
+    for (i = 0; i < props->count_props && !prop_id; ++i) {
+        drmModePropertyPtr p = drmModeGetProperty(fd, props->props[i]);
+
+        if (!p) {
+            continue;
+        }
+        if (!strcmp(p->name, name)) {
+            prop_id = p->prop_id;
+            if (value) {
+                *value = props->prop_values[i];
+            }
+        }
+        drmModeFreeProperty(p);
+    }
+    drmModeFreeObjectProperties(props);
+    return prop_id;
+}
+
+/* Find the primary plane of /monitor/ CRTC and the ids of the properties we commit. */
+static int i915_atomic_probe(struct drm_monitor *monitor)
+{
+    struct drm_device *d = monitor->device;
+    drmModePlaneResPtr rp;
+    uint32_t object;
+    unsigned int i;
+    int pipe;
+
+    if (monitor->atomic_crtc == monitor->crtc) {
+        return monitor->atomic_plane ? 0 : -ENODEV;
+    }
+    monitor->atomic_crtc = monitor->crtc;
+    monitor->atomic_plane = 0;
+
+    pipe = drm_monitor_pipe(monitor);
+    if (pipe < 0) {
+        return pipe;
+    }
+    rp = drmModeGetPlaneResources(d->fd);
+    if (!rp) {
+        return -errno;
+    }
+    for (i = 0; i < rp->count_planes && !monitor->atomic_plane; ++i) {
+        drmModePlanePtr p = drmModeGetPlane(d->fd, rp->planes[i]);
+        uint64_t type;
+
+        if (!p) {
+            continue;
+        }
+        if ((p->possible_crtcs & (1 << pipe)) &&
+            drm_object_property(d->fd, p->plane_id, DRM_MODE_OBJECT_PLANE, "type", &type) &&
+            type == DRM_PLANE_TYPE_PRIMARY) {
+            monitor->atomic_plane = p->plane_id;
+        }
+        drmModeFreePlane(p);
+    }
+    drmModeFreePlaneResources(rp);
+    if (!monitor->atomic_plane) {
+        return -ENODEV;
+    }
+
+    for (i = 0; i < ATOMIC_PROP_COUNT; ++i) {
+        switch (atomic_props[i].type) {
+            case DRM_MODE_OBJECT_CONNECTOR: object = monitor->connector; break;
+            case DRM_MODE_OBJECT_CRTC: object = monitor->crtc; break;
+            default: object = monitor->atomic_plane; break;
+        }
+        monitor->atomic_props[i] = drm_object_property(d->fd, object, atomic_props[i].type,
+                                                       atomic_props[i].name, NULL);
+        if (!monitor->atomic_props[i]) {
+            DRM_DBG("No property %s on object %u of device \"%s\".", atomic_props[i].name,
+                    object, d->devnode);
+            monitor->atomic_plane = 0;
+            return -ENOTSUP;
+        }
+    }
+    return 0;
+}
+
+/* Find a mode of /monitor/ the primary plane can show /fb/ with, as is. */
+static int i915_atomic_find_mode(struct drm_monitor *monitor, struct framebuffer *fb,
+                                 drmModeModeInfoPtr mode)
+{
+    drmModeConnector *con;
+    drmModeModeInfo fallback_mode;
+    int rc = 0;
+
+    con = drmModeGetConnectorCurrent(monitor->device->fd, monitor->connector);
+    if (!con) {
+        return -errno;
+    }
+    if (con->connection != DRM_MODE_CONNECTED) {
+        rc = -ENOENT;
+    } else if (__find_mode(fb, con->modes, con->count_modes, mode, &fallback_mode)) {
+        rc = -ERANGE;
+    }
+    drmModeFreeConnector(con);
+    return rc;
+}
+
+/* Add /monitor/ scanning out /drmfb/ with /mode/ to the pending request. */
+static int i915_atomic_stage(struct drm_monitor *monitor, struct drm_framebuffer *drmfb,
+                             drmModeModeInfoPtr mode)
+{
+    struct drm_device *d = monitor->device;
+    drmModeAtomicReqPtr req = d->commit;
+    const uint32_t *p = monitor->atomic_props;
+    uint32_t plane = monitor->atomic_plane;
+    uint32_t blob;
+    int cursor = drmModeAtomicGetCursor(req);
+
+    if (!monitor->mode_blob || memcmp(&monitor->blob_mode, mode, sizeof (*mode))) {
+        if (drmModeCreatePropertyBlob(d->fd, mode, sizeof (*mode), &blob)) {
+            return -errno;
+        }
+        /* The kernel keeps its own reference while the CRTC uses the old one. */
+        if (monitor->mode_blob) {
+            drmModeDestroyPropertyBlob(d->fd, monitor->mode_blob);
+        }
+        monitor->mode_blob = blob;
+        memcpy(&monitor->blob_mode, mode, sizeof (*mode));
+    }
+
+    if (drmModeAtomicAddProperty(req, monitor->connector, p[ATOMIC_CONNECTOR_CRTC_ID], monitor->crtc) < 0 ||
+        drmModeAtomicAddProperty(req, monitor->crtc, p[ATOMIC_CRTC_MODE_ID], monitor->mode_blob) < 0 ||
+        drmModeAtomicAddProperty(req, monitor->crtc, p[ATOMIC_CRTC_ACTIVE], 1) < 0 ||
+        drmModeAtomicAddProperty(req, plane, p[ATOMIC_PLANE_FB_ID], drmfb->id) < 0 ||
+        drmModeAtomicAddProperty(req, plane, p[ATOMIC_PLANE_CRTC_ID], monitor->crtc) < 0 ||
+        drmModeAtomicAddProperty(req, plane, p[ATOMIC_PLANE_SRC_X], 0) < 0 ||
+        drmModeAtomicAddProperty(req, plane, p[ATOMIC_PLANE_SRC_Y], 0) < 0 ||
+        drmModeAtomicAddProperty(req, plane, p[ATOMIC_PLANE_SRC_W], mode->hdisplay << 16) < 0 ||
+        drmModeAtomicAddProperty(req, plane, p[ATOMIC_PLANE_SRC_H], mode->vdisplay << 16) < 0 ||
+        drmModeAtomicAddProperty(req, plane, p[ATOMIC_PLANE_CRTC_X], 0) < 0 ||
+        drmModeAtomicAddProperty(req, plane, p[ATOMIC_PLANE_CRTC_Y], 0) < 0 ||
+        drmModeAtomicAddProperty(req, plane, p[ATOMIC_PLANE_CRTC_W], mode->hdisplay) < 0 ||
+        drmModeAtomicAddProperty(req, plane, p[ATOMIC_PLANE_CRTC_H], mode->vdisplay) < 0) {
+        drmModeAtomicSetCursor(req, cursor);
+        return -ENOMEM;
+    }
+
+    memcpy(&monitor->commit_mode, mode, sizeof (*mode));
+    monitor->flipped = monitor->mode_valid && !memcmp(&monitor->mode, mode, sizeof (*mode));
+    list_add_tail(&monitor->l_commit, &d->commit_monitors);
+    return 0;
+}
+
+static void i915_atomic_begin(struct drm_device *device)
+{
+    if (!device->commit) {
+        device->commit = drmModeAtomicAlloc();
+    }
+}
+
+/* Display the staged monitors through the legacy path, one at a time. */
+static int i915_atomic_fallback(struct drm_device *device)
+{
+    struct drm_monitor *m, *mm;
+    int rc = 0, err;
+
+    list_for_each_entry_safe(m, mm, &device->commit_monitors, l_commit) {
+        struct drm_framebuffer *drmfb = m->framebuffer;
+
+        list_del(&m->l_commit);
+        m->framebuffer = NULL;
+        err = i915_modeset(m, drmfb);
+        if (err) {
+            DRM_ERR("Could not display dom%u on connector %u (%s).",
+                    m->surface->domid, m->connector, strerror(-err));
+            m->surface = NULL;
+            list_del(&m->l_sur);
+            drm_fb_cache_put(drmfb);
+            rc = err;
+        }
+    }
+    return rc;
+}
+
+static int i915_atomic_commit(struct drm_device *device)
+{
+    uint32_t flags = DRM_MODE_ATOMIC_ALLOW_MODESET;
+    struct drm_monitor *m, *mm;
+    unsigned int crtcs = 0;
+    uint64_t start;
+    int rc;
+
+    if (!device->commit) {
+        return 0;
+    }
+    if (list_empty(&device->commit_monitors)) {
+        rc = 0;
+        goto out;
+    }
+
+    rc = drm_device_set_master(device);
+    if (rc) {
+        DRM_ERR("Cannot perform modeset operation while something else is mastering `%s' (%s).",
+                device->devnode, strerror(-rc));
+        goto fallback;
+    }
+    if (drmModeAtomicCommit(device->fd, device->commit, flags | DRM_MODE_ATOMIC_TEST_ONLY, NULL)) {
+        DRM_WRN("Atomic configuration rejected by device \"%s\" (%s), using legacy modesetting.",
+                device->devnode, strerror(errno));
+        goto fallback_master;
+    }
+
+    start = latency_now_us();
+    if (device->flips_pending && start - device->commit_start > ATOMIC_FLIP_TIMEOUT_US) {
+        DRM_WRN("Lost %u page-flip events on device \"%s\".", device->flips_pending, device->devnode);
+        device->flips_pending = 0;
+    }
+    /* A commit still in flight would make a non-blocking one fail with EBUSY, wait for it. */
+    if (!device->flips_pending) {
+        flags |= DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT;
+    }
+    SURFMAN_TRACE_BEGIN("drm_atomic_commit", device->devnode);
+    rc = drmModeAtomicCommit(device->fd, device->commit, flags, device);
+    SURFMAN_TRACE_END("drm_atomic_commit", device->devnode);
+    if (rc) {
+        DRM_WRN("Atomic commit failed on device \"%s\" (%s), using legacy modesetting.",
+                device->devnode, strerror(errno));
+        goto fallback_master;
+    }
+    drm_device_drop_master(device);
+
+    list_for_each_entry_safe(m, mm, &device->commit_monitors, l_commit) {
+        list_del(&m->l_commit);
+        memcpy(&m->mode, &m->commit_mode, sizeof (m->mode));
+        m->crtc_x = m->crtc_y = 0;
+        m->mode_valid = 1;
+        ++crtcs;
+    }
+    if (flags & DRM_MODE_PAGE_FLIP_EVENT) {
+        device->flips_pending = crtcs;  /* One event per CRTC. */
+        device->commit_start = start;
+    } else {
+        latency_record(&atomic_commit_latency, latency_now_us() - start);
+    }
+    goto out;
+
+fallback_master:
+    drm_device_drop_master(device);
+fallback:
+    rc = i915_atomic_fallback(device);
+out:
+    drmModeAtomicFree(device->commit);
+    device->commit = NULL;
+    return rc;
+}
+
+/* Page-flip event of the last commit on one of its CRTCs. */
+INTERNAL void i915_atomic_flip_done(struct drm_device *device)
+{
+    struct drm_monitor *m;
+
+    if (device->flips_pending && !--device->flips_pending) {
+        latency_record(&atomic_commit_latency, latency_now_us() - device->commit_start);
+        /* Presents were held back while the configuration was staged. */
+        list_for_each_entry(m, &device->monitors, l_dev) {
+            if (m->framebuffer) {
+                drm_framebuffer_present(m->framebuffer);
+            }
+        }
+    }
+}
+
+static int i915_atomic_set(struct drm_monitor *monitor, struct drm_surface *surface)
+{
+    struct drm_device *d = monitor->device;
+    struct drm_framebuffer *drmfb;
+    drmModeModeInfo mode;
+    int batched = d->commit != NULL;
+    int rc;
+
+    rc = i915_atomic_probe(monitor);
+    if (!rc) {
+        rc = i915_atomic_find_mode(monitor, &surface->fb, &mode);
+    }
+    if (rc) {
+        DRM_DBG("Connector %u cannot show dom%u with its primary plane (%s), using legacy modesetting.",
+                monitor->connector, surface->domid, strerror(-rc));
+        return i915_ops.set(monitor, surface);
+    }
+
+    drmfb = i915_framebuffer_new(d, surface);
+    if (!drmfb) {
+        rc = -errno;
+        DRM_DBG("Could not create a new framebuffer for dom%u on monitor %u (%s).",
+                surface->domid, monitor->connector, strerror(errno));
+        return rc;
+    }
+    i915_atomic_begin(d);
+    rc = d->commit ? i915_atomic_stage(monitor, drmfb, &mode) : -ENOMEM;
+    if (rc) {
+        DRM_DBG("Could not stage dom%u framebuffer on monitor %u (%s).",
+                surface->domid, monitor->connector, strerror(-rc));
+        drm_fb_cache_put(drmfb);
+        if (!batched && d->commit) {
+            drmModeAtomicFree(d->commit);
+            d->commit = NULL;
+        }
+        return rc;
+    }
+    monitor->framebuffer = drmfb;
+    list_add_tail(&monitor->l_sur, &surface->monitors);
+    monitor->surface = surface;
+
+    /* Outside of drmp_display(), e.g. on surface update, apply it right away. */
+    if (!batched) {
+        rc = i915_atomic_commit(d);
+    }
+    return rc;
+}
+
+static void i915_atomic_unset(struct drm_monitor *monitor)
+{
+    i915_ops.unset(monitor);
+}
+
+static void i915_atomic_refresh(struct drm_monitor *monitor, const struct drm_surface *surface,
+                                const struct rect *rectangle)
+{
+    i915_ops.refresh(monitor, surface, rectangle);
+}
+
+static void i915_atomic_flush(struct drm_monitor *monitor, int wait)
+{
+    i915_ops.flush(monitor, wait);
+}
+
+const struct drm_device_ops i915_atomic_ops = {
+    .set = i915_atomic_set,
+    .unset = i915_atomic_unset,
+    .refresh = i915_atomic_refresh,
+    .flush = i915_atomic_flush,
+    .begin = i915_atomic_begin,
+    .commit = i915_atomic_commit,
+};
@@ -99,10 +99,10 @@ static int should_avoid_scaling(struct drm_monitor *monitor, struct drm_framebuf
  * - We are not able to scale down.
  * - We can manage scaled up framebuffer using planes or direct modesetting,
  *   but it is more flexible using planes. */
-static inline int __find_mode(struct framebuffer *fb,
-                              drmModeModeInfoPtr modes, unsigned int count,
-                              drmModeModeInfoPtr mode,
-                              drmModeModeInfoPtr fallback_mode)
+INTERNAL int __find_mode(struct framebuffer *fb,
+                         drmModeModeInfoPtr modes, unsigned int count,
+                         drmModeModeInfoPtr mode,
+                         drmModeModeInfoPtr fallback_mode)
 {
     unsigned int i;
     unsigned int dh, dw, dl, odl = ~0L;   /* delta-width, delta-height, delta-length, old_delta-lenght. */
@@ -175,10 +175,18 @@ static struct drm_plane *__plane_find_new(struct drm_device *device, uint32_t cr
     }
 
     for (i = 0; i < rp->count_planes; ++i) {
+        uint64_t type = DRM_PLANE_TYPE_OVERLAY;
+
         p = drmModeGetPlane(device->fd, rp->planes[i]);
         if (!p) {
             continue;
         }
+        /* Universal planes (atomic clients) also list primary and cursor planes. */
+        drm_object_property(device->fd, p->plane_id, DRM_MODE_OBJECT_PLANE, "type", &type);
+        if (type != DRM_PLANE_TYPE_OVERLAY) {
+            drmModeFreePlane(p);
+            continue;
+        }
         for (j = 0; j < rs->count_crtcs; ++j) {
             if (p->possible_crtcs & (1 << j)) {     /* We only have the id not the index in that array. */
                 if (rs->crtcs[j] == crtc) {         /* Plane compatible with our crtc. */
@@ -309,11 +317,17 @@ static void i915_plane_release(struct drm_plane *plane)
 /* I'm not sure we should expose those in the /drm_device_ops/ struct.
  * - /set/ and /unset/ will use them,
  * - having a framebuffer without putting it on the screen is not a use case yet. */
-static struct drm_framebuffer *i915_framebuffer_new(struct drm_device *device, struct drm_surface *surface)
+INTERNAL struct drm_framebuffer *i915_framebuffer_new(struct drm_device *device, struct drm_surface *surface)
 {
     struct drm_framebuffer *drmfb;
     int err;
 
+    /* Switching back to a surface reuses the framebuffer we already made for it. */
+    drmfb = drm_fb_cache_get(device, surface);
+    if (drmfb) {
+        return drmfb;
+    }
+
     /* TODO: We now have a userland way to provide fbtap feature (and better) using
      *       DRM. So that check will eventually go away with fbtap. */
     if (surface->domid > 0) {
@@ -346,7 +360,7 @@ static struct drm_framebuffer *i915_framebuffer_new(struct drm_device *device, s
     }
 
 succeed:
-    /* TODO: We might find useful to have a list of framebuffers for each device. */
+    drm_fb_cache_add(drmfb, surface);
     return drmfb;
 }
 
@@ -357,6 +371,15 @@ static int i915_framebuffer_release(struct drm_framebuffer *framebuffer)
     return 0;
 }
 
+/* Can /monitor/ switch to /mode/ with a page-flip, without touching the CRTC timings? */
+static int i915_can_flip(struct drm_monitor *monitor, drmModeModeInfoPtr mode,
+                         unsigned int crtc_x, unsigned int crtc_y)
+{
+    return monitor->mode_valid && !monitor->plane &&
+           monitor->crtc_x == crtc_x && monitor->crtc_y == crtc_y &&
+           !memcmp(&monitor->mode, mode, sizeof (*mode));
+}
+
 /*
  * Helper function to enable or disable the scaling (panel fitting) for a given connector.
  */
@@ -405,14 +428,14 @@ static int __create_mode_for_framebuffer(struct drm_monitor *monitor,
 /*
  * Device interface.
  */
-static int i915_modeset(struct drm_monitor *monitor, struct drm_framebuffer *drmfb)
+INTERNAL int i915_modeset(struct drm_monitor *monitor, struct drm_framebuffer *drmfb)
 {
     int rc = 0;
     drmModeConnector *con;
     drmModeModeInfo mode = { 0 }, fallback_mode = { 0 };
     unsigned int crtc_x = 0, crtc_y = 0;
 
-    con = drmModeGetConnector(monitor->device->fd, monitor->connector);
+    con = drmModeGetConnectorCurrent(monitor->device->fd, monitor->connector);
     if (!con) {
         rc = -errno;
         DRM_ERR("Could not access connector %u on device \"%s\" (%s).",
@@ -494,9 +517,32 @@ modeset:
         goto fail_setmaster;
     }
 
-    if (drmModeSetCrtc(monitor->device->fd, monitor->crtc, monitor->framebuffer->id,
-                       crtc_x, crtc_y,
-                       &(monitor->connector), 1, &mode)) {
+    monitor->flipped = 0;
+    if (i915_can_flip(monitor, &mode, crtc_x, crtc_y)) {
+        /* Same timings as what is scanned out already: swap the framebuffer on the next vblank.
+         * Presents of that framebuffer wait for the flip (see framebuffer-dumb.c). */
+        SURFMAN_TRACE_BEGIN("drm_page_flip", monitor->device->devnode);
+        rc = drmModePageFlip(monitor->device->fd, monitor->crtc, monitor->framebuffer->id,
+                             DRM_MODE_PAGE_FLIP_EVENT, monitor->framebuffer);
+        SURFMAN_TRACE_END("drm_page_flip", monitor->device->devnode);
+        if (!rc) {
+            monitor->framebuffer->flips_pending++;
+            monitor->flipped = 1;
+            drm_device_drop_master(monitor->device);
+            drmModeFreeConnector(con);
+            return 0;
+        }
+        DRM_DBG("Could not flip to framebuffer %u on CRTC %u (%s), falling back to modeset.",
+                monitor->framebuffer->id, monitor->crtc, strerror(errno));
+    }
+
+    monitor->mode_valid = 0;
+    SURFMAN_TRACE_BEGIN("drm_setcrtc", monitor->device->devnode);
+    rc = drmModeSetCrtc(monitor->device->fd, monitor->crtc, monitor->framebuffer->id,
+                        crtc_x, crtc_y,
+                        &(monitor->connector), 1, &mode);
+    SURFMAN_TRACE_END("drm_setcrtc", monitor->device->devnode);
+    if (rc) {
         rc = -errno;
         DRM_ERR("Cannot display framebuffer %u in connector %u (%s).",
                 monitor->framebuffer->id, monitor->connector, strerror(errno));
@@ -526,9 +572,16 @@ modeset:
         if(rc < 0) {
             DRM_ERR("Error setting up scaling: %s.", strerror(-rc));
         }
+
+        /* Later switches to a framebuffer fitting that mode can page-flip. */
+        memcpy(&monitor->mode, &mode, sizeof (mode));
+        monitor->crtc_x = crtc_x;
+        monitor->crtc_y = crtc_y;
+        monitor->mode_valid = 1;
     }
 
     drm_device_drop_master(monitor->device);
+    drmModeFreeConnector(con);
 
     return 0;
 
@@ -560,7 +613,7 @@ static int i915_set(struct drm_monitor *monitor, struct drm_surface *surface)
     if (rc) {
         DRM_DBG("Count not setup dom%u framebuffer on monitor %u (%s).",
                 surface->domid, monitor->connector, strerror(-rc));
-        i915_framebuffer_release(drmfb);
+        drm_fb_cache_put(drmfb);
         return rc;
     }
     list_add_tail(&monitor->l_sur, &surface->monitors);
@@ -568,19 +621,31 @@ static int i915_set(struct drm_monitor *monitor, struct drm_surface *surface)
     return 0;
 }
 
+static void i915_flush(struct drm_monitor *monitor, int wait);
+
 static void i915_unset(struct drm_monitor *monitor)
 {
+    /* Don't leave copies from the surface behind. */
+    i915_flush(monitor, 1);
     monitor->surface = NULL;
     list_del(&monitor->l_sur);
     if (monitor->plane) {
+        /* The plane shows the surface framebuffer, on top of our own blank one. */
+        struct drm_framebuffer *drmfb = monitor->plane->framebuffer;
+
         i915_plane_unset(monitor->plane);
+        monitor->plane->framebuffer = NULL;     /* Cached, don't release it with the plane. */
         i915_plane_release(monitor->plane);
         monitor->plane = NULL;
+        drm_fb_cache_put(drmfb);
+        if (monitor->framebuffer) {
+            i915_framebuffer_release(monitor->framebuffer);
+        }
+    } else if (monitor->framebuffer) {
+        /* Keep scanning it out until the next set() flips or modesets. */
+        drm_fb_cache_put(monitor->framebuffer);
     }
-    if (monitor->framebuffer) {
-        i915_framebuffer_release(monitor->framebuffer);
-        monitor->framebuffer = NULL;
-    }
+    monitor->framebuffer = NULL;
 }
 
 /* XXX: Different devices might be displaying only a plane, only a framebuffer or both,
@@ -602,6 +667,22 @@ static void i915_refresh(struct drm_monitor *monitor, const struct drm_surface *
     sink->ops->refresh(sink, &surface->fb, rectangle);
 }
 
+static void i915_flush(struct drm_monitor *monitor, int wait)
+{
+    struct drm_framebuffer *sink;
+
+    sink = monitor->plane ? monitor->plane->framebuffer : monitor->framebuffer;
+    if (!sink) {
+        return;
+    }
+    if (wait) {
+        drm_framebuffer_sync(sink);
+        drm_framebuffer_wait_flips(sink);
+    } else {
+        drm_framebuffer_present(sink);
+    }
+}
+
 static int i915_match_udev_device(struct udev *udev, struct udev_device *device)
 {
     const char *driver;
@@ -639,6 +720,8 @@ const struct drm_device_ops i915_ops = {
     .set = i915_set,
     .unset = i915_unset,
     .refresh = i915_refresh,
-    .match = i915_match_udev_device
+    .flush = i915_flush,
+    .match = i915_match_udev_device,
+    .atomic = &i915_atomic_ops
 };
 
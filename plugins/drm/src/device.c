@@ -27,6 +27,25 @@ static const struct drm_device_ops *supported_devices[SUPPORTED_DEVICE_MAX] = {
     [SUPPORTED_DEVICE_I915] = &i915_ops,
 };
 
+/* Use the atomic variant of /ops/ if it has one, the kernel supports it and it is not disabled
+ * in the configuration. */
+static const struct drm_device_ops *drm_device_atomic_ops(struct drm_device *device,
+                                                          const struct drm_device_ops *ops)
+{
+    const char *enable = config_get(PLUGIN_NAME, CONFIG_ATOMIC_MODESET);
+
+    if (!ops->atomic || (enable && !strtoul(enable, NULL, 0))) {
+        return ops;
+    }
+    if (drmSetClientCap(device->fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1) ||
+        drmSetClientCap(device->fd, DRM_CLIENT_CAP_ATOMIC, 1)) {
+        DRM_INF("No atomic modesetting on device \"%s\" (%s).", device->devnode, strerror(errno));
+        return ops;
+    }
+    DRM_INF("Using atomic modesetting on device \"%s\".", device->devnode);
+    return ops->atomic;
+}
+
 /* Open the char-dev provided by DRM and initializes our object for it. */
 INTERNAL struct drm_device *drm_device_init(const char *path, const struct drm_device_ops *ops)
 {
@@ -40,6 +59,8 @@ INTERNAL struct drm_device *drm_device_init(const char *path, const struct drm_d
     strncpy(d->devnode, path, 255);
     INIT_LIST_HEAD(&d->monitors);
     INIT_LIST_HEAD(&d->planes);
+    INIT_LIST_HEAD(&d->fb_cache);
+    INIT_LIST_HEAD(&d->commit_monitors);
 
     d->fd = open(d->devnode, O_RDWR | O_CLOEXEC);
     if (d->fd < 0) {
@@ -47,7 +68,10 @@ INTERNAL struct drm_device *drm_device_init(const char *path, const struct drm_d
         free(d);
         return NULL;
     }
-    d->ops = ops;
+    d->ops = drm_device_atomic_ops(d, ops);
+    if (drm_device_events_init(d)) {
+        DRM_WRN("No vblank or page-flip events for device \"%s\".", d->devnode);
+    }
 
     list_add_tail(&d->l, &devices);
     drm_monitors_scan(d);
@@ -98,8 +122,14 @@ INTERNAL void drm_device_release(struct drm_device *device)
 
         device->ops->unset(m);
         list_del(device->monitors.next);
+        drm_monitor_cache_release(m);
         free(m);
     }
+    drm_fb_cache_release(device);
+    drm_device_events_release(device);
+    if (device->commit) {
+        drmModeAtomicFree(device->commit);
+    }
     free(device);
 }
 
@@ -152,6 +182,7 @@ INTERNAL void drm_device_del_monitor(struct drm_device *device, uint32_t connect
         if (m->surface) {
             device->ops->unset(m);
         }
+        drm_monitor_cache_release(m);
         free(m);
     }
 }
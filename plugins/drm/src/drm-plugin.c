@@ -59,6 +59,27 @@ static const char * scaling_modes_config [SCALING_MODE_COUNT] = {
 /* Stores the scaling mode read from the configuration. Used when possible. */
 int configured_scaling_mode = DRM_MODE_SCALE_FULLSCREEN;
 
+/* Dirty rectangles at most that many clean lines apart are refreshed as one. */
+static unsigned int dirty_merge_gap = SURFMAN_DIRTY_MERGE_GAP;
+
+/* Time taken to display a new surface on a monitor, by method. */
+static struct latency_histogram switch_flip = { .name = "Switch latency (page-flip)" };
+static struct latency_histogram switch_modeset = { .name = "Switch latency (modeset)" };
+
+static void __dump_switch_latencies(void)
+{
+    DRM_INF("Framebuffer cache: %lu hits, %lu misses.", fb_cache_hits, fb_cache_misses);
+    DRM_INF("Connector cache: %lu hits, %lu misses, %lu probes.",
+            connector_cache_hits, connector_cache_misses, connector_probes);
+    DRM_INF("Double buffering: %lu frames flipped, %lu dropped while a flip was pending.",
+            dumb_frames_flipped, dumb_frames_dropped);
+    latency_dump(&flip_interval);
+    latency_dump(&switch_flip);
+    latency_dump(&switch_modeset);
+    latency_dump(&atomic_commit_latency);
+    latency_dump(&hotplug_latency);
+}
+
 /**
  * Attempts to read the default scaling mode from surfman.conf,
  * and populates configured_scaling_mode.
@@ -118,6 +139,12 @@ INTERNAL int drmp_init(surfman_plugin_t *plugin)
 
     __read_configuration_scaling_mode();
 
+    dirty_merge_gap = rects_merge_gap(PLUGIN_NAME);
+    fb_cache_size = config_get_uint_max(PLUGIN_NAME, CONFIG_FB_CACHE_SIZE,
+                                        FB_CACHE_SIZE, FB_CACHE_SIZE_MAX);
+    dumb_double_buffer = config_get_uint_max(PLUGIN_NAME, CONFIG_DOUBLE_BUFFER,
+                                             dumb_double_buffer, 1);
+
     return SURFMAN_SUCCESS;
 }
 
@@ -126,6 +153,7 @@ INTERNAL void drmp_shutdown(surfman_plugin_t *plugin)
     (void) plugin;
     struct drm_device *dev, *tmp;
 
+    __dump_switch_latencies();
     backlight_release(backlight);
     list_for_each_entry_safe(dev, tmp, &devices, l) {
         drm_device_release(dev);
@@ -136,13 +164,22 @@ INTERNAL void drmp_shutdown(surfman_plugin_t *plugin)
 INTERNAL int drmp_display(surfman_plugin_t *plugin, surfman_display_t *config, size_t size)
 {
     (void) plugin;
+    struct drm_device *dd;
     unsigned int i;
     int rc;
 
+    /* Devices that can, apply the whole configuration at once. */
+    list_for_each_entry(dd, &devices, l) {
+        if (dd->ops->begin) {
+            dd->ops->begin(dd);
+        }
+    }
     for (i = 0; i < size; ++i) {
         struct drm_surface *s = config[i].psurface;
         struct drm_monitor *m = config[i].monitor;
         struct drm_device *d = m->device;
+        struct latency_histogram *h;
+        uint64_t start;
 
         assert(d != NULL);
         if (s == NULL) {
@@ -164,8 +201,9 @@ INTERNAL int drmp_display(surfman_plugin_t *plugin, surfman_display_t *config, s
                 continue;   /* Skip errors. */
             }
         }
+        start = latency_now_us();
         if (m->surface) {
-            /* Release the displayed surface resources. */
+            /* Release the displayed surface resources (the framebuffer stays cached). */
             d->ops->unset(m);
         }
         /* The monitor is already setup, but does not display the correct surface. */
@@ -179,8 +217,27 @@ INTERNAL int drmp_display(surfman_plugin_t *plugin, surfman_display_t *config, s
                 .x = 0, .y = 0, .w = s->fb.width, .h = s->fb.height
             };
             d->ops->refresh(m, s, &r);
+            if (d->ops->flush) {
+                d->ops->flush(m, 0);
+            }
             drm_monitor_info(m);
         }
+        h = m->flipped ? &switch_flip : &switch_modeset;
+        latency_record(h, latency_now_us() - start);
+        if (!((switch_flip.count + switch_modeset.count) % LATENCY_DUMP_PERIOD)) {
+            __dump_switch_latencies();
+        }
+    }
+    list_for_each_entry(dd, &devices, l) {
+        if (dd->ops->commit) {
+            rc = dd->ops->commit(dd);
+            if (rc) {
+                DRM_WRN("Could not apply configuration on device \"%s\" (%s).",
+                        dd->devnode, strerror(-rc));
+            }
+        }
+        /* Monitors moved to their new framebuffers, old ones can go. */
+        drm_fb_cache_trim(dd);
     }
 
     return SURFMAN_SUCCESS;
@@ -207,15 +264,25 @@ INTERNAL int drmp_get_monitors(surfman_plugin_t *plugin, surfman_monitor_t *moni
         list_for_each_entry_safe(m, mm, &(d->monitors), l_dev) {
             if (j >= size) {
                 DRM_WRN("Surfman cannot manage all the reported monitors.");
+                hotplug_rescanned();
                 return SURFMAN_SUCCESS; /* Surfman cannot deal with more monitors. */
             }
             drm_monitor_info(m);
             monitors[j++] = m;
         }
     }
+    hotplug_rescanned();
     return j;
 }
 
+INTERNAL int drmp_get_notify_fd(surfman_plugin_t *plugin)
+{
+    (void) plugin;
+    int fd = hotplug_notify_fd();
+
+    return fd < 0 ? SURFMAN_ERROR : fd;
+}
+
 INTERNAL int drmp_set_monitor_modes(struct surfman_plugin *plugin,
                                     surfman_monitor_t monitor, surfman_monitor_mode_t *mode)
 {
@@ -237,20 +304,21 @@ INTERNAL int drmp_get_monitor_info(struct surfman_plugin *plugin, surfman_monito
     drmModeConnector *c;
     unsigned int i, mode = 0;
 
-    c = drmModeGetConnector(d->fd, m->connector);
+    c = drm_monitor_connector(m);
     if (!c) {
         DRM_WRN("Could not access connector %u on device \"%s\" (%s).",
-                m->connector, m->device->devnode, strerror(errno));
+                m->connector, d->devnode, strerror(errno));
         return SURFMAN_ERROR;
     }
     if (!c->count_modes) {
-        DRM_WRN("0 modes found on connector %u on device \"%s\" (%s).",
-                m->connector, m->device->devnode, strerror(errno));
+        DRM_WRN("0 modes found on connector %u on device \"%s\".",
+                m->connector, d->devnode);
         return SURFMAN_ERROR;
     }
     /* From the biggest to the lowest, depending on how many Surfman can manage. */
     modes_count = min(modes_count, (unsigned int)c->count_modes);
     for (i = 0; i < modes_count; ++i) {
+        info->modes[i].pix_clock_hz = c->modes[i].clock * 1000;     /* kHz */
         info->modes[i].htimings[SURFMAN_TIMING_ACTIVE] = c->modes[i].hdisplay;
         info->modes[i].htimings[SURFMAN_TIMING_SYNC_START] = c->modes[i].hsync_start;
         info->modes[i].htimings[SURFMAN_TIMING_SYNC_END] = c->modes[i].hsync_end;
@@ -261,7 +329,6 @@ INTERNAL int drmp_get_monitor_info(struct surfman_plugin *plugin, surfman_monito
         info->modes[i].vtimings[SURFMAN_TIMING_SYNC_END] = c->modes[i].vsync_end;
         info->modes[i].vtimings[SURFMAN_TIMING_TOTAL] = c->modes[i].vtotal;
     }
-    drmModeFreeConnector(c);
 
     /* If we give back any value higher than 3000, surfman will override it.
      * Try to find the highest resolution with both components below 3000. */
@@ -304,6 +371,7 @@ INTERNAL surfman_psurface_t drmp_get_psurface_from_surface(surfman_plugin_t *plu
     }
     s->fb.height = surfman_surface->height;
     s->fb.width = surfman_surface->width;
+    s->format = surfman_surface->format;
     s->fb.bpp = surfman_format_to_bpp(surfman_surface->format);
     s->fb.depth = surfman_format_to_depth(surfman_surface->format);
     if (!s->fb.bpp || !s->fb.depth) {
@@ -314,12 +382,16 @@ INTERNAL surfman_psurface_t drmp_get_psurface_from_surface(surfman_plugin_t *plu
     s->fb.pitch = surfman_surface->stride;
     s->fb.size = surfman_surface->page_count * XC_PAGE_SIZE;
     s->fb.offset = surfman_surface->offset;
+    s->src = surfman_surface;
     s->fb.map = surface_map(surfman_surface);
     s->domid = surfman_surface->pages_domid;
 
     s->mfns = malloc(surfman_surface->page_count * sizeof (*s->mfns));
     if (!s->mfns) {
         DRM_ERR("Could not allocate memory (%s).", strerror(errno));
+        if (s->fb.map) {
+            surface_unmap(surfman_surface);
+        }
         free(s);
         return NULL;
     }
@@ -336,9 +408,14 @@ INTERNAL int drmp_get_monitor_edid(struct surfman_plugin *plugin, surfman_monito
                                    surfman_monitor_edid_t *edid)
 {
     (void) plugin;
-    (void) monitor;
-    (void) edid;
-    return SURFMAN_ERROR;
+    struct drm_monitor *m = monitor;
+
+    /* Only the base block fits, extensions are left out. */
+    if (!drm_monitor_connector(m) || !m->edid || m->edid_len < sizeof (edid->edid)) {
+        return SURFMAN_ERROR;
+    }
+    memcpy(edid->edid, m->edid, sizeof (edid->edid));
+    return SURFMAN_SUCCESS;
 }
 
 INTERNAL void drmp_update_psurface(surfman_plugin_t *plugin, surfman_psurface_t psurface,
@@ -346,18 +423,33 @@ INTERNAL void drmp_update_psurface(surfman_plugin_t *plugin, surfman_psurface_t
 {
     (void) plugin;
     struct drm_surface *s = psurface;
+    void *map;
     int rc;
 
     if (flags & (SURFMAN_UPDATE_PAGES | SURFMAN_UPDATE_OFFSET)) {
-        /* Remap Surfman's framebuffer. */
-        surface_unmap(surface);
-        s->fb.map = surface_map(surface);
+        struct drm_monitor *m;
+
+        /* Copies still reading from the old mapping have to be over. */
+        list_for_each_entry(m, &(s->monitors), l_sur) {
+            if (m->device->ops->flush) {
+                m->device->ops->flush(m, 1);
+            }
+        }
+        /* Take the new reference first, the mapping is kept if the pages
+         * did not change. */
+        map = surface_map(surface);
+        if (s->fb.map) {
+            surface_unmap(surface);
+        }
+        s->fb.map = map;
     }
+    s->src = surface;
     s->fb.size = surface->page_count * XC_PAGE_SIZE;
     s->fb.offset = surface->offset;
     s->fb.pitch = surface->stride;
     s->fb.width = surface->width;
     s->fb.height = surface->height;
+    s->format = surface->format;
     s->fb.depth = surfman_format_to_depth(surface->format);
     s->fb.bpp = surfman_format_to_bpp(surface->format);
     s->domid = surface->pages_domid;
@@ -392,6 +484,8 @@ INTERNAL void drmp_update_psurface(surfman_plugin_t *plugin, surfman_psurface_t
             t->p = m;
             list_add_tail(&(t->l), &ms);
         }
+        /* Cached framebuffers map the old pages or geometry. */
+        drm_fb_cache_invalidate(s);
         while (&ms != ms.next) {
             t = container_of(ms.next, struct ptr, l);
             m = t->p;
@@ -407,45 +501,48 @@ INTERNAL void drmp_update_psurface(surfman_plugin_t *plugin, surfman_psurface_t
     }
 }
 
-#define DIV_CEIL(x, y) (((x) + (y) - 1) / (y))
-INTERNAL void drmp_refresh_psurface(struct surfman_plugin *plugin,
-                                    surfman_psurface_t psurface, uint8_t *db)
+/* Copy /rects/ of /s/ to the monitors displaying it. */
+static void __refresh_rects(struct drm_surface *s, const surfman_rect_t *rects, size_t count)
 {
-    (void) plugin;
-    struct drm_surface *s = psurface;
-    unsigned int b, i;  /* First and last dirty page. */
     struct drm_monitor *m, *mm;
-    struct rect r = {
-        .x = 0, .y = 0,
-        .w = s->fb.width, .h = s->fb.height
-    };
-
-    /* TODO: Shortcut that if we don't need refresh... */
-    if (db) {
-        unsigned int n = DIV_CEIL(s->fb.pitch * s->fb.height, XC_PAGE_SIZE);
-        /* TODO: Take this arithmetic in Qemu and generate dirty rects ... */
-	/* TODO: bsf/bsr!! Sounds like a beer and crisps evening.
-         *       The implementation in libsurfman is too simple, we want more than one rect. */
-        for (i = 0; i < n; ++i) {
-            if (db[i / 8] & (1 << (i % 8))) {
-                b = i;
-                do {
-                    ++i;
-                } while ((i < n) && (db[i / 8] & (1 << (i % 8))));
-                r.y = (b * XC_PAGE_SIZE) / s->fb.pitch;
-                r.h = (i * XC_PAGE_SIZE - 1) / s->fb.pitch;
-                r.h = min(r.h, s->fb.height - 1);   /* Page can end outside the FB region. */
-                r.h -= r.y - 1; /* Don't forget r.y itslelf. */
-                list_for_each_entry_safe(m, mm, &(s->monitors), l_sur) {
-                    m->device->ops->refresh(m, s, &r);
-                }
-            }
-        }
-    } else {
+    size_t i;
+
+    for (i = 0; i < count; ++i) {
+        struct rect r = {
+            .x = rects[i].x, .y = rects[i].y, .w = rects[i].w, .h = rects[i].h
+        };
+
         list_for_each_entry_safe(m, mm, &(s->monitors), l_sur) {
             m->device->ops->refresh(m, s, &r);
         }
     }
+    /* Copies run on libsurfman workers, the event loop moves on. */
+    list_for_each_entry_safe(m, mm, &(s->monitors), l_sur) {
+        if (m->device->ops->flush) {
+            m->device->ops->flush(m, 0);
+        }
+    }
+}
+
+INTERNAL void drmp_refresh_psurface(struct surfman_plugin *plugin,
+                                    surfman_psurface_t psurface, uint8_t *db)
+{
+    (void) plugin;
+    struct drm_surface *s = psurface;
+    surfman_rect_t rects[SURFMAN_DIRTY_RECTS_MAX];
+    unsigned int n;
+
+    n = rects_from_dirty_bitmap(db, s->fb.width, s->fb.height, s->fb.pitch, s->format,
+                                dirty_merge_gap, rects, ARRAY_SIZE(rects));
+    __refresh_rects(s, rects, n);
+}
+
+INTERNAL void drmp_refresh_psurface_rects(struct surfman_plugin *plugin, surfman_psurface_t psurface,
+                                          const surfman_rect_t *rects, size_t count)
+{
+    (void) plugin;
+
+    __refresh_rects(psurface, rects, count);
 }
 
 INTERNAL void drmp_free_psurface(surfman_plugin_t *plugin, surfman_psurface_t psurface)
@@ -457,7 +554,10 @@ INTERNAL void drmp_free_psurface(surfman_plugin_t *plugin, surfman_psurface_t ps
     list_for_each_entry_safe(m, mm, &(s->monitors), l_sur) {
         m->device->ops->unset(m);
     }
-    /* XXX: Surfman should unmap the surface. */
+    drm_fb_cache_invalidate(s);
+    if (s->fb.map) {
+        surface_unmap(s->src);
+    }
     free(s->mfns);
     free(s);
 }
@@ -577,11 +677,22 @@ surfman_plugin_t surfman_plugin = {
     .dpms_on = drmp_dpms_on,
     .dpms_off = drmp_dpms_off,
 
+    /* Vblank clock for Surfman's refresh. */
+    .get_vblank_fd = drmp_get_vblank_fd,
+    .request_vblank = drmp_request_vblank,
+    .handle_vblank = drmp_handle_vblank,
+
+    /* Hotplug notifications. */
+    .get_notify_fd = drmp_get_notify_fd,
+
+    .refresh_psurface_rects = drmp_refresh_psurface_rects,
+
     .options = {
         64,   /* libDRM requires a 64 bytes alignment (not 64bit ;). */
-        0     /* TODO: SURFMAN_FEATURE_NEED_REFRESH triggers a cache-incohrency with xenfb2
-                       and foreign method (looks like scrambling when moving something on the screen.
-                       I thought this was fixed with linux-pq.git:master/enable-pat. */
+        /* TODO: SURFMAN_FEATURE_NEED_REFRESH triggers a cache-incohrency with xenfb2
+                 and foreign method (looks like scrambling when moving something on the screen.
+                 I thought this was fixed with linux-pq.git:master/enable-pat. */
+        SURFMAN_FEATURE_REFRESH_RECTS
     },
     .notify = SURFMAN_NOTIFY_NONE
 };
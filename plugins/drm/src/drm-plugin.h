@@ -80,6 +80,10 @@ struct rect {
     unsigned int w, h;              /* Width and heigth. */
 };
 
+/* Default and maximum number of idle framebuffers cached per device. */
+#define FB_CACHE_SIZE 8
+#define FB_CACHE_SIZE_MAX 64
+
 /* Generic parameters of a framebuffer. */
 struct framebuffer {
     unsigned int width, height;     /* Pixel map geometry (Could be != than mode, with resize) */
@@ -95,6 +99,8 @@ struct framebuffer {
 /* Our plugin surface to surfman. */
 struct drm_surface {
     struct framebuffer fb;          /* Framebuffer info. */
+    surfman_surface_t *src;         /* Surface fb.map holds a reference on. */
+    enum surfman_surface_format format; /* Surfman pixel format of the framebuffer. */
     /* MFN info */
     unsigned long *mfns;            /* The MFNs translated or otherwise */
     uint32_t num_mfns;              /* The cound of MFNs */
@@ -106,6 +112,17 @@ struct drm_surface {
 
 /* Interface to manipulate DRM framebuffers. */
 struct drm_framebuffer;
+
+/* Second buffer of a double-buffered dumb framebuffer (see framebuffer-dumb.c). */
+struct drm_backbuffer {
+    struct drm_framebuffer *bo;         /* Buffer not scanned out, swapped with the front one on flip. */
+    struct rect damage[SURFMAN_DIRTY_RECTS_MAX];    /* Refreshed since the last flip, in neither buffer yet. */
+    unsigned int damage_count;
+    struct rect stale[SURFMAN_DIRTY_RECTS_MAX];     /* Presented by the last flip, missing from /bo/. */
+    unsigned int stale_count;
+    int presenting;                     /* The copies of a present are running, it flips after. */
+};
+
 struct drm_device;
 struct drm_framebuffer_ops {
     const char *name;
@@ -129,6 +146,17 @@ struct drm_framebuffer {
     /* Refs. */
     struct drm_device *device;          /* Device for which that framebuffer is allocated. */
     int fd; /* private device fd for holding foreign mappings */
+    copy_fence_t *copies;               /* Copies refresh() queued into that framebuffer. */
+
+    /* Page-flipping. */
+    struct drm_backbuffer *back;        /* NULL unless double-buffered. */
+    unsigned int flips_pending;         /* CRTCs that did not complete the last flip to it yet. */
+    uint64_t last_flip;                 /* Completion of the last flip to it (us). */
+
+    /* Cache (see fbcache.c). */
+    struct list_head l_cache;           /* List header for struct drm_device framebuffer cache. */
+    const struct drm_surface *surface;  /* Surface it was created for, NULL once invalidated. */
+    unsigned int users;                 /* Monitors currently displaying it. */
 };
 
 struct drm_plane {
@@ -141,6 +169,24 @@ struct drm_plane {
     struct drm_device *device;          /* TODO: Poor design with this back ref. */
 };
 
+/* Properties set by an atomic commit (see device-intel-atomic.c). */
+enum drm_atomic_prop {
+    ATOMIC_CONNECTOR_CRTC_ID,
+    ATOMIC_CRTC_MODE_ID,
+    ATOMIC_CRTC_ACTIVE,
+    ATOMIC_PLANE_FB_ID,
+    ATOMIC_PLANE_CRTC_ID,
+    ATOMIC_PLANE_SRC_X,
+    ATOMIC_PLANE_SRC_Y,
+    ATOMIC_PLANE_SRC_W,
+    ATOMIC_PLANE_SRC_H,
+    ATOMIC_PLANE_CRTC_X,
+    ATOMIC_PLANE_CRTC_Y,
+    ATOMIC_PLANE_CRTC_W,
+    ATOMIC_PLANE_CRTC_H,
+    ATOMIC_PROP_COUNT
+};
+
 /* Monitor informations to interface with Surfman. */
 struct drm_monitor {
     struct list_head l_dev;         /* List header for struct drm_device. */
@@ -157,6 +203,29 @@ struct drm_monitor {
 
     uint32_t dpms_prop_id;          /* libDRM DPMS property id for this connector. */
 
+    /* Connector state as of the last scan (see monitor.c). */
+    drmModeConnector *con;          /* Modes and status of the connector. */
+    uint8_t *edid;                  /* Content of the EDID property, NULL if none. */
+    size_t edid_len;
+
+    int pipe;                       /* Index of the CRTC in the device resources. */
+    uint32_t pipe_crtc;             /* CRTC the pipe index was computed for. */
+
+    /* Last plane-less modeset, a switch keeping it only needs a page-flip. */
+    int mode_valid;                 /* The CRTC still scans out with /mode/. */
+    drmModeModeInfo mode;           /* Mode set on the CRTC. */
+    unsigned int crtc_x, crtc_y;    /* Framebuffer offset scanned out. */
+    int flipped;                    /* Last set() page-flipped instead of modesetting. */
+
+    /* Atomic modesetting. */
+    uint32_t atomic_crtc;           /* CRTC the fields below were probed for. */
+    uint32_t atomic_plane;          /* Primary plane of that CRTC. */
+    uint32_t atomic_props[ATOMIC_PROP_COUNT]; /* libDRM property ids. */
+    uint32_t mode_blob;             /* Property blob holding /blob_mode/. */
+    drmModeModeInfo blob_mode;
+    drmModeModeInfo commit_mode;    /* Mode staged in the pending commit. */
+    struct list_head l_commit;      /* List header for struct drm_device staged monitors. */
+
     /* Refs */
     struct drm_surface *surface;    /* Surface displayed currently. */
     struct drm_device *device;      /* Reference to the device (in case of multiple devices). */
@@ -171,9 +240,17 @@ struct drm_device_ops {
     /* Sync the source and the sink (OPTIONNAL). */
     void (*refresh)(struct drm_monitor *sink, const struct drm_surface *source,
                     const struct rect *rectangle);
+    /* Start the copies refresh() queued, and wait for them to complete if /wait/ (OPTIONNAL). */
+    void (*flush)(struct drm_monitor *sink, int wait);
+    /* Bracket the set() calls of one display configuration, so they apply at once (OPTIONNAL). */
+    void (*begin)(struct drm_device *device);
+    int (*commit)(struct drm_device *device);
 
     /* Match the device to this set of ops.*/
     int (*match)(struct udev *udev, struct udev_device *dev);
+
+    /* Variant of these ops used if the device supports atomic modesetting (OPTIONNAL). */
+    const struct drm_device_ops *atomic;
 };
 
 /* Agregates ressources around one device this plugin manages. */
@@ -187,8 +264,35 @@ struct drm_device {
 
     struct list_head monitors;          /* List of plugged monitors (in a pipe or not). List of connected connector to libDRM. */
     struct list_head planes;            /* List of planes currently in use. */
+    struct list_head fb_cache;          /* Framebuffers of surfaces, most recently used first. */
+    unsigned int fb_cache_count;        /* Number of framebuffers in /fb_cache/. */
 
     struct hotplug *hotplug;            /* Object dealing with hoplug for that device. */
+    unsigned int probe_generation;      /* hotplug_generation of the last connector probe. */
+
+    /* DRM events (see vblank.c). */
+    struct event event;                 /* Watch on /fd/. */
+    int vblank_pipe[2];                 /* Wakes Surfman up when /vblank_queue/ fills. */
+#define VBLANK_QUEUE_MAX 16
+    uint32_t vblank_queue[VBLANK_QUEUE_MAX]; /* Connectors that reached vblank. */
+    unsigned int vblank_count;
+
+    /* Atomic modesetting. */
+    drmModeAtomicReqPtr commit;         /* Request being built between begin() and commit(). */
+    struct list_head commit_monitors;   /* Monitors staged in /commit/. */
+    unsigned int flips_pending;         /* CRTCs the last commit has not completed on yet. */
+    uint64_t commit_start;              /* Submission time of the last commit (us). */
+};
+
+/* Monitor switch latencies (see latency.c). */
+#define LATENCY_BUCKETS 24              /* Up to 2^24us (~16s). */
+#define LATENCY_DUMP_PERIOD 32          /* Log the histograms every that many switches. */
+struct latency_histogram {
+    const char *name;
+    uint64_t count;
+    uint64_t total_us;
+    uint64_t max_us;
+    uint64_t buckets[LATENCY_BUCKETS];
 };
 
 /* Hotplug handling. This is udev notifying the plugin. */
@@ -0,0 +1,143 @@
+/*
+ * Copyright (c) 2014 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "project.h"
+
+/*
+ * Framebuffer cache.
+ *
+ * Creating a framebuffer for a surface (foreign BO import or dumb BO + drmModeAddFB) is what
+ * makes a domain switch slow. Framebuffers are kept per device, keyed on the surface they were
+ * created for, once no monitor displays them anymore. Switching back to that surface then only
+ * costs a lookup.
+ *
+ * - The list is kept in LRU order, most recently used first.
+ * - Entries displayed by a monitor (users > 0) are never evicted.
+ * - Entries are dropped when the surface pages or format change, or when the surface is freed.
+ * - Trimming is deferred until the switch is done (drm_fb_cache_trim), so we never remove a
+ *   framebuffer the CRTC still scans out before it flipped to the new one.
+ */
+
+/* Maximum number of idle framebuffers kept per device (0 disables the cache). */
+unsigned int fb_cache_size = FB_CACHE_SIZE;
+
+/* Lookup statistics, reported with switch latencies. */
+unsigned long fb_cache_hits;
+unsigned long fb_cache_misses;
+
+static void drm_fb_cache_evict(struct drm_framebuffer *fb)
+{
+    list_del(&fb->l_cache);
+    fb->device->fb_cache_count--;
+    fb->ops->release(fb);
+}
+
+/* Find a framebuffer of /device/ created for /surface/ and take a reference on it.
+ * Return NULL if there is none, the caller then creates one and drm_fb_cache_add() it. */
+INTERNAL struct drm_framebuffer *drm_fb_cache_get(struct drm_device *device,
+                                                  const struct drm_surface *surface)
+{
+    struct drm_framebuffer *fb;
+
+    list_for_each_entry(fb, &device->fb_cache, l_cache) {
+        if (fb->surface == surface) {
+            list_del(&fb->l_cache);
+            list_add(&fb->l_cache, &device->fb_cache);
+            fb->users++;
+            fb_cache_hits++;
+            return fb;
+        }
+    }
+    fb_cache_misses++;
+    return NULL;
+}
+
+/* Insert a framebuffer freshly created for /surface/, referenced by the caller. */
+INTERNAL void drm_fb_cache_add(struct drm_framebuffer *fb, const struct drm_surface *surface)
+{
+    fb->surface = surface;
+    fb->users = 1;
+    list_add(&fb->l_cache, &fb->device->fb_cache);
+    fb->device->fb_cache_count++;
+}
+
+/* Drop a reference taken with drm_fb_cache_get() or drm_fb_cache_add().
+ * The framebuffer stays cached unless its surface went away meanwhile. */
+INTERNAL void drm_fb_cache_put(struct drm_framebuffer *fb)
+{
+    assert(fb->users > 0);
+    if (--fb->users) {
+        return;
+    }
+    if (!fb->surface || !fb_cache_size) {
+        drm_fb_cache_evict(fb);
+    }
+}
+
+/* Forget every framebuffer created for /surface/ on every device. Those still displayed are
+ * released by their last drm_fb_cache_put(). */
+INTERNAL void drm_fb_cache_invalidate(const struct drm_surface *surface)
+{
+    struct drm_device *d;
+    struct drm_framebuffer *fb, *fbb;
+
+    list_for_each_entry(d, &devices, l) {
+        list_for_each_entry_safe(fb, fbb, &d->fb_cache, l_cache) {
+            if (fb->surface != surface) {
+                continue;
+            }
+            fb->surface = NULL;
+            if (!fb->users) {
+                drm_fb_cache_evict(fb);
+            }
+        }
+    }
+}
+
+/* Evict least recently used idle framebuffers until /device/ is back under the cache size. */
+INTERNAL void drm_fb_cache_trim(struct drm_device *device)
+{
+    struct list_head *pos, *prev;
+
+    /* Walk from the tail, least recently used first. */
+    for (pos = device->fb_cache.prev; pos != &device->fb_cache; pos = prev) {
+        struct drm_framebuffer *fb = list_entry(pos, struct drm_framebuffer, l_cache);
+
+        if (device->fb_cache_count <= fb_cache_size) {
+            break;
+        }
+        prev = pos->prev;
+        if (!fb->users) {
+            DRM_DBG("Evicting framebuffer %u from device \"%s\" cache.", fb->id, device->devnode);
+            drm_fb_cache_evict(fb);
+        }
+    }
+}
+
+/* Release every cached framebuffer of /device/. Monitors must have been unset already. */
+INTERNAL void drm_fb_cache_release(struct drm_device *device)
+{
+    struct drm_framebuffer *fb, *fbb;
+
+    list_for_each_entry_safe(fb, fbb, &device->fb_cache, l_cache) {
+        if (fb->users) {
+            DRM_WRN("Framebuffer %u on device \"%s\" is still in use.", fb->id, device->devnode);
+        }
+        drm_fb_cache_evict(fb);
+    }
+}
@@ -18,6 +18,32 @@
 
 #include "project.h"
 
+/*
+ * Double buffering.
+ *
+ * A dumb framebuffer scanned out directly by CRTCs gets a second BO on its first present. From
+ * then on refresh() only records the damage, and drm_framebuffer_present() has the copy workers
+ * copy it into the back buffer, along with the damage of the previous frame that buffer missed.
+ * Once they are done, the event loop swaps the buffers and page-flips the CRTCs. The flip
+ * completes in the event loop as well (see vblank.c).
+ *
+ * - While the copies or a flip are pending, frames are dropped, their damage waits for the next
+ *   present, which the completion of the flip triggers.
+ * - drm_framebuffer_sync() waits for the copies of a present and flips right away.
+ * - A framebuffer also shown through a plane is updated in place, planes are not flipped.
+ *
+ * surfman.conf, drm-plugin section:
+ *   double_buffer: 0 keeps copying into the scanned out buffer (default: 1).
+ */
+
+/* Create a back buffer for the dumb framebuffers scanned out directly. */
+unsigned int dumb_double_buffer = 1;
+
+/* Presents of double-buffered framebuffers, reported with switch latencies. */
+unsigned long dumb_frames_flipped;
+unsigned long dumb_frames_dropped;
+struct latency_histogram flip_interval = { .name = "Page-flip interval" };
+
 /* TODO: Tie up surface and framebuffers. */
 #if 0
 struct drm_framebuffer_dumb {
@@ -112,20 +138,26 @@ dumb_framebuffer_create(struct drm_device *device, const struct drm_surface *sur
     struct drm_framebuffer *dfb;
     struct drm_mode_create_dumb creq;
     struct drm_mode_destroy_dumb dreq;
-    int err;
+    int err, rc;
     uint32_t id;
 
     memset(&creq, 0, sizeof (creq));
     creq.height = sfb->height;
     creq.width = sfb->width;
     creq.bpp = sfb->bpp;
-    if (drmIoctl(device->fd, DRM_IOCTL_MODE_CREATE_DUMB, &creq)) {
+    SURFMAN_TRACE_BEGIN("drm_create_dumb", device->devnode);
+    rc = drmIoctl(device->fd, DRM_IOCTL_MODE_CREATE_DUMB, &creq);
+    SURFMAN_TRACE_END("drm_create_dumb", device->devnode);
+    if (rc) {
         DRM_DBG("drmIoctl(%s, DRM_IOCTL_MODE_CREATE_DUMB, %ux%u:%u) failed (%s).", device->devnode,
                 sfb->width, sfb->height, sfb->bpp, strerror(errno));
         return NULL;
     }
-    if (drmModeAddFB(device->fd, sfb->width, sfb->height, sfb->depth, sfb->bpp,
-                     creq.pitch, creq.handle, &id)) {
+    SURFMAN_TRACE_BEGIN("drm_addfb", device->devnode);
+    rc = drmModeAddFB(device->fd, sfb->width, sfb->height, sfb->depth, sfb->bpp,
+                      creq.pitch, creq.handle, &id);
+    SURFMAN_TRACE_END("drm_addfb", device->devnode);
+    if (rc) {
         err = errno;
         DRM_DBG("drmModeAddFB(%s, %ux%u:%u/%u) failed (%s).", device->devnode,
                 sfb->width, sfb->height, sfb->depth, sfb->bpp, strerror(errno));
@@ -190,16 +222,54 @@ static void dumb_framebuffer_unmap(struct drm_framebuffer *framebuffer)
     }
 }
 
+/* Queue the copy of /r/ from /source/ into /dfb/, one of the buffers of /drm/. */
+static void dumb_framebuffer_copy(struct drm_framebuffer *drm, struct framebuffer *dfb,
+                                  const struct framebuffer *source, const struct rect *r)
+{
+    const struct framebuffer *sfb = source;
+    uint8_t *src = sfb->map + r->y * sfb->pitch + r->x * (sfb->bpp / 8);
+    uint8_t *dst = dfb->map + r->y * dfb->pitch + r->x * (dfb->bpp / 8);
+
+    /* Copies of the previous refresh could still target the same lines. */
+    if (drm->copies && copy_fence_submitted(drm->copies)) {
+        drm_framebuffer_sync(drm);
+    }
+    if (!drm->copies) {
+        drm->copies = copy_fence_new(NULL, NULL);
+    }
+    copy_rect(drm->copies, dst, dfb->pitch, src, sfb->pitch, r->w * (dfb->bpp / 8), r->h);
+}
+
+/* Add /r/ to the /count/ rectangles of /rects/, the last one absorbs the overflow. */
+static void dumb_damage_add(struct rect *rects, unsigned int *count, const struct rect *r)
+{
+    struct rect *last;
+    unsigned int i, x1, y1;
+
+    for (i = 0; i < *count; ++i) {
+        if (!memcmp(&rects[i], r, sizeof (*r))) {
+            return;     /* Cloned monitors refresh the same rectangles. */
+        }
+    }
+    if (*count < SURFMAN_DIRTY_RECTS_MAX) {
+        rects[(*count)++] = *r;
+        return;
+    }
+    last = &rects[*count - 1];
+    x1 = max(last->x + last->w, r->x + r->w);
+    y1 = max(last->y + last->h, r->y + r->h);
+    last->x = min(last->x, r->x);
+    last->y = min(last->y, r->y);
+    last->w = x1 - last->x;
+    last->h = y1 - last->y;
+}
+
 static void dumb_framebuffer_refresh(struct drm_framebuffer *drm,
                                      const struct framebuffer *source,
                                      const struct rect *r)
 {
     struct framebuffer *dfb = &drm->fb;
     const struct framebuffer *sfb = source;
-    unsigned int i;
-
-    uint8_t *src = sfb->map + r->y * sfb->pitch + r->x * (sfb->bpp / 8);
-    uint8_t *dst = dfb->map + r->y * dfb->pitch + r->x * (dfb->bpp / 8);
 
     /* Those are just safeguards for now in case I fucked up something else. */
     if ((sfb->map == MAP_FAILED || sfb->map == NULL) ||
@@ -219,18 +289,276 @@ static void dumb_framebuffer_refresh(struct drm_framebuffer *drm,
         return;
     }
 
-    for (i = 0; i < r->h; ++i) {
-        memcpy(dst, src, r->w * (dfb->bpp / 8));
-        src += sfb->pitch;
-        dst += dfb->pitch;
+    if (drm->back) {
+        /* drm_framebuffer_present() copies it into the back buffer. */
+        dumb_damage_add(drm->back->damage, &drm->back->damage_count, r);
+        return;
+    }
+    dumb_framebuffer_copy(drm, dfb, source, r);
+}
+
+/* Hand the copies queued by refresh() over to the workers. */
+INTERNAL void drm_framebuffer_flush(struct drm_framebuffer *framebuffer)
+{
+    if (framebuffer->copies && !copy_fence_submitted(framebuffer->copies)) {
+        copy_fence_submit(framebuffer->copies);
+    }
+}
+
+static void dumb_framebuffer_present_done(void *opaque);
+
+/* Wait for the copies into /framebuffer/, so either side can go away. */
+INTERNAL void drm_framebuffer_sync(struct drm_framebuffer *framebuffer)
+{
+    if (!framebuffer->copies) {
+        return;
+    }
+    drm_framebuffer_flush(framebuffer);
+    copy_fence_wait(framebuffer->copies);
+    if (framebuffer->back && framebuffer->back->presenting) {
+        /* Flip now rather than from the event loop. */
+        copy_fence_cancel(framebuffer->copies);
+        dumb_framebuffer_present_done(framebuffer);
+        return;
+    }
+    copy_fence_put(framebuffer->copies);
+    framebuffer->copies = NULL;
+}
+
+
+/* Give /drm/ a back buffer, which misses everything the front one shows. */
+static int dumb_backbuffer_new(struct drm_framebuffer *drm)
+{
+    struct drm_backbuffer *back;
+    const struct framebuffer *fb = &drm->fb;
+    int rc;
+
+    back = calloc(1, sizeof (*back));
+    if (!back) {
+        return -errno;
+    }
+    back->bo = __dumb_framebuffer_create(drm->device, fb->width, fb->height, fb->depth, fb->bpp);
+    if (!back->bo) {
+        rc = -errno;
+        free(back);
+        return rc;
+    }
+    rc = dumb_framebuffer_map(back->bo);
+    if (rc) {
+        back->bo->ops->release(back->bo);
+        free(back->bo);
+        free(back);
+        return rc;
+    }
+    back->stale[0].w = fb->width;
+    back->stale[0].h = fb->height;
+    back->stale_count = 1;
+    drm->back = back;
+    return 0;
+}
+
+static void dumb_backbuffer_release(struct drm_framebuffer *drm)
+{
+    struct drm_backbuffer *back = drm->back;
+
+    back->bo->ops->release(back->bo);
+    free(back->bo);
+    free(back);
+    drm->back = NULL;
+}
+
+/* Exchange the buffers of /drm/, its id then names the one to scan out next. */
+static void dumb_framebuffer_swap(struct drm_framebuffer *drm)
+{
+    struct drm_framebuffer *bo = drm->back->bo;
+    struct framebuffer fb = drm->fb;
+    uint32_t handle = drm->handle, id = drm->id;
+
+    drm->fb = bo->fb;
+    drm->handle = bo->handle;
+    drm->id = bo->id;
+    bo->fb = fb;
+    bo->handle = handle;
+    bo->id = id;
+}
+
+/* Flip the CRTCs scanning /drm/ out to its current buffer. Return how many did. */
+static unsigned int dumb_framebuffer_flip(struct drm_framebuffer *drm)
+{
+    struct drm_device *d = drm->device;
+    struct drm_monitor *m;
+    unsigned int n = 0;
+
+    if (drm_device_set_master(d)) {
+        return 0;
+    }
+    list_for_each_entry(m, &d->monitors, l_dev) {
+        if (m->framebuffer != drm || m->plane || !m->crtc) {
+            continue;
+        }
+        if (drmModePageFlip(d->fd, m->crtc, drm->id, DRM_MODE_PAGE_FLIP_EVENT, drm)) {
+            DRM_DBG("Could not flip CRTC %u to framebuffer %u (%s).", m->crtc, drm->id,
+                    strerror(errno));
+            continue;
+        }
+        ++n;
+    }
+    drm_device_drop_master(d);
+    return n;
+}
+
+/*
+ * Get the damage refresh() recorded on the screen, see "Double buffering" above.
+ * Other framebuffers only have the copies refresh() queued handed over to the workers.
+ */
+INTERNAL void drm_framebuffer_present(struct drm_framebuffer *drm)
+{
+    struct drm_backbuffer *back = drm->back;
+    struct drm_device *d = drm->device;
+    struct drm_monitor *m;
+    unsigned int i, crtcs = 0, planes = 0;
+    int rc;
+
+    if (drm->ops != &framebuffer_dumb_ops) {
+        drm_framebuffer_flush(drm);
+        return;
+    }
+    list_for_each_entry(m, &d->monitors, l_dev) {
+        if (m->plane && m->plane->framebuffer == drm) {
+            ++planes;
+        } else if (m->framebuffer == drm && m->crtc) {
+            ++crtcs;
+        }
+    }
+
+    if (!back) {
+        /* refresh() copied straight into the scanned out buffer. */
+        drm_framebuffer_flush(drm);
+        if (dumb_double_buffer && crtcs && !planes && drm->surface) {
+            rc = dumb_backbuffer_new(drm);
+            if (rc) {
+                DRM_WRN("Could not create a back buffer for framebuffer %u (%s).", drm->id,
+                        strerror(-rc));
+            }
+        }
+        return;
+    }
+    if (!back->damage_count) {
+        return;
+    }
+    if (!drm->surface) {
+        back->damage_count = 0;     /* The surface is going away. */
+        return;
+    }
+    if (planes || !crtcs) {
+        /* Planes are not flipped, update the buffer they show in place. */
+        for (i = 0; i < back->damage_count; ++i) {
+            dumb_framebuffer_copy(drm, &drm->fb, &drm->surface->fb, &back->damage[i]);
+            dumb_damage_add(back->stale, &back->stale_count, &back->damage[i]);
+        }
+        back->damage_count = 0;
+        drm_framebuffer_flush(drm);
+        return;
+    }
+    /*
+     * The back buffer is being copied into or still scanned out, or a configuration is being
+     * staged.
+     */
+    if (drm->flips_pending || d->commit) {
+        ++dumb_frames_dropped;
+        return;
+    }
+
+    SURFMAN_TRACE_BEGIN("drm_present", d->devnode);
+    if (drm->copies) {
+        drm_framebuffer_sync(drm);  /* Left by an update in place. */
+    }
+    /* Never flip to a partial frame: flip once the copies are over. */
+    drm->copies = copy_fence_new(dumb_framebuffer_present_done, drm);
+    for (i = 0; i < back->stale_count; ++i) {
+        dumb_framebuffer_copy(drm, &back->bo->fb, &drm->surface->fb, &back->stale[i]);
+    }
+    for (i = 0; i < back->damage_count; ++i) {
+        dumb_framebuffer_copy(drm, &back->bo->fb, &drm->surface->fb, &back->damage[i]);
     }
+    /* The front buffer misses that damage once the flip is over. */
+    memcpy(back->stale, back->damage, back->damage_count * sizeof (back->damage[0]));
+    back->stale_count = back->damage_count;
+    back->damage_count = 0;
+    back->presenting = 1;
+    drm->flips_pending = 1;
+    SURFMAN_TRACE_END("drm_present", d->devnode);
+    /* Without copy workers, this flips right away. */
+    copy_fence_submit(drm->copies);
 }
 
+/* The copies of the last present into the back buffer of /opaque/ are over, flip to it. */
+static void dumb_framebuffer_present_done(void *opaque)
+{
+    struct drm_framebuffer *drm = opaque;
+    struct drm_backbuffer *back = drm->back;
+    unsigned int i;
+
+    copy_fence_put(drm->copies);
+    drm->copies = NULL;
+    back->presenting = 0;
+
+    SURFMAN_TRACE_BEGIN("drm_flip", drm->device->devnode);
+    dumb_framebuffer_swap(drm);
+    drm->flips_pending = dumb_framebuffer_flip(drm);
+    SURFMAN_TRACE_END("drm_flip", drm->device->devnode);
+    if (!drm->flips_pending) {
+        /* Nothing flipped, the next present does it again. */
+        dumb_framebuffer_swap(drm);
+        for (i = 0; i < back->stale_count; ++i) {
+            dumb_damage_add(back->damage, &back->damage_count, &back->stale[i]);
+        }
+        back->stale_count = 0;
+        return;
+    }
+    ++dumb_frames_flipped;
+}
+
+/* Page-flip event for /data/, a framebuffer of /device/ unless it was released meanwhile. */
+INTERNAL void drm_framebuffer_flip_done(struct drm_device *device, void *data)
+{
+    struct drm_framebuffer *drm;
+    uint64_t now;
+
+    list_for_each_entry(drm, &device->fb_cache, l_cache) {
+        if (drm != data) {
+            continue;
+        }
+        if (!drm->flips_pending || --drm->flips_pending) {
+            return;
+        }
+        now = latency_now_us();
+        if (drm->last_flip) {
+            latency_record(&flip_interval, now - drm->last_flip);
+        }
+        drm->last_flip = now;
+        /* Present what the frames dropped meanwhile damaged. */
+        if (drm->back && drm->back->damage_count) {
+            drm_framebuffer_present(drm);
+        }
+        return;
+    }
+}
 
 static void dumb_framebuffer_release(struct drm_framebuffer *framebuffer)
 {
     struct drm_mode_destroy_dumb dreq = { 0 };
 
+    if (framebuffer->back && framebuffer->back->presenting) {
+        /* Wait for the copies, but do not flip to a framebuffer going away. */
+        copy_fence_cancel(framebuffer->copies);
+        framebuffer->back->presenting = 0;
+        framebuffer->flips_pending = 0;
+    }
+    drm_framebuffer_sync(framebuffer);
+    if (framebuffer->back) {
+        dumb_backbuffer_release(framebuffer);
+    }
     if (framebuffer->fb.map && framebuffer->fb.map != MAP_FAILED) {
         dumb_framebuffer_unmap(framebuffer);
     }
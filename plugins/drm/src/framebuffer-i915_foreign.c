@@ -55,7 +55,7 @@ foreign_framebuffer_create(struct drm_device *device, const struct drm_surface *
     const struct framebuffer *sfb = &surface->fb;
     struct drm_framebuffer *dfb;
     struct drm_i915_gem_foreign creq;
-    int err;
+    int err, rc;
     unsigned int i;
     uint32_t id;
     int fd;
@@ -83,7 +83,10 @@ foreign_framebuffer_create(struct drm_device *device, const struct drm_surface *
     }
     creq.num_pages = surface->num_mfns;
     creq.flags = 0;     /* TODO: Switch to ballooned pages at some point? */
-    if (drmIoctl(fd, DRM_IOCTL_I915_GEM_FOREIGN, &creq)) {
+    SURFMAN_TRACE_BEGIN("drm_gem_foreign", device->devnode);
+    rc = drmIoctl(fd, DRM_IOCTL_I915_GEM_FOREIGN, &creq);
+    SURFMAN_TRACE_END("drm_gem_foreign", device->devnode);
+    if (rc) {
         err = errno;
         DRM_DBG("drmIoctl(%s, DRM_IOCTL_I915_GEM_FOREIGN, [%#lx, ...] %u) failed (%s).",
                 device->devnode, surface->mfns[0], surface->num_mfns, strerror(errno));
@@ -91,8 +94,11 @@ foreign_framebuffer_create(struct drm_device *device, const struct drm_surface *
         goto fail_foreign;
     }
     free(creq.mfns);
-    if (drmModeAddFB(fd, sfb->width, sfb->height, sfb->depth, sfb->bpp, sfb->pitch,
-                     creq.handle, &id)) {
+    SURFMAN_TRACE_BEGIN("drm_addfb", device->devnode);
+    rc = drmModeAddFB(fd, sfb->width, sfb->height, sfb->depth, sfb->bpp, sfb->pitch,
+                      creq.handle, &id);
+    SURFMAN_TRACE_END("drm_addfb", device->devnode);
+    if (rc) {
         err = errno;
         DRM_DBG("drmModeAddFB(%s, %ux%u:%u/%u) failed (%s).", device->devnode,
                 sfb->width, sfb->height, sfb->depth, sfb->bpp, strerror(errno));
@@ -16,8 +16,42 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#include <sys/eventfd.h>
+
 #include "project.h"
 
+/*
+ * Hotplug notifications are signalled to Surfman through an eventfd, see
+ * drmp_get_notify_fd(), and the delay until Surfman rescans the monitors is
+ * recorded.
+ */
+static int notify_fd = -1;
+static uint64_t hotplug_start;          /* Oldest hotplug event not rescanned yet. */
+struct latency_histogram hotplug_latency = { .name = "Hotplug to rescan" };
+
+/* Bumped on each hotplug event: the next scan of each device probes its connectors again. */
+unsigned int hotplug_generation = 1;
+
+INTERNAL int hotplug_notify_fd(void)
+{
+    if (notify_fd < 0) {
+        notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (notify_fd < 0) {
+            DRM_WRN("Could not create hotplug notification eventfd (%s).", strerror(errno));
+        }
+    }
+    return notify_fd;
+}
+
+/* Surfman rescanned the monitors. */
+INTERNAL void hotplug_rescanned(void)
+{
+    if (hotplug_start) {
+        latency_record(&hotplug_latency, latency_now_us() - hotplug_start);
+        hotplug_start = 0;
+    }
+}
+
 /*
  * Callback for udev when drm subsystem throws an event.
  */
@@ -33,6 +67,14 @@ static void hotplug_event_handler(int fd, short event, void *priv)
     /* Notify surfman to rescan monitors.
      * This will trigger a callback to the plugin on Surfman's terms. */
     surfman_plugin.notify |= SURFMAN_NOTIFY_MONITOR_RESCAN;
+    ++hotplug_generation;
+    if (!hotplug_start) {
+        hotplug_start = latency_now_us();
+    }
+    SURFMAN_TRACE_MARK("drm_hotplug", NULL);
+    if (notify_fd >= 0 && eventfd_write(notify_fd, 1)) {
+        DRM_WRN("Could not signal hotplug event to Surfman (%s).", strerror(errno));
+    }
 
     dev = udev_monitor_receive_device(hotplug->monitor);
     if (!dev) {
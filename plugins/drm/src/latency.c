@@ -0,0 +1,66 @@
+/*
+ * Copyright (c) 2014 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "project.h"
+
+/*
+ * Log2 histograms of monitor switch latencies.
+ * Bucket i counts switches that took [2^i, 2^(i+1)) microseconds.
+ */
+
+INTERNAL uint64_t latency_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+INTERNAL void latency_record(struct latency_histogram *h, uint64_t us)
+{
+    unsigned int b = 0;
+
+    while (b < LATENCY_BUCKETS - 1 && (us >> (b + 1))) {
+        ++b;
+    }
+    h->buckets[b]++;
+    h->count++;
+    h->total_us += us;
+    if (us > h->max_us) {
+        h->max_us = us;
+    }
+}
+
+INTERNAL void latency_dump(const struct latency_histogram *h)
+{
+    unsigned int i;
+
+    if (!h->count) {
+        return;
+    }
+    DRM_INF("%s: %llu switches, mean %lluus, max %lluus.", h->name,
+            (unsigned long long) h->count,
+            (unsigned long long) (h->total_us / h->count),
+            (unsigned long long) h->max_us);
+    for (i = 0; i < LATENCY_BUCKETS; ++i) {
+        if (h->buckets[i]) {
+            DRM_INF("%s:   [%8lluus, %8lluus) %llu", h->name,
+                    1ULL << i, 1ULL << (i + 1), (unsigned long long) h->buckets[i]);
+        }
+    }
+}
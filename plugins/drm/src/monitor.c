@@ -59,6 +59,104 @@ static int drmModeSetDpmsProp(int fd, drmModeConnector *connector, int value)
     return 0;
 }
 
+/*
+ * Connector cache.
+ *
+ * drmModeGetConnector() has the kernel probe the connector, which reads the EDID
+ * over DDC and can take tens of milliseconds per monitor. Connectors are only
+ * probed by the first scan of a device and the first scan following a hotplug
+ * event; otherwise drmModeGetConnectorCurrent() returns what the kernel already
+ * knows. Each monitor keeps its connector and EDID from the last scan, which is
+ * what get_monitor_info() and get_monitor_edid() are served from.
+ */
+unsigned long connector_cache_hits;
+unsigned long connector_cache_misses;
+unsigned long connector_probes;
+
+/* Copy the EDID property blob of connector /c/ in /m/, if there is one. */
+static void drm_monitor_cache_edid(struct drm_monitor *m, drmModeConnector *c)
+{
+    int fd = m->device->fd;
+    drmModePropertyPtr p;
+    drmModePropertyBlobPtr blob;
+    int i;
+
+    free(m->edid);
+    m->edid = NULL;
+    m->edid_len = 0;
+
+    for (i = 0; i < c->count_props; ++i) {
+        p = drmModeGetProperty(fd, c->props[i]);
+        if (!p) {
+            continue;
+        }
+        if ((p->flags & DRM_MODE_PROP_BLOB) && !strcmp(p->name, "EDID")) {
+            drmModeFreeProperty(p);
+            if (!c->prop_values[i]) {
+                return;     /* Nothing read from the monitor. */
+            }
+            blob = drmModeGetPropertyBlob(fd, c->prop_values[i]);
+            if (!blob) {
+                DRM_WRN("Could not read EDID of connector %u (%s).",
+                        c->connector_id, strerror(errno));
+                return;
+            }
+            m->edid = malloc(blob->length);
+            if (m->edid) {
+                memcpy(m->edid, blob->data, blob->length);
+                m->edid_len = blob->length;
+            }
+            drmModeFreePropertyBlob(blob);
+            return;
+        }
+        drmModeFreeProperty(p);
+    }
+}
+
+/* Keep connector /c/ as the state of /m/. /m/ owns /c/ after this call. */
+static void drm_monitor_cache_connector(struct drm_monitor *m, drmModeConnector *c)
+{
+    if (m->con) {
+        drmModeFreeConnector(m->con);
+    }
+    m->con = c;
+    drm_monitor_cache_edid(m, c);
+}
+
+INTERNAL void drm_monitor_cache_release(struct drm_monitor *m)
+{
+    if (m->con) {
+        drmModeFreeConnector(m->con);
+        m->con = NULL;
+    }
+    if (m->mode_blob) {
+        drmModeDestroyPropertyBlob(m->device->fd, m->mode_blob);
+        m->mode_blob = 0;
+    }
+    free(m->edid);
+    m->edid = NULL;
+    m->edid_len = 0;
+}
+
+/* Connector of /m/ as of the last scan, queried without probing if not known yet.
+ * The connector belongs to /m/, do not free it. */
+INTERNAL drmModeConnector *drm_monitor_connector(struct drm_monitor *m)
+{
+    drmModeConnector *c;
+
+    if (m->con) {
+        ++connector_cache_hits;
+        return m->con;
+    }
+    ++connector_cache_misses;
+    c = drmModeGetConnectorCurrent(m->device->fd, m->connector);
+    if (!c) {
+        return NULL;
+    }
+    drm_monitor_cache_connector(m, c);
+    return c;
+}
+
 static int drm_monitor_disable_dpms(struct drm_monitor *monitor)
 {
     /* TODO for now, set DPMS to On for each monitor as it is initialized. I believe
@@ -77,7 +175,7 @@ int drm_monitor_dpms_on(struct drm_monitor *monitor)
     drmModeConnector *c;
     int rc;
 
-    c = drmModeGetConnector(monitor->device->fd, monitor->connector);
+    c = drmModeGetConnectorCurrent(monitor->device->fd, monitor->connector);
     if (!c) {
         return -errno;
     }
@@ -92,7 +190,7 @@ int drm_monitor_dpms_off(struct drm_monitor *monitor)
     drmModeConnector *c;
     int rc;
 
-    c = drmModeGetConnector(monitor->device->fd, monitor->connector);
+    c = drmModeGetConnectorCurrent(monitor->device->fd, monitor->connector);
     if (!c) {
         return -errno;
     }
@@ -113,7 +211,7 @@ INTERNAL void drm_monitor_info(const struct drm_monitor *m)
     assert(m);
     assert(m->device);
 
-    con = drmModeGetConnector(m->device->fd, m->connector);
+    con = drmModeGetConnectorCurrent(m->device->fd, m->connector);
     if (!con) {
         return; /* Silently give up. */
     }
@@ -158,11 +256,14 @@ INTERNAL void drm_monitor_info(const struct drm_monitor *m)
     drmModeFreeConnector(con);
 }
 
-/* Probes libDRM for monitors (connected connectors) and fill /monitors/ with it. */
+/* Probes libDRM for monitors (connected connectors) and fill /monitors/ with it.
+ * Connectors are only probed again after a hotplug event, see the connector cache above. */
 INTERNAL int drm_monitors_scan(struct drm_device *device)
 {
     drmModeResPtr r;
     unsigned int max;
+    unsigned int generation = hotplug_generation;
+    int probe = device->probe_generation != generation;
     int i, rc = 0;
 
     r = drmModeGetResources(device->fd);
@@ -175,9 +276,15 @@ INTERNAL int drm_monitors_scan(struct drm_device *device)
     max = min(r->count_crtcs, r->count_connectors);
     /* Those missing unsigned ... */
     for (i = 0; (i < r->count_connectors) && (max != 0); ++i) {
+        struct drm_monitor *m;
         drmModeConnector *c;
 
-        c = drmModeGetConnector(device->fd, r->connectors[i]);
+        if (probe) {
+            c = drmModeGetConnector(device->fd, r->connectors[i]);
+            ++connector_probes;
+        } else {
+            c = drmModeGetConnectorCurrent(device->fd, r->connectors[i]);
+        }
         if (!c) {
             DRM_WRN("Could not access connector %u on device \"%s\" (%s).",
                     r->connectors[i], device->devnode, strerror(errno));
@@ -192,23 +299,30 @@ INTERNAL int drm_monitors_scan(struct drm_device *device)
          *       there... Should be hash-tables really... */
         if (c->connection == DRM_MODE_CONNECTED) {
             if (!c->count_modes) {
+                drmModeFreeConnector(c);
                 rc = -ENOENT;
                 break; /* The monitor does not report modes, skip it. */
             }
             /* Either known or newly connected monitor. */
-            if (!drm_device_add_monitor(device, c->connector_id, &c->modes[0])) {
+            m = drm_device_add_monitor(device, c->connector_id, &c->modes[0]);
+            if (!m) {
+                drmModeFreeConnector(c);
                 rc = -ENOMEM;
                 break; /* Give up on memory errors. */
             }
+            drm_monitor_cache_connector(m, c);
             --max;
         } else {
             /* Unplugged monitor, check if we knew about that. */
             drm_device_del_monitor(device, c->connector_id);
             /* XXX: Since we rescan the entire libDRM list, don't touch max_monitors! */
+            drmModeFreeConnector(c);
         }
-        drmModeFreeConnector(c);  /* libDRM id is enough for now. */
     }
     drmModeFreeResources(r);
+    if (probe && !rc) {
+        device->probe_generation = generation;
+    }
     return rc;
 }
 
@@ -221,7 +335,7 @@ static int drm_monitor_check_pipe(struct drm_monitor *monitor)
     drmModeEncoder *e;
     int rc = 0;
 
-    c = drmModeGetConnector(monitor->device->fd, monitor->connector);
+    c = drmModeGetConnectorCurrent(monitor->device->fd, monitor->connector);
     if (!c) {
         return -errno;
     }
@@ -258,7 +372,7 @@ static int drm_monitor_probe_pipe(struct drm_monitor *monitor)
     if (!r) {
         return -errno;
     }
-    c = drmModeGetConnector(monitor->device->fd, monitor->connector);
+    c = drmModeGetConnectorCurrent(monitor->device->fd, monitor->connector);
     if (!c) {
         rc = -errno;
         goto out_res;
@@ -297,6 +411,9 @@ INTERNAL int drm_monitor_init(struct drm_monitor *monitor)
     struct drm_device *d = monitor->device;
     int rc;
 
+    /* Whatever the CRTC was doing, the next set() has to modeset. */
+    monitor->mode_valid = 0;
+
     /* Prevent screen from blanking. */
     rc = drm_monitor_disable_dpms(monitor);
     if (rc) {
@@ -21,6 +21,9 @@
 
 #define PLUGIN_NAME "drm-plugin"
 #define CONFIG_SCALING_MODE "scaling_mode"
+#define CONFIG_FB_CACHE_SIZE "fb_cache_size"
+#define CONFIG_ATOMIC_MODESET "atomic_modeset"
+#define CONFIG_DOUBLE_BUFFER "double_buffer"
 
 # include "config.h"
 
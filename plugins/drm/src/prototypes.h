@@ -25,6 +25,7 @@ extern int drmp_init(surfman_plugin_t *plugin);
 extern void drmp_shutdown(surfman_plugin_t *plugin);
 extern int drmp_display(surfman_plugin_t *plugin, surfman_display_t *config, size_t size);
 extern int drmp_get_monitors(surfman_plugin_t *plugin, surfman_monitor_t *monitors, size_t size);
+extern int drmp_get_notify_fd(surfman_plugin_t *plugin);
 extern int drmp_set_monitor_modes(struct surfman_plugin *plugin, surfman_monitor_t monitor, surfman_monitor_mode_t *mode);
 extern int drmp_get_monitor_info(struct surfman_plugin *plugin, surfman_monitor_t monitor, surfman_monitor_info_t *info, unsigned int modes_count);
 extern int drmp_get_monitor_info_by_monitor(surfman_plugin_t *p, surfman_monitor_t monitor, surfman_monitor_info_t *info, unsigned int modes_count);
@@ -32,6 +33,7 @@ extern surfman_psurface_t drmp_get_psurface_from_surface(surfman_plugin_t *plugi
 extern int drmp_get_monitor_edid(struct surfman_plugin *plugin, surfman_monitor_t monitor, surfman_monitor_edid_t *edid);
 extern void drmp_update_psurface(surfman_plugin_t *plugin, surfman_psurface_t psurface, surfman_surface_t *surface, unsigned int flags);
 extern void drmp_refresh_psurface(struct surfman_plugin *plugin, surfman_psurface_t psurface, uint8_t *db);
+extern void drmp_refresh_psurface_rects(struct surfman_plugin *plugin, surfman_psurface_t psurface, const surfman_rect_t *rects, size_t count);
 extern void drmp_free_psurface(surfman_plugin_t *plugin, surfman_psurface_t psurface);
 extern void drmp_increase_brightness(surfman_plugin_t *plugin);
 extern void drmp_decrease_brightness(surfman_plugin_t *plugin);
@@ -52,13 +54,44 @@ extern int drm_device_plane_is_used(struct drm_device *device, uint32_t plane);
 extern int drm_device_set_master(struct drm_device *device);
 extern void drm_device_drop_master(struct drm_device *device);
 /* device-intel.c */
+extern int __find_mode(struct framebuffer *fb, drmModeModeInfoPtr modes, unsigned int count, drmModeModeInfoPtr mode, drmModeModeInfoPtr fallback_mode);
+extern struct drm_framebuffer *i915_framebuffer_new(struct drm_device *device, struct drm_surface *surface);
+extern int i915_modeset(struct drm_monitor *monitor, struct drm_framebuffer *drmfb);
 extern const struct drm_device_ops i915_ops;
+/* device-intel-atomic.c */
+extern struct latency_histogram atomic_commit_latency;
+extern uint32_t drm_object_property(int fd, uint32_t id, uint32_t type, const char *name, uint64_t *value);
+extern void i915_atomic_flip_done(struct drm_device *device);
+extern const struct drm_device_ops i915_atomic_ops;
 /* framebuffer-dumb.c */
+extern unsigned int dumb_double_buffer;
+extern unsigned long dumb_frames_flipped;
+extern unsigned long dumb_frames_dropped;
+extern struct latency_histogram flip_interval;
 extern struct drm_framebuffer *__dumb_framebuffer_create(struct drm_device *device, unsigned int width, unsigned int height, unsigned int depth, unsigned int bpp);
+extern void drm_framebuffer_flush(struct drm_framebuffer *framebuffer);
+extern void drm_framebuffer_sync(struct drm_framebuffer *framebuffer);
+extern void drm_framebuffer_present(struct drm_framebuffer *drm);
+extern void drm_framebuffer_flip_done(struct drm_device *device, void *data);
 extern const struct drm_framebuffer_ops framebuffer_dumb_ops;
 /* framebuffer-i915_foreign.c */
 extern const struct drm_framebuffer_ops framebuffer_foreign_ops;
+/* fbcache.c */
+extern unsigned int fb_cache_size;
+extern unsigned long fb_cache_hits;
+extern unsigned long fb_cache_misses;
+extern struct drm_framebuffer *drm_fb_cache_get(struct drm_device *device, const struct drm_surface *surface);
+extern void drm_fb_cache_add(struct drm_framebuffer *fb, const struct drm_surface *surface);
+extern void drm_fb_cache_put(struct drm_framebuffer *fb);
+extern void drm_fb_cache_invalidate(const struct drm_surface *surface);
+extern void drm_fb_cache_trim(struct drm_device *device);
+extern void drm_fb_cache_release(struct drm_device *device);
 /* monitor.c */
+extern unsigned long connector_cache_hits;
+extern unsigned long connector_cache_misses;
+extern unsigned long connector_probes;
+extern void drm_monitor_cache_release(struct drm_monitor *m);
+extern drmModeConnector *drm_monitor_connector(struct drm_monitor *m);
 extern void drm_monitor_info(const struct drm_monitor *m);
 extern int drm_monitors_scan(struct drm_device *device);
 extern int drm_monitor_init(struct drm_monitor *monitor);
@@ -73,6 +106,10 @@ extern void udev_device_set_sysattr_uint(struct udev_device *device, const char
 extern unsigned int udev_syspath_get_sysattr_uint(const char *syspath, const char *sysattr);
 extern void udev_syspath_set_sysattr_uint(const char *syspath, const char *sysattr, unsigned int u);
 /* hotplug.c */
+extern struct latency_histogram hotplug_latency;
+extern unsigned int hotplug_generation;
+extern int hotplug_notify_fd(void);
+extern void hotplug_rescanned(void);
 extern struct hotplug *hotplug_initialize(struct udev *udev, struct udev_device *device);
 extern void hotplug_release(struct hotplug *hotplug);
 /* backlight.c */
@@ -81,3 +118,15 @@ extern void backlight_increase(struct backlight *backlight);
 extern void backlight_decrease(struct backlight *backlight);
 extern void backlight_restore(struct backlight *backlight);
 extern void backlight_release(struct backlight *backlight);
+/* vblank.c */
+extern int drm_monitor_pipe(struct drm_monitor *m);
+extern void drm_framebuffer_wait_flips(struct drm_framebuffer *framebuffer);
+extern int drm_device_events_init(struct drm_device *device);
+extern void drm_device_events_release(struct drm_device *device);
+extern int drmp_get_vblank_fd(surfman_plugin_t *plugin, surfman_monitor_t monitor);
+extern int drmp_request_vblank(surfman_plugin_t *plugin, surfman_monitor_t monitor);
+extern int drmp_handle_vblank(surfman_plugin_t *plugin, int fd, surfman_monitor_t *monitors, size_t size);
+/* latency.c */
+extern uint64_t latency_now_us(void);
+extern void latency_record(struct latency_histogram *h, uint64_t us);
+extern void latency_dump(const struct latency_histogram *h);
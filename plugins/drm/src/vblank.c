@@ -0,0 +1,253 @@
+/*
+ * Copyright (c) 2014 Citrix Systems, Inc.
+ * 
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ * 
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ * 
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include <poll.h>
+
+#include "project.h"
+
+/*
+ * DRM events.
+ *
+ * The plugin owns the libevent watch on each device fd, as vblank and page-flip completions
+ * are read from it in one go by drmHandleEvent(). Vblank events are queued on the device and
+ * Surfman is woken up through a pipe, that is the fd drmp_get_vblank_fd() hands out. Page-flip
+ * completions are consumed here directly.
+ */
+
+/* Page-flips not completed after that long are considered lost. */
+#define FLIP_WAIT_TIMEOUT_MS 100
+
+/* Device drmHandleEvent() is currently dispatching for.
+ * libDRM handlers have no private pointer besides the request signal. */
+static struct drm_device *events_device;
+
+/*
+ * drmWaitVBlank() addresses CRTCs by their index in the device resources.
+ */
+INTERNAL int drm_monitor_pipe(struct drm_monitor *m)
+{
+    drmModeRes *r;
+    int i;
+
+    if (m->pipe_crtc == m->crtc) {
+        return m->pipe;
+    }
+    r = drmModeGetResources(m->device->fd);
+    if (!r) {
+        return -errno;
+    }
+    for (i = 0; i < r->count_crtcs; ++i) {
+        if (r->crtcs[i] == m->crtc) {
+            m->pipe = i;
+            m->pipe_crtc = m->crtc;
+            drmModeFreeResources(r);
+            return i;
+        }
+    }
+    drmModeFreeResources(r);
+    return -ENODEV;
+}
+
+static uint32_t drm_pipe_to_vblank_type(int pipe)
+{
+    if (pipe > 1) {
+        return (pipe << DRM_VBLANK_HIGH_CRTC_SHIFT) & DRM_VBLANK_HIGH_CRTC_MASK;
+    }
+    return pipe ? DRM_VBLANK_SECONDARY : 0;
+}
+
+static void drm_vblank_handler(int fd, unsigned int sequence, unsigned int tv_sec,
+                               unsigned int tv_usec, void *data)
+{
+    struct drm_device *d = events_device;
+    uint32_t connector = (uint32_t)(unsigned long) data;
+    unsigned int i;
+    char c = 0;
+
+    (void) fd;
+    (void) sequence;
+    (void) tv_sec;
+    (void) tv_usec;
+
+    for (i = 0; i < d->vblank_count; ++i) {
+        if (d->vblank_queue[i] == connector) {
+            return;
+        }
+    }
+    if (d->vblank_count >= ARRAY_SIZE(d->vblank_queue)) {
+        return;
+    }
+    d->vblank_queue[d->vblank_count++] = connector;
+    if (d->vblank_count == 1 && write(d->vblank_pipe[1], &c, 1) != 1) {
+        DRM_DBG("Could not notify vblank on device \"%s\" (%s).", d->devnode, strerror(errno));
+    }
+}
+
+static void drm_page_flip_handler(int fd, unsigned int sequence, unsigned int tv_sec,
+                                  unsigned int tv_usec, void *data)
+{
+    (void) fd;
+    (void) sequence;
+    (void) tv_sec;
+    (void) tv_usec;
+
+    SURFMAN_TRACE_MARK("drm_flip_done", NULL);
+    if (data == events_device) {
+        i915_atomic_flip_done(events_device);
+    } else {
+        drm_framebuffer_flip_done(events_device, data);
+    }
+}
+
+static void drm_device_event_handler(int fd, short event, void *priv)
+{
+    drmEventContext ctx = {
+        .version = 2,
+        .vblank_handler = drm_vblank_handler,
+        .page_flip_handler = drm_page_flip_handler,
+    };
+    struct drm_device *d = priv;
+
+    (void) event;
+
+    events_device = d;
+    if (drmHandleEvent(fd, &ctx)) {
+        DRM_WRN("drmHandleEvent failed on device %s (%s).", d->devnode, strerror(errno));
+    }
+    events_device = NULL;
+}
+
+/* Dispatch the events of the device of /framebuffer/ until no page-flip to it is pending. */
+INTERNAL void drm_framebuffer_wait_flips(struct drm_framebuffer *framebuffer)
+{
+    struct drm_device *d = framebuffer->device;
+    struct pollfd pfd = { .fd = d->fd, .events = POLLIN };
+
+    while (framebuffer->flips_pending) {
+        if (poll(&pfd, 1, FLIP_WAIT_TIMEOUT_MS) <= 0) {
+            DRM_WRN("Lost %u page-flip events on device \"%s\".", framebuffer->flips_pending,
+                    d->devnode);
+            framebuffer->flips_pending = 0;
+            break;
+        }
+        drm_device_event_handler(d->fd, EV_READ, d);
+    }
+}
+
+/* Watch /device/ fd for DRM events. */
+INTERNAL int drm_device_events_init(struct drm_device *device)
+{
+    int i, err;
+
+    if (pipe(device->vblank_pipe)) {
+        err = errno;
+        DRM_ERR("Could not create vblank pipe for device \"%s\" (%s).", device->devnode,
+                strerror(err));
+        device->vblank_pipe[0] = device->vblank_pipe[1] = -1;
+        return -err;
+    }
+    for (i = 0; i < 2; ++i) {
+        fcntl(device->vblank_pipe[i], F_SETFL, O_NONBLOCK);
+        fcntl(device->vblank_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+    event_set(&(device->event), device->fd, EV_READ | EV_PERSIST, drm_device_event_handler, device);
+    event_add(&(device->event), NULL);
+    return 0;
+}
+
+INTERNAL void drm_device_events_release(struct drm_device *device)
+{
+    if (device->vblank_pipe[0] < 0) {
+        return;
+    }
+    event_del(&(device->event));
+    close(device->vblank_pipe[0]);
+    close(device->vblank_pipe[1]);
+    device->vblank_pipe[0] = device->vblank_pipe[1] = -1;
+}
+
+INTERNAL int drmp_get_vblank_fd(surfman_plugin_t *plugin, surfman_monitor_t monitor)
+{
+    (void) plugin;
+    struct drm_monitor *m = monitor;
+
+    if (!m->crtc || m->device->vblank_pipe[0] < 0) {
+        return SURFMAN_ERROR;   /* Not scanning anything out yet. */
+    }
+    return m->device->vblank_pipe[0];
+}
+
+INTERNAL int drmp_request_vblank(surfman_plugin_t *plugin, surfman_monitor_t monitor)
+{
+    (void) plugin;
+    struct drm_monitor *m = monitor;
+    drmVBlank vbl;
+    int pipe, rc;
+
+    if (!m->crtc) {
+        return SURFMAN_ERROR;
+    }
+    pipe = drm_monitor_pipe(m);
+    if (pipe < 0) {
+        DRM_DBG("Could not find pipe of CRTC %u (%s).", m->crtc, strerror(-pipe));
+        return SURFMAN_ERROR;
+    }
+
+    memset(&vbl, 0, sizeof (vbl));
+    vbl.request.type = DRM_VBLANK_RELATIVE | DRM_VBLANK_EVENT | drm_pipe_to_vblank_type(pipe);
+    vbl.request.sequence = 1;
+    vbl.request.signal = m->connector;
+    rc = drmWaitVBlank(m->device->fd, &vbl);
+    if (rc) {
+        DRM_DBG("drmWaitVBlank failed on CRTC %u (%s).", m->crtc, strerror(errno));
+        return SURFMAN_ERROR;
+    }
+    return SURFMAN_SUCCESS;
+}
+
+INTERNAL int drmp_handle_vblank(surfman_plugin_t *plugin, int fd,
+                                surfman_monitor_t *monitors, size_t size)
+{
+    (void) plugin;
+    struct drm_device *d;
+    unsigned int i;
+    size_t count = 0;
+    char buf[16];
+
+    list_for_each_entry(d, &devices, l) {
+        if (d->vblank_pipe[0] == fd) {
+            break;
+        }
+    }
+    if (&d->l == &devices) {
+        return SURFMAN_ERROR;
+    }
+
+    while (read(fd, buf, sizeof (buf)) > 0)
+        continue;
+
+    for (i = 0; i < d->vblank_count && count < size; ++i) {
+        /* The monitor could have been unplugged since the request, look it up. */
+        struct drm_monitor *m = drm_device_find_monitor(d, d->vblank_queue[i]);
+
+        if (m) {
+            monitors[count++] = m;
+        }
+    }
+    d->vblank_count = 0;
+    return count;
+}
@@ -0,0 +1,248 @@
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Test of the PBO upload path under a software GL, no X server or GPU
+ * needed: a surfaceless EGL context (Mesa llvmpipe unless told otherwise
+ * through LIBGL_ALWAYS_SOFTWARE/EGL_PLATFORM) stands for the glgfx window.
+ *
+ * A memfd-backed surface is uploaded by upload_to_gpu() with the dirty
+ * patterns a refresh usually sees, through the persistently mapped ring when
+ * the driver has GL_ARB_buffer_storage and through glMapBufferRange() per
+ * upload otherwise. For each, it reports the upload bandwidth, the upload
+ * and frame (upload until the GPU is done) times and the PBO waits, then
+ * reads the texture back and checks it matches the framebuffer, and that a
+ * clean bitmap uploads nothing.
+ *
+ *   glgfx-upload-test [uploads per run] [width height]
+ */
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+/* The upload path is static, test it in place. */
+#include "glgfx.c"
+
+#include <surfman-memfd.h>
+
+enum pattern {
+    PATTERN_FULL,
+    PATTERN_CURSOR,
+    PATTERN_SCATTERED,
+    PATTERN_BANDS,
+    PATTERN_COUNT
+};
+
+static const char *pattern_names[PATTERN_COUNT] = {
+    "full", "cursor", "scattered", "bands",
+};
+
+static unsigned int width = 1920;
+static unsigned int height = 1080;
+
+static int
+create_context()
+{
+    static const EGLint attribs[] = {
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_NONE
+    };
+    PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display;
+    EGLDisplay dpy = EGL_NO_DISPLAY;
+    EGLContext ctx;
+    EGLConfig config;
+    EGLint n;
+
+    get_platform_display = (PFNEGLGETPLATFORMDISPLAYEXTPROC)
+        eglGetProcAddress( "eglGetPlatformDisplayEXT" );
+    if (get_platform_display) {
+        dpy = get_platform_display( EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL );
+    }
+    if (dpy == EGL_NO_DISPLAY || !eglInitialize( dpy, NULL, NULL )) {
+        error("no surfaceless EGL display");
+        return -1;
+    }
+    if (!eglBindAPI( EGL_OPENGL_API ) ||
+        !eglChooseConfig( dpy, attribs, &config, 1, &n ) || !n) {
+        error("no EGL config for desktop GL");
+        return -1;
+    }
+    ctx = eglCreateContext( dpy, config, EGL_NO_CONTEXT, NULL );
+    if (ctx == EGL_NO_CONTEXT ||
+        !eglMakeCurrent( dpy, EGL_NO_SURFACE, EGL_NO_SURFACE, ctx )) {
+        error("failed to create a GL context");
+        return -1;
+    }
+    return 0;
+}
+
+/* Dirty some pages of the surface, write to them and mark them */
+static void
+dirty_pages( glgfx_surface *surf, uint8_t *bitmap, enum pattern p, unsigned int frame )
+{
+    size_t npages = ((size_t) surf->stride * surf->h + XC_PAGE_SIZE - 1) / XC_PAGE_SIZE;
+    size_t line_pages = (surf->stride + XC_PAGE_SIZE - 1) / XC_PAGE_SIZE;
+    size_t i, j, len = (size_t) surf->stride * surf->h;
+    uint32_t seed = frame * 2654435761u;
+
+    memset( bitmap, 0, (npages + 7) / 8 );
+    for (i = 0; i < npages; ++i) {
+        switch (p) {
+        case PATTERN_FULL:
+            break;
+        case PATTERN_CURSOR:
+            /* a 64 line cursor moving down the screen */
+            if (i < (frame * 8 % surf->h) * line_pages ||
+                i >= (frame * 8 % surf->h + 64) * line_pages) {
+                continue;
+            }
+            break;
+        case PATTERN_SCATTERED:
+            seed = seed * 1103515245 + 12345;
+            if ((seed >> 8) % 20) {
+                continue;
+            }
+            break;
+        case PATTERN_BANDS:
+            if (((i / (line_pages * 32)) + frame) % 2) {
+                continue;
+            }
+            break;
+        default:
+            continue;
+        }
+        bitmap[i / 8] |= 1 << (i % 8);
+        for (j = i * XC_PAGE_SIZE; j < (i + 1) * XC_PAGE_SIZE && j < len; j += 4) {
+            *(uint32_t*) (surf->mapped_fb + j) = j * 7 + frame;
+        }
+    }
+}
+
+/* Read the texture back, return the number of bytes that differ */
+static size_t
+check_texture( glgfx_surface *surf )
+{
+    size_t i, bad = 0, len = (size_t) surf->w * surf->h * 4;
+    uint8_t *pixels = malloc( len );
+    GLuint fbo;
+
+    glGenFramebuffers( 1, &fbo );
+    glBindFramebuffer( GL_FRAMEBUFFER, fbo );
+    glFramebufferTexture2D( GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, surf->tex, 0 );
+    glPixelStorei( GL_PACK_ALIGNMENT, 4 );
+    glReadPixels( 0, 0, surf->w, surf->h, GL_RGBA, GL_UNSIGNED_BYTE, pixels );
+    glBindFramebuffer( GL_FRAMEBUFFER, 0 );
+    glDeleteFramebuffers( 1, &fbo );
+
+    /* stride is w * 4, the layouts match */
+    for (i = 0; i < len; ++i) {
+        bad += pixels[i] != surf->mapped_fb[i];
+    }
+    free( pixels );
+    return bad;
+}
+
+static int
+run( glgfx_surface *surf, const char *path, enum pattern p, unsigned int uploads )
+{
+    size_t npages = ((size_t) surf->stride * surf->h + XC_PAGE_SIZE - 1) / XC_PAGE_SIZE;
+    uint8_t *bitmap = calloc( (npages + 7) / 8, 1 );
+    uint64_t t0, frame_us = 0;
+    unsigned int i, clean;
+    size_t bad;
+
+    /* a fresh ring and a full upload first */
+    surf->last_w = surf->last_h = 0;
+    upload_to_gpu( surf->src, surf, NULL );
+    glFinish();
+    memset( &g_stats, 0, sizeof (g_stats) );
+
+    for (i = 0; i < uploads; ++i) {
+        dirty_pages( surf, bitmap, p, i );
+        t0 = now_us();
+        upload_to_gpu( surf->src, surf, p == PATTERN_FULL ? NULL : bitmap );
+        /* what a frame waits for before it can be composited */
+        glFinish();
+        frame_us += now_us() - t0;
+    }
+    bad = check_texture( surf );
+
+    /* a clean pass uploads nothing, glgfx_refresh_surface() then does not composite */
+    memset( bitmap, 0, (npages + 7) / 8 );
+    clean = upload_to_gpu( surf->src, surf, bitmap );
+
+    printf( "%-10s %-10s %10.1f %10.3f %10.3f %6u %s\n", path, pattern_names[p],
+            g_stats.upload_us ? g_stats.bytes / (double) g_stats.upload_us : 0.,
+            g_stats.upload_us / 1000. / uploads, frame_us / 1000. / uploads,
+            g_stats.waits, bad ? "MISMATCH" : clean ? "CLEAN UPLOAD" : "ok" );
+    free( bitmap );
+    return bad || clean ? -1 : 0;
+}
+
+int
+main( int argc, char **argv )
+{
+    unsigned int uploads = argc > 1 ? strtoul( argv[1], NULL, 0 ) : 100;
+    int have_storage, path, rv = 0;
+    surfman_surface_t *s;
+    glgfx_surface *surf;
+    enum pattern p;
+
+    if (argc > 3) {
+        width = strtoul( argv[2], NULL, 0 );
+        height = strtoul( argv[3], NULL, 0 );
+    }
+    if (!uploads || !width || !height) {
+        fprintf( stderr, "usage: %s [uploads] [width height]\n", argv[0] );
+        return 1;
+    }
+
+    if (create_context() < 0) {
+        return 1;
+    }
+    init_gl();
+    printf( "%s, %ux%u, %u uploads per run\n",
+            (const char*) glGetString( GL_RENDERER ), width, height, uploads );
+
+    s = xc_memfd_surface_new( width, height, SURFMAN_FORMAT_BGRX8888 );
+    if (!s) {
+        return 1;
+    }
+    surf = glgfx_get_psurface_from_surface( &surfman_plugin, s );
+    if (!surf || init_surface_resources( surf ) < 0) {
+        return 1;
+    }
+
+    printf( "%-10s %-10s %10s %10s %10s %6s\n", "path", "pattern", "MB/s",
+            "upload ms", "frame ms", "waits" );
+    have_storage = g_have_buffer_storage;
+    for (path = have_storage ? 0 : 1; path < 2; ++path) {
+        g_have_buffer_storage = !path;
+        for (p = 0; p < PATTERN_COUNT; ++p) {
+            if (run( surf, path ? "map" : "persistent", p, uploads ) < 0) {
+                rv = 1;
+            }
+        }
+    }
+    g_have_buffer_storage = have_storage;
+
+    free_surface_resources( surf );
+    printf( "%s\n", rv ? "FAIL" : "PASS" );
+    return rv;
+}
@@ -25,6 +25,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <time.h>
+#include <event.h>
 #include <xenctrl.h>
 #include <surfman.h>
 #include <stdio.h>
@@ -43,6 +45,11 @@
 
 #define XORG_TEMPLATE "/etc/X11/xorg.conf-glgfx-nvidia"
 
+#define PBO_WAIT_TIMEOUT_NS 1000000000ULL /* give up on a PBO fence after 1s */
+#define STATS_PERIOD 300                  /* refreshes between upload statistics */
+#define ANIM_STEP 0.05f                   /* cross-fade progress per composited frame */
+#define FRAME_US 16667                    /* monitor period: no pixel clock reported, surfman's 60Hz */
+
 static int g_attributes[] = {
     GLX_RGBA, GLX_DOUBLEBUFFER,
     GLX_RED_SIZE, 8,
@@ -59,6 +66,31 @@ static int g_have_window = 0;
 static xc_interface *g_xc = NULL;
 static glgfx_surface *g_current_surface = NULL;
 static struct event hotplug_timer;
+/* GL_ARB_buffer_storage: PBOs stay mapped for their whole life */
+static int g_have_buffer_storage = 0;
+/* clean lines allowed between coalesced dirty rectangles */
+static unsigned int g_merge_gap = SURFMAN_DIRTY_MERGE_GAP;
+
+/* compositor: one program, one VBO, one frame per refresh period */
+static struct {
+    GLuint program;
+    GLuint vbo;
+    GLint a_pos, a_tex;
+    GLint u_viewport, u_tex, u_swizzle, u_opacity;
+    int w, h;
+    struct event event;
+    int pending;
+    uint64_t last_us;                     /* start of the last composite */
+} g_comp;
+
+/* upload statistics, reported every STATS_PERIOD refreshes */
+static struct {
+    unsigned int frames;
+    unsigned int waits;
+    uint64_t bytes;
+    uint64_t upload_us;
+    uint64_t frame_us;
+} g_stats;
 
 typedef struct {
     /* taken from xinerama */
@@ -77,6 +109,7 @@ static surfman_display_t g_dispcfg[MAX_DISPLAY_CONFIGS];
 static int g_num_dispcfgs = 0;
 
 static int stop_X();
+static void schedule_composite( void );
 
 static int
 get_gpu_busid(int *b, int *d, int *f)
@@ -177,44 +210,189 @@ resize_gl( int w, int h )
     info("resize_gl");
     h = h == 0 ? 1 : h;
     glViewport( 0, 0, w, h );
-    glMatrixMode(GL_PROJECTION);
-    glLoadIdentity();
-    glOrtho( 0, w-1, h-1, 0, -10, 10 );
-    glMatrixMode(GL_MODELVIEW);
-    glLoadIdentity();
+    g_comp.w = w;
+    g_comp.h = h;
+}
+
+static uint64_t
+now_us()
+{
+    struct timespec ts;
+
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Works as GLSL 1.10 and GLSL ES 1.00. Positions are in window pixels,
+ * u_swizzle exchanges red and blue for BGR layouts uploaded as RGB and the
+ * X channel of the framebuffer is ignored.
+ */
+static const char *vertex_shader =
+    "attribute vec2 a_pos;\n"
+    "attribute vec2 a_tex;\n"
+    "uniform vec2 u_viewport;\n"
+    "varying vec2 v_tex;\n"
+    "void main() {\n"
+    "    v_tex = a_tex;\n"
+    "    gl_Position = vec4(a_pos.x * 2.0 / u_viewport.x - 1.0,\n"
+    "                       1.0 - a_pos.y * 2.0 / u_viewport.y, 0.0, 1.0);\n"
+    "}\n";
+
+static const char *fragment_shader =
+    "#ifdef GL_ES\n"
+    "precision mediump float;\n"
+    "#endif\n"
+    "uniform sampler2D u_tex;\n"
+    "uniform float u_swizzle;\n"
+    "uniform float u_opacity;\n"
+    "varying vec2 v_tex;\n"
+    "void main() {\n"
+    "    vec4 c = texture2D(u_tex, v_tex);\n"
+    "    gl_FragColor = vec4(mix(c.rgb, c.bgr, u_swizzle), u_opacity);\n"
+    "}\n";
+
+static GLuint
+compile_shader( GLenum type, const char *src )
+{
+    GLuint id = glCreateShader( type );
+    GLint ok = 0;
+    char log[1024];
+
+    glShaderSource( id, 1, &src, NULL );
+    glCompileShader( id );
+    glGetShaderiv( id, GL_COMPILE_STATUS, &ok );
+    if (!ok) {
+        glGetShaderInfoLog( id, sizeof (log), NULL, log );
+        error("shader compilation failed: %s", log);
+        glDeleteShader( id );
+        return 0;
+    }
+    return id;
+}
+
+static int
+init_compositor()
+{
+    GLuint vs, fs;
+    GLint ok = 0;
+    char log[1024];
+
+    vs = compile_shader( GL_VERTEX_SHADER, vertex_shader );
+    fs = compile_shader( GL_FRAGMENT_SHADER, fragment_shader );
+    if (!vs || !fs) {
+        return -1;
+    }
+    g_comp.program = glCreateProgram();
+    glAttachShader( g_comp.program, vs );
+    glAttachShader( g_comp.program, fs );
+    glLinkProgram( g_comp.program );
+    glDeleteShader( vs );
+    glDeleteShader( fs );
+    glGetProgramiv( g_comp.program, GL_LINK_STATUS, &ok );
+    if (!ok) {
+        glGetProgramInfoLog( g_comp.program, sizeof (log), NULL, log );
+        error("shader link failed: %s", log);
+        return -1;
+    }
+
+    g_comp.a_pos = glGetAttribLocation( g_comp.program, "a_pos" );
+    g_comp.a_tex = glGetAttribLocation( g_comp.program, "a_tex" );
+    g_comp.u_viewport = glGetUniformLocation( g_comp.program, "u_viewport" );
+    g_comp.u_tex = glGetUniformLocation( g_comp.program, "u_tex" );
+    g_comp.u_swizzle = glGetUniformLocation( g_comp.program, "u_swizzle" );
+    g_comp.u_opacity = glGetUniformLocation( g_comp.program, "u_opacity" );
+    glGenBuffers( 1, &g_comp.vbo );
+    return 0;
 }
 
 static void
 init_gl()
 {
+    const char *ext = (const char*) glGetString( GL_EXTENSIONS );
+
     info("init_gl");
+    g_have_buffer_storage = ext && strstr( ext, "GL_ARB_buffer_storage" ) != NULL;
+    info("persistently mapped PBOs: %s", g_have_buffer_storage ? "yes" : "no");
+    if (init_compositor() < 0) {
+        error("failed to set up the compositor");
+    }
     glClearColor( 0, 0, 0, 0 );
     glClear( GL_COLOR_BUFFER_BIT  );
-    glEnable( GL_TEXTURE );
-    glEnable( GL_TEXTURE_2D );
     glFlush();
 }
 
 static void
-resize_pbo( GLuint id, size_t sz )
+release_pbo( glgfx_pbo *pbo )
 {
-    GLubyte *ptr;
-    info( "sizing PBO %d to %d bytes", id, sz );
-    glBindBuffer( GL_PIXEL_UNPACK_BUFFER, id );
-    glBufferData( GL_PIXEL_UNPACK_BUFFER, sz, 0, GL_DYNAMIC_DRAW );
+    if (pbo->fence) {
+        glDeleteSync( pbo->fence );
+        pbo->fence = NULL;
+    }
+    if (pbo->id) {
+        if (pbo->ptr) {
+            glBindBuffer( GL_PIXEL_UNPACK_BUFFER, pbo->id );
+            glUnmapBuffer( GL_PIXEL_UNPACK_BUFFER );
+            pbo->ptr = NULL;
+        }
+        glDeleteBuffers( 1, &pbo->id );
+        pbo->id = 0;
+    }
+}
 
-    ptr = (GLubyte*) glMapBuffer( GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY );
-    info( "PBO %d seems to map onto %p", id, ptr );
-    glUnmapBuffer( GL_PIXEL_UNPACK_BUFFER );
+/* (Re)create the PBO ring of a surface with sz bytes per buffer */
+static int
+resize_pbo_ring( glgfx_surface *surface, size_t sz )
+{
+    const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glgfx_pbo *pbo;
+    int i;
+
+    info( "sizing %d PBOs to %zu bytes", GLGFX_PBO_RING, sz );
+    for (i = 0; i < GLGFX_PBO_RING; ++i) {
+        pbo = &surface->pbo[i];
+        release_pbo( pbo );
+        glGenBuffers( 1, &pbo->id );
+        glBindBuffer( GL_PIXEL_UNPACK_BUFFER, pbo->id );
+        if (g_have_buffer_storage) {
+            glBufferStorage( GL_PIXEL_UNPACK_BUFFER, sz, NULL, flags );
+            pbo->ptr = (GLubyte*) glMapBufferRange( GL_PIXEL_UNPACK_BUFFER, 0, sz, flags );
+            if (!pbo->ptr) {
+                error("failed to map PBO %d persistently", pbo->id);
+                return -1;
+            }
+        } else {
+            glBufferData( GL_PIXEL_UNPACK_BUFFER, sz, NULL, GL_STREAM_DRAW );
+        }
+    }
+    glBindBuffer( GL_PIXEL_UNPACK_BUFFER, 0 );
+    surface->pbo_size = sz;
+    surface->pbo_next = 0;
+    return 0;
 }
 
-static GLuint
-create_pbo( size_t sz )
+/* Take the next PBO of the ring, once the GPU is done reading it */
+static glgfx_pbo *
+next_pbo( glgfx_surface *surface )
 {
-    GLuint id;
-    glGenBuffers( 1, &id );
-    info( "created PBO %d", id );
-    return id;
+    glgfx_pbo *pbo = &surface->pbo[surface->pbo_next];
+    GLenum rv;
+
+    surface->pbo_next = (surface->pbo_next + 1) % GLGFX_PBO_RING;
+    if (!pbo->fence) {
+        return pbo;
+    }
+    rv = glClientWaitSync( pbo->fence, 0, 0 );
+    if (rv == GL_TIMEOUT_EXPIRED) {
+        ++g_stats.waits;
+        rv = glClientWaitSync( pbo->fence, GL_SYNC_FLUSH_COMMANDS_BIT, PBO_WAIT_TIMEOUT_NS );
+    }
+    if (rv == GL_TIMEOUT_EXPIRED || rv == GL_WAIT_FAILED) {
+        warning("PBO %d still busy, uploading anyway", pbo->id);
+    }
+    glDeleteSync( pbo->fence );
+    pbo->fence = NULL;
+    return pbo;
 }
 
 static GLuint
@@ -230,20 +408,31 @@ create_texobj()
     return id;
 }
 
-static int get_gl_formats( int surfman_surface_fmt, GLenum *gl_fmt, GLenum *gl_typ )
+/*
+ * Pixels are uploaded as they are, GLES2 has no BGR formats: the shader
+ * swaps red and blue for the BGR layouts.
+ */
+static int get_gl_formats( int surfman_surface_fmt, GLenum *gl_fmt, GLenum *gl_typ,
+                           unsigned int *Bpp, int *swizzle )
 {
     switch (surfman_surface_fmt) {
     case SURFMAN_FORMAT_BGRX8888:
-        *gl_fmt = GL_BGRA;
+        *gl_fmt = GL_RGBA;
         *gl_typ = GL_UNSIGNED_BYTE;
+        *Bpp = 4;
+        *swizzle = 1;
         return 0;
     case SURFMAN_FORMAT_RGBX8888:
         *gl_fmt = GL_RGBA;
         *gl_typ = GL_UNSIGNED_BYTE;
+        *Bpp = 4;
+        *swizzle = 0;
         return 0;
     case SURFMAN_FORMAT_BGR565:
-        *gl_fmt = GL_BGR;
+        *gl_fmt = GL_RGB;
         *gl_typ = GL_UNSIGNED_SHORT_5_6_5;
+        *Bpp = 2;
+        *swizzle = 1;
         return 0;
     default:
         error("unsupported surfman surface format %d", surfman_surface_fmt );
@@ -251,111 +440,107 @@ static int get_gl_formats( int surfman_surface_fmt, GLenum *gl_fmt, GLenum *gl_t
     }
 }
 
-static void
-upload_pbo_to_texture(
-    GLuint pbo,
-    GLenum pbo_format,
-    GLenum pbo_type,
-    GLuint tex,
-    int recreate_texture,
-    int x,
-    int y,
-    int w,
-    int h,
-    int stride_in_bytes )
-{
-    glBindBuffer( GL_PIXEL_UNPACK_BUFFER, pbo );
-    glBindTexture( GL_TEXTURE_2D, tex );
-
-    glPixelStorei( GL_UNPACK_ALIGNMENT, 4 );
-    glPixelStorei( GL_UNPACK_ROW_LENGTH, stride_in_bytes / 4 ); // assume 4bpp for now
-    if (recreate_texture) {
-        glTexImage2D( GL_TEXTURE_2D, 0, 4, w, h, 0, pbo_format, pbo_type, 0 );
-    } else {
-        glTexSubImage2D( GL_TEXTURE_2D, 0, x, y, w, h, pbo_format, pbo_type, 0 );
-    }
-}
-
+/*
+ * Stage the rectangles in a PBO of the ring, at the same offsets as in the
+ * framebuffer, then upload only those rectangles to the texture. The fence
+ * placed after the upload tells when that PBO can be written again.
+ */
 static int
-copy_to_pbo( GLuint pbo, GLubyte *src, size_t len, uint8_t *dirty_bitmap )
+upload_rects( glgfx_surface *dst, GLenum format, GLenum type, unsigned int Bpp,
+              const surfman_rect_t *rects, unsigned int n )
 {
+    glgfx_pbo *pbo;
     GLubyte *ptr;
-    glBindBuffer( GL_PIXEL_UNPACK_BUFFER, pbo );
-    ptr = (GLubyte*) glMapBuffer( GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY );
-    if (!ptr) {
-        error("copy_to_pbo %d %p %d: map buffer FAILED", pbo, src, len);
-        return -1;
-    }
-    if (!dirty_bitmap) {
-        memcpy( ptr, src, len );
+    unsigned int i;
+    uint64_t bytes = 0;
+
+    pbo = next_pbo( dst );
+    glBindBuffer( GL_PIXEL_UNPACK_BUFFER, pbo->id );
+    if (pbo->ptr) {
+        ptr = pbo->ptr;
     } else {
-        /* FIXME: this is bit suboptimal */
-        int num_pages = (len+XC_PAGE_SIZE-1) / XC_PAGE_SIZE;
-        int num_bytes = num_pages/8;
-        uint8_t* p = dirty_bitmap;
-        int i = 0, j;
-        while (i < num_bytes) {
-            switch (*p) {
-            case 0x00:
-                break;
-            default:
-                memcpy( ptr + XC_PAGE_SIZE*i*8, src + XC_PAGE_SIZE*i*8, XC_PAGE_SIZE*8 );
-                break;
-            }
-            ++p;
-            ++i;
-        }
-        ptr = ptr + XC_PAGE_SIZE*i*8;
-        src = src + XC_PAGE_SIZE*i*8;
-        i = 0;
-        while (i < num_pages%8) {
-            if (*p & (1<<i)) {
-                memcpy( ptr + XC_PAGE_SIZE*i, src + XC_PAGE_SIZE*i, XC_PAGE_SIZE );
-            }
-            ++i;
+        /* the fence already synchronised us with the GPU */
+        ptr = (GLubyte*) glMapBufferRange( GL_PIXEL_UNPACK_BUFFER, 0, dst->pbo_size,
+                                           GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT );
+        if (!ptr) {
+            error("upload_rects: map PBO %d FAILED", pbo->id);
+            return -1;
         }
     }
+    for (i = 0; i < n; ++i) {
+        size_t off = (size_t) rects[i].y * dst->stride + rects[i].x * Bpp;
+        blit_rect( ptr + off, dst->stride, dst->mapped_fb + off, dst->stride,
+                   (size_t) rects[i].w * Bpp, rects[i].h );
+    }
+    if (!pbo->ptr) {
+        glUnmapBuffer( GL_PIXEL_UNPACK_BUFFER );
+    }
 
-    glUnmapBuffer( GL_PIXEL_UNPACK_BUFFER );
-    return 0;
+    glBindTexture( GL_TEXTURE_2D, dst->tex );
+    glPixelStorei( GL_UNPACK_ALIGNMENT, Bpp );
+    glPixelStorei( GL_UNPACK_ROW_LENGTH, dst->stride / Bpp );
+    for (i = 0; i < n; ++i) {
+        size_t off = (size_t) rects[i].y * dst->stride + rects[i].x * Bpp;
+        glTexSubImage2D( GL_TEXTURE_2D, 0, rects[i].x, rects[i].y, rects[i].w, rects[i].h,
+                         format, type, (const GLvoid*) off );
+        bytes += (uint64_t) rects[i].w * rects[i].h * Bpp;
+    }
+    glPixelStorei( GL_UNPACK_ROW_LENGTH, 0 );
+    glBindBuffer( GL_PIXEL_UNPACK_BUFFER, 0 );
 
+    pbo->fence = glFenceSync( GL_SYNC_GPU_COMMANDS_COMPLETE, 0 );
+    g_stats.bytes += bytes;
+    return 0;
 }
 
-static void
+/* Returns the number of rectangles uploaded. */
+static unsigned int
 upload_to_gpu( surfman_surface_t *src, glgfx_surface *dst, uint8_t *dirty_bitmap )
 {
     GLenum fb_format, fb_type;
+    unsigned int Bpp, n;
+    surfman_rect_t rects[SURFMAN_DIRTY_RECTS_MAX];
     int recreate=0, rv;
+    uint64_t t0 = now_us();
+
     if ( !dst->initialised ) {
         error("gpu surface not initialised");
-        return;
+        return 0;
     }
     if ( !dst->mapped_fb ) {
         error("framebuffer does not appear to be mapped");
-        return;
+        return 0;
     }
     if ( dst->mapped_fb_size < dst->stride * dst->h ) {
         error("framebuffer mapping appears to be too short");
-        return;
+        return 0;
     }
-    if ( get_gl_formats( src->format, &fb_format, &fb_type ) < 0 ) {
+    if ( get_gl_formats( src->format, &fb_format, &fb_type, &Bpp, &dst->swizzle ) < 0 ) {
         error("unsupported/unknown surface format");
-        return;
+        return 0;
     }
     if ( dst->last_w != dst->w || dst->last_h != dst->h ) {
         recreate = 1;
     }
     if ( recreate ) {
         info("stride: %d, height: %d", dst->stride, dst->h);
-        resize_pbo( dst->pbo, dst->stride*dst->h );
+        if ( resize_pbo_ring( dst, (size_t) dst->stride * dst->h ) < 0 ) {
+            return 0;
+        }
+        glBindTexture( GL_TEXTURE_2D, dst->tex );
+        glTexImage2D( GL_TEXTURE_2D, 0, fb_format, dst->w, dst->h, 0, fb_format, fb_type, NULL );
+        dirty_bitmap = NULL;
     }
-    rv = copy_to_pbo( dst->pbo, dst->mapped_fb, dst->stride * dst->h, recreate ? NULL : dirty_bitmap );
-    upload_pbo_to_texture( dst->pbo, fb_format, fb_type, dst->tex, recreate, 0, 0, dst->w, dst->h, dst->stride );
+    n = rects_from_dirty_bitmap( dirty_bitmap, dst->w, dst->h, dst->stride, src->format,
+                                 g_merge_gap, rects, SURFMAN_DIRTY_RECTS_MAX );
+    rv = n ? upload_rects( dst, fb_format, fb_type, Bpp, rects, n ) : 0;
     /* only overwrite if success from previous ops */
     if (rv == 0) {
         dst->last_w = dst->w;
         dst->last_h = dst->h;
     }
+    g_stats.upload_us += now_us() - t0;
+    return rv == 0 ? n : 0;
 }
 
 static void
@@ -363,7 +548,10 @@ map_fb( surfman_surface_t *src, glgfx_surface *dst )
 {
     if ( !( dst->mapped_fb = surface_map( src ) ) ) {
         error("failed to map framebuffer pages");
+        dst->mapped_fb_size = 0;
+        return;
     }
+    dst->mapped_fb_size = src->page_count * XC_PAGE_SIZE;
 }
 
 static int
@@ -377,8 +565,9 @@ init_surface_resources( glgfx_surface *surface )
         return -1;
     }
     surface->tex = create_texobj();
-    surface->pbo = create_pbo( surface->w*surface->stride );
-    map_fb( surface->src, surface );
+    if (!surface->mapped_fb) {
+        map_fb( surface->src, surface );
+    }
     surface->initialised = 1;
     return 0;
 }
@@ -386,6 +575,8 @@ init_surface_resources( glgfx_surface *surface )
 static void
 free_surface_resources( glgfx_surface *surf )
 {
+    int i;
+
     if (surf) {
         info("free surface resources %p", surf);
         if (surf->anim_next && surf->anim_next->anim_prev == surf) {
@@ -395,100 +586,178 @@ free_surface_resources( glgfx_surface *surf )
             surf->anim_prev->anim_next = NULL;
         }
         glDeleteTextures( 1, &surf->tex );
-        glBufferData( GL_PIXEL_UNPACK_BUFFER, 0, NULL, GL_DYNAMIC_DRAW );
-        glDeleteBuffers( 1, &surf->pbo );
-        surface_unmap( surf );
+        for (i = 0; i < GLGFX_PBO_RING; ++i) {
+            release_pbo( &surf->pbo[i] );
+        }
+        surf->last_w = surf->last_h = 0;
+        if (surf->mapped_fb) {
+            surface_unmap( surf->src );
+            surf->mapped_fb = NULL;
+        }
         surf->initialised = 0;
     }
 }
 
+/* Two triangles covering x,y,w,h of the window with the whole texture */
 static void
-render( glgfx_surface *surface, int w, int h )
+quad( GLfloat *v, float x, float y, float w, float h )
 {
-    glBindTexture( GL_TEXTURE_2D, surface->tex );
-    glColor3f( 1,1,1 );
-    glBegin( GL_QUADS );
-    glTexCoord2f( 0,0 ); glVertex2f( 0, 0 );
-    glTexCoord2f( 1,0 ); glVertex2f( w-1, 0 );
-    glTexCoord2f( 1,1 ); glVertex2f( w-1, h-1 );
-    glTexCoord2f( 0,1 ); glVertex2f( 0, h-1 );
-    glEnd();
-    glFlush();
+    const GLfloat q[] = {
+        x,     y,     0, 0,
+        x + w, y,     1, 0,
+        x,     y + h, 0, 1,
+        x + w, y,     1, 0,
+        x + w, y + h, 1, 1,
+        x,     y + h, 0, 1,
+    };
+    memcpy( v, q, sizeof (q) );
+}
+
+static int
+uploaded( glgfx_surface *surface )
+{
+    return surface->initialised && surface->last_w;
 }
 
 static void
-render_as_tiles( glgfx_surface *surface, int xtiles, int ytiles, float z, int rev,
-                 int w, int h, float phase )
-                 
+draw( glgfx_surface *surface, int first, float opacity )
 {
-    int x,y;
-    float xstep = 1.0 / xtiles;
-    float ystep = 1.0 / ytiles;
-    float xc = xstep*xtiles/2;
-    float yc = ystep*ytiles/2;
     glBindTexture( GL_TEXTURE_2D, surface->tex );
-    glColor3f( 1,1,1 );
-    for (y = 0; y < ytiles; ++y) {
-        for (x = 0; x < xtiles; ++x) {
-            float x0 = xstep*x;
-            float y0 = ystep*y;
-            float x1 = x0+xstep;
-            float y1 = y0+xstep;
-            float dst = sqrtf(sqrtf((x1-xc)*(x1-xc)+(y1-yc)*(y1-yc)));
-            float speed = cos(dst*3.14159/2)*2;
-            if (speed<1) speed=1;
-            float rot = phase * speed * 180;
-            if (rev) {
-                rot = 180-rot;
-            }
-            glLoadIdentity();
-            glTranslatef( x0*(w-1), y0*(h-1), z );
-            if (rot > 180) rot=180;
-            if (rot < 0) rot=0;
-            glRotatef( rot, 1, 1, 0 );
-            glBegin( GL_QUADS );
-            glTexCoord2f( x0,y0 ); glVertex3f( 0,0,0 );
-            glTexCoord2f( x1,y0 ); glVertex3f( xstep*(w-1),0,0 );
-            glTexCoord2f( x1,y1 ); glVertex3f( xstep*(w-1),ystep*(h-1),0 );
-            glTexCoord2f( x0,y1 ); glVertex3f( 0,ystep*(h-1),0 );
-            glEnd();
-        }
-    }
+    glUniform1f( g_comp.u_swizzle, surface->swizzle ? 1.f : 0.f );
+    glUniform1f( g_comp.u_opacity, opacity );
+    glDrawArrays( GL_TRIANGLES, first, 6 );
 }
 
+/*
+ * Draw every visible surface, scaled to its monitor, in one frame. A surface
+ * that just replaced another on a monitor fades in over it.
+ */
 static void
-render_animated( glgfx_surface *surface, int w, int h )
+composite()
 {
-    if ( !surface->anim_active ) {
-        render( surface, w, h );
-    } else {
-        glPushAttrib( GL_DEPTH_BUFFER_BIT );
-        glEnable( GL_CULL_FACE );
-        glClearColor( 0, 0, 0, 0 );
-        glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT  );
+    GLfloat v[MAX_DISPLAY_CONFIGS * 6 * 4];
+    int i, n = 0, animating = 0;
 
-        glFrontFace( GL_CW );
-        render_as_tiles( surface, 16, 16, 1, 1, w, h, surface->anim_phase );
+    glClear( GL_COLOR_BUFFER_BIT );
+    if (!g_comp.program) {
+        return;
+    }
+    for (i = 0; i < g_num_dispcfgs; ++i) {
+        xinemonitor_t *m = (xinemonitor_t*) g_dispcfg[i].monitor;
+        quad( &v[n * 6 * 4], m->xoff, m->yoff, m->w, m->h );
+        ++n;
+    }
+    if (!n) {
+        return;
+    }
+
+    glUseProgram( g_comp.program );
+    glUniform2f( g_comp.u_viewport, g_comp.w, g_comp.h );
+    glUniform1i( g_comp.u_tex, 0 );
+    glActiveTexture( GL_TEXTURE0 );
+    glBindBuffer( GL_ARRAY_BUFFER, g_comp.vbo );
+    glBufferData( GL_ARRAY_BUFFER, n * 6 * 4 * sizeof (GLfloat), v, GL_STREAM_DRAW );
+    glEnableVertexAttribArray( g_comp.a_pos );
+    glEnableVertexAttribArray( g_comp.a_tex );
+    glVertexAttribPointer( g_comp.a_pos, 2, GL_FLOAT, GL_FALSE, 4 * sizeof (GLfloat), (void*) 0 );
+    glVertexAttribPointer( g_comp.a_tex, 2, GL_FLOAT, GL_FALSE, 4 * sizeof (GLfloat),
+                           (void*) (2 * sizeof (GLfloat)) );
 
-        if ( surface->anim_prev ) {
-            glFrontFace( GL_CW );
-            render_as_tiles( surface->anim_prev, 16, 16, -1, 0, w, h, surface->anim_phase );
+    for (i = 0; i < g_num_dispcfgs; ++i) {
+        glgfx_surface *surf = (glgfx_surface*) g_dispcfg[i].psurface;
+
+        if (!surf) {
+            continue;
+        }
+        if (!surf->anim_active) {
+            if (uploaded( surf )) {
+                draw( surf, i * 6, 1.f );
+            }
+            continue;
+        }
+
+        if (surf->anim_prev && uploaded( surf->anim_prev )) {
+            draw( surf->anim_prev, i * 6, 1.f );
+        }
+        /* fade in from the first upload on */
+        if (!uploaded( surf )) {
+            animating = 1;
+            continue;
         }
+        glEnable( GL_BLEND );
+        glBlendFunc( GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA );
+        draw( surf, i * 6, surf->anim_phase );
+        glDisable( GL_BLEND );
 
         /* update animation frame */
-        surface->anim_phase += 0.02;
-        if (surface->anim_phase > 1) {
-            surface->anim_phase = 0;
-            surface->anim_active = 0;
-            surface->anim_next = NULL;
-            if (surface->anim_prev) {
-                surface->anim_prev->anim_next = NULL;
+        surf->anim_phase += ANIM_STEP;
+        if (surf->anim_phase >= 1) {
+            surf->anim_phase = 0;
+            surf->anim_active = 0;
+            surf->anim_next = NULL;
+            if (surf->anim_prev) {
+                surf->anim_prev->anim_next = NULL;
             }
+        } else {
+            animating = 1;
         }
-        glPopAttrib();
-        glDisable( GL_CULL_FACE );
     }
-    glFlush();
+
+    glDisableVertexAttribArray( g_comp.a_pos );
+    glDisableVertexAttribArray( g_comp.a_tex );
+    glBindBuffer( GL_ARRAY_BUFFER, 0 );
+    glUseProgram( 0 );
+
+    /* keep the fade going even if no surface refreshes */
+    if (animating) {
+        schedule_composite();
+    }
+}
+
+static void
+composite_cb(int fd, short event, void *opaque)
+{
+    uint64_t t0 = now_us();
+
+    g_comp.pending = 0;
+    if (!g_display || g_window == None) {
+        return;
+    }
+    g_comp.last_us = t0;
+    composite();
+    /* deus ex machina */
+    glXSwapBuffers( g_display, g_window );
+
+    g_stats.frame_us += now_us() - t0;
+    if (++g_stats.frames == STATS_PERIOD) {
+        info("upload: %.1f MB/s, %.2f ms avg upload, %.2f ms avg frame, %u PBO waits",
+             g_stats.upload_us ? g_stats.bytes / (double) g_stats.upload_us : 0.,
+             g_stats.upload_us / 1000. / g_stats.frames,
+             g_stats.frame_us / 1000. / g_stats.frames, g_stats.waits);
+        memset( &g_stats, 0, sizeof (g_stats) );
+    }
+}
+
+/*
+ * Each surface refreshes on its own timer or vblank, in different event loop
+ * iterations. Compositing at most once per monitor period, a period after the
+ * last frame, makes one frame and one swap out of all the uploads meanwhile.
+ */
+static void
+schedule_composite( void )
+{
+    struct timeval tv = {0, 0};
+    uint64_t now = now_us();
+
+    if (g_comp.pending) {
+        return;
+    }
+    if (g_comp.last_us + FRAME_US > now) {
+        tv.tv_usec = g_comp.last_us + FRAME_US - now;
+    }
+    event_set( &g_comp.event, -1, EV_TIMEOUT, composite_cb, NULL );
+    g_comp.pending = 1;
+    event_add( &g_comp.event, &tv );
 }
 
 static void
@@ -717,6 +986,13 @@ stop_X()
         free_surface_resources( g_surfaces[i] );
     }
 
+    if (g_comp.pending) {
+        event_del( &g_comp.event );
+        g_comp.pending = 0;
+    }
+    g_comp.program = 0;
+    g_comp.vbo = 0;
+
     if (g_context) {
         info("freeing context");
         glXMakeCurrent( g_display, None, NULL );
@@ -834,6 +1110,7 @@ glgfx_init (surfman_plugin_t * p)
         error("NVIDIA device not present");
         return SURFMAN_ERROR;
     }
+    g_merge_gap = rects_merge_gap("glgfx");
     g_xc = xc_interface_open(NULL, NULL, 0);
     if (!g_xc) {
         error("failed to open XC interface");
@@ -921,6 +1198,7 @@ glgfx_display (surfman_plugin_t * p,
     /* cache the display config for actual rendering done during refresh callback */
     memcpy( g_dispcfg, config, sizeof(surfman_display_t) * size );
     g_num_dispcfgs = size;
+    schedule_composite();
 
     return SURFMAN_SUCCESS;
 }
@@ -1040,11 +1318,16 @@ glgfx_update_psurface (surfman_plugin_t *plugin,
     glsurf->w = surface->width;
     glsurf->h = surface->height;
     glsurf->stride = surface->stride;
-    glsurf->src = surface;
     if (flags & SURFMAN_UPDATE_PAGES) {
-        surface_unmap( psurface );
-        map_fb( surface, psurface );
+        /* New reference first, so an unchanged mapping is kept. */
+        uint8_t *old = glsurf->mapped_fb;
+
+        map_fb( surface, glsurf );
+        if (old) {
+            surface_unmap( surface );
+        }
     }
+    glsurf->src = surface;
 }
 
 static void
@@ -1059,26 +1342,18 @@ glgfx_refresh_surface(struct surfman_plugin *plugin,
         return;
     }
 
-    glLoadIdentity();
-
     /* upload the surface which requires refresh into GPU */
-    upload_to_gpu( dst->src, dst, refresh_bitmap );
+    if (!upload_to_gpu( dst->src, dst, refresh_bitmap )) {
+        return;
+    }
 
-    /* then render all currently visible surfaces */
+    /* and composite if it is visible */
     for (i = 0; i < g_num_dispcfgs; ++i) {
-        surfman_display_t *d = &g_dispcfg[i];
-        xinemonitor_t *m = (xinemonitor_t*) d->monitor;
-        glgfx_surface *surf = (glgfx_surface*) d->psurface;
-
-        if (surf && surf == psurface && surf->initialised) {
-            /* translate onto monitor */
-            glLoadIdentity();
-            glTranslatef( m->xoff, m->yoff, 0 );
-            render_animated( dst, m->w, m->h );
+        if (g_dispcfg[i].psurface == psurface) {
+            schedule_composite();
+            break;
         }
     }
-    /* deus ex machina */
-    glXSwapBuffers( g_display, g_window );
 }
 
 
@@ -1123,7 +1398,9 @@ glgfx_free_psurface (surfman_plugin_t * plugin,
     info( "glgfx_free_psurface");
     if (surf) {
         free_surface_resources( surf );
-        surface_unmap( surf );
+        if (surf->mapped_fb) {
+            surface_unmap( surf->src );
+        }
         for (i = 0; i < g_num_surfaces; ++i) {
             if (g_surfaces[i] == surf) {
                 info ("removing surface at %d", i);
@@ -19,11 +19,22 @@
 #ifndef GLGFX_H
 #define GLGFX_H
 
+#define GLGFX_PBO_RING 3 /* uploads in flight before the CPU waits on the GPU */
+
+typedef struct glgfx_pbo_ {
+    GLuint id;
+    GLubyte *ptr; // persistent mapping, NULL if mapped for each upload
+    GLsync fence; // signalled once the GPU is done reading the last upload
+} glgfx_pbo;
+
 typedef struct glgfx_surface_ {
     int initialised;
     GLuint tex; // texture handle
-    GLuint pbo; // pbo handle
+    glgfx_pbo pbo[GLGFX_PBO_RING]; // staging buffers, used in turn
+    unsigned int pbo_next;
+    size_t pbo_size;
     GLuint w,h,stride,last_w,last_h;
+    int swizzle; // exchange red and blue when sampling
     GLubyte *mapped_fb;
     unsigned int mapped_fb_size;
     surfman_surface_t *src;
@@ -48,8 +48,12 @@
 # define DIV_ROUND_UP(x, y) (((x) + (y) - 1) / (y))
 #endif
 
+const surfman_version_t surfman_plugin_version = SURFMAN_API_VERSION;
+
 static int g_monitor = 1;
 static surfman_psurface_t g_fb_pages_taken = NULL;
+/* Clean lines allowed between coalesced dirty rectangles. */
+static unsigned int g_merge_gap = SURFMAN_DIRTY_MERGE_GAP;
 
 static struct
 {
@@ -155,7 +159,9 @@ static int fb_remap_host_fb(void)
 
 static void unmap_fb(fb_surface *s)
 {
-    surface_unmap(s->surfman_surface);
+    if (s->mapped_fb)
+        surface_unmap(s->surfman_surface);
+    s->mapped_fb = NULL;
 }
 
 static int map_fb(surfman_surface_t *src, fb_surface *dst)
@@ -176,6 +182,8 @@ static int map_fb(surfman_surface_t *src, fb_surface *dst)
 
 static int fb_init(surfman_plugin_t * p)
 {
+    g_merge_gap = rects_merge_gap("linuxfb");
+
     if (fb_read_info() != 0) {
         surfman_error("reading fb info failed");
         return SURFMAN_ERROR;
@@ -303,9 +311,12 @@ static void fb_update_psurface(surfman_plugin_t *plugin, surfman_psurface_t psur
             s->Bpp = 4;
     }
     if (flags & SURFMAN_UPDATE_PAGES) {
-        s->surfman_surface = surface;
-        unmap_fb(psurface);
+        /* New reference first, so an unchanged mapping is kept. */
+        void *old = s->mapped_fb;
+
         map_fb(surface, psurface);
+        if (old)
+            surface_unmap(surface);
     }
 }
 
@@ -320,92 +331,78 @@ static void fb_dump_refresh_bitmap(uint8_t *refresh_bitmap, unsigned int size)
    surfman_info("%s: %s", __func__, tmp);
 }
 
-/* Sick arithmetic ... Most variables are just aliases to make it "readable". */
-static void fb_copy_converted(fb_surface *surface, uint8_t *refresh_bitmap)
+/*
+ * Copy the lines of /rects/, or the whole surface if /rects/ is NULL.
+ * Surfman composites surfaces of another size than the monitor's
+ * (SURFMAN_FEATURE_MONITOR_SIZED), anything past the host framebuffer is
+ * only clipped in case that failed.
+ */
+static void fb_copy_converted(fb_surface *surface, const surfman_rect_t *rects, size_t n)
 {
     uint8_t *hfb = g_fb_info.map;                       /* host framebuffer. */
-    unsigned int hh = g_fb_info.y;                      /* height */
-    unsigned int hw = g_fb_info.x;                      /* width */
-    unsigned int hs = g_fb_info.maxBytesPerScanline;    /* stride */
-
+    unsigned int hs = g_fb_info.maxBytesPerScanline;    /* host stride */
     uint8_t *gfb = surface->mapped_fb;                  /* guest framebuffer. */
-    unsigned int gh = surface->height;                  /* height */
-    unsigned int gw = surface->width;                   /* width */
-    unsigned int gs = surface->stride;                  /* stride */
+    unsigned int gs = surface->stride;                  /* guest stride */
+    unsigned int h = MIN(surface->height, g_fb_info.y);
+    unsigned int len = MIN(surface->width, g_fb_info.x) * g_fb_info.Bpp;
+    size_t i;
+
+    if (!rects) {
+        blit_rect(hfb, hs, gfb, gs, len, h);
+        return;
+    }
 
-    unsigned int bpp = g_fb_info.Bpp;                   /* Bits per pixel (x offset calculation),
-                                                           we safelly assume this is consistent between both surfaces. */
-    unsigned int vs = hs < gs ? hs : gs;                /* Smallest stride. */
+    /* Turns out it's better for perfs to refresh whole lines instead of the exact dirty
+     * columns, so only the lines of each dirty rectangle matter here. */
+    for (i = 0; i < n; ++i) {
+        unsigned int y = rects[i].y;
+        unsigned int lines = rects[i].h;
+
+        if (y >= h)
+            continue;
+        if (lines > h - y)
+            lines = h - y;
+        blit_rect(hfb + y * hs, hs, gfb + y * gs, gs, len, lines);
+    }
+}
 
-    /* host and guest offset to apply surfaces on each other croping/centering the right one (because it's beeeaaauuuutiful) */
-    /* hy = gy - dgy + dhy ; gy = hy - dhy + dhy */
-    unsigned int dhx = (hw < gw) ? 0 : (hw - gw) / 2;
-    unsigned int dhy = (hh < gh) ? 0 : (hh - gh) / 2;
-    unsigned int dgx = (hw > gw) ? 0 : (gw - hw) / 2;
-    unsigned int dgy = (hh > gh) ? 0 : (gh - hh) / 2;
+static void fb_refresh_surface(struct surfman_plugin *plugin, surfman_psurface_t psurface, uint8_t *refresh_bitmap)
+{
+    fb_surface *ps = psurface;
+    surfman_rect_t rects[SURFMAN_DIRTY_RECTS_MAX];
+    unsigned int n;
 
-    unsigned int hy, gy;                                /* host/guest fb longitudinal axis iterators. */
+    assert(psurface != NULL);   /* NOTE: This would be a surfman bug I guess, so bailing out the whole thing is safer. */
 
+    if (g_fb_info.fb_need_cleanning)
+    {
+        fb_clean_hostfb();
+        g_fb_info.fb_need_cleanning = 0;
+        refresh_bitmap = NULL;
+    }
     if (!refresh_bitmap) {
-        for (hy = dhy, gy = dgy; (hy < hh) && (gy < gh); ++hy, ++gy) {
-            memcpy(hfb + (hy * hs) + (dhx * bpp), gfb + (gy * gs) + (dgx * bpp), vs);
-        }
-    } else {
-        unsigned int n = DIV_ROUND_UP(gh * gs, XC_PAGE_SIZE); /* How many pages in our bitmap ? */
-        unsigned int i = 0;                                   /* Page iterator. */
-        unsigned int gy_end = dgy;                            /* y coordinate where the page ends (initialy the first line). */
-        unsigned int pgy_end;                                 /* previous gy_end. */
-
-        do {
-            if (!refresh_bitmap[i / 8]) {
-                i += 8;
-                continue;
-            }
-
-            do {
-                if (refresh_bitmap[i / 8] & (1 << (i % 8))) {
-                    /* Turns out it's better for perfs to refresh the whole line instead of search the
-                     * exact correct position of the dirty page in the framebuffer. Or I missed something ...
-                     * Anyway, it'll be bad so ... */
-                    gy = (i * XC_PAGE_SIZE) / gs;                       /* guest y coordinate from page number. */
-                    if (gy >= (gh - dgy)) {
-                        return;                                         /* we're already out of visible part, bail out. */
-                    }
-                    pgy_end = gy_end;
-                    gy_end = ((i + 1) * XC_PAGE_SIZE) / gs;
-                    if (gy_end < dgy) {
-                        return;                                         /* we're already out of visible part, bail out. */
-                    }
-
-                    if (gy_end > pgy_end) {
-                        for (gy = pgy_end + 1; (gy <= gy_end) && (gy < gh); ++gy) {
-                            hy = gy - dgy + dhy;                        /* host y coordinate relative to previous gy. */
-                            memcpy(hfb + (hy * hs) + dhx * bpp,
-                                   gfb + (gy * gs) + dgx * bpp, vs);
-                        }
-                    }
-                }
-                ++i;
-            } while ((i % 8) && (i < n));
-        } while (i < n);
+        fb_copy_converted(ps, NULL, 0);
+        return;
     }
+    n = rects_from_dirty_bitmap(refresh_bitmap, ps->width, ps->height, ps->stride,
+                                ps->surfman_surface->format, g_merge_gap, rects, SURFMAN_DIRTY_RECTS_MAX);
+    fb_copy_converted(ps, rects, n);
 }
 
-static void fb_refresh_surface(struct surfman_plugin *plugin, surfman_psurface_t psurface, uint8_t *refresh_bitmap)
+static void fb_refresh_surface_rects(struct surfman_plugin *plugin, surfman_psurface_t psurface,
+                                     const surfman_rect_t *rects, size_t count)
 {
     fb_surface *ps = psurface;
-    uint32_t size = DIV_ROUND_UP(ps->stride * ps->height, XC_PAGE_SIZE);
-    unsigned int n = 0, i = 0;
 
-    assert(psurface != NULL);   /* NOTE: This would be a surfman bug I guess, so bailing out the whole thing is safer. */
+    assert(psurface != NULL);
 
     if (g_fb_info.fb_need_cleanning)
     {
         fb_clean_hostfb();
         g_fb_info.fb_need_cleanning = 0;
-        refresh_bitmap = NULL;
+        rects = NULL;
     }
-    fb_copy_converted(ps, refresh_bitmap);
+    fb_copy_converted(ps, rects, count);
 }
 
 
@@ -453,6 +450,8 @@ surfman_plugin_t surfman_plugin = {
     .copy_surface_on_psurface = fb_copy_surface_on_psurface,
     .copy_psurface_on_surface = fb_copy_psurface_on_surface,
     .free_psurface = fb_free_psurface,
-    .options = {1, SURFMAN_FEATURE_NEED_REFRESH},
+    .refresh_psurface_rects = fb_refresh_surface_rects,
+    .options = {1, SURFMAN_FEATURE_NEED_REFRESH | SURFMAN_FEATURE_REFRESH_RECTS |
+                   SURFMAN_FEATURE_MONITOR_SIZED},
     .notify = SURFMAN_NOTIFY_NONE
 };
@@ -48,7 +48,8 @@
 #define OPTION_FILE "/var/cache/xorg-vesa-lfb"
 
 static int g_monitor = 1;
-static xc_interface *g_xc = NULL;
+/* Clean lines allowed between coalesced dirty rectangles. */
+static unsigned int g_merge_gap = SURFMAN_DIRTY_MERGE_GAP;
 static surfman_psurface_t g_vesa_pages_taken = NULL;
 
 static struct
@@ -143,69 +144,35 @@ vesa_remap_host_fb(void)
     return err;
 }
 
-static void
-unmap_surfman_surface(uint8_t *mapped, surfman_surface_t *src)
-{
-    if ( munmap(mapped, src->page_count * XC_PAGE_SIZE) < 0 ) {
-        error("failed to unmap framebuffer pages");
-    }
-}
-
 void
 unmap_fb( vesa_surface *dst)
 {
     if (dst->mapped_fb)
     {
-        unmap_surfman_surface(dst->mapped_fb, dst->src);
+        surface_unmap(dst->src);
         dst->mapped_fb = NULL;
     }
     dst->mapped_fb_size = 0;
 }
 
-static uint8_t*
-map_surfman_surface(surfman_surface_t *src, int caching)
-{
-    xen_pfn_t *fns = NULL;
-    uint8_t *mapped = NULL;
-    unsigned int i = 0;
-
-    fns = malloc( src->page_count*sizeof(xen_pfn_t) );
-    if (!fns) {
-        error("failed to malloc mfns");
-        goto out;
-    }
-    for (i = 0; i < src->page_count; ++i) {
-        if (src->guest_base_addr)
-            fns[i] = (xen_pfn_t)((src->guest_base_addr >> XC_PAGE_SHIFT) + i);
-        else
-            fns[i] = (xen_pfn_t) src->mfns[i];
-    }
-    if (src->guest_base_addr) {
-        mapped = xc_map_foreign_batch_cacheattr(
-                g_xc, src->pages_domid,
-                PROT_READ | PROT_WRITE,
-                fns, src->page_count,
-                caching);
-    } else {
-        mapped = xc_map_foreign_pages( g_xc, src->pages_domid, PROT_READ | PROT_WRITE, fns, src->page_count );
-    }
-out:
-    if (fns) {
-        free(fns);
-    }
-    return mapped;
-}
-
 static int
 map_fb( surfman_surface_t *src, vesa_surface *dst )
 {
-    unmap_fb(dst);
-    if (!xc_domid_exists(dst->src->pages_domid))
+    uint8_t *old = dst->mapped_fb;
+
+    if (!xc_domid_exists(dst->src->pages_domid)) {
+        unmap_fb(dst);
         return -1;
+    }
 
-    dst->mapped_fb = map_surfman_surface(src, XEN_DOMCTL_MEM_CACHEATTR_WC);
+    /* New reference first, so an unchanged mapping is kept. */
+    dst->mapped_fb = surface_map(src);
+    if (old) {
+        surface_unmap(src);
+    }
     if ( !dst->mapped_fb ) {
-        error("failed to map framebuffer pages (WC)");
+        error("failed to map framebuffer pages");
+        dst->mapped_fb_size = 0;
         return -1;
     }
     dst->mapped_fb_size = src->page_count * XC_PAGE_SIZE;
@@ -260,12 +227,7 @@ vesa_init (surfman_plugin_t * p)
     unsigned int i=0;
     info( "vesa_init");
 
-    g_xc = xc_interface_open(NULL, NULL, 0);
-    if (!g_xc) {
-        error("failed to open XC interface");
-        return SURFMAN_ERROR;
-    }
-
+    g_merge_gap = rects_merge_gap("vesa");
     pci_system_init();
 
     rv = start_X();
@@ -312,8 +274,6 @@ vesa_shutdown (surfman_plugin_t * p)
 {
     int rv;
     info("shutting down");
-    xc_interface_close(g_xc);
-    g_xc = NULL;
 }
 
 static void
@@ -431,7 +391,6 @@ vesa_update_psurface (surfman_plugin_t *plugin,
     }
     if (flags & SURFMAN_UPDATE_PAGES)
     {
-        unmap_fb( psurface);
         map_fb( surface, psurface);
     }
 }
@@ -448,49 +407,14 @@ vesa_dump_refresh_bitmap(uint8_t *refresh_bitmap, unsigned int size)
     info("%s: %s", __func__, tmp);
 }
 
-static void
-vesa_copy_converted(vesa_surface *surf,
-                    uint8_t *refresh_bitmap)
-{
-    uint8_t *vesa_fb;
-    uint8_t *guest_fb = surf->mapped_fb;
-    unsigned int i;
-    uint32_t size = surf->src->stride * surf->src->height;
-
-    vesa_fb = g_vesa_info.map +
-        ((g_vesa_info.y - (surf->src->height)) / 2) * g_vesa_info.maxBytesPerScanline +
-        ((g_vesa_info.x - (surf->src->width)) / 2) * 4;
-    if (refresh_bitmap == NULL)
-    {
-        for (i = 0; i < surf->src->height; i++)
-        {
-            memcpy(vesa_fb, guest_fb, surf->src->width * 4);
-            vesa_fb += g_vesa_info.maxBytesPerScanline;
-            guest_fb += surf->src->stride;
-        }
-    }
-    else
-    {
-        for (i = 0; i < surf->src->height; i++)
-        {
-            unsigned int p = i * surf->src->stride / XC_PAGE_SIZE;
-            if (refresh_bitmap[p / 8] & (1 << (p % 8)))
-            {
-                memcpy(vesa_fb + i * g_vesa_info.maxBytesPerScanline,
-                        guest_fb + i * surf->src->stride, surf->src->width * 4);
-            }
-        }
-    }
-}
-
 static void
 vesa_refresh_surface(struct surfman_plugin *plugin,
                       surfman_psurface_t psurface,
                       uint8_t *refresh_bitmap)
 {
     vesa_surface *dst = (vesa_surface*) psurface;
-    uint32_t size = dst->src->stride * dst->src->height;
-    unsigned int i = 0;
+    surfman_rect_t rects[SURFMAN_DIRTY_RECTS_MAX];
+    unsigned int i, n, h, len, pitch;
 
     if (g_vesa_info.fb_need_cleanning)
     {
@@ -503,22 +427,34 @@ vesa_refresh_surface(struct surfman_plugin *plugin,
         return;
     }
 
-    /* Check is resolution mismatch */
-    if (dst->src->width != g_vesa_info.x ||
-            dst->src->height != g_vesa_info.y)
+    /*
+     * Surfman composites surfaces of another size than the monitor's
+     * (SURFMAN_FEATURE_MONITOR_SIZED), anything past the VESA framebuffer
+     * is only clipped in case that failed. Whole lines are copied, which is
+     * one contiguous copy when both pitches match.
+     */
+    h = MIN(dst->src->height, g_vesa_info.y);
+    len = MIN(dst->src->width, g_vesa_info.x) * 4;
+    pitch = g_vesa_info.maxBytesPerScanline;
+
+    n = rects_from_dirty_bitmap(refresh_bitmap, dst->src->width, dst->src->height,
+                                dst->src->stride, dst->src->format,
+                                g_merge_gap, rects, SURFMAN_DIRTY_RECTS_MAX);
+    for (i = 0; i < n; i++)
     {
-        vesa_copy_converted(dst, refresh_bitmap);
-        return;
-    }
-
-    for (i = 0; i < ((size / XC_PAGE_SIZE) + 1); i++)
-    {
-        if (refresh_bitmap == NULL || refresh_bitmap[i / 8] & (1 << (i % 8)))
-            memcpy(g_vesa_info.map + i * XC_PAGE_SIZE, dst->mapped_fb + i * XC_PAGE_SIZE, XC_PAGE_SIZE);
+        unsigned int y = rects[i].y;
+        unsigned int lines = rects[i].h;
+
+        if (y >= h)
+            continue;
+        if (lines > h - y)
+            lines = h - y;
+        blit_rect(g_vesa_info.map + y * pitch, pitch,
+                  dst->mapped_fb + y * dst->src->stride, dst->src->stride,
+                  len, lines);
     }
 }
 
-
 static int
 vesa_get_pages_from_psurface (surfman_plugin_t * p,
                                surfman_psurface_t psurface,
@@ -568,7 +504,7 @@ vesa_timed_copy(uint8_t *dst, uint8_t *src, unsigned int size)
     struct timeval tv1, tv2, tv_res;
 
     gettimeofday(&tv1, NULL);
-    memcpy(dst, src, size);
+    blit_copy(dst, src, size);
     gettimeofday(&tv2, NULL);
     timersub(&tv2, &tv1, &tv_res);
     print_transfert_rate(&tv_res, size);
@@ -638,6 +574,6 @@ surfman_plugin_t surfman_plugin = {
     .copy_surface_on_psurface = vesa_copy_surface_on_psurface,
     .copy_psurface_on_surface = vesa_copy_psurface_on_surface,
     .free_psurface = vesa_free_psurface,
-    .options = {64, SURFMAN_FEATURE_NEED_REFRESH},
+    .options = {64, SURFMAN_FEATURE_NEED_REFRESH | SURFMAN_FEATURE_MONITOR_SIZED},
     .notify = SURFMAN_NOTIFY_NONE
 };
@@ -0,0 +1,595 @@
+/*
+ * Copyright (c) 2014 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "project.h"
+
+/*
+ * Rectangle encoders: Raw, Zlib, ZRLE and Tight (fill, basic and JPEG).
+ *
+ * Surfaces are 32bpp BGRX, which is the pixel format announced in
+ * ServerInit (little-endian, red-shift 16), so Raw and Zlib send the guest
+ * pixels as they are. ZRLE CPIXELs are the three low bytes of a pixel and
+ * Tight TPIXELs are R, G, B.
+ *
+ * Encoders append to client->out. Raw pixels are queued from the
+ * framebuffer itself, see sendq.c.
+ */
+
+static const int jpeg_quality_levels[10] = {
+    15, 29, 41, 42, 62, 77, 79, 86, 92, 100
+};
+
+uint8_t *
+vnc_buf_put (struct vnc_buf *b, size_t len)
+{
+    uint8_t *p;
+
+    if (b->len + len > b->size)
+    {
+        size_t size = b->size ? b->size : 4096;
+
+        while (size < b->len + len)
+            size *= 2;
+        b->data = realloc(b->data, size);
+        b->size = size;
+    }
+    p = b->data + b->len;
+    b->len += len;
+
+    return p;
+}
+
+void
+vnc_buf_u8 (struct vnc_buf *b, uint8_t v)
+{
+    *vnc_buf_put(b, 1) = v;
+}
+
+void
+vnc_buf_u16 (struct vnc_buf *b, uint16_t v)
+{
+    uint8_t *p = vnc_buf_put(b, 2);
+
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+void
+vnc_buf_u32 (struct vnc_buf *b, uint32_t v)
+{
+    uint8_t *p = vnc_buf_put(b, 4);
+
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+void
+vnc_buf_release (struct vnc_buf *b)
+{
+    free(b->data);
+    b->data = NULL;
+    b->len = b->size = 0;
+}
+
+/* Hand the encoded data over to the send queue. */
+void
+vnc_encode_flush (struct vnc_client *c)
+{
+    if (!c->out.len)
+        return;
+    vnc_sendq_push(&c->sendq, c->out.data, c->out.len);
+    c->out.data = NULL;
+    c->out.len = c->out.size = 0;
+}
+
+static void
+vnc_rect_header (struct vnc_buf *b, unsigned int x, unsigned int y,
+                 unsigned int w, unsigned int h, int32_t encoding)
+{
+    vnc_buf_u16(b, x);
+    vnc_buf_u16(b, y);
+    vnc_buf_u16(b, w);
+    vnc_buf_u16(b, h);
+    vnc_buf_u32(b, (uint32_t) encoding);
+}
+
+/* Compress /len/ bytes of /in/ at the end of /out/. */
+static int
+vnc_deflate (z_stream *z, struct vnc_buf *out, const uint8_t *in, size_t len,
+             int flush)
+{
+    int rc;
+
+    z->next_in = (Bytef *) in;
+    z->avail_in = len;
+    do
+    {
+        size_t room = deflateBound(z, z->avail_in) + 64;
+
+        vnc_buf_put(out, room);
+        out->len -= room;
+        z->next_out = out->data + out->len;
+        z->avail_out = room;
+
+        rc = deflate(z, flush);
+        out->len += room - z->avail_out;
+        if (rc != Z_OK && rc != Z_BUF_ERROR)
+        {
+            error("vnc: deflate failed (%d)", rc);
+            return -1;
+        }
+    } while (z->avail_in || !z->avail_out);
+
+    return 0;
+}
+
+static z_stream *
+vnc_zstream (struct vnc_client *c, z_stream *z, int which)
+{
+    if (c->zstreams & which)
+        return z;
+
+    memset(z, 0, sizeof (*z));
+    if (deflateInit(z, c->compress_level) != Z_OK)
+    {
+        error("vnc: deflateInit failed");
+        return NULL;
+    }
+    c->zstreams |= which;
+
+    return z;
+}
+
+void
+vnc_encode_release (struct vnc_client *c)
+{
+    if (c->zstreams & VNC_ZSTREAM_ZLIB)
+        deflateEnd(&c->zlib);
+    if (c->zstreams & VNC_ZSTREAM_ZRLE)
+        deflateEnd(&c->zrle);
+    if (c->zstreams & VNC_ZSTREAM_TIGHT)
+        deflateEnd(&c->tight);
+    c->zstreams = 0;
+
+    if (c->jpeg_init)
+        jpeg_destroy_compress(&c->jpeg);
+    c->jpeg_init = 0;
+
+    vnc_buf_release(&c->out);
+    vnc_buf_release(&c->scratch);
+}
+
+/*
+ * Raw.
+ */
+static void
+vnc_encode_raw (struct vnc_client *c, const uint8_t *fb, size_t stride,
+                const surfman_rect_t *r)
+{
+    vnc_rect_header(&c->out, r->x, r->y, r->w, r->h, VNC_ENCODING_RAW);
+    vnc_encode_flush(c);
+    vnc_sendq_push_lines(&c->sendq, fb + r->y * stride + r->x * 4,
+                         r->w * 4, stride, r->h);
+}
+
+/*
+ * Zlib: the Raw pixels through the client's zlib stream.
+ */
+static int
+vnc_encode_zlib (struct vnc_client *c, const uint8_t *fb, size_t stride,
+                 const surfman_rect_t *r)
+{
+    z_stream *z = vnc_zstream(c, &c->zlib, VNC_ZSTREAM_ZLIB);
+    size_t start, len;
+    unsigned int y;
+
+    if (!z)
+        return -1;
+
+    vnc_rect_header(&c->out, r->x, r->y, r->w, r->h, VNC_ENCODING_ZLIB);
+    vnc_buf_u32(&c->out, 0);
+    start = c->out.len;
+
+    for (y = 0; y < r->h; y++)
+        if (vnc_deflate(z, &c->out, fb + (r->y + y) * stride + r->x * 4,
+                        r->w * 4, y == r->h - 1 ? Z_SYNC_FLUSH : Z_NO_FLUSH))
+            return -1;
+
+    len = c->out.len - start;
+    c->out.len = start - 4;
+    vnc_buf_u32(&c->out, len);
+    c->out.len = start + len;
+
+    return 0;
+}
+
+/*
+ * ZRLE: 64x64 tiles of solid, packed palette or raw CPIXELs, through the
+ * client's ZRLE zlib stream.
+ */
+static void
+vnc_zrle_tile (struct vnc_buf *b, const uint8_t *p, size_t stride,
+               unsigned int w, unsigned int h)
+{
+    uint32_t palette[16];
+    unsigned int n = 0, x, y, i, bits;
+    const uint32_t *row;
+
+    for (y = 0; y < h; y++)
+    {
+        row = (const uint32_t *) (p + y * stride);
+        for (x = 0; x < w; x++)
+        {
+            uint32_t px = row[x] & 0xffffff;
+
+            for (i = 0; i < n && palette[i] != px; i++)
+                ;
+            if (i < n)
+                continue;
+            if (n == 16)
+                goto raw;
+            palette[n++] = px;
+        }
+    }
+
+    if (n == 1)
+    {
+        vnc_buf_u8(b, 1);
+        memcpy(vnc_buf_put(b, 3), p, 3);
+        return;
+    }
+
+    vnc_buf_u8(b, n);
+    for (i = 0; i < n; i++)
+    {
+        uint8_t *cp = vnc_buf_put(b, 3);
+
+        cp[0] = palette[i];
+        cp[1] = palette[i] >> 8;
+        cp[2] = palette[i] >> 16;
+    }
+
+    bits = n <= 2 ? 1 : n <= 4 ? 2 : 4;
+    for (y = 0; y < h; y++)
+    {
+        uint8_t acc = 0;
+        unsigned int used = 0;
+
+        row = (const uint32_t *) (p + y * stride);
+        for (x = 0; x < w; x++)
+        {
+            uint32_t px = row[x] & 0xffffff;
+
+            for (i = 0; palette[i] != px; i++)
+                ;
+            acc |= i << (8 - bits - used);
+            used += bits;
+            if (used == 8)
+            {
+                vnc_buf_u8(b, acc);
+                acc = 0;
+                used = 0;
+            }
+        }
+        if (used)
+            vnc_buf_u8(b, acc);
+    }
+    return;
+
+raw:
+    vnc_buf_u8(b, 0);
+    for (y = 0; y < h; y++)
+    {
+        uint8_t *cp = vnc_buf_put(b, w * 3);
+
+        row = (const uint32_t *) (p + y * stride);
+        for (x = 0; x < w; x++)
+        {
+            *cp++ = row[x];
+            *cp++ = row[x] >> 8;
+            *cp++ = row[x] >> 16;
+        }
+    }
+}
+
+static int
+vnc_encode_zrle (struct vnc_client *c, const uint8_t *fb, size_t stride,
+                 const surfman_rect_t *r)
+{
+    z_stream *z = vnc_zstream(c, &c->zrle, VNC_ZSTREAM_ZRLE);
+    unsigned int tx, ty, tw, th;
+    size_t start, len;
+
+    if (!z)
+        return -1;
+
+    c->scratch.len = 0;
+    for (ty = 0; ty < r->h; ty += VNC_TILE)
+        for (tx = 0; tx < r->w; tx += VNC_TILE)
+        {
+            tw = r->w - tx < VNC_TILE ? r->w - tx : VNC_TILE;
+            th = r->h - ty < VNC_TILE ? r->h - ty : VNC_TILE;
+            vnc_zrle_tile(&c->scratch,
+                          fb + (r->y + ty) * stride + (r->x + tx) * 4,
+                          stride, tw, th);
+        }
+
+    vnc_rect_header(&c->out, r->x, r->y, r->w, r->h, VNC_ENCODING_ZRLE);
+    vnc_buf_u32(&c->out, 0);
+    start = c->out.len;
+    if (vnc_deflate(z, &c->out, c->scratch.data, c->scratch.len, Z_SYNC_FLUSH))
+        return -1;
+
+    len = c->out.len - start;
+    c->out.len = start - 4;
+    vnc_buf_u32(&c->out, len);
+    c->out.len = start + len;
+
+    return 0;
+}
+
+/*
+ * Tight.
+ */
+static void
+vnc_tight_length (struct vnc_buf *b, size_t len)
+{
+    vnc_buf_u8(b, (len & 0x7f) | (len > 0x7f ? 0x80 : 0));
+    if (len > 0x7f)
+    {
+        vnc_buf_u8(b, ((len >> 7) & 0x7f) | (len > 0x3fff ? 0x80 : 0));
+        if (len > 0x3fff)
+            vnc_buf_u8(b, len >> 14);
+    }
+}
+
+static int
+vnc_rect_solid (const uint8_t *p, size_t stride, unsigned int w, unsigned int h)
+{
+    uint32_t px = *(const uint32_t *) p & 0xffffff;
+    const uint32_t *row;
+    unsigned int x, y;
+
+    for (y = 0; y < h; y++)
+    {
+        row = (const uint32_t *) (p + y * stride);
+        for (x = 0; x < w; x++)
+            if ((row[x] & 0xffffff) != px)
+                return 0;
+    }
+
+    return 1;
+}
+
+static void
+vnc_jpeg_error_exit (j_common_ptr cinfo)
+{
+    struct vnc_client *c = cinfo->client_data;
+
+    longjmp(c->jpeg_jmp, 1);
+}
+
+/*
+ * Compress a rectangle to JPEG, in memory malloc()ed by libjpeg.
+ * Return 0 on success.
+ */
+static int
+vnc_tight_jpeg (struct vnc_client *c, const uint8_t *p, size_t stride,
+                unsigned int w, unsigned int h,
+                unsigned char **data, unsigned long *len)
+{
+    struct jpeg_compress_struct *j = &c->jpeg;
+    JSAMPROW row;
+    unsigned int x;
+
+    if (!c->jpeg_init)
+    {
+        j->err = jpeg_std_error(&c->jpeg_err);
+        c->jpeg_err.error_exit = vnc_jpeg_error_exit;
+        j->client_data = c;
+        jpeg_create_compress(j);
+        c->jpeg_init = 1;
+    }
+
+    *data = NULL;
+    *len = 0;
+    if (setjmp(c->jpeg_jmp))
+    {
+        jpeg_abort_compress(j);
+        free(*data);
+        *data = NULL;
+        return -1;
+    }
+
+    jpeg_mem_dest(j, data, len);
+    j->image_width = w;
+    j->image_height = h;
+#ifdef JCS_EXTENSIONS
+    j->input_components = 4;
+    j->in_color_space = JCS_EXT_BGRX;
+#else
+    j->input_components = 3;
+    j->in_color_space = JCS_RGB;
+#endif
+    jpeg_set_defaults(j);
+    jpeg_set_quality(j, jpeg_quality_levels[c->jpeg_quality], TRUE);
+    jpeg_start_compress(j, TRUE);
+
+    while (j->next_scanline < h)
+    {
+        const uint8_t *src = p + j->next_scanline * stride;
+
+#ifdef JCS_EXTENSIONS
+        row = (JSAMPROW) src;
+#else
+        uint8_t *dst;
+
+        c->scratch.len = 0;
+        row = dst = vnc_buf_put(&c->scratch, w * 3);
+        for (x = 0; x < w; x++, src += 4)
+        {
+            *dst++ = src[2];
+            *dst++ = src[1];
+            *dst++ = src[0];
+        }
+#endif
+        jpeg_write_scanlines(j, &row, 1);
+    }
+    jpeg_finish_compress(j);
+    (void) x;
+
+    return 0;
+}
+
+static int
+vnc_encode_tight_one (struct vnc_client *c, const uint8_t *fb, size_t stride,
+                      unsigned int rx, unsigned int ry,
+                      unsigned int w, unsigned int h)
+{
+    const uint8_t *p = fb + ry * stride + rx * 4;
+    z_stream *z;
+    unsigned char *jpeg;
+    unsigned long jpeg_len;
+    unsigned int x, y;
+    size_t start, len;
+    uint8_t *dst;
+
+    vnc_rect_header(&c->out, rx, ry, w, h, VNC_ENCODING_TIGHT);
+
+    if (vnc_rect_solid(p, stride, w, h))
+    {
+        dst = vnc_buf_put(&c->out, 4);
+        dst[0] = 0x80;          /* FillCompression */
+        dst[1] = p[2];
+        dst[2] = p[1];
+        dst[3] = p[0];
+        return 0;
+    }
+
+    if (c->jpeg_quality >= 0 && w * h >= VNC_TIGHT_JPEG_MIN_PIXELS &&
+        !vnc_tight_jpeg(c, p, stride, w, h, &jpeg, &jpeg_len))
+    {
+        vnc_buf_u8(&c->out, 0x90); /* JpegCompression */
+        vnc_tight_length(&c->out, jpeg_len);
+        memcpy(vnc_buf_put(&c->out, jpeg_len), jpeg, jpeg_len);
+        free(jpeg);
+        return 0;
+    }
+
+    /* BasicCompression, stream 0, no filter. */
+    c->scratch.len = 0;
+    for (y = 0; y < h; y++)
+    {
+        const uint8_t *src = p + y * stride;
+
+        dst = vnc_buf_put(&c->scratch, w * 3);
+        for (x = 0; x < w; x++, src += 4)
+        {
+            *dst++ = src[2];
+            *dst++ = src[1];
+            *dst++ = src[0];
+        }
+    }
+
+    vnc_buf_u8(&c->out, 0x00);
+    if (c->scratch.len < 12)
+    {
+        memcpy(vnc_buf_put(&c->out, c->scratch.len), c->scratch.data,
+               c->scratch.len);
+        return 0;
+    }
+
+    z = vnc_zstream(c, &c->tight, VNC_ZSTREAM_TIGHT);
+    if (!z)
+        return -1;
+
+    /* Leave room for the longest compact length, then close the gap. */
+    vnc_buf_put(&c->out, 3);
+    start = c->out.len;
+    if (vnc_deflate(z, &c->out, c->scratch.data, c->scratch.len, Z_SYNC_FLUSH))
+        return -1;
+    len = c->out.len - start;
+
+    c->out.len = start - 3;
+    vnc_tight_length(&c->out, len);
+    memmove(c->out.data + c->out.len, c->out.data + start, len);
+    c->out.len += len;
+
+    return 0;
+}
+
+static unsigned int
+vnc_tight_rows (unsigned int w)
+{
+    unsigned int rows = VNC_TIGHT_MAX_PIXELS / w;
+
+    return rows ? rows : 1;
+}
+
+/*
+ * Number of rectangles vnc_encode_rect() sends for /r/.
+ */
+unsigned int
+vnc_encode_count (const struct vnc_client *c, const surfman_rect_t *r)
+{
+    unsigned int cols, w, rows;
+
+    if (c->encoding != VNC_ENCODING_TIGHT)
+        return 1;
+
+    cols = (r->w + VNC_TIGHT_MAX_WIDTH - 1) / VNC_TIGHT_MAX_WIDTH;
+    w = r->w < VNC_TIGHT_MAX_WIDTH ? r->w : VNC_TIGHT_MAX_WIDTH;
+    rows = vnc_tight_rows(w);
+
+    return cols * ((r->h + rows - 1) / rows);
+}
+
+/*
+ * Encode /r/ of a framebuffer with the encoding negotiated by the client.
+ */
+int
+vnc_encode_rect (struct vnc_client *c, const uint8_t *fb, size_t stride,
+                 const surfman_rect_t *r)
+{
+    unsigned int x, y, w, h, rows;
+
+    switch (c->encoding)
+    {
+    case VNC_ENCODING_ZLIB:
+        return vnc_encode_zlib(c, fb, stride, r);
+    case VNC_ENCODING_ZRLE:
+        return vnc_encode_zrle(c, fb, stride, r);
+    case VNC_ENCODING_TIGHT:
+        w = r->w < VNC_TIGHT_MAX_WIDTH ? r->w : VNC_TIGHT_MAX_WIDTH;
+        rows = vnc_tight_rows(w);
+        for (y = 0; y < r->h; y += rows)
+            for (x = 0; x < r->w; x += VNC_TIGHT_MAX_WIDTH)
+            {
+                w = r->w - x < VNC_TIGHT_MAX_WIDTH ? r->w - x : VNC_TIGHT_MAX_WIDTH;
+                h = r->h - y < rows ? r->h - y : rows;
+                if (vnc_encode_tight_one(c, fb, stride, r->x + x, r->y + y, w, h))
+                    return -1;
+            }
+        return 0;
+    default:
+        vnc_encode_raw(c, fb, stride, r);
+        return 0;
+    }
+}
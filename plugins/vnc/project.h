@@ -99,7 +99,12 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <sys/un.h>
+#include <sys/uio.h>
 #include <linux/input.h>
+#include <setjmp.h>
+
+#include <zlib.h>
+#include <jpeglib.h>
 
 #ifdef HAVE_XENCTRL_H
 # include <xenctrl.h>
@@ -109,6 +114,7 @@
 
 #include <event.h>
 
+#include "vnc.h"
 #include "prototypes.h"
 
 #endif /* __PROJECT_H__ */
@@ -17,4 +17,21 @@
  */
 
 /* vnc.c */
-surfman_plugin_t surfman_plugin;
+extern surfman_plugin_t surfman_plugin;
+/* encoding.c */
+extern uint8_t *vnc_buf_put(struct vnc_buf *b, size_t len);
+extern void vnc_buf_u8(struct vnc_buf *b, uint8_t v);
+extern void vnc_buf_u16(struct vnc_buf *b, uint16_t v);
+extern void vnc_buf_u32(struct vnc_buf *b, uint32_t v);
+extern void vnc_buf_release(struct vnc_buf *b);
+extern void vnc_encode_flush(struct vnc_client *c);
+extern void vnc_encode_release(struct vnc_client *c);
+extern unsigned int vnc_encode_count(const struct vnc_client *c, const surfman_rect_t *r);
+extern int vnc_encode_rect(struct vnc_client *c, const uint8_t *fb, size_t stride, const surfman_rect_t *r);
+/* sendq.c */
+extern void vnc_sendq_init(struct vnc_sendq *q);
+extern void vnc_sendq_push(struct vnc_sendq *q, uint8_t *buf, size_t len);
+extern void vnc_sendq_push_lines(struct vnc_sendq *q, const uint8_t *data, size_t len, size_t pitch, unsigned int lines);
+extern int vnc_sendq_flush(struct vnc_sendq *q, int fd);
+extern void vnc_sendq_detach(struct vnc_sendq *q, const uint8_t *base, size_t size);
+extern void vnc_sendq_release(struct vnc_sendq *q);
@@ -0,0 +1,210 @@
+/*
+ * Copyright (c) 2014 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "project.h"
+
+/*
+ * Per-client send queue.
+ *
+ * Encoded data is queued as chunks and written with gathered, non-blocking
+ * sendmsg() calls. Raw pixels are not copied: their chunks point in the
+ * guest framebuffer, one iovec per line. Before that mapping goes away,
+ * vnc_sendq_detach() copies whatever is still queued from it.
+ */
+
+void
+vnc_sendq_init (struct vnc_sendq *q)
+{
+    q->head = NULL;
+    q->tail = &q->head;
+    q->bytes = 0;
+}
+
+static void
+vnc_chunk_free (struct vnc_chunk *c)
+{
+    free(c->buf);
+    free(c);
+}
+
+static void
+vnc_sendq_append (struct vnc_sendq *q, struct vnc_chunk *c)
+{
+    c->next = NULL;
+    c->off = 0;
+    *q->tail = c;
+    q->tail = &c->next;
+    q->bytes += c->len * c->lines;
+}
+
+/* Queue /len/ bytes of /buf/, which was malloc()ed and now belongs to the queue. */
+void
+vnc_sendq_push (struct vnc_sendq *q, uint8_t *buf, size_t len)
+{
+    struct vnc_chunk *c;
+
+    if (!len)
+    {
+        free(buf);
+        return;
+    }
+
+    c = calloc(1, sizeof (*c));
+    c->data = c->buf = buf;
+    c->len = len;
+    c->lines = 1;
+    vnc_sendq_append(q, c);
+}
+
+/* Queue /lines/ lines of /len/ bytes, /pitch/ bytes apart, without copying them. */
+void
+vnc_sendq_push_lines (struct vnc_sendq *q, const uint8_t *data, size_t len,
+                      size_t pitch, unsigned int lines)
+{
+    struct vnc_chunk *c;
+
+    if (!len || !lines)
+        return;
+
+    c = calloc(1, sizeof (*c));
+    c->data = data;
+    c->len = len;
+    c->pitch = pitch;
+    c->lines = lines;
+    vnc_sendq_append(q, c);
+}
+
+/* Account for /n/ bytes written. */
+static void
+vnc_sendq_consume (struct vnc_sendq *q, size_t n)
+{
+    struct vnc_chunk *c;
+    size_t left;
+
+    q->bytes -= n;
+    while (n && (c = q->head))
+    {
+        left = c->len - c->off;
+        if (n < left)
+        {
+            c->off += n;
+            return;
+        }
+        n -= left;
+        c->off = 0;
+        c->data += c->pitch;
+        if (--c->lines)
+            continue;
+
+        q->head = c->next;
+        if (!q->head)
+            q->tail = &q->head;
+        vnc_chunk_free(c);
+    }
+}
+
+/*
+ * Write as much of the queue as the socket takes.
+ * Return 1 once the queue is empty, 0 if the socket is full, -1 on error.
+ */
+int
+vnc_sendq_flush (struct vnc_sendq *q, int fd)
+{
+    struct iovec iov[VNC_IOV_MAX];
+    struct msghdr msg;
+    struct vnc_chunk *c;
+    unsigned int i, n;
+    ssize_t rc;
+
+    while (q->head)
+    {
+        n = 0;
+        for (c = q->head; c && n < VNC_IOV_MAX; c = c->next)
+            for (i = 0; i < c->lines && n < VNC_IOV_MAX; i++, n++)
+            {
+                size_t off = i ? 0 : c->off;
+
+                iov[n].iov_base = (void *) (c->data + i * c->pitch + off);
+                iov[n].iov_len = c->len - off;
+            }
+
+        memset(&msg, 0, sizeof (msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n;
+
+        rc = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return 0;
+            return -1;
+        }
+        vnc_sendq_consume(q, rc);
+    }
+
+    return 1;
+}
+
+/*
+ * Copy the data still queued from [base, base + size) so that mapping can
+ * be released.
+ */
+void
+vnc_sendq_detach (struct vnc_sendq *q, const uint8_t *base, size_t size)
+{
+    struct vnc_chunk *c;
+    uint8_t *buf, *p;
+    unsigned int i;
+    size_t len;
+
+    for (c = q->head; c; c = c->next)
+    {
+        if (c->buf || c->data < base || c->data >= base + size)
+            continue;
+
+        len = c->len * c->lines - c->off;
+        p = buf = malloc(len);
+        for (i = 0; i < c->lines; i++)
+        {
+            size_t off = i ? 0 : c->off;
+
+            memcpy(p, c->data + i * c->pitch + off, c->len - off);
+            p += c->len - off;
+        }
+        c->data = c->buf = buf;
+        c->len = len;
+        c->pitch = 0;
+        c->lines = 1;
+        c->off = 0;
+    }
+}
+
+void
+vnc_sendq_release (struct vnc_sendq *q)
+{
+    struct vnc_chunk *c, *next;
+
+    for (c = q->head; c; c = next)
+    {
+        next = c->next;
+        vnc_chunk_free(c);
+    }
+    vnc_sendq_init(q);
+}
@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) 2014 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "project.h"
+
+/*
+ * Encoder throughput benchmark: frames/s, input MB/s and compression ratio
+ * of each encoding of encoding.c, on synthetic 32bpp BGRX content.
+ *
+ * - desktop: flat windows, text-like glyph rows and a gradient;
+ * - photo: smooth noise, the worst case for the lossless encoders.
+ * Each is encoded as one full-frame rectangle ("frame") and as the
+ * VNC_TILE x VNC_TILE rectangles damage tracking produces ("tiles").
+ * Raw only queues the framebuffer lines, its cost is in the socket writes.
+ *
+ *   vnc-bench [seconds per run] [width height]
+ */
+
+struct bench_encoding
+{
+    const char *name;
+    int32_t encoding;
+    int jpeg_quality;
+};
+
+static const struct bench_encoding encodings[] = {
+    { "raw", VNC_ENCODING_RAW, -1 },
+    { "zlib", VNC_ENCODING_ZLIB, -1 },
+    { "zrle", VNC_ENCODING_ZRLE, -1 },
+    { "tight", VNC_ENCODING_TIGHT, -1 },
+    { "tight-jpeg", VNC_ENCODING_TIGHT, 6 },
+};
+
+static unsigned int width = 1920;
+static unsigned int height = 1080;
+
+static double
+now (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint32_t
+rnd (uint32_t *state)
+{
+    *state = *state * 1103515245 + 12345;
+    return *state >> 8;
+}
+
+static void
+fill_rect (uint32_t *fb, unsigned int x, unsigned int y, unsigned int w,
+           unsigned int h, uint32_t color)
+{
+    unsigned int i, j;
+
+    for (j = y; j < y + h && j < height; j++)
+        for (i = x; i < x + w && i < width; i++)
+            fb[j * width + i] = color;
+}
+
+static void
+draw_desktop (uint32_t *fb)
+{
+    uint32_t seed = 1;
+    unsigned int i, x, y;
+
+    fill_rect(fb, 0, 0, width, height, 0x003a6ea5);
+
+    /* Gradient wallpaper band. */
+    for (y = height * 3 / 4; y < height; y++)
+        for (x = 0; x < width; x++)
+            fb[y * width + x] = ((x * 255 / width) << 16) |
+                                ((y * 255 / height) << 8) | 0x40;
+
+    /* Windows: title bar, white client area, rows of glyph-like strokes. */
+    for (i = 0; i < 4; i++)
+    {
+        unsigned int wx = width / 16 + i * width / 6;
+        unsigned int wy = height / 12 + i * height / 10;
+        unsigned int ww = width / 2, wh = height / 2;
+
+        fill_rect(fb, wx, wy, ww, 24, 0x00203040);
+        fill_rect(fb, wx, wy + 24, ww, wh, 0x00ffffff);
+        for (y = wy + 32; y + 12 < wy + 24 + wh; y += 16)
+            for (x = wx + 8; x + 8 < wx + ww; x += 8)
+            {
+                uint32_t glyph = rnd(&seed);
+                unsigned int gx, gy;
+
+                if (!(glyph & 0x7))
+                    continue;   /* Space */
+                for (gy = 0; gy < 10; gy++)
+                    for (gx = 0; gx < 6; gx++)
+                        if ((glyph >> ((gy * 6 + gx) % 24)) & 1)
+                            fill_rect(fb, x + gx, y + gy, 1, 1, 0x00101010);
+            }
+    }
+}
+
+static void
+draw_photo (uint32_t *fb)
+{
+    uint32_t seed = 7;
+    unsigned int x, y;
+
+    for (y = 0; y < height; y++)
+        for (x = 0; x < width; x++)
+        {
+            unsigned int n = rnd(&seed) & 0x1f;
+            unsigned int r = (x * 200 / width + n) & 0xff;
+            unsigned int g = (y * 200 / height + n) & 0xff;
+            unsigned int b = ((x + y) * 100 / (width + height) + n) & 0xff;
+
+            fb[y * width + x] = (r << 16) | (g << 8) | b;
+        }
+}
+
+/* Encode the frame once, return the bytes it produced. */
+static size_t
+encode_frame (struct vnc_client *c, const uint8_t *fb, int tiles)
+{
+    size_t stride = width * 4, bytes;
+    surfman_rect_t r;
+
+    if (!tiles)
+    {
+        r.x = r.y = 0;
+        r.w = width;
+        r.h = height;
+        if (vnc_encode_rect(c, fb, stride, &r))
+            return 0;
+    }
+    else
+        for (r.y = 0; r.y < height; r.y += VNC_TILE)
+            for (r.x = 0; r.x < width; r.x += VNC_TILE)
+            {
+                r.w = width - r.x < VNC_TILE ? width - r.x : VNC_TILE;
+                r.h = height - r.y < VNC_TILE ? height - r.y : VNC_TILE;
+                if (vnc_encode_rect(c, fb, stride, &r))
+                    return 0;
+            }
+
+    vnc_encode_flush(c);
+    bytes = c->sendq.bytes;
+    vnc_sendq_release(&c->sendq);
+
+    return bytes;
+}
+
+static void
+bench (const char *content, const uint8_t *fb, int tiles,
+       const struct bench_encoding *e, double seconds)
+{
+    struct vnc_client c;
+    unsigned long frames = 0;
+    unsigned long long bytes = 0;
+    double t0, t;
+
+    memset(&c, 0, sizeof (c));
+    vnc_sendq_init(&c.sendq);
+    c.encoding = e->encoding;
+    c.compress_level = VNC_DEFAULT_COMPRESS_LEVEL;
+    c.jpeg_quality = e->jpeg_quality;
+    c.width = width;
+    c.height = height;
+
+    t0 = now();
+    do
+    {
+        size_t n = encode_frame(&c, fb, tiles);
+
+        if (!n)
+        {
+            printf("%-8s %-6s %-11s encoding failed\n", content,
+                   tiles ? "tiles" : "frame", e->name);
+            break;
+        }
+        bytes += n;
+        frames++;
+        t = now() - t0;
+    }
+    while (t < seconds);
+
+    if (frames)
+        printf("%-8s %-6s %-11s %9.1f %10.1f %8.2f\n", content,
+               tiles ? "tiles" : "frame", e->name, frames / t,
+               frames * (width * 4.0 * height) / t / 1e6,
+               (double) frames * width * 4 * height / bytes);
+
+    vnc_encode_release(&c);
+    vnc_buf_release(&c.out);
+    vnc_buf_release(&c.scratch);
+}
+
+int
+main (int argc, char **argv)
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 1.0;
+    uint8_t *desktop, *photo;
+    unsigned int i;
+    int tiles;
+
+    if (argc > 3)
+    {
+        width = strtoul(argv[2], NULL, 0);
+        height = strtoul(argv[3], NULL, 0);
+    }
+    if (!width || !height || width > 65535 || height > 65535)
+    {
+        fprintf(stderr, "usage: %s [seconds] [width height]\n", argv[0]);
+        return 1;
+    }
+
+    desktop = malloc(width * 4 * height);
+    photo = malloc(width * 4 * height);
+    if (!desktop || !photo)
+    {
+        perror("malloc");
+        return 1;
+    }
+    draw_desktop((uint32_t *) desktop);
+    draw_photo((uint32_t *) photo);
+
+    printf("%ux%u, %.1f MB per frame\n", width, height,
+           width * 4.0 * height / 1e6);
+    printf("%-8s %-6s %-11s %9s %10s %8s\n", "content", "rects", "encoding",
+           "frames/s", "MB/s in", "ratio");
+    for (tiles = 0; tiles < 2; tiles++)
+        for (i = 0; i < sizeof (encodings) / sizeof (encodings[0]); i++)
+        {
+            bench("desktop", desktop, tiles, &encodings[i], seconds);
+            bench("photo", photo, tiles, &encodings[i], seconds);
+        }
+
+    free(desktop);
+    free(photo);
+
+    return 0;
+}
@@ -0,0 +1,470 @@
+/*
+ * Copyright (c) 2014 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "project.h"
+#include <pthread.h>
+#include <surfman-memfd.h>
+
+/*
+ * Stalled client test: the plugin serves a memfd-backed surface refreshed
+ * from a thread, as surfman does with SURFMAN_FEATURE_THREADED_REFRESH, to
+ * two raw-encoding clients on the loopback:
+ *
+ * - a stalled client, with a small receive buffer, which keeps requesting
+ *   updates but never reads them;
+ * - a healthy client, which reads every update as fast as it can.
+ *
+ * It passes if the healthy client keeps getting frames, and if neither the
+ * event loop (a 10ms timer) nor the refresh thread ever waits on the
+ * stalled client.
+ *
+ *   vnc-stall-test [seconds] [width height]
+ */
+
+#define TICK_MS 10              /* Event loop probe and refresh period */
+#define MAX_STALL_MS 100        /* Longest wait tolerated for either */
+#define MIN_FPS 5               /* Frames/s the healthy client must get */
+#define STALLED_RCVBUF 4096
+
+extern surfman_plugin_t surfman_plugin;
+
+static unsigned int width = 1280;
+static unsigned int height = 720;
+static unsigned short port;
+
+static surfman_surface_t *surface;
+static surfman_psurface_t psurface;
+static volatile int done;
+
+static struct event tick_event;
+static double tick_expected;
+static double loop_max_late;
+static double refresh_max;
+
+static unsigned long healthy_frames;
+static double healthy_max_gap;
+static unsigned long stalled_requests;
+
+static double
+now (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+read_full (int fd, void *buf, size_t len)
+{
+    uint8_t *p = buf;
+    ssize_t rc;
+
+    while (len)
+    {
+        rc = read(fd, p, len);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            return -1;
+        p += rc;
+        len -= rc;
+    }
+
+    return 0;
+}
+
+static int
+write_full (int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    ssize_t rc;
+
+    while (len)
+    {
+        rc = write(fd, p, len);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            return -1;
+        p += rc;
+        len -= rc;
+    }
+
+    return 0;
+}
+
+static int
+skip (int fd, size_t len)
+{
+    uint8_t buf[65536];
+    size_t n;
+
+    while (len)
+    {
+        n = len < sizeof (buf) ? len : sizeof (buf);
+        if (read_full(fd, buf, n))
+            return -1;
+        len -= n;
+    }
+
+    return 0;
+}
+
+static uint16_t
+get_u16 (const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static uint32_t
+get_u32 (const uint8_t *p)
+{
+    return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static int
+request_update (int fd, int incremental)
+{
+    uint8_t req[10] = { 3, incremental };
+
+    req[6] = width >> 8;
+    req[7] = width;
+    req[8] = height >> 8;
+    req[9] = height;
+
+    return write_full(fd, req, sizeof (req));
+}
+
+/* Connect, go through the handshake and ask for raw updates. */
+static int
+client_connect (int rcvbuf)
+{
+    static const uint8_t set_encodings[8] = { 2, 0, 0, 1, 0, 0, 0, 0 };
+    struct sockaddr_in addr;
+    uint8_t buf[24];
+    int fd;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    /* Before connect(), for the window to be negotiated with it. */
+    if (rcvbuf)
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof (rcvbuf));
+
+    memset(&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof (addr)))
+        goto fail;
+
+    if (read_full(fd, buf, 12) || memcmp(buf, "RFB 003.008\n", 12) ||
+        write_full(fd, "RFB 003.008\n", 12))
+        goto fail;
+    if (read_full(fd, buf, 2) || buf[0] != 1 || buf[1] != 1 ||
+        write_full(fd, "\1", 1))                /* No auth */
+        goto fail;
+    if (read_full(fd, buf, 4) || get_u32(buf))
+        goto fail;
+    if (write_full(fd, "\1", 1) ||              /* Shared */
+        read_full(fd, buf, 24) || skip(fd, get_u32(buf + 20)))
+        goto fail;
+    if (get_u16(buf) != width || get_u16(buf + 2) != height)
+    {
+        fprintf(stderr, "server announced %ux%u\n", get_u16(buf),
+                get_u16(buf + 2));
+        goto fail;
+    }
+    if (write_full(fd, set_encodings, sizeof (set_encodings)))
+        goto fail;
+
+    return fd;
+
+fail:
+    close(fd);
+    return -1;
+}
+
+/* Read a FramebufferUpdate of raw rectangles. */
+static int
+read_update (int fd)
+{
+    uint8_t buf[12];
+    unsigned int i, n;
+
+    if (read_full(fd, buf, 4) || buf[0])
+        return -1;
+    n = get_u16(buf + 2);
+    for (i = 0; i < n; i++)
+    {
+        if (read_full(fd, buf, 12) || get_u32(buf + 8) != VNC_ENCODING_RAW)
+            return -1;
+        if (skip(fd, (size_t) get_u16(buf + 4) * get_u16(buf + 6) * 4))
+            return -1;
+    }
+
+    return 0;
+}
+
+struct connect_job
+{
+    int rcvbuf;
+    volatile int fd;
+    volatile int done;
+};
+
+static void *
+connect_thread (void *opaque)
+{
+    struct connect_job *job = opaque;
+
+    job->fd = client_connect(job->rcvbuf);
+    job->done = 1;
+
+    return NULL;
+}
+
+/* Connect a client while the event loop runs. */
+static int
+connect_client (int rcvbuf)
+{
+    struct connect_job job = { rcvbuf, -1, 0 };
+    double deadline = now() + 5;
+    pthread_t t;
+
+    pthread_create(&t, NULL, connect_thread, &job);
+    while (!job.done && now() < deadline)
+        event_loop(EVLOOP_ONCE);
+    if (!job.done)
+        pthread_cancel(t);
+    pthread_join(t, NULL);
+
+    return job.fd;
+}
+
+static void *
+healthy_client (void *opaque)
+{
+    int fd = *(int *) opaque;
+    double last = now(), t;
+
+    if (request_update(fd, 0))
+        return NULL;
+    while (!done)
+    {
+        if (read_update(fd))
+            break;
+        t = now();
+        if (healthy_frames && t - last > healthy_max_gap)
+            healthy_max_gap = t - last;
+        last = t;
+        healthy_frames++;
+        if (request_update(fd, 1))
+            break;
+    }
+
+    return NULL;
+}
+
+static void *
+stalled_client (void *opaque)
+{
+    int fd = *(int *) opaque;
+
+    /* Only input is ever read by the server, so this never blocks. */
+    while (!done && !request_update(fd, 1))
+    {
+        stalled_requests++;
+        usleep(TICK_MS * 1000);
+    }
+
+    return NULL;
+}
+
+/* Stands for the surfman refresh thread: every line changes each tick. */
+static void *
+refresh_thread (void *opaque)
+{
+    uint32_t *fb = surface_map(surface);
+    surfman_rect_t r = { 0, 0, width, height };
+    uint32_t frame = 0;
+    double t;
+    size_t i;
+
+    while (!done)
+    {
+        for (i = 0; i < (size_t) width * height; i += 61)
+            fb[i] = frame;
+        frame++;
+
+        t = now();
+        surfman_plugin.refresh_psurface_rects(&surfman_plugin, psurface, &r, 1);
+        t = now() - t;
+        if (t > refresh_max)
+            refresh_max = t;
+
+        usleep(TICK_MS * 1000);
+    }
+    surface_unmap(surface);
+
+    return NULL;
+}
+
+static void
+tick_handler (int fd, short event, void *opaque)
+{
+    struct timeval tv = { 0, TICK_MS * 1000 };
+    double t = now();
+
+    if (t - tick_expected > loop_max_late)
+        loop_max_late = t - tick_expected;
+    tick_expected = t + TICK_MS / 1000.;
+    evtimer_add(&tick_event, &tv);
+}
+
+/* A port nothing listens on, handed to the plugin as vnc.port. */
+static int
+configure_port (void)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof (addr);
+    char path[] = "/tmp/vnc-stall-test.XXXXXX";
+    FILE *f;
+    int fd, rc;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof (addr)) ||
+        getsockname(fd, (struct sockaddr *) &addr, &len))
+        return -1;
+    port = ntohs(addr.sin_port);
+    close(fd);
+
+    fd = mkstemp(path);
+    if (fd < 0)
+        return -1;
+    f = fdopen(fd, "w");
+    fprintf(f, "vnc.port = %u\n", port);
+    fclose(f);
+    rc = config_load_file(path);
+    unlink(path);
+
+    return rc > 0 ? 0 : -1;
+}
+
+static int
+surface_create (void)
+{
+    surface = xc_memfd_surface_new(width, height, SURFMAN_FORMAT_BGRX8888);
+
+    return surface ? 0 : -1;
+}
+
+int
+main (int argc, char **argv)
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 5.0;
+    struct timeval tv = { 0, TICK_MS * 1000 };
+    surfman_rect_t r;
+    pthread_t refresher, healthy, stalled;
+    int healthy_fd, stalled_fd, pending = 0, ok;
+    double deadline;
+
+    if (argc > 3)
+    {
+        width = strtoul(argv[2], NULL, 0);
+        height = strtoul(argv[3], NULL, 0);
+    }
+    if (seconds <= 0 || !width || !height || width > 65535 || height > 65535)
+    {
+        fprintf(stderr, "usage: %s [seconds] [width height]\n", argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    event_init();
+    if (configure_port() || surface_create() ||
+        surfman_plugin.init(&surfman_plugin) != SURFMAN_SUCCESS)
+    {
+        fprintf(stderr, "setup failed\n");
+        return 1;
+    }
+    psurface = surfman_plugin.get_psurface_from_surface(&surfman_plugin,
+                                                        surface);
+    if (!psurface)
+        return 1;
+
+    /* Announce the surface size to the clients. */
+    r.x = r.y = 0;
+    r.w = width;
+    r.h = height;
+    surfman_plugin.refresh_psurface_rects(&surfman_plugin, psurface, &r, 1);
+
+    evtimer_set(&tick_event, tick_handler, NULL);
+    evtimer_add(&tick_event, &tv);
+    tick_expected = now() + TICK_MS / 1000.;
+    pthread_create(&refresher, NULL, refresh_thread, NULL);
+
+    /* The handshakes need the event loop, connect from threads. */
+    stalled_fd = connect_client(STALLED_RCVBUF);
+    healthy_fd = connect_client(0);
+    if (stalled_fd < 0 || healthy_fd < 0)
+    {
+        fprintf(stderr, "clients failed to connect\n");
+        return 1;
+    }
+    pthread_create(&stalled, NULL, stalled_client, &stalled_fd);
+    pthread_create(&healthy, NULL, healthy_client, &healthy_fd);
+
+    loop_max_late = 0;
+    deadline = now() + seconds;
+    while (now() < deadline)
+        event_loop(EVLOOP_ONCE);
+
+    done = 1;
+    pthread_join(refresher, NULL);
+    ioctl(stalled_fd, FIONREAD, &pending);
+    shutdown(stalled_fd, SHUT_RDWR);
+    shutdown(healthy_fd, SHUT_RDWR);
+    pthread_join(stalled, NULL);
+    pthread_join(healthy, NULL);
+
+    ok = healthy_frames >= seconds * MIN_FPS &&
+         healthy_max_gap * 1000 < MAX_STALL_MS * 5 &&
+         loop_max_late * 1000 < MAX_STALL_MS &&
+         refresh_max * 1000 < MAX_STALL_MS &&
+         pending > 0 && stalled_requests > seconds * 10;
+
+    printf("%ux%u raw, %.1fs\n", width, height, seconds);
+    printf("healthy client: %lu frames (%.1f/s), longest gap %.1f ms\n",
+           healthy_frames, healthy_frames / seconds, healthy_max_gap * 1000);
+    printf("stalled client: %lu requests, %d bytes unread\n",
+           stalled_requests, pending);
+    printf("event loop: timer late by %.1f ms at most\n", loop_max_late * 1000);
+    printf("refresh: %.1f ms at most\n", refresh_max * 1000);
+    printf("%s\n", ok ? "PASS" : "FAIL");
+
+    close(stalled_fd);
+    close(healthy_fd);
+    surfman_plugin.free_psurface(&surfman_plugin, psurface);
+
+    return !ok;
+}
@@ -17,7 +17,9 @@
  */
 
 #include "project.h"
-#include "list.h"
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
 
 const int X11_to_input[] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, KEY_SPACE, 0 /* XK_exclam */, 0 /* XK_quotedbl */, 0 /* XK_numbersign */, KEY_DOLLAR, 0 /* XK_percent */, 0 /* XK_ampersand */, KEY_APOSTROPHE, 0 /* XK_parenleft */, 0 /* XK_parenright */, KEY_KPASTERISK /* XK_asterisk */, KEY_KPPLUS /* XK_plus */, KEY_COMMA, KEY_MINUS, KEY_DOT, KEY_SLASH, KEY_0, KEY_1, KEY_2, KEY_3, KEY_4, KEY_5, KEY_6, KEY_7, KEY_8, KEY_9, 0 /* XK_colon */, KEY_SEMICOLON, 0 /* XK_less */, KEY_EQUAL, 0 /* XK_greater */, KEY_QUESTION, 0 /* XK_at */, KEY_A, KEY_B, KEY_C, KEY_D, KEY_E, KEY_F, KEY_G, KEY_H, KEY_I, KEY_J, KEY_K, KEY_L, KEY_M, KEY_N, KEY_O, KEY_P, KEY_Q, KEY_R, KEY_S, KEY_T, KEY_U, KEY_V, KEY_W, KEY_X, KEY_Y, KEY_Z, KEY_LEFTBRACE /* XK_bracketleft */, KEY_BACKSLASH, KEY_RIGHTBRACE /* XK_bracketright */, 0 /* XK_asciicircum */, 0 /* XK_underscore */, KEY_GRAVE, KEY_A, KEY_B, KEY_C, KEY_D, KEY_E, KEY_F, KEY_G, KEY_H, KEY_I, KEY_J, KEY_K, KEY_L, KEY_M, KEY_N, KEY_O, KEY_P, KEY_Q, KEY_R, KEY_S, KEY_T, KEY_U, KEY_V, KEY_W, KEY_X, KEY_Y, KEY_Z, KEY_LEFTBRACE /* XK_braceleft */, 0 /* XK_bar */, KEY_RIGHTBRACE /* XK_braceright */};
 
@@ -36,31 +38,68 @@ typedef struct
     int addr_len;
 } vnc_socket;
 
-typedef struct
-{
-    int fd;
-    struct event ev;
-} vnc_client_socket;
+LIST_HEAD (, struct vnc_client) clients;
 
-struct pending_socket_s
-{
-    LIST_ENTRY(struct pending_socket_s) next;
+const surfman_version_t surfman_plugin_version = SURFMAN_API_VERSION;
 
-    vnc_client_socket *socket;
-};
-
-LIST_HEAD (, struct pending_socket_s) pending_sockets;
+/* Surface last refreshed, its size is announced to new clients. */
+static vnc_surface *g_surface = NULL;
 
 static int g_monitor = 1;
 
+/* Clean lines allowed between coalesced dirty rectangles. */
+static unsigned int vnc_merge_gap = SURFMAN_DIRTY_MERGE_GAP;
+
+static unsigned int vnc_port = VNC_DEFAULT_PORT;
+
 static struct event vnc_socket_event;
 
+/*
+ * Refreshes come from a surfman thread (SURFMAN_FEATURE_THREADED_REFRESH)
+ * while the sockets are served from the event loop. vnc_lock protects the
+ * clients and the writes to g_surface (only the event loop clears it, so it
+ * reads it without). libevent is only used from the event loop, which
+ * never waits for an update being encoded: what it cannot do right away is
+ * deferred (vnc_defer()), and the refresh thread wakes it up through
+ * vnc_wake_fd once it is done. Clients are only freed from the event loop.
+ */
+static pthread_mutex_t vnc_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t vnc_loop;
+static int vnc_deferred;        /* Some clients have VNC_DEFER_* flags */
+static int vnc_wake_fd = -1;
+static struct event vnc_wake_event;
+
+/* Accepted, announced to the refresh thread by vnc_run_deferred(). */
+static LIST_HEAD (, struct vnc_client) new_clients;
+
+static void vnc_defer(struct vnc_client *c, int flags);
+static void vnc_wake_handler(int fd, short event, void *opaque);
+
 static int
 vnc_init (surfman_plugin_t * p)
 {
+    const char *v;
+
     info("vnc: init");
 
-    LIST_HEAD_INIT(&pending_sockets);
+    LIST_HEAD_INIT(&clients);
+    LIST_HEAD_INIT(&new_clients);
+
+    vnc_merge_gap = rects_merge_gap("vnc");
+    v = config_get("vnc", "port");
+    if (v && *v)
+        vnc_port = strtoul(v, NULL, 0);
+
+    vnc_loop = pthread_self();
+    vnc_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (vnc_wake_fd < 0)
+    {
+        info("vnc: eventfd failed: %s", strerror(errno));
+        return SURFMAN_ERROR;
+    }
+    event_set(&vnc_wake_event, vnc_wake_fd, EV_READ | EV_PERSIST,
+              vnc_wake_handler, NULL);
+    event_add(&vnc_wake_event, NULL);
 
     return SURFMAN_SUCCESS;
 }
@@ -69,6 +108,13 @@ static void
 vnc_shutdown (surfman_plugin_t * p)
 {
     info("vnc: shutdown");
+
+    if (vnc_wake_fd >= 0)
+    {
+        event_del(&vnc_wake_event);
+        close(vnc_wake_fd);
+        vnc_wake_fd = -1;
+    }
 }
 
 static int
@@ -140,101 +186,49 @@ vnc_get_monitor_edid_by_monitor (surfman_plugin_t * p,
     return SURFMAN_SUCCESS;
 }
 
-static void
-vnc_write_u8(int fd, uint8_t value)
-{
-    write(fd, &value, 1);
-}
-
-static void
-vnc_write_u16(int fd, uint16_t value)
-{
-    uint8_t buf[2];
-
-    buf[0] = (value >> 8) & 0xFF;
-    buf[1] = value & 0xFF;
-
-    write(fd, buf, 2);
-}
-
-static void
-vnc_write_u32(int fd, uint32_t value)
-{
-    uint8_t buf[4];
-
-    buf[0] = (value >> 24) & 0xFF;
-    buf[1] = (value >> 16) & 0xFF;
-    buf[2] = (value >>  8) & 0xFF;
-    buf[3] = value & 0xFF;
-
-    write(fd, buf, 4);
-}
-
-static uint32_t
-vnc_read_u16(int fd)
+static uint16_t
+vnc_get_u16(const uint8_t *p)
 {
-    uint16_t value;
-
-    read(fd, &value, 2);
-
-    return (((value << 8) & 0xFF00) +
-	    ((value >> 8) & 0x00FF));
+    return (p[0] << 8) | p[1];
 }
 
 static uint32_t
-vnc_read_u32(int fd)
+vnc_get_u32(const uint8_t *p)
 {
-    uint32_t value;
-
-    read(fd, &value, 4);
-
-    return (((value << 24) & 0xFF000000) +
-	    ((value << 8)  & 0x00FF0000) +
-	    ((value >> 8)  & 0x0000FF00) +
-	    ((value >> 24) & 0x000000FF));
+    return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
 }
 
 static void
-vnc_write_s32(int fd, int32_t value)
+pixel_format_message (struct vnc_buf *b)
 {
-    vnc_write_u32(fd, *(uint32_t *)&value);
+    vnc_buf_u8(b, 32);          /* bits-per-pixel  */
+    vnc_buf_u8(b, 24);          /* depth           */
+
+    vnc_buf_u8(b, 0);           /* big-endian-flag */
+    vnc_buf_u8(b, 1);           /* true-color-flag */
+    vnc_buf_u16(b, 255);        /* red-max         */
+    vnc_buf_u16(b, 255);        /* green-max       */
+    vnc_buf_u16(b, 255);        /* blue-max        */
+    vnc_buf_u8(b, 16);          /* red-shift       */
+    vnc_buf_u8(b, 8);           /* green-shift     */
+    vnc_buf_u8(b, 0);           /* blue-shift      */
+    memset(vnc_buf_put(b, 3), 0, 3); /* padding    */
 }
 
 static void
-pixel_format_message (int fd)
-{
-    char pad[3] = { 0, 0, 0 };
-
-    vnc_write_u8(fd, 32);       /* bits-per-pixel  */
-    vnc_write_u8(fd, 24);       /* depth           */
-
-    vnc_write_u8(fd, 0);        /* big-endian-flag */
-    vnc_write_u8(fd, 1);        /* true-color-flag */
-    vnc_write_u16(fd, 255);     /* red-max         */
-    vnc_write_u16(fd, 255);     /* green-max       */
-    vnc_write_u16(fd, 255);     /* blue-max        */
-    vnc_write_u8(fd, 0);        /* red-shift       */
-    vnc_write_u8(fd, 0);        /* green-shift     */
-    vnc_write_u8(fd, 0);        /* blue-shift      */
-    write(fd, pad, 3);          /* padding         */
-}
-
-static int
-protocol_client_init(int fd)
+protocol_client_init(struct vnc_buf *b, unsigned int width, unsigned int height)
 {
     size_t l;
     char domain_name[] = "fish";
 
-    vnc_write_u16(fd, 1280);
-    vnc_write_u16(fd, 1024);
+    vnc_buf_u16(b, width);
+    vnc_buf_u16(b, height);
 
-    pixel_format_message(fd);
+    pixel_format_message(b);
 
-    l = strlen(domain_name); 
-    vnc_write_u32(fd, l);        
-    write(fd, domain_name, l);
-
-    return 0;
+    l = strlen(domain_name);
+    vnc_buf_u32(b, l);
+    memcpy(vnc_buf_put(b, l), domain_name, l);
 }
 
 static void
@@ -276,17 +270,14 @@ vnc_send_input_event(struct input_event* e)
 }
 
 static void
-vnc_process_key_event(int fd)
+vnc_process_key_event(const uint8_t *msg)
 {
     uint8_t down_flag;
     uint32_t key;
     struct input_event e;
 
-    /* Read input event */
-    read(fd, &down_flag, 1); /* Down flag */
-    read(fd, &key, 2);       /* Padding */
-
-    key = vnc_read_u32(fd);
+    down_flag = msg[1];
+    key = vnc_get_u32(msg + 4);
 
     if (key < sizeof(X11_to_input) && X11_to_input[key] != 0)
       {
@@ -310,7 +301,7 @@ vnc_process_key_event(int fd)
 }
 
 static void
-vnc_process_mouse_event(int fd)
+vnc_process_mouse_event(const uint8_t *msg)
 {
     uint8_t buttons;
     static uint16_t prev_x = 0;
@@ -320,9 +311,9 @@ vnc_process_mouse_event(int fd)
     struct input_event e;
     char to_send[sizeof(struct input_event) + 1];
 
-    read(fd, &buttons, 1); /* Button mask */
-    x = vnc_read_u16(fd);  /* x-position (abs) */
-    y = vnc_read_u16(fd);  /* y-position (abs) */
+    buttons = msg[1];          /* Button mask */
+    x = vnc_get_u16(msg + 2);  /* x-position (abs) */
+    y = vnc_get_u16(msg + 4);  /* y-position (abs) */
 
     /* Send it to input_server */
     /* e.type = EV_ABS; */
@@ -365,72 +356,554 @@ vnc_process_mouse_event(int fd)
     prev_y = y;
 }
 
+/* Mark the tiles covering a rectangle of the client framebuffer as damaged. */
+static void
+vnc_client_damage(struct vnc_client *c, unsigned int x, unsigned int y,
+                  unsigned int w, unsigned int h)
+{
+    unsigned int tx, ty, tx1, ty1;
+
+    if (x >= c->width || y >= c->height || !w || !h)
+        return;
+    if (w > c->width - x)
+        w = c->width - x;
+    if (h > c->height - y)
+        h = c->height - y;
+
+    tx1 = (x + w - 1) / VNC_TILE;
+    ty1 = (y + h - 1) / VNC_TILE;
+    for (ty = y / VNC_TILE; ty <= ty1; ty++)
+        for (tx = x / VNC_TILE; tx <= tx1; tx++)
+            c->damage[ty * c->tiles_w + tx] = 1;
+}
+
+/* (Re)size the client framebuffer, which is then entirely damaged. */
+static void
+vnc_client_resize(struct vnc_client *c, unsigned int width, unsigned int height)
+{
+    c->width = width;
+    c->height = height;
+    c->tiles_w = (width + VNC_TILE - 1) / VNC_TILE;
+    c->tiles_h = (height + VNC_TILE - 1) / VNC_TILE;
+    free(c->damage);
+    c->damage = calloc(c->tiles_w * c->tiles_h, 1);
+    vnc_client_damage(c, 0, 0, width, height);
+}
+
+/*
+ * Turn the damaged tiles into rectangles, clipped to width x height, and
+ * clear them. Runs of tiles on a tile row are merged with the run right
+ * above when they span the same columns. Past /max/ rectangles, the
+ * bounding box of the damage is sent instead.
+ */
+static unsigned int
+vnc_client_damage_rects(struct vnc_client *c, unsigned int width,
+                        unsigned int height, surfman_rect_t *rects,
+                        unsigned int max)
+{
+    unsigned int tx, tx0, ty, i, n = 0;
+    unsigned int bx0 = c->tiles_w, by0 = c->tiles_h, bx1 = 0, by1 = 0;
+    int overflow = 0;
+
+    for (ty = 0; ty < c->tiles_h; ty++)
+    {
+        for (tx = 0; tx < c->tiles_w; tx++)
+        {
+            if (!c->damage[ty * c->tiles_w + tx])
+                continue;
+
+            tx0 = tx;
+            while (tx < c->tiles_w && c->damage[ty * c->tiles_w + tx])
+                c->damage[ty * c->tiles_w + tx++] = 0;
+
+            if (tx0 < bx0)
+                bx0 = tx0;
+            if (tx > bx1)
+                bx1 = tx;
+            if (ty < by0)
+                by0 = ty;
+            by1 = ty + 1;
+
+            if (overflow)
+                continue;
+            for (i = 0; i < n; i++)
+                if (rects[i].x == tx0 && rects[i].w == tx - tx0 &&
+                    rects[i].y + rects[i].h == ty)
+                    break;
+            if (i < n)
+                rects[i].h++;
+            else if (n < max)
+            {
+                rects[n].x = tx0;
+                rects[n].y = ty;
+                rects[n].w = tx - tx0;
+                rects[n].h = 1;
+                n++;
+            }
+            else
+                overflow = 1;
+        }
+    }
+
+    if (overflow)
+    {
+        rects[0].x = bx0;
+        rects[0].y = by0;
+        rects[0].w = bx1 - bx0;
+        rects[0].h = by1 - by0;
+        n = 1;
+    }
+
+    /* Tiles to pixels. */
+    for (i = 0; i < n; i++)
+    {
+        unsigned int x1 = (rects[i].x + rects[i].w) * VNC_TILE;
+        unsigned int y1 = (rects[i].y + rects[i].h) * VNC_TILE;
+
+        rects[i].x *= VNC_TILE;
+        rects[i].y *= VNC_TILE;
+        if (x1 > width)
+            x1 = width;
+        if (y1 > height)
+            y1 = height;
+        if (rects[i].x >= x1 || rects[i].y >= y1)
+        {
+            rects[i--] = rects[--n];
+            continue;
+        }
+        rects[i].w = x1 - rects[i].x;
+        rects[i].h = y1 - rects[i].y;
+    }
+
+    return n;
+}
+
+static void
+vnc_client_free(struct vnc_client *c)
+{
+    info("vnc: client %d left, %lu frames dropped", c->fd, c->frames_dropped);
+
+    event_del(&c->ev);
+    event_del(&c->wev);
+    LIST_REMOVE(c, link);
+    close(c->fd);
+
+    vnc_sendq_release(&c->sendq);
+    vnc_encode_release(c);
+    vnc_buf_release(&c->in);
+    free(c->damage);
+    free(c);
+}
+
+/* Leave /flags/ for the event loop to handle on /c/. */
 static void
-vnc_socket_client_handler(int fd, short event, void *opaque)
+vnc_mark(struct vnc_client *c, int flags)
+{
+    __sync_fetch_and_or(&c->deferred, flags);
+    __sync_fetch_and_or(&vnc_deferred, 1);
+}
+
+/* Push the send queue, waiting for the socket to drain if it is full. */
+static int
+vnc_client_flush(struct vnc_client *c)
 {
-    vnc_client_socket *client = (vnc_client_socket*)opaque;
-    uint8_t val;
-    struct pending_socket_s *pending = NULL;
-    char buf[1024];
     int rc;
 
-    if (event & EV_READ)
+    rc = vnc_sendq_flush(&c->sendq, c->fd);
+    if (rc < 0)
+    {
+        info("vnc: write to client %d failed: %s", c->fd, strerror(errno));
+        return -1;
+    }
+    if (!rc)
     {
-        rc = read(fd, &val, 1);
+        if (pthread_equal(pthread_self(), vnc_loop))
+            event_add(&c->wev, NULL);
+        else
+            vnc_mark(c, VNC_DEFER_WRITE);
+    }
 
-	if (rc == 0)
-	{
-	    /* The client left, closing the socket. FIXME: If the socket is currently pending for a refresh, it needs to be removed from the list */
-            /* Peer disconnected */
-	    event_del(&client->ev);
-	    close(client->fd);
-	    free(client);
-            return;
-	}
+    return 0;
+}
 
-        if (rc < 0)
-            return;
+static void
+vnc_client_write_handler(int fd, short event, void *opaque)
+{
+    vnc_defer(opaque, VNC_DEFER_FLUSH);
+}
+
+/*
+ * Send the damage of the client framebuffer if an update was requested.
+ * A client whose send queue is over VNC_SENDQ_WATERMARK is skipped: its
+ * damage keeps accumulating and goes out in one update once it caught up.
+ */
+static int
+vnc_client_update(struct vnc_client *c, vnc_surface *s)
+{
+    surfman_surface_t *surf = s->surface;
+    surfman_rect_t rects[VNC_UPDATE_RECTS_MAX];
+    unsigned int i, n, w, h, count;
+    int resize = 0;
+
+    if (!c->update_requested)
+        return 0;
+    if (c->sendq.bytes > VNC_SENDQ_WATERMARK)
+    {
+        c->frames_dropped++;
+        return 0;
+    }
+
+    if (c->desktop_size &&
+        (surf->width != c->width || surf->height != c->height))
+    {
+        vnc_client_resize(c, surf->width, surf->height);
+        resize = 1;
+    }
+
+    w = surf->width < c->width ? surf->width : c->width;
+    h = surf->height < c->height ? surf->height : c->height;
+    n = vnc_client_damage_rects(c, w, h, rects, VNC_UPDATE_RECTS_MAX);
+    if (!n && !resize)
+        return 0;
+
+    count = resize;
+    for (i = 0; i < n; i++)
+        count += vnc_encode_count(c, &rects[i]);
+
+    vnc_buf_u8(&c->out, 0);     /* FramebufferUpdate */
+    vnc_buf_u8(&c->out, 0);
+    vnc_buf_u16(&c->out, count);
+    if (resize)
+    {
+        vnc_buf_u16(&c->out, 0);
+        vnc_buf_u16(&c->out, 0);
+        vnc_buf_u16(&c->out, c->width);
+        vnc_buf_u16(&c->out, c->height);
+        vnc_buf_u32(&c->out, (uint32_t) VNC_ENCODING_DESKTOP_SIZE);
+    }
+    for (i = 0; i < n; i++)
+        if (vnc_encode_rect(c, s->fb, surf->stride, &rects[i]))
+            return -1;
+    vnc_encode_flush(c);
+    c->update_requested = 0;
+
+    return vnc_client_flush(c);
+}
 
-        switch (val)
+static void
+vnc_set_encodings(struct vnc_client *c, const uint8_t *p, unsigned int n)
+{
+    int32_t e;
+    int chosen = 0;
+
+    c->encoding = VNC_ENCODING_RAW;
+    c->compress_level = VNC_DEFAULT_COMPRESS_LEVEL;
+    c->jpeg_quality = -1;
+    c->desktop_size = 0;
+
+    for (; n--; p += 4)
+    {
+        e = (int32_t) vnc_get_u32(p);
+        switch (e)
         {
-        case 0: /* Set Pixel Format */
-            read(fd, buf, 19); /* Eat-and-ignore message */
-            break;
-        case 2: /* Set Encodings */
-            read(fd, buf, 1); /* Padding */
-            {
-                uint16_t i;
-                i = read(fd, &i, 2);
-                read(fd, buf, i * 4); /* Eat-and-ignore message */
-            }
-            break;
-        case 3: /* Framebuffer Update Request */
-            read(fd, buf, 9); /* Eat-and-ignore message */
-            pending = calloc(1, sizeof(struct pending_socket_s));
-            pending->socket = client;
-            LIST_INSERT_HEAD(&pending_sockets, pending, next); /* Should
-                                                                * be
-                                                                * TAIL!*/
+        case VNC_ENCODING_RAW:
+        case VNC_ENCODING_ZLIB:
+        case VNC_ENCODING_TIGHT:
+        case VNC_ENCODING_ZRLE:
+            /* Encodings come in order of preference. */
+            if (!chosen)
+                c->encoding = e;
+            chosen = 1;
             break;
-        case 4: /* Key Event */
-            vnc_process_key_event(fd);
+        case VNC_ENCODING_DESKTOP_SIZE:
+            c->desktop_size = 1;
             break;
-        case 5: /* Pointer Event */
-            vnc_process_mouse_event(fd);
+        default:
+            /* Only applies to zlib streams not created yet. */
+            if (e >= VNC_ENCODING_COMPRESS_LEVEL0 &&
+                e <= VNC_ENCODING_COMPRESS_LEVEL9)
+                c->compress_level = e - VNC_ENCODING_COMPRESS_LEVEL0;
+            else if (e >= VNC_ENCODING_QUALITY_LEVEL0 &&
+                     e <= VNC_ENCODING_QUALITY_LEVEL9)
+                c->jpeg_quality = e - VNC_ENCODING_QUALITY_LEVEL0;
             break;
-        case 6: /* Client Cut Text */
-            read(fd, buf, 3); /* Padding */
+        }
+    }
+
+    info("vnc: client %d: encoding %d, compression %d, quality %d",
+         c->fd, c->encoding, c->compress_level, c->jpeg_quality);
+}
+
+/*
+ * Client input state machine.
+ *
+ * Each step looks at the /len/ bytes buffered at /p/ and returns how many
+ * it consumed, 0 if the message is not complete yet, -1 to drop the client.
+ * Replies are queued on client->out.
+ */
+
+static int
+vnc_client_version(struct vnc_client *c, const uint8_t *p, size_t len)
+{
+    if (len < 12)
+        return 0;
+    if (memcmp(p, "RFB 003.008\n", 12))
+    {
+        info("Incompatible client version : %.11s", p);
+        return -1;
+    }
+
+    vnc_buf_u8(&c->out, 1);     /* Num auth */
+    vnc_buf_u8(&c->out, 1);     /* No auth */
+    c->state = VNC_STATE_SECURITY;
+
+    return 12;
+}
+
+static int
+vnc_client_security(struct vnc_client *c, const uint8_t *p, size_t len)
+{
+    if (len < 1)
+        return 0;
+    if (*p != 1)
+    {
+        info("Client disagreed on no auth, it wants %i", *p);
+        return -1;
+    }
+
+    vnc_buf_u32(&c->out, 0);    /* Accept auth completion */
+    c->state = VNC_STATE_INIT;
+    info("vnc: auth done");
+
+    return 1;
+}
+
+static int
+vnc_client_init(struct vnc_client *c, const uint8_t *p, size_t len)
+{
+    if (len < 1)                /* Shared flag, ignored */
+        return 0;
+
+    protocol_client_init(&c->out, c->width, c->height);
+    c->state = VNC_STATE_NORMAL;
+
+    return 1;
+}
+
+static int
+vnc_client_message(struct vnc_client *c, const uint8_t *p, size_t len)
+{
+    size_t need;
+
+    if (len < 1)
+        return 0;
+
+    switch (p[0])
+    {
+    case 0: /* Set Pixel Format, ignored */
+        return len < 20 ? 0 : 20;
+    case 2: /* Set Encodings */
+        if (len < 4)
+            return 0;
+        need = 4 + vnc_get_u16(p + 2) * 4;
+        if (len < need)
+            return 0;
+        vnc_set_encodings(c, p + 4, vnc_get_u16(p + 2));
+        return need;
+    case 3: /* Framebuffer Update Request */
+        if (len < 10)
+            return 0;
+        /* Requests coalesce until the next update goes out. */
+        if (!p[1])
+            vnc_client_damage(c, vnc_get_u16(p + 2), vnc_get_u16(p + 4),
+                              vnc_get_u16(p + 6), vnc_get_u16(p + 8));
+        c->update_requested = 1;
+        return 10;
+    case 4: /* Key Event */
+        if (len < 8)
+            return 0;
+        vnc_process_key_event(p);
+        return 8;
+    case 5: /* Pointer Event */
+        if (len < 6)
+            return 0;
+        vnc_process_mouse_event(p);
+        return 6;
+    case 6: /* Client Cut Text, ignored */
+        if (len < 8)
+            return 0;
+        c->skip = vnc_get_u32(p + 4);
+        return 8;
+    default:
+        info("Received invalid command from client : %d", p[0]);
+        return -1;
+    }
+}
+
+/* Run the buffered input through the state machine and send the replies. */
+static int
+vnc_client_parse(struct vnc_client *c)
+{
+    size_t off = 0, len;
+    const uint8_t *p;
+    int n;
+
+    while (off < c->in.len)
+    {
+        p = c->in.data + off;
+        len = c->in.len - off;
+
+        if (c->skip)
+        {
+            n = c->skip < len ? c->skip : len;
+            c->skip -= n;
+        }
+        else
+        {
+            switch (c->state)
             {
-                uint32_t i;
-                i = read(fd, &i, 4);
-                read(fd, buf, i); /* Eat-and-ignore message */
+            case VNC_STATE_VERSION:
+                n = vnc_client_version(c, p, len);
+                break;
+            case VNC_STATE_SECURITY:
+                n = vnc_client_security(c, p, len);
+                break;
+            case VNC_STATE_INIT:
+                n = vnc_client_init(c, p, len);
+                break;
+            default:
+                n = vnc_client_message(c, p, len);
+                break;
             }
+        }
+        if (n < 0)
+            return -1;
+        if (!n)
+            break;
+        off += n;
+    }
+
+    c->in.len -= off;
+    memmove(c->in.data, c->in.data + off, c->in.len);
+    if (c->in.len > VNC_INPUT_MAX)
+    {
+        info("vnc: client %d: message too long", c->fd);
+        return -1;
+    }
+
+    vnc_encode_flush(c);
+    return vnc_client_flush(c);
+}
+
+/* Handle what was deferred on the clients, vnc_lock held, in the event loop. */
+static void
+vnc_run_deferred(void)
+{
+    struct vnc_client *c, *next_c;
+    int flags;
+
+    __sync_fetch_and_and(&vnc_deferred, 0);
+
+    LIST_FOREACH_SAFE(c, next_c, &new_clients, link)
+    {
+        LIST_REMOVE(c, link);
+        LIST_INSERT_HEAD(&clients, c, link);
+    }
+
+    LIST_FOREACH_SAFE(c, next_c, &clients, link)
+    {
+        flags = __sync_fetch_and_and(&c->deferred, 0);
+        if (!flags)
+            continue;
+
+        if ((flags & VNC_DEFER_FREE) ||
+            ((flags & VNC_DEFER_PARSE) && vnc_client_parse(c)) ||
+            ((flags & VNC_DEFER_FLUSH) && vnc_client_flush(c)))
+        {
+            vnc_client_free(c);
+            continue;
+        }
+        if (flags & VNC_DEFER_WRITE)
+            event_add(&c->wev, NULL);
+    }
+}
+
+/*
+ * Get the deferred work done: right away from the event loop unless a
+ * refresh is in progress, in which case the refresh thread calls back once
+ * done; from the refresh thread, by waking the event loop up.
+ */
+static void
+vnc_kick(void)
+{
+    if (!vnc_deferred)
+        return;
+
+    if (!pthread_equal(pthread_self(), vnc_loop))
+    {
+        if (eventfd_write(vnc_wake_fd, 1))
+            info("vnc: cannot wake the event loop: %s", strerror(errno));
+        return;
+    }
+
+    if (pthread_mutex_trylock(&vnc_lock))
+        return;
+    vnc_run_deferred();
+    pthread_mutex_unlock(&vnc_lock);
+}
+
+static void
+vnc_defer(struct vnc_client *c, int flags)
+{
+    vnc_mark(c, flags);
+    vnc_kick();
+}
+
+static void
+vnc_wake_handler(int fd, short event, void *opaque)
+{
+    eventfd_t n;
+
+    eventfd_read(fd, &n);
+    vnc_kick();
+}
+
+static void
+vnc_client_read_handler(int fd, short event, void *opaque)
+{
+    struct vnc_client *c = opaque;
+    int flags = VNC_DEFER_PARSE;
+    ssize_t rc;
+
+    /* c->in belongs to the event loop, parsing may have to wait. */
+    while (c->in.len <= VNC_INPUT_MAX)
+    {
+        vnc_buf_put(&c->in, VNC_READ_SIZE);
+        c->in.len -= VNC_READ_SIZE;
+
+        rc = read(fd, c->in.data + c->in.len, VNC_READ_SIZE);
+        if (rc == 0)
+        {
+            flags |= VNC_DEFER_FREE;    /* Peer disconnected */
+            break;
+        }
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            info("vnc: read from client %d failed: %s", fd, strerror(errno));
+            flags |= VNC_DEFER_FREE;
             break;
-        default:
-          break;
-          info("Received invalid command from client : %d", val);
         }
+
+        c->in.len += rc;
+        if (rc < VNC_READ_SIZE)
+            break;
     }
+
+    vnc_defer(c, flags);
 }
 
 static void
@@ -438,10 +911,8 @@ vnc_socket_handler(int sockfd, short event, void *opaque)
 {
     vnc_socket* socket = (vnc_socket*) opaque;
     int fd;
-    int i = 0;
-    char buf[13];
-    vnc_client_socket* client;
-    struct pending_socket_s *pending;
+    int i = 1;
+    struct vnc_client *client;
 
     if (socket == NULL)
     {
@@ -457,85 +928,32 @@ vnc_socket_handler(int sockfd, short event, void *opaque)
 	return;
       }
 
-    strncpy(buf, "RFB 003.008\n", 13);
-    write(fd, buf, 12); /* Send our version */
-    read(fd, buf, 12); /* Receive client version */
-    buf[12] = '\0';
-    if (strncmp(buf, "RFB 003.008\n", 12))
-    {
-	close(fd);
-	info("Incompatible client version : %s", buf);
-	return;
-    }
-    vnc_write_u8(fd, 1); /* Num auth */
-    vnc_write_u8(fd, 1); /* No auth */
-    read(fd, buf, 1);    /* Read client auth, should be 1 (no auth) */
-    if (*buf != 1)
-    {
-	close(fd);
-	info("Client disagreed on no auth, it wants %i", *buf);
-	return;
-    }
-    else
-	vnc_write_u32(fd, 0); /* Accept auth completion */
-
-    info("vnc: auth done");
-
-    protocol_client_init(fd);
+    /* Nothing may block the event loop on a client. */
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    /* Updates are small writes, do not wait for more. */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &i, sizeof (i));
 
-    client = malloc(sizeof(vnc_client_socket));
+    client = calloc(1, sizeof (*client));
     client->fd = fd;
+    client->state = VNC_STATE_VERSION;
+    client->encoding = VNC_ENCODING_RAW;
+    client->compress_level = VNC_DEFAULT_COMPRESS_LEVEL;
+    client->jpeg_quality = -1;
+    vnc_sendq_init(&client->sendq);
+    vnc_client_resize(client,
+                      g_surface ? g_surface->surface->width : VNC_DEFAULT_WIDTH,
+                      g_surface ? g_surface->surface->height : VNC_DEFAULT_HEIGHT);
+
     event_set (&client->ev, fd, EV_READ | EV_PERSIST,
-               vnc_socket_client_handler, client);
+               vnc_client_read_handler, client);
     event_add (&client->ev, NULL);
+    event_set (&client->wev, fd, EV_WRITE, vnc_client_write_handler, client);
 
-    /* First display */
-    pending = calloc(1, sizeof(struct pending_socket_s));
-    pending->socket = client;
-    LIST_INSERT_HEAD(&pending_sockets, pending, next); /* Should
-							* be
-							* TAIL!*/
-}
-
-static uint8_t*
-map_surfman_surface(surfman_surface_t *src)
-{
-    xen_pfn_t *fns = NULL;
-    uint8_t *mapped = NULL;
-    unsigned int i = 0;
-
-    fns = malloc( src->page_count*sizeof(xen_pfn_t) );
-    if (!fns) {
-        error("failed to malloc mfns");
-        goto out;
-    }
-    for (i = 0; i < src->page_count; ++i) {
-        if (src->guest_base_addr)
-            fns[i] = (xen_pfn_t)((src->guest_base_addr >> XC_PAGE_SHIFT) + i);
-        else
-            fns[i] = (xen_pfn_t) src->mfns[i];
-    }
-    if (src->guest_base_addr) {
-        mapped = xc_map_foreign_batch_cacheattr(
-                xch, src->pages_domid,
-                PROT_READ | PROT_WRITE, fns, src->page_count,
-                XEN_DOMCTL_MEM_CACHEATTR_WB);
-    } else {
-        mapped = xc_map_foreign_pages( xch, src->pages_domid, PROT_READ | PROT_WRITE, fns, src->page_count );
-    }
-out:
-    if (fns) {
-        free(fns);
-    }
-    return mapped;
-}
+    LIST_INSERT_HEAD(&new_clients, client, link);
 
-static void
-unmap_surfman_surface(uint8_t *mapped, surfman_surface_t *src)
-{
-    if ( munmap(mapped, src->page_count * XC_PAGE_SIZE) < 0 ) {
-        error("failed to unmap framebuffer pages");
-    }
+    memcpy(vnc_buf_put(&client->out, 12), "RFB 003.008\n", 12); /* Send our version */
+    vnc_encode_flush(client);
+    vnc_defer(client, VNC_DEFER_FLUSH);
 }
 
 static surfman_psurface_t
@@ -568,7 +986,7 @@ vnc_get_psurface_from_surface (surfman_plugin_t * p,
 	struct sockaddr_in addr;
 
 	addr.sin_addr.s_addr=INADDR_ANY;
-	addr.sin_port=htons(5900);
+	addr.sin_port=htons(vnc_port);
 	addr.sin_family=AF_INET;
 
 	/* Try not to block the port if surfman cashes */
@@ -601,52 +1019,91 @@ vnc_get_psurface_from_surface (surfman_plugin_t * p,
 
     my_surface = calloc(1, sizeof(vnc_surface));
     my_surface->surface = surface;
-    my_surface->fb = map_surfman_surface(surface);
+    my_surface->fb = surface_map(surface);
 
     return my_surface;
 }
 
+/* Stop queuing pixels straight from the mapping of /s/, it goes away. */
+static void
+vnc_surface_detach(vnc_surface *s)
+{
+    struct vnc_client *c;
+
+    if (!s->fb)
+        return;
+    LIST_FOREACH(c, &clients, link)
+        vnc_sendq_detach(&c->sendq, s->fb,
+                         s->surface->page_count * XC_PAGE_SIZE);
+}
+
+/* Damage /rects/ of /s/ on every client and send what they can take. */
+static void
+vnc_refresh_rects(vnc_surface *s, const surfman_rect_t *rects, size_t n)
+{
+    struct vnc_client *c;
+    size_t i;
+
+    pthread_mutex_lock(&vnc_lock);
+    g_surface = s;
+
+    LIST_FOREACH(c, &clients, link)
+    {
+        if (c->deferred & VNC_DEFER_FREE)
+            continue;
+        for (i = 0; i < n; i++)
+            vnc_client_damage(c, rects[i].x, rects[i].y, rects[i].w, rects[i].h);
+        if (vnc_client_update(c, s))
+            vnc_mark(c, VNC_DEFER_FREE);
+    }
+    pthread_mutex_unlock(&vnc_lock);
+
+    vnc_kick();
+}
+
 static void
 vnc_refresh_psurface(surfman_plugin_t *p,
                         surfman_psurface_t psurface,
                         uint8_t *refresh_bitmap)
 
 {
-    unsigned int i, j, n;
-    int fd;
+    unsigned int n;
     vnc_surface *my_surface = (vnc_surface*) psurface;
-    unsigned int w, h, s;
     surfman_surface_t *surf;
-    uint8_t *fb;
-    struct pending_socket_s *pend, *next_pend;
+    surfman_rect_t rects[SURFMAN_DIRTY_RECTS_MAX];
 
     surf = my_surface->surface;
-    fb = my_surface->fb;
-    w = surf->width;
-    h = surf->height;
-    s = surf->stride;
+    if (!my_surface->fb)
+        return;
 
-    LIST_FOREACH_SAFE(pend, next_pend, &pending_sockets, next)
+    if (refresh_bitmap == NULL)
     {
-	fd = pend->socket->fd;
-	if (fd > 0)
-	{
-	    vnc_write_u8(fd, 0);  /* Message ID */
-	    vnc_write_u8(fd, 0);
-	    vnc_write_u16(fd, 1); /* Number of rects */
-
-	    vnc_write_u16(fd, 0); /* x */
-	    vnc_write_u16(fd, 0); /* y */
-	    vnc_write_u16(fd, w); /* w */
-	    vnc_write_u16(fd, h); /* h */
-
-	    vnc_write_s32(fd, 0);
-	    for (j = 0; j < h; ++j)
-	    	write(fd, fb + j * s, w * 4);
-	}
-	LIST_REMOVE(pend, next);
-	free(pend);
+        rects[0].x = rects[0].y = 0;
+        rects[0].w = surf->width;
+        rects[0].h = surf->height;
+        n = 1;
     }
+    else
+        n = rects_from_dirty_bitmap(refresh_bitmap, surf->width, surf->height,
+                                    surf->stride, surf->format,
+                                    vnc_merge_gap, rects,
+                                    SURFMAN_DIRTY_RECTS_MAX);
+
+    vnc_refresh_rects(my_surface, rects, n);
+}
+
+static void
+vnc_refresh_psurface_rects(surfman_plugin_t *p,
+                           surfman_psurface_t psurface,
+                           const surfman_rect_t *rects,
+                           size_t count)
+{
+    vnc_surface *my_surface = (vnc_surface*) psurface;
+
+    if (!my_surface->fb)
+        return;
+
+    vnc_refresh_rects(my_surface, rects, count);
 }
 
 static void
@@ -656,14 +1113,25 @@ vnc_update_psurface (surfman_plugin_t *plugin,
                         unsigned int flags)
 {
     vnc_surface *my_surface = (vnc_surface*) psurface;
+    struct vnc_client *c;
 
     info("vnc: update_psurface");
+    pthread_mutex_lock(&vnc_lock);
     if (flags & SURFMAN_UPDATE_PAGES)
     {
-	unmap_surfman_surface(my_surface->fb, my_surface->surface);
-	my_surface->fb = map_surfman_surface(surface);
+        uint8_t *old = my_surface->fb;
+
+        vnc_surface_detach(my_surface);
+        /* New reference first, so an unchanged mapping is kept. */
+        my_surface->fb = surface_map(surface);
+        if (old)
+            surface_unmap(surface);
     }
     my_surface->surface = surface;
+
+    LIST_FOREACH(c, &clients, link)
+        vnc_client_damage(c, 0, 0, c->width, c->height);
+    pthread_mutex_unlock(&vnc_lock);
 }
 
 static int
@@ -708,6 +1176,15 @@ vnc_free_psurface (surfman_plugin_t * plugin,
     vnc_surface *my_surface = (vnc_surface*) psurface;
 
     info("vnc: free p");
+    pthread_mutex_lock(&vnc_lock);
+    if (g_surface == my_surface)
+        g_surface = NULL;
+    if (my_surface->fb)
+    {
+        vnc_surface_detach(my_surface);
+        surface_unmap(my_surface->surface);
+    }
+    pthread_mutex_unlock(&vnc_lock);
     free(my_surface);
 }
 
@@ -754,6 +1231,8 @@ surfman_plugin_t surfman_plugin = {
   .post_s3 = vnc_post_s3,
   .increase_brightness = vnc_increase_brightness,
   .decrease_brightness = vnc_decrease_brightness,
-  .options = { 1, SURFMAN_FEATURE_NEED_REFRESH },
+  .refresh_psurface_rects = vnc_refresh_psurface_rects,
+  .options = { 1, SURFMAN_FEATURE_NEED_REFRESH | SURFMAN_FEATURE_REFRESH_RECTS |
+                SURFMAN_FEATURE_THREADED_REFRESH },
   .notify = SURFMAN_NOTIFY_NONE
 };
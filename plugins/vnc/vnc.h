@@ -0,0 +1,149 @@
+/*
+ * Copyright (c) 2014 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __VNC_H__
+#define __VNC_H__
+
+#include "list.h"
+
+#define VNC_TILE 64             /* Damage granularity, also the ZRLE tile size. */
+#define VNC_UPDATE_RECTS_MAX 64 /* Rectangles per update before falling back to bands. */
+#define VNC_IOV_MAX 256         /* iovecs gathered per sendmsg(). */
+#define VNC_READ_SIZE 4096      /* Bytes read from a client at once. */
+#define VNC_INPUT_MAX (4 + 65535 * 4) /* Longest message buffered (SetEncodings). */
+/* Queued bytes past which a client gets no new update. */
+#define VNC_SENDQ_WATERMARK (1024 * 1024)
+
+/* Tight rectangles are split so their pixel data stays under these limits. */
+#define VNC_TIGHT_MAX_WIDTH 2048
+#define VNC_TIGHT_MAX_PIXELS 65536
+/* Smallest non-solid Tight rectangle worth a JPEG. */
+#define VNC_TIGHT_JPEG_MIN_PIXELS 4096
+
+#define VNC_ENCODING_RAW 0
+#define VNC_ENCODING_ZLIB 6
+#define VNC_ENCODING_TIGHT 7
+#define VNC_ENCODING_ZRLE 16
+#define VNC_ENCODING_DESKTOP_SIZE -223
+#define VNC_ENCODING_COMPRESS_LEVEL0 -256
+#define VNC_ENCODING_COMPRESS_LEVEL9 -247
+#define VNC_ENCODING_QUALITY_LEVEL0 -32
+#define VNC_ENCODING_QUALITY_LEVEL9 -23
+
+#define VNC_DEFAULT_WIDTH 1280
+#define VNC_DEFAULT_HEIGHT 1024
+#define VNC_DEFAULT_COMPRESS_LEVEL 2
+#define VNC_DEFAULT_PORT 5900      /* Unless vnc.port is configured. */
+
+/* Growable output buffer. */
+struct vnc_buf
+{
+    uint8_t *data;
+    size_t len;
+    size_t size;
+};
+
+/*
+ * Outgoing data: /lines/ lines of /len/ bytes, /pitch/ bytes apart.
+ * Chunks owning their data (buf != NULL) are a single line; the others point
+ * straight into a mapped guest framebuffer.
+ */
+struct vnc_chunk
+{
+    struct vnc_chunk *next;
+
+    const uint8_t *data;
+    size_t len;
+    size_t pitch;
+    unsigned int lines;
+    size_t off;                 /* Bytes of the first line already sent */
+
+    uint8_t *buf;
+};
+
+struct vnc_sendq
+{
+    struct vnc_chunk *head;
+    struct vnc_chunk **tail;
+    size_t bytes;
+};
+
+enum vnc_client_state
+{
+    VNC_STATE_VERSION,          /* ProtocolVersion */
+    VNC_STATE_SECURITY,         /* Security type */
+    VNC_STATE_INIT,             /* ClientInit */
+    VNC_STATE_NORMAL            /* Client to server messages */
+};
+
+/* Work on a client left for the event loop, see vnc_defer(). */
+#define VNC_DEFER_PARSE (1 << 0)        /* Input buffered, not parsed yet */
+#define VNC_DEFER_FLUSH (1 << 1)        /* Socket writable */
+#define VNC_DEFER_WRITE (1 << 2)        /* Wait for the socket to drain */
+#define VNC_DEFER_FREE  (1 << 3)        /* Disconnected or failed */
+
+struct vnc_client
+{
+    LIST_ENTRY(struct vnc_client) link;
+
+    int fd;
+    struct event ev;
+    struct event wev;           /* Pending while the socket is full */
+    enum vnc_client_state state;
+    struct vnc_buf in;          /* Input not parsed yet */
+    size_t skip;                /* Input bytes to discard (cut text) */
+    struct vnc_sendq sendq;
+    struct vnc_buf out;         /* Update being encoded */
+    struct vnc_buf scratch;     /* Encoder intermediate data */
+
+    /* Negotiated with SetEncodings. */
+    int32_t encoding;
+    int compress_level;
+    int jpeg_quality;           /* -1 unless the client asked for a quality level */
+    int desktop_size;
+
+    /* Framebuffer size as known by the client. */
+    unsigned int width;
+    unsigned int height;
+
+    /* Damage, one byte per VNC_TILE x VNC_TILE tile. */
+    uint8_t *damage;
+    unsigned int tiles_w;
+    unsigned int tiles_h;
+
+    int update_requested;
+    unsigned long frames_dropped;
+
+    int deferred;               /* VNC_DEFER_*, for the event loop */
+
+    z_stream zlib;
+    z_stream zrle;
+    z_stream tight;
+    int zstreams;               /* Initialized streams, VNC_ZSTREAM_* */
+
+    struct jpeg_compress_struct jpeg;
+    struct jpeg_error_mgr jpeg_err;
+    jmp_buf jpeg_jmp;
+    int jpeg_init;
+};
+
+#define VNC_ZSTREAM_ZLIB (1 << 0)
+#define VNC_ZSTREAM_ZRLE (1 << 1)
+#define VNC_ZSTREAM_TIGHT (1 << 2)
+
+#endif /* __VNC_H__ */
@@ -0,0 +1,493 @@
+/*
+ * Copyright (c) 2014 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "project.h"
+
+/*
+ * Browser connections.
+ *
+ * Sockets are non-blocking. The HTTP request goes through http_parser: an
+ * Upgrade to websocket is answered per RFC 6455, any other GET gets the
+ * viewer page and the connection is closed once it is out. Browsers let any
+ * page open a WebSocket to us, so an upgrade is only accepted from the
+ * viewer page, served from the same host, or from websocket.allowed_origin.
+ * DNS rebinding gets past the same host check: set websocket.bind to a
+ * trusted address where that matters. Client frames are
+ * unmasked and handled when complete; output is buffered and written as the
+ * socket takes it.
+ */
+
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+static const char viewer_page[] =
+    "<!DOCTYPE html>\n"
+    "<html><head><title>surfman</title></head>\n"
+    "<body style=\"margin:0;background:#000\"><canvas id=\"c\"></canvas>\n"
+    "<script>\n"
+    "var c = document.getElementById('c'), g = c.getContext('2d');\n"
+    "var ws = new WebSocket('ws://' + location.host + '/'), q = Promise.resolve();\n"
+    "ws.binaryType = 'arraybuffer';\n"
+    "ws.onmessage = function (e) {\n"
+    "  var d = new DataView(e.data), t = d.getUint8(0);\n"
+    "  if (t == 0) { c.width = d.getUint16(1); c.height = d.getUint16(3); return; }\n"
+    "  if (t == 1) {\n"
+    "    var x = d.getUint16(2), y = d.getUint16(4);\n"
+    "    var b = new Blob([new Uint8Array(e.data, 14)], { type: d.getUint8(1) ? 'image/jpeg' : 'image/png' });\n"
+    "    q = q.then(function () { return createImageBitmap(b); })\n"
+    "         .then(function (i) { g.drawImage(i, x, y); });\n"
+    "    return;\n"
+    "  }\n"
+    "  if (t == 2) {\n"
+    "    var a = e.data.slice(1, 5);\n"
+    "    q = q.then(function () { ws.send(a); });\n"
+    "  }\n"
+    "};\n"
+    "</script></body></html>\n";
+
+/* Append a complete, unmasked message. */
+void
+ws_frame (struct ws_buf *b, int opcode, const void *payload, size_t len)
+{
+    ws_buf_u8(b, 0x80 | opcode);        /* FIN */
+    if (len < 126)
+        ws_buf_u8(b, len);
+    else if (len < 65536)
+    {
+        ws_buf_u8(b, 126);
+        ws_buf_u16(b, len);
+    }
+    else
+    {
+        ws_buf_u8(b, 127);
+        ws_buf_u32(b, (uint64_t) len >> 32);
+        ws_buf_u32(b, len);
+    }
+    if (len)
+        memcpy(ws_buf_put(b, len), payload, len);
+}
+
+/* Bytes waiting to be written. */
+size_t
+ws_client_pending (const struct ws_client *c)
+{
+    return c->out.len - c->out_off;
+}
+
+void
+ws_client_put (struct ws_client *c)
+{
+    if (--c->refs)
+        return;
+
+    ws_buf_release(&c->in);
+    ws_buf_release(&c->out);
+    ws_buf_release(&c->field);
+    ws_buf_release(&c->value);
+    free(c->damage);
+    free(c);
+}
+
+void
+ws_client_close (struct ws_client *c)
+{
+    if (c->dead)
+        return;
+
+    surfman_info("websocket: client %d left, %lu frames dropped.", c->fd,
+                 c->frames_dropped);
+    c->dead = 1;
+    event_del(&c->ev);
+    event_del(&c->wev);
+    LIST_REMOVE(c, link);
+    close(c->fd);
+    ws_client_put(c);
+}
+
+/*
+ * Write what the socket takes. Return -1 if the client is gone.
+ */
+int
+ws_client_flush (struct ws_client *c)
+{
+    ssize_t rc;
+
+    while (c->out_off < c->out.len)
+    {
+        rc = send(c->fd, c->out.data + c->out_off, c->out.len - c->out_off,
+                  MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                event_add(&c->wev, NULL);
+                return 0;
+            }
+            surfman_info("websocket: write to client %d failed: %s", c->fd,
+                         strerror(errno));
+            ws_client_close(c);
+            return -1;
+        }
+        c->out_off += rc;
+    }
+
+    c->out.len = c->out_off = 0;
+    if (c->state == WS_STATE_CLOSING)
+    {
+        ws_client_close(c);
+        return -1;
+    }
+
+    return 0;
+}
+
+static void
+ws_client_write_handler (int fd, short event, void *opaque)
+{
+    ws_client_flush(opaque);
+}
+
+/*
+ * HTTP request.
+ */
+static void
+ws_http_header (struct ws_client *c)
+{
+    const char *field, *value;
+
+    if (!c->field.len)
+        return;
+    ws_buf_u8(&c->field, 0);
+    ws_buf_u8(&c->value, 0);
+    field = (const char *) c->field.data;
+    value = (const char *) c->value.data;
+
+    if (!strcasecmp(field, "Upgrade") && !strcasecmp(value, "websocket"))
+        c->upgrade = 1;
+    else if (!strcasecmp(field, "Sec-WebSocket-Key"))
+        snprintf(c->key, sizeof (c->key), "%s", value);
+    else if (!strcasecmp(field, "Host") && strlen(value) < sizeof (c->host))
+        strcpy(c->host, value);
+    else if (!strcasecmp(field, "Origin") && strlen(value) < sizeof (c->origin))
+        strcpy(c->origin, value);
+
+    c->field.len = c->value.len = 0;
+}
+
+static int
+ws_on_header_field (http_parser *parser, const char *at, size_t len)
+{
+    struct ws_client *c = parser->data;
+
+    if (c->value_last)
+        ws_http_header(c);
+    c->value_last = 0;
+    memcpy(ws_buf_put(&c->field, len), at, len);
+
+    return 0;
+}
+
+static int
+ws_on_header_value (http_parser *parser, const char *at, size_t len)
+{
+    struct ws_client *c = parser->data;
+
+    c->value_last = 1;
+    memcpy(ws_buf_put(&c->value, len), at, len);
+
+    return 0;
+}
+
+static int
+ws_on_headers_complete (http_parser *parser)
+{
+    ws_http_header(parser->data);
+
+    return 0;
+}
+
+static int
+ws_on_message_complete (http_parser *parser)
+{
+    struct ws_client *c = parser->data;
+
+    c->complete = 1;
+
+    return 0;
+}
+
+static const http_parser_settings ws_http_settings = {
+    .on_header_field = ws_on_header_field,
+    .on_header_value = ws_on_header_value,
+    .on_headers_complete = ws_on_headers_complete,
+    .on_message_complete = ws_on_message_complete,
+};
+
+static void
+ws_http_reply (struct ws_client *c, const char *status, const char *body)
+{
+    char hdr[256];
+    int n;
+
+    n = snprintf(hdr, sizeof (hdr),
+                 "HTTP/1.1 %s\r\n"
+                 "Content-Type: text/html\r\n"
+                 "Content-Length: %zu\r\n"
+                 "Connection: close\r\n\r\n", status, strlen(body));
+    memcpy(ws_buf_put(&c->out, n), hdr, n);
+    memcpy(ws_buf_put(&c->out, strlen(body)), body, strlen(body));
+    c->state = WS_STATE_CLOSING;
+}
+
+/* The viewer page connects to the host it was served from. */
+static int
+ws_origin_allowed (const struct ws_client *c)
+{
+    const char *allowed = config_get("websocket", WS_CONFIG_ALLOWED_ORIGIN);
+    char self[sizeof ("http://") + sizeof (c->host)];
+
+    if (!c->origin[0])
+        return 0;
+    if (allowed && !strcmp(c->origin, allowed))
+        return 1;
+    snprintf(self, sizeof (self), "http://%s", c->host);
+
+    return c->host[0] && !strcasecmp(c->origin, self);
+}
+
+static int
+ws_handshake (struct ws_client *c)
+{
+    char accept[29], hdr[256], key[sizeof (c->key) + sizeof (WS_GUID)];
+    uint8_t digest[20];
+    int n;
+
+    snprintf(key, sizeof (key), "%s%s", c->key, WS_GUID);
+    ws_sha1(key, strlen(key), digest);
+    ws_base64(digest, sizeof (digest), accept);
+
+    n = snprintf(hdr, sizeof (hdr),
+                 "HTTP/1.1 101 Switching Protocols\r\n"
+                 "Upgrade: websocket\r\n"
+                 "Connection: Upgrade\r\n"
+                 "Sec-WebSocket-Accept: %s\r\n\r\n", accept);
+    memcpy(ws_buf_put(&c->out, n), hdr, n);
+    c->state = WS_STATE_OPEN;
+
+    surfman_info("websocket: client %d connected.", c->fd);
+    ws_client_opened(c);
+
+    return 0;
+}
+
+/* Return the bytes of input consumed, -1 on error. */
+static ssize_t
+ws_http_parse (struct ws_client *c, const uint8_t *p, size_t len)
+{
+    size_t n;
+
+    n = http_parser_execute(&c->parser, &ws_http_settings, (const char *) p, len);
+    if (c->parser.upgrade)
+    {
+        if (!c->upgrade || !c->key[0])
+        {
+            ws_http_reply(c, "400 Bad Request", "");
+            return len;
+        }
+        if (!ws_origin_allowed(c))
+        {
+            surfman_warning("websocket: client %d: origin \"%s\" refused.",
+                            c->fd, c->origin);
+            ws_http_reply(c, "403 Forbidden", "");
+            return len;
+        }
+        ws_handshake(c);
+        return n;
+    }
+    if (HTTP_PARSER_ERRNO(&c->parser) != HPE_OK)
+    {
+        surfman_info("websocket: client %d: bad request (%s).", c->fd,
+                     http_errno_name(HTTP_PARSER_ERRNO(&c->parser)));
+        return -1;
+    }
+    if (c->complete)
+    {
+        /* A plain request: hand out the viewer. */
+        ws_http_reply(c, "200 OK", viewer_page);
+        return len;
+    }
+
+    return n;
+}
+
+/*
+ * WebSocket frames. Return the bytes consumed, 0 if the frame is not
+ * complete, -1 to drop the client.
+ */
+static ssize_t
+ws_frame_parse (struct ws_client *c, uint8_t *p, size_t len)
+{
+    uint64_t plen;
+    size_t hlen = 2, i;
+    uint8_t *mask, *payload;
+    int opcode;
+
+    if (len < 2)
+        return 0;
+    opcode = p[0] & 0x0f;
+    plen = p[1] & 0x7f;
+    if (!(p[1] & 0x80))
+    {
+        surfman_info("websocket: client %d: unmasked frame.", c->fd);
+        return -1;
+    }
+    if (plen == 126)
+    {
+        if (len < 4)
+            return 0;
+        plen = (p[2] << 8) | p[3];
+        hlen = 4;
+    }
+    else if (plen == 127)
+    {
+        if (len < 10)
+            return 0;
+        for (plen = 0, i = 2; i < 10; i++)
+            plen = (plen << 8) | p[i];
+        hlen = 10;
+    }
+    if (plen > WS_INPUT_MAX)
+    {
+        surfman_info("websocket: client %d: message too long.", c->fd);
+        return -1;
+    }
+    if (len < hlen + 4 + plen)
+        return 0;
+
+    mask = p + hlen;
+    payload = mask + 4;
+    for (i = 0; i < plen; i++)
+        payload[i] ^= mask[i % 4];
+
+    if (!(p[0] & 0x80) || opcode == WS_OPCODE_CONTINUATION)
+    {
+        surfman_info("websocket: client %d: fragmented messages are not supported.",
+                     c->fd);
+        return -1;
+    }
+
+    switch (opcode)
+    {
+    case WS_OPCODE_BINARY:
+        if (plen == 4)
+            ws_client_ack(c, ((uint32_t) payload[0] << 24) | (payload[1] << 16) |
+                             (payload[2] << 8) | payload[3]);
+        break;
+    case WS_OPCODE_CLOSE:
+        ws_frame(&c->out, WS_OPCODE_CLOSE, payload, plen < 2 ? plen : 2);
+        c->state = WS_STATE_CLOSING;
+        break;
+    case WS_OPCODE_PING:
+        ws_frame(&c->out, WS_OPCODE_PONG, payload, plen);
+        break;
+    default:
+        break;
+    }
+
+    return hlen + 4 + plen;
+}
+
+static void
+ws_client_read_handler (int fd, short event, void *opaque)
+{
+    struct ws_client *c = opaque;
+    size_t off;
+    ssize_t rc, n;
+
+    for (;;)
+    {
+        ws_buf_put(&c->in, WS_READ_SIZE);
+        c->in.len -= WS_READ_SIZE;
+        rc = read(fd, c->in.data + c->in.len, WS_READ_SIZE);
+        if (rc == 0)
+        {
+            ws_client_close(c);
+            return;
+        }
+        if (rc < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            ws_client_close(c);
+            return;
+        }
+        c->in.len += rc;
+
+        for (off = 0; off < c->in.len && c->state != WS_STATE_CLOSING; off += n)
+        {
+            if (c->state == WS_STATE_HTTP)
+                n = ws_http_parse(c, c->in.data + off, c->in.len - off);
+            else
+                n = ws_frame_parse(c, c->in.data + off, c->in.len - off);
+            if (n < 0)
+            {
+                ws_client_close(c);
+                return;
+            }
+            if (!n)
+                break;
+        }
+        if (c->state == WS_STATE_CLOSING)
+            off = c->in.len;
+        c->in.len -= off;
+        memmove(c->in.data, c->in.data + off, c->in.len);
+        if (c->in.len > WS_INPUT_MAX + 14)
+        {
+            ws_client_close(c);
+            return;
+        }
+
+        if (ws_client_flush(c))
+            return;
+        if (rc < WS_READ_SIZE)
+            break;
+    }
+}
+
+struct ws_client *
+ws_client_new (int fd)
+{
+    struct ws_client *c;
+
+    c = xcalloc(1, sizeof (*c));
+    c->fd = fd;
+    c->refs = 1;
+    c->state = WS_STATE_HTTP;
+    http_parser_init(&c->parser, HTTP_REQUEST);
+    c->parser.data = c;
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    event_set(&c->ev, fd, EV_READ | EV_PERSIST, ws_client_read_handler, c);
+    event_add(&c->ev, NULL);
+    event_set(&c->wev, fd, EV_WRITE, ws_client_write_handler, c);
+
+    return c;
+}
@@ -0,0 +1,403 @@
+/*
+ * Copyright (c) 2014 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "project.h"
+
+/*
+ * Tile encoder thread.
+ *
+ * Jobs carry snapshots of the damaged rectangles of one frame for one client.
+ * The worker compresses each to PNG or JPEG and wraps them in WebSocket
+ * messages, followed by the end of frame message. Finished jobs are handed
+ * back to the event loop through a pipe, like the libsurfman copy pool, and
+ * their messages queued on the client.
+ */
+
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    struct ws_job *head;
+    struct ws_job **tail;
+    struct ws_job *done;
+
+    int running;
+    int pipe[2];
+    struct event event;
+} encoder = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work = PTHREAD_COND_INITIALIZER,
+    .pipe = { -1, -1 },
+};
+
+/* Worker state. */
+static struct ws_buf message;
+static struct ws_buf rows;
+static struct ws_buf idat;
+static z_stream png_z;
+static struct jpeg_compress_struct jpeg;
+static struct jpeg_error_mgr jpeg_err;
+static jmp_buf jpeg_jmp;
+
+uint8_t *
+ws_buf_put (struct ws_buf *b, size_t len)
+{
+    uint8_t *p;
+
+    if (b->len + len > b->size)
+    {
+        size_t size = b->size ? b->size : 4096;
+
+        while (size < b->len + len)
+            size *= 2;
+        b->data = xrealloc(b->data, size);
+        b->size = size;
+    }
+    p = b->data + b->len;
+    b->len += len;
+
+    return p;
+}
+
+void
+ws_buf_u8 (struct ws_buf *b, uint8_t v)
+{
+    *ws_buf_put(b, 1) = v;
+}
+
+void
+ws_buf_u16 (struct ws_buf *b, uint16_t v)
+{
+    uint8_t *p = ws_buf_put(b, 2);
+
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+void
+ws_buf_u32 (struct ws_buf *b, uint32_t v)
+{
+    uint8_t *p = ws_buf_put(b, 4);
+
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+void
+ws_buf_release (struct ws_buf *b)
+{
+    free(b->data);
+    b->data = NULL;
+    b->len = b->size = 0;
+}
+
+static void
+png_chunk (struct ws_buf *b, const char *type, const uint8_t *data, size_t len)
+{
+    uLong crc;
+
+    ws_buf_u32(b, len);
+    memcpy(ws_buf_put(b, 4), type, 4);
+    if (len)
+        memcpy(ws_buf_put(b, len), data, len);
+    crc = crc32(0, (const Bytef *) type, 4);
+    crc = crc32(crc, data, len);
+    ws_buf_u32(b, crc);
+}
+
+/* 8-bit RGB, Sub filter on every row. */
+static int
+encode_png (struct ws_buf *b, const uint8_t *pixels, unsigned int w,
+            unsigned int h)
+{
+    static const uint8_t signature[8] = { 137, 'P', 'N', 'G', '\r', '\n', 26, '\n' };
+    uint8_t ihdr[13];
+    unsigned int x, y;
+    uint8_t *dst;
+    size_t bound;
+
+    rows.len = 0;
+    for (y = 0; y < h; y++)
+    {
+        const uint8_t *src = pixels + y * w * 4;
+
+        dst = ws_buf_put(&rows, 1 + w * 3);
+        *dst++ = 1;             /* Sub */
+        dst[0] = src[2];
+        dst[1] = src[1];
+        dst[2] = src[0];
+        for (x = 1; x < w; x++)
+        {
+            dst[x * 3] = src[x * 4 + 2] - src[x * 4 - 2];
+            dst[x * 3 + 1] = src[x * 4 + 1] - src[x * 4 - 3];
+            dst[x * 3 + 2] = src[x * 4] - src[x * 4 - 4];
+        }
+    }
+
+    if (deflateReset(&png_z) != Z_OK)
+        return -1;
+    bound = deflateBound(&png_z, rows.len);
+    idat.len = 0;
+    ws_buf_put(&idat, bound);
+    png_z.next_in = rows.data;
+    png_z.avail_in = rows.len;
+    png_z.next_out = idat.data;
+    png_z.avail_out = bound;
+    if (deflate(&png_z, Z_FINISH) != Z_STREAM_END)
+        return -1;
+    idat.len = bound - png_z.avail_out;
+
+    memcpy(ws_buf_put(b, sizeof (signature)), signature, sizeof (signature));
+    ihdr[0] = w >> 24; ihdr[1] = w >> 16; ihdr[2] = w >> 8; ihdr[3] = w;
+    ihdr[4] = h >> 24; ihdr[5] = h >> 16; ihdr[6] = h >> 8; ihdr[7] = h;
+    ihdr[8] = 8;                /* Bit depth */
+    ihdr[9] = 2;                /* Truecolour */
+    ihdr[10] = ihdr[11] = ihdr[12] = 0;
+    png_chunk(b, "IHDR", ihdr, sizeof (ihdr));
+    png_chunk(b, "IDAT", idat.data, idat.len);
+    png_chunk(b, "IEND", NULL, 0);
+
+    return 0;
+}
+
+static void
+jpeg_error_exit (j_common_ptr cinfo)
+{
+    longjmp(jpeg_jmp, 1);
+}
+
+static int
+encode_jpeg (struct ws_buf *b, const uint8_t *pixels, unsigned int w,
+             unsigned int h, int quality)
+{
+    unsigned char *data = NULL;
+    unsigned long len = 0;
+    JSAMPROW row;
+
+    if (setjmp(jpeg_jmp))
+    {
+        jpeg_abort_compress(&jpeg);
+        free(data);
+        return -1;
+    }
+
+    jpeg_mem_dest(&jpeg, &data, &len);
+    jpeg.image_width = w;
+    jpeg.image_height = h;
+#ifdef JCS_EXTENSIONS
+    jpeg.input_components = 4;
+    jpeg.in_color_space = JCS_EXT_BGRX;
+#else
+    jpeg.input_components = 3;
+    jpeg.in_color_space = JCS_RGB;
+#endif
+    jpeg_set_defaults(&jpeg);
+    jpeg_set_quality(&jpeg, quality, TRUE);
+    jpeg_start_compress(&jpeg, TRUE);
+    while (jpeg.next_scanline < h)
+    {
+        const uint8_t *src = pixels + jpeg.next_scanline * w * 4;
+#ifdef JCS_EXTENSIONS
+        row = (JSAMPROW) src;
+#else
+        unsigned int x;
+        uint8_t *dst;
+
+        rows.len = 0;
+        row = dst = ws_buf_put(&rows, w * 3);
+        for (x = 0; x < w; x++, src += 4)
+        {
+            *dst++ = src[2];
+            *dst++ = src[1];
+            *dst++ = src[0];
+        }
+#endif
+        jpeg_write_scanlines(&jpeg, &row, 1);
+    }
+    jpeg_finish_compress(&jpeg);
+
+    memcpy(ws_buf_put(b, len), data, len);
+    free(data);
+
+    return 0;
+}
+
+static void
+encode_job (struct ws_job *job)
+{
+    unsigned int i;
+    uint8_t *hdr;
+    int rc;
+
+    for (i = 0; i < job->count; i++)
+    {
+        const surfman_rect_t *r = &job->rects[i];
+
+        message.len = 0;
+        hdr = ws_buf_put(&message, WS_TILE_HEADER);
+        hdr[0] = WS_MSG_TILE;
+        hdr[1] = job->format;
+        hdr[2] = r->x >> 8; hdr[3] = r->x;
+        hdr[4] = r->y >> 8; hdr[5] = r->y;
+        hdr[6] = r->w >> 8; hdr[7] = r->w;
+        hdr[8] = r->h >> 8; hdr[9] = r->h;
+        hdr[10] = job->frame >> 24; hdr[11] = job->frame >> 16;
+        hdr[12] = job->frame >> 8; hdr[13] = job->frame;
+
+        if (job->format == WS_FORMAT_JPEG)
+            rc = encode_jpeg(&message, job->pixels[i], r->w, r->h, job->quality);
+        else
+            rc = encode_png(&message, job->pixels[i], r->w, r->h);
+        if (rc)
+        {
+            surfman_error("Could not encode a %ux%u tile.", r->w, r->h);
+            continue;
+        }
+        ws_frame(&job->out, WS_OPCODE_BINARY, message.data, message.len);
+    }
+
+    message.len = 0;
+    ws_buf_u8(&message, WS_MSG_FRAME);
+    ws_buf_u32(&message, job->frame);
+    ws_frame(&job->out, WS_OPCODE_BINARY, message.data, message.len);
+}
+
+static void *
+encoder_thread (void *opaque)
+{
+    struct ws_job *job;
+    char c = 0;
+
+    (void) opaque;
+
+    pthread_mutex_lock(&encoder.lock);
+    for (;;)
+    {
+        while (!encoder.head)
+            pthread_cond_wait(&encoder.work, &encoder.lock);
+
+        job = encoder.head;
+        encoder.head = job->next;
+        if (!encoder.head)
+            encoder.tail = &encoder.head;
+        pthread_mutex_unlock(&encoder.lock);
+
+        encode_job(job);
+
+        pthread_mutex_lock(&encoder.lock);
+        job->next = encoder.done;
+        encoder.done = job;
+        if (!job->next && write(encoder.pipe[1], &c, 1) != 1)
+            surfman_warning("Could not signal encoded frame: %s", strerror(errno));
+    }
+
+    return NULL;
+}
+
+/* Back in the event loop, in submission order. */
+static void
+encoder_done_handler (int fd, short event, void *opaque)
+{
+    struct ws_job *job, *next, *list = NULL;
+    char buf[16];
+
+    while (read(fd, buf, sizeof (buf)) > 0)
+        continue;
+
+    pthread_mutex_lock(&encoder.lock);
+    job = encoder.done;
+    encoder.done = NULL;
+    pthread_mutex_unlock(&encoder.lock);
+
+    for (; job; job = next)
+    {
+        next = job->next;
+        job->next = list;
+        list = job;
+    }
+    for (job = list; job; job = next)
+    {
+        next = job->next;
+        ws_client_job_done(job);
+        ws_job_free(job);
+    }
+}
+
+int
+ws_encoder_init (void)
+{
+    pthread_t t;
+    int i;
+
+    if (encoder.running)
+        return 0;
+
+    encoder.tail = &encoder.head;
+    memset(&png_z, 0, sizeof (png_z));
+    if (deflateInit(&png_z, Z_BEST_SPEED) != Z_OK)
+        return -1;
+    jpeg.err = jpeg_std_error(&jpeg_err);
+    jpeg_err.error_exit = jpeg_error_exit;
+    jpeg_create_compress(&jpeg);
+
+    if (pipe(encoder.pipe))
+    {
+        surfman_error("Could not create encoder pipe: %s", strerror(errno));
+        return -1;
+    }
+    for (i = 0; i < 2; i++)
+        fcntl(encoder.pipe[i], F_SETFL, fcntl(encoder.pipe[i], F_GETFL) | O_NONBLOCK);
+    event_set(&encoder.event, encoder.pipe[0], EV_READ | EV_PERSIST,
+              encoder_done_handler, NULL);
+    event_add(&encoder.event, NULL);
+
+    if (pthread_create(&t, NULL, encoder_thread, NULL))
+    {
+        surfman_error("Could not start the encoder thread: %s", strerror(errno));
+        return -1;
+    }
+    pthread_detach(t);
+    encoder.running = 1;
+
+    return 0;
+}
+
+void
+ws_encoder_submit (struct ws_job *job)
+{
+    job->next = NULL;
+
+    pthread_mutex_lock(&encoder.lock);
+    *encoder.tail = job;
+    encoder.tail = &job->next;
+    pthread_cond_signal(&encoder.work);
+    pthread_mutex_unlock(&encoder.lock);
+}
+
+void
+ws_job_free (struct ws_job *job)
+{
+    unsigned int i;
+
+    for (i = 0; i < job->count; i++)
+        free(job->pixels[i]);
+    ws_buf_release(&job->out);
+    free(job);
+}
@@ -18,5 +18,28 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
 
+#include <event.h>
+#include <zlib.h>
+#include <jpeglib.h>
+
+#include <xenctrl.h>
 #include <surfman.h>
+
+#include "http_parser.h"
+#include "websocket.h"
+#include "prototypes.h"
@@ -17,3 +17,33 @@
  */
 
 /* websocket.c */
+extern void ws_client_job_done(struct ws_job *job);
+extern void ws_client_ack(struct ws_client *c, uint32_t frame);
+extern void ws_client_opened(struct ws_client *c);
+extern surfman_plugin_t surfman_plugin;
+/* client.c */
+extern void ws_frame(struct ws_buf *b, int opcode, const void *payload, size_t len);
+extern size_t ws_client_pending(const struct ws_client *c);
+extern void ws_client_put(struct ws_client *c);
+extern void ws_client_close(struct ws_client *c);
+extern int ws_client_flush(struct ws_client *c);
+extern struct ws_client *ws_client_new(int fd);
+/* encoder.c */
+extern uint8_t *ws_buf_put(struct ws_buf *b, size_t len);
+extern void ws_buf_u8(struct ws_buf *b, uint8_t v);
+extern void ws_buf_u16(struct ws_buf *b, uint16_t v);
+extern void ws_buf_u32(struct ws_buf *b, uint32_t v);
+extern void ws_buf_release(struct ws_buf *b);
+extern int ws_encoder_init(void);
+extern void ws_encoder_submit(struct ws_job *job);
+extern void ws_job_free(struct ws_job *job);
+/* sha1.c */
+extern void ws_sha1(const void *data, size_t len, uint8_t digest[20]);
+extern void ws_base64(const uint8_t *in, size_t len, char *out);
+/* http_parser.c */
+extern size_t http_parser_execute(http_parser *parser, const http_parser_settings *settings, const char *data, size_t len);
+extern int http_should_keep_alive(http_parser *parser);
+extern const char *http_method_str(enum http_method m);
+extern void http_parser_init(http_parser *parser, enum http_parser_type t);
+extern const char *http_errno_name(enum http_errno err);
+extern const char *http_errno_description(enum http_errno err);
@@ -0,0 +1,119 @@
+/*
+ * Copyright (c) 2014 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "project.h"
+
+/*
+ * SHA-1 and base64, just enough for Sec-WebSocket-Accept (RFC 6455, 4.2.2).
+ */
+
+#define ROL(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void
+sha1_block (uint32_t h[5], const uint8_t *p)
+{
+    uint32_t w[80], a, b, c, d, e, f, k, t;
+    unsigned int i;
+
+    for (i = 0; i < 16; i++)
+        w[i] = ((uint32_t) p[4 * i] << 24) | (p[4 * i + 1] << 16) |
+               (p[4 * i + 2] << 8) | p[4 * i + 3];
+    for (; i < 80; i++)
+        w[i] = ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+    a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4];
+    for (i = 0; i < 80; i++)
+    {
+        if (i < 20)
+        {
+            f = (b & c) | (~b & d);
+            k = 0x5a827999;
+        }
+        else if (i < 40)
+        {
+            f = b ^ c ^ d;
+            k = 0x6ed9eba1;
+        }
+        else if (i < 60)
+        {
+            f = (b & c) | (b & d) | (c & d);
+            k = 0x8f1bbcdc;
+        }
+        else
+        {
+            f = b ^ c ^ d;
+            k = 0xca62c1d6;
+        }
+        t = ROL(a, 5) + f + e + k + w[i];
+        e = d; d = c; c = ROL(b, 30); b = a; a = t;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+}
+
+void
+ws_sha1 (const void *data, size_t len, uint8_t digest[20])
+{
+    uint32_t h[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+    const uint8_t *p = data;
+    uint8_t last[128];
+    size_t n, i;
+    uint64_t bits = (uint64_t) len * 8;
+
+    for (; len >= 64; p += 64, len -= 64)
+        sha1_block(h, p);
+
+    memset(last, 0, sizeof (last));
+    memcpy(last, p, len);
+    last[len] = 0x80;
+    n = len + 9 > 64 ? 128 : 64;
+    for (i = 0; i < 8; i++)
+        last[n - 1 - i] = bits >> (8 * i);
+    sha1_block(h, last);
+    if (n == 128)
+        sha1_block(h, last + 64);
+
+    for (i = 0; i < 20; i++)
+        digest[i] = h[i / 4] >> (24 - 8 * (i % 4));
+}
+
+/* /out/ holds 4 * ((len + 2) / 3) + 1 bytes. */
+void
+ws_base64 (const uint8_t *in, size_t len, char *out)
+{
+    static const char alphabet[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    uint32_t v;
+
+    for (; len >= 3; in += 3, len -= 3)
+    {
+        v = (in[0] << 16) | (in[1] << 8) | in[2];
+        *out++ = alphabet[(v >> 18) & 63];
+        *out++ = alphabet[(v >> 12) & 63];
+        *out++ = alphabet[(v >> 6) & 63];
+        *out++ = alphabet[v & 63];
+    }
+    if (len)
+    {
+        v = (in[0] << 16) | (len > 1 ? in[1] << 8 : 0);
+        *out++ = alphabet[(v >> 18) & 63];
+        *out++ = alphabet[(v >> 12) & 63];
+        *out++ = len > 1 ? alphabet[(v >> 6) & 63] : '=';
+        *out++ = '=';
+    }
+    *out = '\0';
+}
@@ -18,16 +18,435 @@
 
 #include "project.h"
 
+/*
+ * Streams the guest framebuffer to browsers over WebSocket.
+ *
+ * Refreshes damage the 64x64 tiles of every client. When a client is ready
+ * for a frame its damaged tiles are coalesced into rectangles, snapshotted
+ * and handed to the encoder thread; the encoded tiles come back as a batch
+ * of messages ending with WS_MSG_FRAME. The browser acknowledges each frame
+ * once drawn, which paces the stream and measures the end-to-end latency.
+ */
+
+static LIST_HEAD (ws_clients, ws_client) clients;
+
+/* Surface last refreshed. */
+static ws_surface *g_surface = NULL;
+
+static int g_monitor = 1;
+
+static struct
+{
+    int port;
+    const char *bind;
+    enum ws_format format;
+    int quality;
+    uint64_t frame_us;          /* Shortest interval between two frames */
+    unsigned int width;
+    unsigned int height;
+    unsigned int merge_gap;     /* Clean lines between coalesced damage */
+} ws_config;
+
+static int ws_socket = -1;
+static struct event ws_socket_event;
+
+static uint64_t
+ws_now_us (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int
+ws_config_int (const char *key, int def)
+{
+    const char *v = config_get("websocket", key);
+
+    return v ? atoi(v) : def;
+}
+
+static void
+ws_load_config (void)
+{
+    const char *format;
+    int fps;
+
+    ws_config.port = ws_config_int(WS_CONFIG_PORT, WS_DEFAULT_PORT);
+    ws_config.bind = config_get("websocket", WS_CONFIG_BIND);
+    if (!ws_config.bind)
+        ws_config.bind = WS_DEFAULT_BIND;
+    ws_config.quality = ws_config_int(WS_CONFIG_QUALITY, WS_DEFAULT_QUALITY);
+    if (ws_config.quality < 1 || ws_config.quality > 100)
+        ws_config.quality = WS_DEFAULT_QUALITY;
+    fps = ws_config_int(WS_CONFIG_FPS, WS_DEFAULT_FPS);
+    ws_config.frame_us = fps > 0 ? 1000000 / fps : 0;
+    ws_config.width = ws_config_int(WS_CONFIG_WIDTH, WS_DEFAULT_WIDTH);
+    ws_config.height = ws_config_int(WS_CONFIG_HEIGHT, WS_DEFAULT_HEIGHT);
+    ws_config.merge_gap = rects_merge_gap("websocket");
+
+    format = config_get("websocket", WS_CONFIG_FORMAT);
+    ws_config.format = format && !strcasecmp(format, "jpeg") ?
+                       WS_FORMAT_JPEG : WS_FORMAT_PNG;
+}
+
+/* Mark the tiles covering a rectangle of the client framebuffer as damaged. */
+static void
+ws_client_damage (struct ws_client *c, unsigned int x, unsigned int y,
+                  unsigned int w, unsigned int h)
+{
+    unsigned int tx, ty, tx1, ty1;
+
+    if (x >= c->width || y >= c->height || !w || !h)
+        return;
+    if (w > c->width - x)
+        w = c->width - x;
+    if (h > c->height - y)
+        h = c->height - y;
+
+    tx1 = (x + w - 1) / WS_TILE;
+    ty1 = (y + h - 1) / WS_TILE;
+    for (ty = y / WS_TILE; ty <= ty1; ty++)
+        for (tx = x / WS_TILE; tx <= tx1; tx++)
+            c->damage[ty * c->tiles_w + tx] = 1;
+}
+
+/* (Re)size the client framebuffer and tell the browser. */
+static void
+ws_client_resize (struct ws_client *c, unsigned int width, unsigned int height)
+{
+    uint8_t msg[5];
+
+    c->width = width;
+    c->height = height;
+    c->tiles_w = (width + WS_TILE - 1) / WS_TILE;
+    c->tiles_h = (height + WS_TILE - 1) / WS_TILE;
+    free(c->damage);
+    c->damage = xcalloc(c->tiles_w * c->tiles_h, 1);
+    ws_client_damage(c, 0, 0, width, height);
+
+    msg[0] = WS_MSG_SIZE;
+    msg[1] = width >> 8; msg[2] = width;
+    msg[3] = height >> 8; msg[4] = height;
+    ws_frame(&c->out, WS_OPCODE_BINARY, msg, sizeof (msg));
+}
+
+/*
+ * Turn the damaged tiles into rectangles, clipped to the client framebuffer,
+ * and clear them. Runs of tiles on a tile row are merged with the run right
+ * above when they span the same columns. Past /max/ rectangles, the bounding
+ * box of the damage is sent instead.
+ */
+static unsigned int
+ws_client_damage_rects (struct ws_client *c, surfman_rect_t *rects,
+                        unsigned int max)
+{
+    unsigned int tx, tx0, ty, i, n = 0;
+    unsigned int bx0 = c->tiles_w, by0 = c->tiles_h, bx1 = 0, by1 = 0;
+    int overflow = 0;
+
+    for (ty = 0; ty < c->tiles_h; ty++)
+    {
+        for (tx = 0; tx < c->tiles_w; tx++)
+        {
+            if (!c->damage[ty * c->tiles_w + tx])
+                continue;
+
+            tx0 = tx;
+            while (tx < c->tiles_w && c->damage[ty * c->tiles_w + tx])
+                c->damage[ty * c->tiles_w + tx++] = 0;
+
+            if (tx0 < bx0)
+                bx0 = tx0;
+            if (tx > bx1)
+                bx1 = tx;
+            if (ty < by0)
+                by0 = ty;
+            by1 = ty + 1;
+
+            if (overflow)
+                continue;
+            for (i = 0; i < n; i++)
+                if (rects[i].x == tx0 && rects[i].w == tx - tx0 &&
+                    rects[i].y + rects[i].h == ty)
+                    break;
+            if (i < n)
+                rects[i].h++;
+            else if (n < max)
+            {
+                rects[n].x = tx0;
+                rects[n].y = ty;
+                rects[n].w = tx - tx0;
+                rects[n].h = 1;
+                n++;
+            }
+            else
+                overflow = 1;
+        }
+    }
+
+    if (overflow)
+    {
+        rects[0].x = bx0;
+        rects[0].y = by0;
+        rects[0].w = bx1 - bx0;
+        rects[0].h = by1 - by0;
+        n = 1;
+    }
+
+    /* Tiles to pixels. */
+    for (i = 0; i < n; i++)
+    {
+        unsigned int x1 = (rects[i].x + rects[i].w) * WS_TILE;
+        unsigned int y1 = (rects[i].y + rects[i].h) * WS_TILE;
+
+        rects[i].x *= WS_TILE;
+        rects[i].y *= WS_TILE;
+        rects[i].w = (x1 > c->width ? c->width : x1) - rects[i].x;
+        rects[i].h = (y1 > c->height ? c->height : y1) - rects[i].y;
+    }
+
+    return n;
+}
+
+/* Copy a rectangle of the surface as BGRX, w * 4 bytes per line. */
+static uint8_t *
+ws_snapshot (ws_surface *s, const surfman_rect_t *r)
+{
+    surfman_surface_t *surf = s->surface;
+    size_t pitch = r->w * 4;
+    uint8_t *dst, *src;
+    unsigned int y;
+
+    dst = xmalloc(pitch * r->h);
+    switch (surf->format)
+    {
+    case SURFMAN_FORMAT_BGR565:
+        src = s->fb + surf->offset + r->y * surf->stride + r->x * 2;
+        for (y = 0; y < r->h; y++)
+            blit_expand_565((uint32_t *) (dst + y * pitch),
+                            (const uint16_t *) (src + y * surf->stride), r->w);
+        break;
+    case SURFMAN_FORMAT_RGBX8888:
+        src = s->fb + surf->offset + r->y * surf->stride + r->x * 4;
+        for (y = 0; y < r->h; y++)
+            blit_swizzle((uint32_t *) (dst + y * pitch),
+                         (const uint32_t *) (src + y * surf->stride), r->w);
+        break;
+    default:
+        src = s->fb + surf->offset + r->y * surf->stride + r->x * 4;
+        blit_rect(dst, pitch, src, surf->stride, pitch, r->h);
+        break;
+    }
+
+    return dst;
+}
+
+/*
+ * Hand the damage of a client to the encoder if it is ready for a frame:
+ * nothing being encoded, less than WS_FRAMES_IN_FLIGHT frames unacknowledged,
+ * its output under WS_OUTPUT_WATERMARK and the frame interval elapsed.
+ * Otherwise return -1, the damage keeps accumulating for a later frame.
+ */
+static int
+ws_client_update (struct ws_client *c, ws_surface *s)
+{
+    surfman_surface_t *surf = s->surface;
+    struct ws_job *job;
+    unsigned int i;
+    uint64_t now;
+
+    if (c->state != WS_STATE_OPEN || !s->fb)
+        return 0;
+
+    now = ws_now_us();
+    if (c->encoding ||
+        c->frame - c->acked >= WS_FRAMES_IN_FLIGHT ||
+        ws_client_pending(c) > WS_OUTPUT_WATERMARK ||
+        now - c->last_frame_us < ws_config.frame_us)
+        return -1;
+
+    if (surf->width != c->width || surf->height != c->height)
+        ws_client_resize(c, surf->width, surf->height);
+
+    job = xcalloc(1, sizeof (*job));
+    job->count = ws_client_damage_rects(c, job->rects, WS_TILE_RECTS_MAX);
+    if (!job->count)
+    {
+        free(job);
+        return 0;
+    }
+
+    for (i = 0; i < job->count; i++)
+        job->pixels[i] = ws_snapshot(s, &job->rects[i]);
+    job->client = c;
+    job->format = ws_config.format;
+    job->quality = ws_config.quality;
+    job->frame = ++c->frame;
+
+    c->capture_us[c->frame % (WS_FRAMES_IN_FLIGHT + 1)] = now;
+    c->last_frame_us = now;
+    c->encoding = 1;
+    c->refs++;
+    ws_encoder_submit(job);
+
+    return 0;
+}
+
+/* The encoder is done with a frame of /job->client/. */
+void
+ws_client_job_done (struct ws_job *job)
+{
+    struct ws_client *c = job->client;
+
+    c->encoding = 0;
+    if (c->dead)
+    {
+        ws_client_put(c);
+        return;
+    }
+
+    memcpy(ws_buf_put(&c->out, job->out.len), job->out.data, job->out.len);
+    ws_client_put(c);
+    if (ws_client_flush(c))
+        return;
+
+    /* Damage that came while encoding. */
+    if (g_surface)
+        ws_client_update(c, g_surface);
+}
+
+/* The browser drew /frame/. */
+void
+ws_client_ack (struct ws_client *c, uint32_t frame)
+{
+    uint64_t latency;
+
+    if (frame - c->acked > c->frame - c->acked || frame == c->acked)
+        return;
+    c->acked = frame;
+
+    latency = ws_now_us() - c->capture_us[frame % (WS_FRAMES_IN_FLIGHT + 1)];
+    c->latency_total_us += latency;
+    if (latency > c->latency_max_us)
+        c->latency_max_us = latency;
+    if (++c->latency_count == WS_LATENCY_PERIOD)
+    {
+        surfman_info("websocket: client %d: latency avg %lluus max %lluus, "
+                     "%lu frames dropped.", c->fd,
+                     (unsigned long long) (c->latency_total_us / c->latency_count),
+                     (unsigned long long) c->latency_max_us, c->frames_dropped);
+        c->latency_total_us = c->latency_max_us = 0;
+        c->latency_count = 0;
+    }
+
+    if (g_surface)
+        ws_client_update(c, g_surface);
+}
+
+/* The WebSocket handshake is done, send the whole screen. */
+void
+ws_client_opened (struct ws_client *c)
+{
+    if (g_surface)
+        ws_client_resize(c, g_surface->surface->width,
+                         g_surface->surface->height);
+    else
+        ws_client_resize(c, ws_config.width, ws_config.height);
+}
+
+static void
+ws_socket_handler (int sockfd, short event, void *opaque)
+{
+    struct ws_client *c;
+    int fd, one = 1;
+
+    fd = accept(sockfd, NULL, NULL);
+    if (fd < 0)
+    {
+        surfman_warning("websocket: accept failed: %s", strerror(errno));
+        return;
+    }
+    /* Frame ends are small writes, do not wait for more. */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+
+    c = ws_client_new(fd);
+    LIST_INSERT_HEAD(&clients, c, link);
+}
+
+static int
+ws_listen (const char *bind_addr, int port)
+{
+    struct sockaddr_in addr;
+    int fd, one = 1;
+
+    memset(&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, bind_addr, &addr.sin_addr) != 1)
+    {
+        surfman_error("websocket: invalid %s address \"%s\".", WS_CONFIG_BIND,
+                      bind_addr);
+        return -1;
+    }
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+    {
+        surfman_error("websocket: socket failed: %s", strerror(errno));
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof (one));
+
+    if (bind(fd, (struct sockaddr *) &addr, sizeof (addr)) || listen(fd, 16))
+    {
+        surfman_error("websocket: cannot listen on %s:%d: %s", bind_addr, port,
+                      strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
 static int
 websocket_init (surfman_plugin_t * p)
 {
+    surfman_info("websocket: init");
+
+    LIST_INIT(&clients);
+    ws_load_config();
+
+    if (ws_encoder_init())
+        return SURFMAN_ERROR;
+
+    ws_socket = ws_listen(ws_config.bind, ws_config.port);
+    if (ws_socket < 0)
+        return SURFMAN_ERROR;
+    event_set(&ws_socket_event, ws_socket, EV_READ | EV_PERSIST,
+              ws_socket_handler, NULL);
+    event_add(&ws_socket_event, NULL);
+
+    surfman_info("websocket: listening on %s:%d, %s tiles.", ws_config.bind,
+                 ws_config.port, ws_config.format == WS_FORMAT_JPEG ? "jpeg" : "png");
+
     return SURFMAN_SUCCESS;
 }
 
 static void
 websocket_shutdown (surfman_plugin_t * p)
 {
-
+    surfman_info("websocket: shutdown");
+
+    while (!LIST_EMPTY(&clients))
+        ws_client_close(LIST_FIRST(&clients));
+    if (ws_socket >= 0)
+    {
+        event_del(&ws_socket_event);
+        close(ws_socket);
+        ws_socket = -1;
+    }
 }
 
 static int
@@ -43,7 +462,11 @@ websocket_get_monitors (surfman_plugin_t * p,
                      surfman_monitor_t * monitors,
                      size_t size)
 {
-    return 0;
+    if (!size)
+        return 0;
+    monitors[0] = &g_monitor;
+
+    return 1;
 }
 
 static int
@@ -60,6 +483,25 @@ websocket_get_monitor_info (surfman_plugin_t * p,
                          surfman_monitor_info_t * info,
                          unsigned int modes_count)
 {
+    unsigned int w = ws_config.width, h = ws_config.height;
+
+    if (!modes_count)
+        return SURFMAN_ERROR;
+
+    info->modes[0].htimings[SURFMAN_TIMING_ACTIVE] = w;
+    info->modes[0].htimings[SURFMAN_TIMING_SYNC_START] = w;
+    info->modes[0].htimings[SURFMAN_TIMING_SYNC_END] = w;
+    info->modes[0].htimings[SURFMAN_TIMING_TOTAL] = w;
+
+    info->modes[0].vtimings[SURFMAN_TIMING_ACTIVE] = h;
+    info->modes[0].vtimings[SURFMAN_TIMING_SYNC_START] = h;
+    info->modes[0].vtimings[SURFMAN_TIMING_SYNC_END] = h;
+    info->modes[0].vtimings[SURFMAN_TIMING_TOTAL] = h;
+
+    info->prefered_mode = &info->modes[0];
+    info->current_mode = &info->modes[0];
+    info->mode_count = 1;
+
     return SURFMAN_SUCCESS;
 }
 
@@ -75,7 +517,19 @@ static surfman_psurface_t
 websocket_get_psurface_from_surface (surfman_plugin_t * p,
                                   surfman_surface_t * surface)
 {
-    return NULL;
+    ws_surface *s;
+
+    s = xcalloc(1, sizeof (*s));
+    s->surface = surface;
+    s->fb = surface_map(surface);
+    if (!s->fb)
+    {
+        surfman_error("websocket: could not map the surface.");
+        free(s);
+        return NULL;
+    }
+
+    return s;
 }
 
 static void
@@ -83,7 +537,39 @@ websocket_refresh_psurface(surfman_plugin_t *p,
                         surfman_psurface_t psurface,
                         uint8_t *refresh_bitmap)
 {
-
+    ws_surface *s = psurface;
+    surfman_surface_t *surf = s->surface;
+    surfman_rect_t rects[SURFMAN_DIRTY_RECTS_MAX];
+    struct ws_client *c, *next;
+    unsigned int i, n;
+
+    if (!s->fb)
+        return;
+    g_surface = s;
+
+    if (refresh_bitmap == NULL)
+    {
+        rects[0].x = rects[0].y = 0;
+        rects[0].w = surf->width;
+        rects[0].h = surf->height;
+        n = 1;
+    }
+    else
+        n = rects_from_dirty_bitmap(refresh_bitmap, surf->width, surf->height,
+                                    surf->stride, surf->format,
+                                    ws_config.merge_gap, rects,
+                                    SURFMAN_DIRTY_RECTS_MAX);
+
+    for (c = LIST_FIRST(&clients); c; c = next)
+    {
+        next = LIST_NEXT(c, link);
+        if (c->state != WS_STATE_OPEN)
+            continue;
+        for (i = 0; i < n; i++)
+            ws_client_damage(c, rects[i].x, rects[i].y, rects[i].w, rects[i].h);
+        if (ws_client_update(c, s))
+            c->frames_dropped++;
+    }
 }
 
 static void
@@ -92,7 +578,20 @@ websocket_update_psurface (surfman_plugin_t *plugin,
                         surfman_surface_t *surface,
                         unsigned int flags)
 {
-
+    ws_surface *s = psurface;
+    struct ws_client *c;
+
+    /* Jobs in flight own snapshots, the mapping can go at once. */
+    if (flags & SURFMAN_UPDATE_PAGES)
+    {
+        if (s->fb)
+            surface_unmap(s->surface);
+        s->fb = surface_map(surface);
+    }
+    s->surface = surface;
+
+    LIST_FOREACH(c, &clients, link)
+        ws_client_damage(c, 0, 0, c->width, c->height);
 }
 
 static int
@@ -129,7 +628,13 @@ static void
 websocket_free_psurface (surfman_plugin_t * plugin,
                       surfman_psurface_t psurface)
 {
+    ws_surface *s = psurface;
 
+    if (g_surface == s)
+        g_surface = NULL;
+    if (s->fb)
+        surface_unmap(s->surface);
+    free(s);
 }
 
 static void
@@ -177,6 +682,6 @@ surfman_plugin_t surfman_plugin = {
   .post_s3 = websocket_post_s3,
   .increase_brightness = websocket_increase_brightness,
   .decrease_brightness = websocket_decrease_brightness,
-  .options = { 1, SURFMAN_FEATURE_NONE },
+  .options = { 1, SURFMAN_FEATURE_NEED_REFRESH },
   .notify = SURFMAN_NOTIFY_NONE
 };
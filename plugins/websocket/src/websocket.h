@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2014 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __WEBSOCKET_H__
+#define __WEBSOCKET_H__
+
+/* surfman.conf, [websocket] section, and their defaults. */
+#define WS_CONFIG_PORT "port"           /* TCP port, serves the viewer page and the stream */
+#define WS_CONFIG_BIND "bind"           /* IPv4 address listened on */
+#define WS_CONFIG_ALLOWED_ORIGIN "allowed_origin" /* Origin accepted besides the viewer page's */
+#define WS_CONFIG_FORMAT "format"       /* "png" or "jpeg" */
+#define WS_CONFIG_QUALITY "quality"     /* JPEG quality */
+#define WS_CONFIG_FPS "fps"             /* Frame rate cap, per client */
+#define WS_CONFIG_WIDTH "width"         /* Mode of the virtual monitor */
+#define WS_CONFIG_HEIGHT "height"
+
+#define WS_DEFAULT_PORT 8080
+#define WS_DEFAULT_BIND "0.0.0.0"
+#define WS_DEFAULT_QUALITY 80
+#define WS_DEFAULT_FPS 30
+#define WS_DEFAULT_WIDTH 1280
+#define WS_DEFAULT_HEIGHT 1024
+
+#define WS_TILE 64              /* Damage granularity. */
+#define WS_TILE_RECTS_MAX 32    /* Images per frame before sending the bounding box. */
+#define WS_FRAMES_IN_FLIGHT 2   /* Frames sent but not acknowledged by a client. */
+#define WS_OUTPUT_WATERMARK (4 * 1024 * 1024) /* Output bytes past which a client gets no frame. */
+#define WS_INPUT_MAX 8192       /* Longest request or client message buffered. */
+#define WS_READ_SIZE 4096
+#define WS_LATENCY_PERIOD 128   /* Acknowledged frames between latency reports. */
+
+/*
+ * Server to browser messages, one per binary WebSocket message. Integers are
+ * big-endian.
+ *   WS_MSG_SIZE:  u8 type, u16 width, u16 height
+ *   WS_MSG_TILE:  u8 type, u8 format, u16 x, u16 y, u16 w, u16 h, u32 frame,
+ *                 then a PNG or JPEG image
+ *   WS_MSG_FRAME: u8 type, u32 frame; the frame is complete
+ * Browser to server: u32 frame, once the frame is drawn.
+ */
+#define WS_MSG_SIZE 0
+#define WS_MSG_TILE 1
+#define WS_MSG_FRAME 2
+
+/* RFC 6455 opcodes. */
+#define WS_OPCODE_CONTINUATION 0x0
+#define WS_OPCODE_TEXT 0x1
+#define WS_OPCODE_BINARY 0x2
+#define WS_OPCODE_CLOSE 0x8
+#define WS_OPCODE_PING 0x9
+#define WS_OPCODE_PONG 0xa
+#define WS_TILE_HEADER 14
+
+enum ws_format
+{
+    WS_FORMAT_PNG,
+    WS_FORMAT_JPEG
+};
+
+struct ws_buf
+{
+    uint8_t *data;
+    size_t len;
+    size_t size;
+};
+
+typedef struct
+{
+    surfman_surface_t *surface;
+    uint8_t *fb;
+} ws_surface;
+
+enum ws_client_state
+{
+    WS_STATE_HTTP,              /* Reading the request */
+    WS_STATE_OPEN,              /* WebSocket established */
+    WS_STATE_CLOSING            /* Flushing a last response, then close */
+};
+
+/* A frame of tiles, encoded by the worker. */
+struct ws_job
+{
+    struct ws_job *next;
+    struct ws_client *client;
+
+    enum ws_format format;
+    int quality;
+    uint32_t frame;
+    unsigned int count;
+    surfman_rect_t rects[WS_TILE_RECTS_MAX];
+    uint8_t *pixels[WS_TILE_RECTS_MAX];    /* Snapshots, w * 4 bytes per line */
+    struct ws_buf out;                      /* WebSocket messages */
+};
+
+struct ws_client
+{
+    LIST_ENTRY(ws_client) link;
+
+    int fd;
+    struct event ev;
+    struct event wev;
+    enum ws_client_state state;
+
+    struct ws_buf in;
+    struct ws_buf out;
+    size_t out_off;             /* Bytes of out already written */
+
+    /* HTTP request. */
+    http_parser parser;
+    struct ws_buf field;
+    struct ws_buf value;
+    int value_last;
+    int upgrade;
+    int complete;
+    char key[64];
+    char host[256];
+    char origin[256];           /* Empty if missing or too long */
+
+    /* Geometry known to the browser and its damage, one byte per tile. */
+    unsigned int width;
+    unsigned int height;
+    uint8_t *damage;
+    unsigned int tiles_w;
+    unsigned int tiles_h;
+
+    /* Pacing. */
+    uint32_t frame;             /* Last frame sent */
+    uint32_t acked;             /* Last frame acknowledged */
+    int encoding;               /* A job is with the worker */
+    uint64_t last_frame_us;
+    uint64_t capture_us[WS_FRAMES_IN_FLIGHT + 1];
+
+    /* End-to-end latency: capture to acknowledgement. */
+    uint64_t latency_total_us;
+    uint64_t latency_max_us;
+    unsigned int latency_count;
+    unsigned long frames_dropped;
+
+    int refs;                   /* Event loop + jobs in flight */
+    int dead;
+};
+
+#endif /* __WEBSOCKET_H__ */
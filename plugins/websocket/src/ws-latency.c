@@ -0,0 +1,513 @@
+/*
+ * Copyright (c) 2014 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include "project.h"
+#include <signal.h>
+#include <surfman-memfd.h>
+
+/*
+ * Headless client measuring the end-to-end frame latency of the plugin.
+ *
+ * The plugin runs in this process on a memfd-backed surface. Every tick,
+ * the "guest" writes a new sequence number into the top-left tile of the
+ * surface and refreshes it from the event loop, as surfman does. An upgrade
+ * from another origin must be refused. A client thread then goes through the
+ * WebSocket handshake, decodes the first pixel of
+ * every PNG tile covering the top-left corner and acknowledges each frame
+ * like the viewer page does. The latency of a sequence number is the time
+ * from its write to the decode of the first tile showing it, so it covers
+ * pacing, the snapshot, the encoder thread and the socket.
+ *
+ *   ws-latency [seconds] [fps cap, 0 for none] [width height]
+ */
+
+#define TICK_US 16667           /* Guest updates, 60Hz */
+#define SEQ_RING 1024           /* Write times kept, by sequence number */
+#define SAMPLES_MAX 65536
+
+extern surfman_plugin_t surfman_plugin;
+
+static unsigned int width = 1280;
+static unsigned int height = 720;
+static unsigned short port;
+
+static surfman_surface_t *surface;
+static surfman_psurface_t psurface;
+static uint32_t *fb;
+static volatile int done;
+
+static struct event tick_event;
+static uint32_t seq;
+static uint64_t written_us[SEQ_RING];
+
+static uint32_t seen;
+static unsigned long frames, tiles;
+static uint64_t bytes;
+static uint64_t samples[SAMPLES_MAX];
+static unsigned int sample_count;
+
+static uint64_t
+now_us (void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int
+read_full (int fd, void *buf, size_t len)
+{
+    uint8_t *p = buf;
+    ssize_t rc;
+
+    while (len)
+    {
+        rc = read(fd, p, len);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            return -1;
+        p += rc;
+        len -= rc;
+    }
+
+    return 0;
+}
+
+static int
+write_full (int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    ssize_t rc;
+
+    while (len)
+    {
+        rc = write(fd, p, len);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0)
+            return -1;
+        p += rc;
+        len -= rc;
+    }
+
+    return 0;
+}
+
+static uint32_t
+get_u32 (const uint8_t *p)
+{
+    return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+/*
+ * Connect and upgrade as a page of /origin/ would, the reply headers end with
+ * an empty line.
+ */
+static int
+client_connect (const char *origin)
+{
+    struct sockaddr_in addr;
+    char request[512], reply[512];
+    size_t len = 0;
+    int fd, one = 1, n;
+
+    n = snprintf(request, sizeof (request),
+                 "GET / HTTP/1.1\r\n"
+                 "Host: localhost\r\n"
+                 "Origin: %s\r\n"
+                 "Upgrade: websocket\r\n"
+                 "Connection: Upgrade\r\n"
+                 "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                 "Sec-WebSocket-Version: 13\r\n\r\n", origin);
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+
+    memset(&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *) &addr, sizeof (addr)) ||
+        write_full(fd, request, n))
+        goto fail;
+
+    while (len < 4 || memcmp(reply + len - 4, "\r\n\r\n", 4))
+        if (len == sizeof (reply) || read_full(fd, reply + len++, 1))
+            goto fail;
+    if (strncmp(reply, "HTTP/1.1 101 ", 13))
+    {
+        fprintf(stderr, "upgrade refused: %.*s\n", (int) strcspn(reply, "\r"),
+                reply);
+        goto fail;
+    }
+
+    return fd;
+
+fail:
+    close(fd);
+    return -1;
+}
+
+/* Read one unfragmented server message, unmasked. */
+static int
+read_message (int fd, struct ws_buf *b, int *opcode)
+{
+    uint8_t hdr[8];
+    uint64_t len;
+    int i;
+
+    if (read_full(fd, hdr, 2))
+        return -1;
+    *opcode = hdr[0] & 0x0f;
+    len = hdr[1] & 0x7f;
+    if (len == 126)
+    {
+        if (read_full(fd, hdr, 2))
+            return -1;
+        len = (hdr[0] << 8) | hdr[1];
+    }
+    else if (len == 127)
+    {
+        if (read_full(fd, hdr, 8))
+            return -1;
+        for (len = 0, i = 0; i < 8; i++)
+            len = (len << 8) | hdr[i];
+    }
+
+    b->len = 0;
+    bytes += len;
+
+    return read_full(fd, ws_buf_put(b, len), len);
+}
+
+/* Acknowledge a frame, masked as every client to server frame must be. */
+static int
+send_ack (int fd, uint32_t frame)
+{
+    uint8_t msg[10] = { 0x80 | WS_OPCODE_BINARY, 0x80 | 4, 1, 2, 3, 4 };
+    int i;
+
+    for (i = 0; i < 4; i++)
+        msg[6 + i] = (frame >> (24 - 8 * i)) ^ msg[2 + i];
+
+    return write_full(fd, msg, sizeof (msg));
+}
+
+/*
+ * First pixel of a PNG of encode_png(): the Sub filter leaves it as is, so
+ * inflating the filter byte and one RGB triple of the IDAT is enough.
+ */
+static int
+png_first_pixel (const uint8_t *png, size_t len, uint32_t *rgb)
+{
+    uint8_t out[4];
+    size_t off = 8;
+    z_stream z;
+    int rc;
+
+    while (off + 8 <= len && memcmp(png + off + 4, "IDAT", 4))
+        off += 12 + get_u32(png + off);
+    if (off + 8 > len || off + 8 + get_u32(png + off) > len)
+        return -1;
+
+    memset(&z, 0, sizeof (z));
+    if (inflateInit(&z) != Z_OK)
+        return -1;
+    z.next_in = (Bytef *) png + off + 8;
+    z.avail_in = get_u32(png + off);
+    z.next_out = out;
+    z.avail_out = sizeof (out);
+    rc = inflate(&z, Z_SYNC_FLUSH);
+    inflateEnd(&z);
+    if ((rc != Z_OK && rc != Z_STREAM_END) || z.avail_out)
+        return -1;
+
+    *rgb = (out[1] << 16) | (out[2] << 8) | out[3];
+
+    return 0;
+}
+
+static void
+tile_received (const uint8_t *p, size_t len, uint64_t t)
+{
+    uint32_t rgb;
+
+    tiles++;
+    /* u8 type, u8 format, u16 x, u16 y, u16 w, u16 h, u32 frame */
+    if (len < WS_TILE_HEADER || p[1] != WS_FORMAT_PNG || p[2] || p[3] ||
+        p[4] || p[5])
+        return;
+    if (png_first_pixel(p + WS_TILE_HEADER, len - WS_TILE_HEADER, &rgb))
+    {
+        fprintf(stderr, "undecodable tile\n");
+        return;
+    }
+
+    /* Only the first tile showing a sequence number counts. */
+    if (rgb - seen > (1 << 23) || rgb == seen)
+        return;
+    seen = rgb;
+    if (seq - rgb < SEQ_RING && sample_count < SAMPLES_MAX)
+        samples[sample_count++] = t - written_us[rgb % SEQ_RING];
+}
+
+static void *
+client_thread (void *opaque)
+{
+    int fd = *(int *) opaque, opcode;
+    struct ws_buf msg = { 0 };
+
+    while (!done && !read_message(fd, &msg, &opcode))
+    {
+        if (opcode != WS_OPCODE_BINARY || !msg.len)
+            continue;
+        switch (msg.data[0])
+        {
+        case WS_MSG_TILE:
+            tile_received(msg.data, msg.len, now_us());
+            break;
+        case WS_MSG_FRAME:
+            frames++;
+            if (msg.len < 5 || send_ack(fd, get_u32(msg.data + 1)))
+                goto out;
+            break;
+        default:
+            break;
+        }
+    }
+
+out:
+    ws_buf_release(&msg);
+    return NULL;
+}
+
+/* The guest: a new sequence number in the top-left tile, then a refresh. */
+static void
+tick_handler (int fd, short event, void *opaque)
+{
+    struct timeval tv = { 0, TICK_US };
+    uint8_t *dirty = opaque;
+    unsigned int x, y;
+    uint32_t v;
+
+    seq = (seq + 1) & 0xffffff;
+    v = seq;                    /* BGRX, read back as RGB */
+    written_us[seq % SEQ_RING] = now_us();
+    for (y = 0; y < WS_TILE && y < height; y++)
+        for (x = 0; x < WS_TILE && x < width; x++)
+            fb[y * width + x] = v;
+
+    /* The pages of the tile lines. */
+    memset(dirty, 0, (surface->page_count + 7) / 8);
+    for (y = 0; y < WS_TILE && y < height; y++)
+    {
+        size_t page = (size_t) y * width * 4 / XC_PAGE_SIZE;
+
+        dirty[page / 8] |= 1 << (page % 8);
+    }
+    surfman_plugin.refresh_psurface(&surfman_plugin, psurface, dirty);
+
+    if (!done)
+        evtimer_add(&tick_event, &tv);
+}
+
+/* A free port and the tile format, handed to the plugin as its config. */
+static int
+configure (int fps)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof (addr);
+    char path[] = "/tmp/ws-latency.XXXXXX";
+    FILE *f;
+    int fd, rc;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof (addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof (addr)) ||
+        getsockname(fd, (struct sockaddr *) &addr, &len))
+        return -1;
+    port = ntohs(addr.sin_port);
+    close(fd);
+
+    fd = mkstemp(path);
+    if (fd < 0)
+        return -1;
+    f = fdopen(fd, "w");
+    fprintf(f, "websocket.%s = %u\n", WS_CONFIG_PORT, port);
+    fprintf(f, "websocket.%s = 127.0.0.1\n", WS_CONFIG_BIND);
+    fprintf(f, "websocket.%s = png\n", WS_CONFIG_FORMAT);
+    fprintf(f, "websocket.%s = %d\n", WS_CONFIG_FPS, fps);
+    fprintf(f, "websocket.%s = %u\n", WS_CONFIG_WIDTH, width);
+    fprintf(f, "websocket.%s = %u\n", WS_CONFIG_HEIGHT, height);
+    fclose(f);
+    rc = config_load_file(path);
+    unlink(path);
+
+    return rc > 0 ? 0 : -1;
+}
+
+static int
+surface_create (void)
+{
+    surface = xc_memfd_surface_new(width, height, SURFMAN_FORMAT_BGRX8888);
+
+    return surface ? 0 : -1;
+}
+
+struct connect_job
+{
+    const char *origin;
+    volatile int fd;
+    volatile int done;
+};
+
+static void *
+connect_thread (void *opaque)
+{
+    struct connect_job *job = opaque;
+
+    job->fd = client_connect(job->origin);
+    job->done = 1;
+
+    return NULL;
+}
+
+/* The handshake needs the event loop, the client connects from a thread. */
+static int
+connect_from (const char *origin)
+{
+    struct connect_job job = { origin, -1, 0 };
+    pthread_t connector;
+    uint64_t deadline;
+
+    pthread_create(&connector, NULL, connect_thread, &job);
+    deadline = now_us() + 5000000;
+    while (!job.done && now_us() < deadline)
+        event_loop(EVLOOP_ONCE | EVLOOP_NONBLOCK);
+    pthread_join(connector, NULL);
+
+    return job.fd;
+}
+
+static int
+compare_u64 (const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+int
+main (int argc, char **argv)
+{
+    double seconds = argc > 1 ? atof(argv[1]) : 5.0;
+    int fps = argc > 2 ? atoi(argv[2]) : WS_DEFAULT_FPS;
+    struct timeval tv = { 0, TICK_US };
+    pthread_t client;
+    uint64_t deadline, total = 0;
+    uint8_t *dirty;
+    unsigned int i;
+    int fd;
+
+    if (argc > 4)
+    {
+        width = strtoul(argv[3], NULL, 0);
+        height = strtoul(argv[4], NULL, 0);
+    }
+    if (seconds <= 0 || fps < 0 || width < WS_TILE || height < WS_TILE ||
+        width > 65535 || height > 65535)
+    {
+        fprintf(stderr, "usage: %s [seconds] [fps cap] [width height]\n",
+                argv[0]);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+
+    event_init();
+    if (configure(fps) || surface_create() ||
+        surfman_plugin.init(&surfman_plugin) != SURFMAN_SUCCESS)
+    {
+        fprintf(stderr, "setup failed\n");
+        return 1;
+    }
+    psurface = surfman_plugin.get_psurface_from_surface(&surfman_plugin,
+                                                        surface);
+    if (!psurface)
+        return 1;
+    fb = surface_map(surface);
+    dirty = xcalloc((surface->page_count + 7) / 8, 1);
+    surfman_plugin.refresh_psurface(&surfman_plugin, psurface, NULL);
+
+    /* Another page the browser shows must not get the screen. */
+    fd = connect_from("http://elsewhere.example");
+    if (fd >= 0)
+    {
+        fprintf(stderr, "upgrade from another origin accepted\n");
+        return 1;
+    }
+    fd = connect_from("http://localhost");
+    if (fd < 0)
+    {
+        fprintf(stderr, "client failed to connect\n");
+        return 1;
+    }
+    pthread_create(&client, NULL, client_thread, (void *) &fd);
+
+    evtimer_set(&tick_event, tick_handler, dirty);
+    evtimer_add(&tick_event, &tv);
+    deadline = now_us() + seconds * 1e6;
+    while (now_us() < deadline)
+        event_loop(EVLOOP_ONCE);
+
+    done = 1;
+    event_del(&tick_event);
+    shutdown(fd, SHUT_RDWR);
+    pthread_join(client, NULL);
+    close(fd);
+
+    printf("%ux%u png, fps cap %d, %.1fs at %.0f updates/s\n", width, height,
+           fps, seconds, 1e6 / TICK_US);
+    printf("%lu frames, %lu tiles, %.1f MB received\n", frames, tiles,
+           bytes / 1e6);
+    if (!sample_count)
+    {
+        printf("no update seen\n");
+        return 1;
+    }
+
+    qsort(samples, sample_count, sizeof (samples[0]), compare_u64);
+    for (i = 0; i < sample_count; i++)
+        total += samples[i];
+    printf("%u of %u updates seen, latency (ms): avg %.2f p50 %.2f "
+           "p99 %.2f max %.2f\n", sample_count, seq,
+           total / 1e3 / sample_count, samples[sample_count / 2] / 1e3,
+           samples[sample_count * 99 / 100] / 1e3,
+           samples[sample_count - 1] / 1e3);
+
+    surface_unmap(surface);
+    surfman_plugin.free_psurface(&surfman_plugin, psurface);
+    surfman_plugin.shutdown(&surfman_plugin);
+
+    return 0;
+}
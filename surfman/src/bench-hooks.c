@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2013 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+/* Stand-ins for xenstore, D-Bus and dmbus when surfman runs without Xen, in
+   surfman-bench: xenstore is an in-memory store, the rest does nothing. The
+   xenstore functions are the ones the display pipeline uses. */
+
+#include "project.h"
+
+struct xs_node {
+    struct xs_node *next;
+    char *path;
+    char *value;
+};
+
+static struct xs_node *xs_nodes = NULL;
+
+static struct xs_node *xs_lookup (const char *path)
+{
+    struct xs_node *n;
+
+    for (n = xs_nodes; n; n = n->next)
+        if (!strcmp (n->path, path))
+            return n;
+
+    return NULL;
+}
+
+static char *vxs_path (const char *format, va_list arg)
+{
+    char *buff = NULL;
+
+    if (vasprintf (&buff, format, arg) == -1)
+        return NULL;
+
+    return buff;
+}
+
+bool xenstore_write (const char *data, const char *format, ...)
+{
+    struct xs_node *n;
+    va_list arg;
+    char *path;
+
+    va_start (arg, format);
+    path = vxs_path (format, arg);
+    va_end (arg);
+
+    if (!path)
+        return false;
+
+    n = xs_lookup (path);
+    if (n)
+    {
+        free (path);
+        free (n->value);
+    }
+    else
+    {
+        n = xcalloc (1, sizeof (*n));
+        n->path = path;
+        n->next = xs_nodes;
+        xs_nodes = n;
+    }
+    n->value = strdup (data);
+
+    surfman_debug ("xenstore: %s = \"%s\"", n->path, n->value);
+
+    return true;
+}
+
+char *xenstore_read (const char *format, ...)
+{
+    struct xs_node *n;
+    va_list arg;
+    char *path;
+
+    va_start (arg, format);
+    path = vxs_path (format, arg);
+    va_end (arg);
+
+    if (!path)
+        return NULL;
+
+    n = xs_lookup (path);
+    free (path);
+
+    return n ? strdup (n->value) : NULL;
+}
+
+char *xenstore_dom_read (unsigned int domid, const char *format, ...)
+{
+    struct xs_node *n;
+    char *buff = NULL;
+    char *path;
+    va_list arg;
+
+    if (asprintf (&buff, "/local/domain/%u/%s", domid, format) == -1)
+        return NULL;
+
+    va_start (arg, format);
+    path = vxs_path (buff, arg);
+    va_end (arg);
+    free (buff);
+
+    if (!path)
+        return NULL;
+
+    n = xs_lookup (path);
+    free (path);
+
+    return n ? strdup (n->value) : NULL;
+}
+
+bool xenstore_chmod (const char *perms, unsigned int nbperm,
+                     const char *format, ...)
+{
+    return true;
+}
+
+dbus_bool_t dbus_notify_visible_domain_changed (int domid)
+{
+    surfman_debug ("Domain %d is now visible", domid);
+
+    return TRUE;
+}
+
+/* Devices of surfman-bench are not dmbus clients. */
+void dmbus_client_disconnect (dmbus_client_t client)
+{
+}
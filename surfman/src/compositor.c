@@ -0,0 +1,627 @@
+/*
+ * Copyright (c) 2013 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "project.h"
+
+/*
+ * CPU compositing.
+ *
+ * Only plugins advertising SURFMAN_FEATURE_EFFECTS crop, scale and blend a
+ * psurface according to the effects of surfman_display_t. For the others, a
+ * surface displayed with a non-trivial effect is rendered here into a
+ * monitor sized buffer, and the plugin is handed that buffer instead.
+ *
+ * Plugins advertising SURFMAN_FEATURE_MONITOR_SIZED (linuxfb, vesa) only
+ * scan out surfaces of their monitor's size: any other surface is centred
+ * on black, cropped if larger, the same way.
+ *
+ * Scaling is bilinear and opacity blends over black. The coefficients are
+ * computed once per (source, destination) geometry, so a refresh pass only
+ * renders the output lines fed by damaged source lines. BGR565 sources are
+ * expanded line by line and rendered into a BGRX8888 output.
+ */
+
+static const surfman_monitor_mode_t *
+monitor_mode (int monitor_id)
+{
+  struct monitor *m = display_get_monitor (monitor_id);
+
+  return (m && m->info) ? m->info->i.current_mode : NULL;
+}
+
+static int
+viewport_unset (const struct effect *e)
+{
+  return !e->psurface_width || !e->psurface_height ||
+         !e->monitor_width || !e->monitor_height;
+}
+
+static int
+surface_fits_mode (const surfman_surface_t *src,
+                   const surfman_monitor_mode_t *mode)
+{
+  return !mode ||
+         (mode->htimings[SURFMAN_TIMING_ACTIVE] == src->width &&
+          mode->vtimings[SURFMAN_TIMING_ACTIVE] == src->height);
+}
+
+/*
+ * Does the effect leave the surface as the plugin would show it anyway:
+ * opaque, whole, unscaled and at the origin of a monitor of the same size?
+ * Without a viewport, the plugin shows the surface however it fits.
+ */
+static int
+effect_is_identity (const struct effect *e, const surfman_surface_t *src,
+                    const surfman_monitor_mode_t *mode)
+{
+  if (e->opacity != 255)
+    return 0;
+  if (viewport_unset (e))
+    return 1;
+
+  return !e->psurface_x && !e->psurface_y &&
+         e->psurface_width == src->width &&
+         e->psurface_height == src->height &&
+         !e->monitor_x && !e->monitor_y &&
+         e->monitor_width == src->width &&
+         e->monitor_height == src->height &&
+         surface_fits_mode (src, mode);
+}
+
+int
+compositor_needed (struct plugin *p, struct surface *s, int monitor_id,
+                   const struct effect *e)
+{
+  const surfman_monitor_mode_t *mode = monitor_mode (monitor_id);
+  int features = PLUGIN_GET_OPTION (p, features);
+
+  if (features & SURFMAN_FEATURE_EFFECTS)
+    return 0;
+
+  if (!effect_is_identity (e, s->surface, mode))
+    return 1;
+
+  return (features & SURFMAN_FEATURE_MONITOR_SIZED) &&
+         !surface_fits_mode (s->surface, mode);
+}
+
+static struct composite *
+composite_lookup (struct surface *s, struct plugin *p, int monitor_id)
+{
+  struct composite *c;
+
+  LIST_FOREACH (c, &s->composites, link)
+    {
+      if (c->plugin == p && c->monitor_id == monitor_id)
+        return c;
+    }
+
+  return NULL;
+}
+
+/*
+ * Has the surface been resized since it was put on the monitor, so that it
+ * now needs compositing, or no longer does?
+ */
+int
+compositor_stale (struct plugin *p, struct surface *s, int monitor_id,
+                  const struct effect *e)
+{
+  struct composite *c = composite_lookup (s, p, monitor_id);
+
+  return compositor_needed (p, s, monitor_id, e) != (c && c->active);
+}
+
+int
+compositor_active (struct surface *s, struct plugin *p)
+{
+  struct composite *c;
+
+  LIST_FOREACH (c, &s->composites, link)
+    {
+      if (c->active && (!p || c->plugin == p))
+        return 1;
+    }
+
+  return 0;
+}
+
+static size_t
+composite_length (const struct composite *c)
+{
+  return (size_t) c->surface->stride * c->surface->height;
+}
+
+static size_t
+composite_npages (const struct composite *c)
+{
+  return (composite_length (c) + XC_PAGE_SIZE - 1) >> XC_PAGE_SHIFT;
+}
+
+static void
+composite_release_output (struct composite *c)
+{
+  if (c->psurface)
+    {
+      plugin_refresh_sync (c->plugin, c->psurface);
+      PLUGIN_CALL (c->plugin, free_psurface, c->psurface);
+    }
+  c->psurface = NULL;
+
+  if (c->surface)
+    {
+      if (c->out_fb)
+        surface_unmap (c->surface);
+      c->out_fb = NULL;
+      surfman_surface_cleanup (c->surface);
+      free (c->surface);
+      c->surface = NULL;
+    }
+  if (c->fd >= 0)
+    close (c->fd);
+  c->fd = -1;
+
+  free (c->dirty);
+  c->dirty = NULL;
+}
+
+/*
+ * Allocate a width x height output in an unlinked shared memory file, so
+ * that surface_map() works on it like on any guest surface.
+ */
+static int
+composite_alloc_output (struct composite *c, unsigned int width,
+                        unsigned int height, enum surfman_surface_format format)
+{
+  char path[] = "/dev/shm/surfman-composite-XXXXXX";
+  surfman_surface_t *out;
+  size_t npages;
+
+  npages = (width * 4 * height + XC_PAGE_SIZE - 1) >> XC_PAGE_SHIFT;
+
+  c->fd = mkstemp (path);
+  if (c->fd < 0)
+    {
+      surfman_error ("Could not create composite buffer: %s", strerror (errno));
+      return -1;
+    }
+  unlink (path);
+  if (ftruncate (c->fd, npages << XC_PAGE_SHIFT))
+    {
+      surfman_error ("Could not size composite buffer: %s", strerror (errno));
+      goto fail;
+    }
+
+  out = xcalloc (1, sizeof (*out) + npages * sizeof (pfn_t));
+  if (surfman_surface_init (out))
+    {
+      free (out);
+      goto fail;
+    }
+  out->width = width;
+  out->height = height;
+  out->stride = width * 4;
+  out->format = format;
+  out->page_count = npages;
+  out->pages_domid = 0;
+  surfman_surface_update_mmap (out, c->fd, 0);
+  c->surface = out;
+
+  c->out_fb = surface_map (out);
+  if (!c->out_fb)
+    {
+      surfman_error ("Could not map composite buffer");
+      composite_release_output (c);
+      return -1;
+    }
+
+  c->dirty = xcalloc ((npages + 7) / 8, 1);
+
+  c->psurface = PLUGIN_CALL (c->plugin, get_psurface_from_surface, out);
+  if (!c->psurface)
+    {
+      surfman_error ("Plugin %s: get_psurface_from_surface() failed for composite",
+                     c->plugin->name);
+      composite_release_output (c);
+      return -1;
+    }
+
+  return 0;
+
+fail:
+  close (c->fd);
+  c->fd = -1;
+  return -1;
+}
+
+/*
+ * Scaling src_len samples to dst_len, map each of the first count
+ * destination samples to the pair of source samples around its center:
+ * idx[i] and idx[i] + 1, the latter weighted w[i] / 256. Only the first
+ * src_valid source samples are available.
+ */
+static void
+scale_coefficients (uint32_t *idx, uint16_t *w, unsigned int count,
+                    unsigned int dst_len, unsigned int src_len,
+                    unsigned int src_valid)
+{
+  unsigned int i;
+
+  for (i = 0; i < count; i++)
+    {
+      int64_t pos = ((int64_t) (2 * i + 1) * src_len * 128) / dst_len - 128;
+
+      if (pos < 0)
+        pos = 0;
+      idx[i] = pos >> 8;
+      w[i] = pos & 0xff;
+      if (idx[i] >= src_valid - 1)
+        {
+          idx[i] = src_valid - 1;
+          w[i] = 0;
+        }
+    }
+}
+
+static unsigned int
+clip (unsigned int pos, unsigned int len, unsigned int limit)
+{
+  if (pos >= limit)
+    return 0;
+  return (len > limit - pos) ? limit - pos : len;
+}
+
+static int
+composite_geometry_changed (const struct composite *c,
+                            const surfman_surface_t *src)
+{
+  return c->src_width != src->width || c->src_height != src->height ||
+         c->src_stride != src->stride || c->src_format != src->format;
+}
+
+/*
+ * Clip both viewports and compute the scaling coefficients for them.
+ * Return -1 if there is nothing to render.
+ */
+static int
+composite_setup (struct composite *c, const surfman_surface_t *src)
+{
+  const struct effect *e = &c->effect;
+  const surfman_surface_t *out = c->surface;
+  unsigned int src_w, src_h, dst_w, dst_h;
+
+  c->src_width = src->width;
+  c->src_height = src->height;
+  c->src_stride = src->stride;
+  c->src_format = src->format;
+
+  if (viewport_unset (e))
+    {
+      /* Unscaled and centered, cropped if needed. */
+      c->sw = c->dw = clip (0, src->width, out->width);
+      c->sh = c->dh = clip (0, src->height, out->height);
+      c->sx = (src->width - c->sw) / 2;
+      c->sy = (src->height - c->sh) / 2;
+      c->dx = (out->width - c->dw) / 2;
+      c->dy = (out->height - c->dh) / 2;
+      src_w = c->sw;
+      src_h = c->sh;
+      dst_w = c->dw;
+      dst_h = c->dh;
+    }
+  else
+    {
+      c->sx = e->psurface_x;
+      c->sy = e->psurface_y;
+      c->sw = clip (e->psurface_x, e->psurface_width, src->width);
+      c->sh = clip (e->psurface_y, e->psurface_height, src->height);
+      c->dx = e->monitor_x;
+      c->dy = e->monitor_y;
+      c->dw = clip (e->monitor_x, e->monitor_width, out->width);
+      c->dh = clip (e->monitor_y, e->monitor_height, out->height);
+      src_w = e->psurface_width;
+      src_h = e->psurface_height;
+      dst_w = e->monitor_width;
+      dst_h = e->monitor_height;
+    }
+
+  free (c->xidx);
+  free (c->xw);
+  free (c->yidx);
+  free (c->yw);
+  free (c->line);
+  free (c->expanded);
+  c->xidx = c->yidx = c->line = c->expanded = NULL;
+  c->xw = c->yw = NULL;
+
+  /* Whatever lies outside the destination viewport stays black. */
+  memset (c->out_fb, 0, out->stride * out->height);
+
+  if (!c->sw || !c->sh || !c->dw || !c->dh)
+    return -1;
+
+  c->xidx = xcalloc (c->dw, sizeof (*c->xidx));
+  c->xw = xcalloc (c->dw, sizeof (*c->xw));
+  c->yidx = xcalloc (c->dh, sizeof (*c->yidx));
+  c->yw = xcalloc (c->dh, sizeof (*c->yw));
+  c->line = xcalloc (c->sw + 1, sizeof (*c->line));
+  if (src->format == SURFMAN_FORMAT_BGR565)
+    c->expanded = xcalloc (2 * c->sw, sizeof (*c->expanded));
+
+  /* Clipping crops the viewports, it does not change the scaling factor. */
+  scale_coefficients (c->xidx, c->xw, c->dw, dst_w, src_w, c->sw);
+  scale_coefficients (c->yidx, c->yw, c->dh, dst_h, src_h, c->sh);
+
+  return 0;
+}
+
+static void
+composite_line (struct composite *c, const uint8_t *src_fb, unsigned int j)
+{
+  const surfman_surface_t *out = c->surface;
+  const uint32_t *a, *b;
+  uint32_t *dst;
+  unsigned int y = c->sy + c->yidx[j];
+
+  if (c->expanded)
+    {
+      const uint16_t *p = (const uint16_t *) (src_fb + y * c->src_stride) + c->sx;
+
+      blit_expand_565 (c->expanded, p, c->sw);
+      a = c->expanded;
+      b = a;
+      if (c->yidx[j] + 1 < c->sh)
+        {
+          p = (const uint16_t *) ((const uint8_t *) p + c->src_stride);
+          blit_expand_565 (c->expanded + c->sw, p, c->sw);
+          b = c->expanded + c->sw;
+        }
+    }
+  else
+    {
+      a = (const uint32_t *) (src_fb + y * c->src_stride) + c->sx;
+      b = (c->yidx[j] + 1 < c->sh) ?
+          (const uint32_t *) ((const uint8_t *) a + c->src_stride) : a;
+    }
+
+  blit_blend_rows (c->line, a, b, ((256 - c->yw[j]) * c->alpha) >> 8,
+                   (c->yw[j] * c->alpha) >> 8, c->sw);
+  c->line[c->sw] = c->line[c->sw - 1];
+
+  dst = (uint32_t *) (c->out_fb + (c->dy + j) * out->stride) + c->dx;
+  blit_scale_row (dst, c->line, c->xidx, c->xw, c->dw);
+}
+
+static void
+composite_mark (struct composite *c, unsigned int j)
+{
+  size_t first = ((size_t) (c->dy + j) * c->surface->stride) >> XC_PAGE_SHIFT;
+  size_t last = ((size_t) (c->dy + j + 1) * c->surface->stride - 1) >> XC_PAGE_SHIFT;
+
+  for (; first <= last; first++)
+    c->dirty[first / 8] |= 1 << (first % 8);
+}
+
+/*
+ * Render the output lines whose source lines intersect the damage (all of
+ * them if dirty is NULL) and record the output pages written in c->dirty.
+ */
+static void
+composite_render (struct composite *c, const surfman_surface_t *src,
+                  const uint8_t *src_fb, const uint8_t *dirty)
+{
+  surfman_rect_t rects[SURFMAN_DIRTY_RECTS_MAX];
+  unsigned int n = 0, i, j;
+
+  memset (c->dirty, 0, (composite_npages (c) + 7) / 8);
+  if (!c->line)
+    return;
+
+  if (dirty)
+    n = rects_from_dirty_bitmap (dirty, src->width, src->height, src->stride,
+                                 src->format, c->merge_gap,
+                                 rects, SURFMAN_DIRTY_RECTS_MAX);
+
+  for (j = 0; j < c->dh; j++)
+    {
+      unsigned int y0 = c->sy + c->yidx[j];
+      unsigned int y1 = y0 + (c->yidx[j] + 1 < c->sh);
+
+      if (dirty)
+        {
+          for (i = 0; i < n; i++)
+            if (y1 >= rects[i].y && y0 < rects[i].y + rects[i].h)
+              break;
+          if (i == n)
+            continue;
+        }
+
+      composite_line (c, src_fb, j);
+      composite_mark (c, j);
+    }
+}
+
+/*
+ * Return the psurface the plugin has to display instead of the surface
+ * itself, or NULL if the effect cannot be rendered.
+ */
+surfman_psurface_t
+compositor_get_psurface (struct surface *s, struct plugin *p, int monitor_id,
+                         const struct effect *e)
+{
+  const surfman_monitor_mode_t *mode = monitor_mode (monitor_id);
+  surfman_surface_t *src = s->surface;
+  struct composite *c;
+  enum surfman_surface_format format;
+  unsigned int width, height;
+  void *fb;
+
+  if (!surface_ready (s) || !mode)
+    return NULL;
+
+  switch (src->format)
+    {
+    case SURFMAN_FORMAT_BGRX8888:
+    case SURFMAN_FORMAT_RGBX8888:
+      format = src->format;
+      break;
+    case SURFMAN_FORMAT_BGR565:
+      format = SURFMAN_FORMAT_BGRX8888;
+      break;
+    default:
+      surfman_warning ("Cannot composite surface format %#x", src->format);
+      return NULL;
+    }
+
+  c = composite_lookup (s, p, monitor_id);
+  if (!c)
+    {
+      c = xcalloc (1, sizeof (*c));
+      c->plugin = p;
+      c->monitor_id = monitor_id;
+      c->merge_gap = rects_merge_gap (p->name);
+      c->fd = -1;
+      LIST_INSERT_HEAD (&s->composites, c, link);
+    }
+
+  /* Kept until the surface dies, refreshes then find the source mapped. */
+  if (!c->src_mapped)
+    {
+      if (!surface_map (src))
+        return NULL;
+      c->src_mapped = 1;
+    }
+
+  width = mode->htimings[SURFMAN_TIMING_ACTIVE];
+  height = mode->vtimings[SURFMAN_TIMING_ACTIVE];
+  if (c->surface &&
+      (c->surface->width != width || c->surface->height != height ||
+       c->surface->format != format))
+    composite_release_output (c);
+
+  if (!c->surface && composite_alloc_output (c, width, height, format))
+    {
+      c->active = 0;
+      return NULL;
+    }
+
+  c->effect = *e;
+  c->alpha = e->opacity + (e->opacity >> 7);
+  composite_setup (c, src);
+  fb = surface_map (src);
+  composite_render (c, src, fb, NULL);
+  surface_unmap (src);
+  c->active = 1;
+
+  surfman_debug ("Compositing %ux%u+%u+%u of surface %p into %ux%u+%u+%u of monitor %d",
+                 c->sw, c->sh, c->sx, c->sy, s, c->dw, c->dh, c->dx, c->dy,
+                 monitor_id);
+
+  return c->psurface;
+}
+
+/* Forward the output pages rendered, /dirty/ (NULL for all), to the plugin. */
+static void
+composite_refresh (struct composite *c, uint8_t *dirty)
+{
+  surfman_rect_t rects[SURFMAN_DIRTY_RECTS_MAX];
+  unsigned int n = 0;
+
+  if (!plugin_refresh_rects_supported (c->plugin))
+    {
+      plugin_refresh_psurface (c->plugin, c->psurface, dirty,
+                               composite_length (c), NULL, 0);
+      return;
+    }
+
+  n = rects_from_dirty_bitmap (dirty, c->surface->width, c->surface->height,
+                               c->surface->stride, c->surface->format,
+                               c->merge_gap, rects, SURFMAN_DIRTY_RECTS_MAX);
+  plugin_refresh_psurface (c->plugin, c->psurface, dirty,
+                           composite_length (c), rects, n);
+}
+
+/*
+ * Render the damage of a refresh pass into the outputs currently displayed
+ * and forward it to their plugins.
+ */
+void
+compositor_refresh (struct surface *s, uint8_t *dirty)
+{
+  struct composite *c;
+  void *fb;
+
+  if (!compositor_active (s, NULL))
+    return;
+
+  fb = surface_map (s->surface);
+  if (!fb)
+    return;
+
+  LIST_FOREACH (c, &s->composites, link)
+    {
+      if (!c->active)
+        continue;
+
+      if (composite_geometry_changed (c, s->surface))
+        {
+          composite_setup (c, s->surface);
+          composite_render (c, s->surface, fb, NULL);
+          composite_refresh (c, NULL);
+          continue;
+        }
+
+      composite_render (c, s->surface, fb, dirty);
+      composite_refresh (c, dirty ? c->dirty : NULL);
+    }
+
+  surface_unmap (s->surface);
+}
+
+/* The outputs are kept, with their coefficients, until the surface dies. */
+void
+compositor_offscreen (struct surface *s, struct plugin *p, int monitor_id)
+{
+  struct composite *c;
+
+  LIST_FOREACH (c, &s->composites, link)
+    {
+      if ((!p || c->plugin == p) && c->monitor_id == monitor_id)
+        c->active = 0;
+    }
+}
+
+void
+compositor_surface_takedown (struct surface *s)
+{
+  struct composite *c, *tmp;
+
+  LIST_FOREACH_SAFE (c, tmp, &s->composites, link)
+    {
+      composite_release_output (c);
+      if (c->src_mapped)
+        surface_unmap (s->surface);
+      free (c->xidx);
+      free (c->xw);
+      free (c->yidx);
+      free (c->yw);
+      free (c->line);
+      free (c->expanded);
+      LIST_REMOVE (c, link);
+      free (c);
+    }
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (c) 2013 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef COMPOSITOR_H_
+#define COMPOSITOR_H_
+
+/*
+ * A surface rendered with its effect into a monitor sized buffer, on
+ * behalf of a plugin that cannot apply the effect itself.
+ */
+struct composite
+{
+  LIST_ENTRY (struct composite) link;
+
+  struct plugin *plugin;
+  int monitor_id;
+  int active;                   /* Output currently displayed by the plugin */
+  int src_mapped;               /* Holds a surface_map() reference on the source */
+  unsigned int merge_gap;       /* Merge gap of the plugin's damage */
+
+  struct effect effect;         /* Effect being rendered */
+  unsigned int alpha;           /* Opacity, out of 256 */
+
+  /* Output, in shared memory so the plugin can map it like any surface. */
+  int fd;
+  surfman_surface_t *surface;
+  uint8_t *out_fb;              /* Mapping of the output, held while it exists */
+  surfman_psurface_t psurface;
+  uint8_t *dirty;               /* Output pages written by the last pass */
+
+  /* Source geometry the coefficients were computed for. */
+  unsigned int src_width;
+  unsigned int src_height;
+  unsigned int src_stride;
+  enum surfman_surface_format src_format;
+
+  unsigned int sx, sy, sw, sh;  /* Source viewport, clipped */
+  unsigned int dx, dy, dw, dh;  /* Destination viewport, clipped */
+
+  /* Bilinear coefficients: source index and weight of the next sample. */
+  uint32_t *xidx;
+  uint16_t *xw;
+  uint32_t *yidx;
+  uint16_t *yw;
+
+  uint32_t *line;               /* Vertically filtered source line (+1 pixel) */
+  uint32_t *expanded;           /* Two BGR565 source lines, expanded */
+};
+
+#endif /* COMPOSITOR_H_ */
@@ -0,0 +1,307 @@
+/*
+ * Copyright (c) 2014 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Test of the sub-page damage stage, no guest needed.
+ *
+ * A 1920x1080x32 framebuffer in plain memory is changed the way a guest
+ * would, the pages touched are marked dirty as log-dirty would, and
+ * damage_refine() is run on them. After each pass:
+ * - every changed pixel lies in a returned rectangle;
+ * - every page holding a changed pixel is still dirty;
+ * - the shadow matches the framebuffer on every page not marked stale.
+ * The scenarios also check what they expect of the rectangles themselves:
+ * exact ones for a cursor, none past the window for a scroll, and a skipped
+ * comparison past the dirty threshold. A surface of unknown format must be
+ * left to the caller, bitmap untouched.
+ *
+ *   damage-test
+ */
+
+#include "project.h"
+
+/* The comparison is static, test it in place. */
+#include "damage.c"
+
+#define WIDTH 1920
+#define HEIGHT 1080
+#define STRIDE (WIDTH * 4)
+#define LEN ((size_t) STRIDE * HEIGHT)
+#define NPAGES ((LEN + XC_PAGE_SIZE - 1) / XC_PAGE_SIZE)
+
+static struct damage_shadow damage;
+static surfman_surface_t *surface;
+static uint32_t *fb;
+static uint32_t *prev;
+static uint8_t dirty[(NPAGES + 7) / 8];
+static surfman_rect_t rects[SURFMAN_DIRTY_RECTS_MAX];
+
+static int
+page_dirty (const uint8_t *bitmap, size_t page)
+{
+  return !!(bitmap[page / 8] & (1 << (page % 8)));
+}
+
+/* Mark the pages holding lines [y0, y1) dirty. */
+static void
+mark_lines (unsigned int y0, unsigned int y1)
+{
+  size_t page;
+
+  for (page = (size_t) y0 * STRIDE / XC_PAGE_SIZE;
+       page <= ((size_t) y1 * STRIDE - 1) / XC_PAGE_SIZE; page++)
+    dirty[page / 8] |= 1 << (page % 8);
+}
+
+static void
+fill_rect (unsigned int x, unsigned int y, unsigned int w, unsigned int h,
+           uint32_t seed)
+{
+  unsigned int i, j;
+
+  for (j = y; j < y + h; j++)
+    for (i = x; i < x + w; i++)
+      fb[j * WIDTH + i] = seed ^ (j * 2654435761u) ^ (i * 40503u);
+}
+
+static int
+in_rects (unsigned int x, unsigned int y, int n)
+{
+  int i;
+
+  for (i = 0; i < n; i++)
+    if (x >= rects[i].x && x < rects[i].x + rects[i].w &&
+        y >= rects[i].y && y < rects[i].y + rects[i].h)
+      return 1;
+
+  return 0;
+}
+
+/*
+ * Check what every pass must guarantee, against the framebuffer as it was
+ * before the pass, and save the current one for the next.
+ */
+static int
+check_pass (const char *name, int n)
+{
+  unsigned int x, y, missed = 0, kept = 0, shadow = 0;
+  size_t page;
+
+  for (y = 0; y < HEIGHT; y++)
+    for (x = 0; x < WIDTH; x++)
+      if (fb[y * WIDTH + x] != prev[y * WIDTH + x])
+        {
+          if (!in_rects (x, y, n))
+            missed++;
+          page = ((size_t) y * STRIDE + x * 4) / XC_PAGE_SIZE;
+          if (!page_dirty (dirty, page))
+            kept++;
+        }
+
+  for (page = 0; page < NPAGES; page++)
+    {
+      size_t off = page * XC_PAGE_SIZE;
+      size_t len = (off + XC_PAGE_SIZE > LEN) ? LEN - off : XC_PAGE_SIZE;
+
+      if (!page_dirty (damage.stale, page) &&
+          memcmp (damage.shadow + off, (uint8_t *) fb + off, len))
+        shadow++;
+    }
+
+  memcpy (prev, fb, LEN);
+  memset (dirty, 0, sizeof (dirty));
+
+  printf ("%-12s %6d %10u %10u %10u\n", name, n, missed, kept, shadow);
+
+  return (missed || kept || shadow) ? -1 : 0;
+}
+
+static int
+refine (void)
+{
+  return damage_refine (&damage, surface, (const uint8_t *) fb, dirty,
+                        rects, SURFMAN_DIRTY_RECTS_MAX);
+}
+
+/* First frame: too much damage to compare, the whole shadow is stale. */
+static int
+test_first (void)
+{
+  unsigned int skipped = damage.passes_skipped;
+  int n;
+
+  fill_rect (0, 0, WIDTH, HEIGHT, 0x12345678);
+  mark_lines (0, HEIGHT);
+  n = refine ();
+
+  if (damage.passes_skipped != skipped + 1 || n <= 0)
+    return -1;
+  return check_pass ("first", n);
+}
+
+/* Compare every page once, a fifth of the screen at a time. */
+static int
+test_warmup (void)
+{
+  unsigned int y;
+  size_t page;
+  int n, rv = 0;
+
+  for (y = 0; y < HEIGHT; y += HEIGHT / 5)
+    {
+      mark_lines (y, y + HEIGHT / 5);
+      n = refine ();
+      if (n < 0 || check_pass ("warmup", n))
+        rv = -1;
+    }
+  for (page = 0; page < NPAGES; page++)
+    if (page_dirty (damage.stale, page))
+      rv = -1;
+
+  return rv;
+}
+
+/* A 16x16 cursor: its lines' pages are dirty, along with a clean page. */
+static int
+test_cursor (void)
+{
+  size_t clean = damage.pages_clean;
+  int n;
+
+  fill_rect (952, 530, 16, 16, 0xdeadbeef);
+  mark_lines (530, 530 + 16);
+  dirty[0] |= 1;
+  n = refine ();
+
+  if (n != 1 || rects[0].x != 952 || rects[0].y != 530 ||
+      rects[0].w != 16 || rects[0].h != 16)
+    {
+      printf ("cursor: %d rects, first %ux%u+%u+%u\n", n,
+              rects[0].w, rects[0].h, rects[0].x, rects[0].y);
+      return -1;
+    }
+  if (page_dirty (dirty, 0) || damage.pages_clean <= clean)
+    return -1;
+  return check_pass ("cursor", n);
+}
+
+/* A 800x250 window scrolls its content up by 16 lines. */
+static int
+test_scroll (void)
+{
+  const unsigned int x0 = 200, w = 800, y0 = 100, h = 250, dy = 16;
+  unsigned int y, skipped = damage.passes_skipped;
+  int i, n;
+
+  for (y = y0; y < y0 + h - dy; y++)
+    memmove (&fb[y * WIDTH + x0], &fb[(y + dy) * WIDTH + x0], w * 4);
+  fill_rect (x0, y0 + h - dy, w, dy, 0x0badf00d);
+  mark_lines (y0, y0 + h);
+  n = refine ();
+
+  if (n <= 0 || damage.passes_skipped != skipped)
+    return -1;
+  for (i = 0; i < n; i++)
+    if (rects[i].x < x0 || rects[i].x + rects[i].w > x0 + w ||
+        rects[i].y < y0 || rects[i].y + rects[i].h > y0 + h)
+      {
+        printf ("scroll: rect %ux%u+%u+%u past the window\n",
+                rects[i].w, rects[i].h, rects[i].x, rects[i].y);
+        return -1;
+      }
+  return check_pass ("scroll", n);
+}
+
+/*
+ * Past the threshold the bitmap is used as is and the pages go stale. A
+ * stale page is then taken whole, and its shadow refreshed.
+ */
+static int
+test_threshold (void)
+{
+  unsigned int skipped = damage.passes_skipped;
+  int n;
+
+  fill_rect (0, 0, WIDTH, HEIGHT / 2, 0xcafebabe);
+  mark_lines (0, HEIGHT / 2);
+  n = refine ();
+  if (n <= 0 || damage.passes_skipped != skipped + 1 ||
+      !page_dirty (damage.stale, 0))
+    return -1;
+  if (check_pass ("threshold", n))
+    return -1;
+
+  fill_rect (10, 0, 1, 1, 0x55aa55aa);
+  dirty[0] |= 1;
+  n = refine ();
+  if (n != 1 || rects[0].x != 0 || rects[0].w != XC_PAGE_SIZE / 4 ||
+      page_dirty (damage.stale, 0))
+    return -1;
+  return check_pass ("stale", n);
+}
+
+/* Unknown format: the caller refreshes the bitmap itself. */
+static int
+test_unknown (void)
+{
+  uint8_t before[sizeof (dirty)];
+  int n, same;
+
+  mark_lines (0, 1);
+  memcpy (before, dirty, sizeof (dirty));
+  surface->format = SURFMAN_FORMAT_UNKNOWN;
+  n = refine ();
+  surface->format = SURFMAN_FORMAT_BGRX8888;
+  same = !memcmp (before, dirty, sizeof (dirty));
+
+  printf ("%-12s %6d %10s\n", "unknown", n, same ? "-" : "changed");
+  memset (dirty, 0, sizeof (dirty));
+
+  return (n == -1 && same) ? 0 : -1;
+}
+
+int
+main (int argc, char **argv)
+{
+  int rv = 0;
+
+  surface = xcalloc (1, sizeof (*surface));
+  surface->width = WIDTH;
+  surface->height = HEIGHT;
+  surface->stride = STRIDE;
+  surface->format = SURFMAN_FORMAT_BGRX8888;
+  fb = xcalloc (1, LEN);
+  prev = xcalloc (1, LEN);
+
+  damage_init (&damage, "damage-test");
+
+  printf ("%-12s %6s %10s %10s %10s\n", "scenario", "rects", "missed",
+          "cleared", "shadow");
+  if (test_first () || test_warmup () || test_cursor () ||
+      test_scroll () || test_threshold () || test_unknown ())
+    rv = 1;
+
+  printf ("%s\n", rv ? "FAIL" : "PASS");
+
+  damage_release (&damage);
+  free (prev);
+  free (fb);
+  free (surface);
+
+  return rv;
+}
@@ -0,0 +1,255 @@
+/*
+ * Copyright (c) 2014 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "project.h"
+
+/*
+ * Sub-page damage.
+ *
+ * Dirty VRAM tracking has page granularity: a page is a line and a bit at
+ * 1024x768x32, a third of a line at 4K, so a blinking cursor dirties whole
+ * lines. This second stage keeps a shadow copy of the framebuffer and
+ * compares each dirty page with it, one line segment at a time, to get the
+ * columns that really changed. Pages whose content did not change are
+ * cleared from the bitmap, and the changed spans of consecutive lines are
+ * gathered in rectangles.
+ *
+ * Comparing costs about as much as copying, which is a waste when most of the
+ * screen changes. Past max_dirty percent of dirty pages the bitmap is used as
+ * is and the dirty pages are only marked stale in the shadow; a stale page is
+ * taken whole, and its shadow refreshed, next time it is dirty.
+ */
+
+#define DAMAGE_DEFAULT_MAX_DIRTY 25     /* Percent of dirty pages */
+
+static unsigned int
+format_Bpp (enum surfman_surface_format format)
+{
+  switch (format)
+    {
+    case SURFMAN_FORMAT_BGR565:
+      return 2;
+    case SURFMAN_FORMAT_BGRX8888:
+    case SURFMAN_FORMAT_RGBX8888:
+      return 4;
+    default:
+      return 0;
+    }
+}
+
+static size_t
+bitmap_count (const uint8_t *bitmap, size_t npages)
+{
+  size_t i, n = 0;
+
+  for (i = 0; i < npages / 8; i++)
+    n += __builtin_popcount (bitmap[i]);
+  if (npages % 8)
+    n += __builtin_popcount (bitmap[i] & ((1 << (npages % 8)) - 1));
+
+  return n;
+}
+
+static void
+damage_reset (struct damage_shadow *d, surfman_surface_t *surface,
+              unsigned int Bpp)
+{
+  d->width = surface->width;
+  d->height = surface->height;
+  d->stride = surface->stride;
+  d->Bpp = Bpp;
+  d->len = (size_t) surface->stride * surface->height;
+  d->npages = (d->len + XC_PAGE_SIZE - 1) / XC_PAGE_SIZE;
+
+  free (d->shadow);
+  free (d->stale);
+  d->shadow = xmalloc (d->len);
+  d->stale = xmalloc ((d->npages + 7) / 8);
+  memset (d->stale, 0xff, (d->npages + 7) / 8);
+}
+
+/* Line y changed from column x0 to x1 (excluded). */
+static void
+damage_add_span (struct damage_shadow *d, surfman_rect_t *rects,
+                 unsigned int max, unsigned int *count, unsigned int y,
+                 unsigned int x0, unsigned int x1)
+{
+  surfman_rect_t *last = *count ? &rects[*count - 1] : NULL;
+
+  /* Spans come line by line: grow the last rectangle while they touch it. */
+  if (last && (y <= last->y + last->h || *count == max))
+    {
+      unsigned int lx1 = last->x + last->w;
+
+      if (x0 > last->x)
+        x0 = last->x;
+      if (x1 < lx1)
+        x1 = lx1;
+      last->x = x0;
+      last->w = x1 - x0;
+      if (y + 1 > last->y + last->h)
+        last->h = y + 1 - last->y;
+      return;
+    }
+
+  rects[*count].x = x0;
+  rects[*count].y = y;
+  rects[*count].w = x1 - x0;
+  rects[*count].h = 1;
+  (*count)++;
+}
+
+/*
+ * Bytes [start, end) of the framebuffer, all on line y. Update the shadow and
+ * return 1 if they changed; a stale shadow counts as a change.
+ */
+static int
+damage_compare_segment (struct damage_shadow *d, const uint8_t *fb,
+                        size_t start, size_t end, int stale,
+                        surfman_rect_t *rects, unsigned int max,
+                        unsigned int *count)
+{
+  size_t line = (start / d->stride) * (size_t) d->stride;
+  const uint8_t *src = fb + start;
+  uint8_t *dst = d->shadow + start;
+  size_t len = end - start;
+  size_t first, last;
+
+  if (!stale && !memcmp (src, dst, len))
+    return 0;
+
+  first = 0;
+  last = len;
+  if (!stale)
+    {
+      while (src[first] == dst[first])
+        first++;
+      while (src[last - 1] == dst[last - 1])
+        last--;
+    }
+  memcpy (dst + first, src + first, last - first);
+
+  damage_add_span (d, rects, max, count, start / d->stride,
+                   (start - line + first) / d->Bpp,
+                   (start - line + last + d->Bpp - 1) / d->Bpp);
+
+  return 1;
+}
+
+void
+damage_init (struct damage_shadow *d, const char *prefix)
+{
+  memset (d, 0, sizeof (*d));
+
+  d->enabled = config_get_uint (prefix, "subpage_damage", 0);
+  d->max_dirty = config_get_uint (prefix, "subpage_damage_max_dirty",
+                                  DAMAGE_DEFAULT_MAX_DIRTY);
+  if (d->max_dirty > 100)
+    d->max_dirty = 100;
+}
+
+void
+damage_release (struct damage_shadow *d)
+{
+  free (d->shadow);
+  free (d->stale);
+  d->shadow = NULL;
+  d->stale = NULL;
+  d->len = 0;
+}
+
+/*
+ * Refine the page bitmap /dirty/ of the framebuffer /fb/ (mapped, offset
+ * applied): clear the pages that did not change and fill up to /max/
+ * rectangles covering the changed pixels. The last rectangle absorbs what
+ * does not fit.
+ * Return the number of rectangles, 0 if nothing changed, or -1 if the
+ * format cannot be refined and /dirty/ was left as is.
+ */
+int
+damage_refine (struct damage_shadow *d, surfman_surface_t *surface,
+               const uint8_t *fb, uint8_t *dirty, surfman_rect_t *rects,
+               unsigned int max)
+{
+  unsigned int Bpp = format_Bpp (surface->format);
+  unsigned int count = 0;
+  size_t line_len, ndirty, page;
+
+  if (!Bpp || !max)
+    return -1;
+
+  if (!d->shadow || d->width != surface->width ||
+      d->height != surface->height || d->stride != surface->stride ||
+      d->Bpp != Bpp)
+    damage_reset (d, surface, Bpp);
+
+  ndirty = bitmap_count (dirty, d->npages);
+  if (!ndirty)
+    return 0;
+
+  if (ndirty * 100 > d->npages * d->max_dirty)
+    {
+      for (page = 0; page < d->npages; page++)
+        if (dirty[page / 8] & (1 << (page % 8)))
+          d->stale[page / 8] |= 1 << (page % 8);
+      d->passes_skipped++;
+
+      return rects_from_dirty_bitmap (dirty, d->width, d->height, d->stride,
+                                      surface->format, 0, rects, max);
+    }
+
+  line_len = (size_t) d->width * Bpp;
+  for (page = 0; page < d->npages; page++)
+    {
+      size_t start, end, pos;
+      int stale, changed = 0;
+
+      if (!(dirty[page / 8] & (1 << (page % 8))))
+        continue;
+
+      stale = !!(d->stale[page / 8] & (1 << (page % 8)));
+      d->stale[page / 8] &= ~(1 << (page % 8));
+
+      start = page * XC_PAGE_SIZE;
+      end = start + XC_PAGE_SIZE;
+      if (end > d->len)
+        end = d->len;
+
+      /* The page split on line boundaries, stride padding left out. */
+      for (pos = start; pos < end; )
+        {
+          size_t line = (pos / d->stride) * (size_t) d->stride;
+          size_t seg_end = line + line_len;
+
+          if (seg_end > end)
+            seg_end = end;
+          if (pos < seg_end)
+            changed |= damage_compare_segment (d, fb, pos, seg_end, stale,
+                                               rects, max, &count);
+          pos = line + d->stride;
+        }
+
+      d->pages_compared++;
+      if (!changed)
+        {
+          dirty[page / 8] &= ~(1 << (page % 8));
+          d->pages_clean++;
+        }
+    }
+
+  return count;
+}
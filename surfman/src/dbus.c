@@ -32,6 +32,8 @@ static const struct
   { "get_visible", dbus_get_visible },
   { "notify_death", dbus_notify_death },
   { "dump_all_screens", dbus_dump_all_screens },
+  { "dump_stats", dbus_dump_stats },
+  { "dump_trace", dbus_dump_trace },
   { "increase_brightness", dbus_increase_brightness },
   { "decrease_brightness", dbus_decrease_brightness },
   { "dpms_on", dbus_dpms_on },
@@ -15,6 +15,8 @@
  * License along with this library; if not, write to the Free Software
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
+#include <limits.h>
+
 #include "project.h"
 
 dbus_bool_t
@@ -89,6 +91,104 @@ dbus_dump_all_screens (DBusMessage *msg, DBusMessage *reply)
   return TRUE;
 }
 
+dbus_bool_t
+dbus_dump_stats (DBusMessage *msg, DBusMessage *reply)
+{
+  dump_all_stats ();
+
+  return TRUE;
+}
+
+/*
+ * Trace dumps go to a new file of TRACE_DUMP_DIR, never to a path picked by
+ * the D-Bus client: surfman runs as root. The directory must belong to us
+ * and not be writable by others, the file is created exclusively and a
+ * symlink is never followed.
+ */
+#define TRACE_DUMP_DIR "/var/log/surfman"
+#define TRACE_DUMP_TRIES 16
+
+static int
+trace_dump_open (char *path, size_t len)
+{
+  struct stat st;
+  char stamp[32], name[64];
+  time_t now = time (NULL);
+  int dir, fd = -1;
+  unsigned int i;
+
+  if (mkdir (TRACE_DUMP_DIR, 0700) && errno != EEXIST)
+    {
+      surfman_error ("Cannot create %s: %s", TRACE_DUMP_DIR, strerror (errno));
+      return -1;
+    }
+
+  dir = open (TRACE_DUMP_DIR, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (dir < 0)
+    {
+      surfman_error ("Cannot open %s: %s", TRACE_DUMP_DIR, strerror (errno));
+      return -1;
+    }
+  if (fstat (dir, &st) || st.st_uid != geteuid () || (st.st_mode & 022))
+    {
+      surfman_error ("%s is not a private directory, not dumping the trace",
+                     TRACE_DUMP_DIR);
+      close (dir);
+      return -1;
+    }
+
+  strftime (stamp, sizeof (stamp), "%Y%m%d-%H%M%S", localtime (&now));
+  for (i = 0; i < TRACE_DUMP_TRIES && fd < 0; i++)
+    {
+      snprintf (name, sizeof (name), "trace-%s-%u.json", stamp, i);
+      fd = openat (dir, name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW |
+                   O_CLOEXEC, 0600);
+      if (fd < 0 && errno != EEXIST)
+        break;
+    }
+  close (dir);
+
+  if (fd < 0)
+    {
+      surfman_error ("Cannot create a trace file in %s: %s", TRACE_DUMP_DIR,
+                     strerror (errno));
+      return -1;
+    }
+  snprintf (path, len, "%s/%s", TRACE_DUMP_DIR, name);
+
+  return fd;
+}
+
+/* dump_trace() -> path of the file written. */
+dbus_bool_t
+dbus_dump_trace (DBusMessage *msg, DBusMessage *reply)
+{
+  char path[PATH_MAX];
+  const char *p = path;
+  int fd, n;
+
+  fd = trace_dump_open (path, sizeof (path));
+  if (fd < 0)
+    return FALSE;
+
+  n = surfman_trace_dump (fd);
+  close (fd);
+  if (n < 0)
+    {
+      unlink (path);
+      return FALSE;
+    }
+
+  surfman_info ("Dumped %d trace events to %s", n, path);
+
+  if (reply)
+    dbus_message_append_args (reply,
+                              DBUS_TYPE_STRING, &p,
+                              DBUS_TYPE_INVALID);
+
+  return TRUE;
+}
+
 dbus_bool_t
 dbus_increase_brightness (DBusMessage *msg, DBusMessage *reply)
 {
@@ -184,6 +284,7 @@ dbus_set_visible (DBusMessage *msg, DBusMessage *reply)
   uint32_t timeout;
   dbus_bool_t force;
   struct domain *d;
+  char trace_arg[16];
 
   dbus_error_init (&err);
   ret = dbus_message_get_args(msg, &err,
@@ -204,7 +305,10 @@ dbus_set_visible (DBusMessage *msg, DBusMessage *reply)
       return FALSE;
     }
 
+  snprintf (trace_arg, sizeof (trace_arg), "dom%u", domid);
+  SURFMAN_TRACE_BEGIN ("set_visible", trace_arg);
   ret = !domain_set_visible (d, force);
+  SURFMAN_TRACE_END ("set_visible", trace_arg);
 
   if (reply && ret)
     dbus_message_append_args (reply,
@@ -19,6 +19,10 @@
 
 struct monitor display[DISPLAY_MONITOR_MAX];
 
+/* Compositing of the displayed surfaces to check again, see below. */
+static struct event display_resize_event;
+static int display_resize_pending;
+
 struct display_list
 {
   surfman_display_t *disp;
@@ -67,6 +71,8 @@ display_list_append (struct display_list *l,
                      surfman_psurface_t ps,
                      struct effect *e)
 {
+  surfman_display_t *disp;
+
   if (l->len == l->max)
     {
       l->disp = realloc (l->disp, (l->max + 16) * sizeof (surfman_display_t));
@@ -75,9 +81,22 @@ display_list_append (struct display_list *l,
       l->max += 16;
     }
 
-  l->disp[l->len].monitor = m;
-  l->disp[l->len].psurface = ps;
-  /* TODO: Compositing here */
+  disp = &l->disp[l->len];
+  memset (disp, 0, sizeof (*disp));
+  disp->monitor = m;
+  disp->psurface = ps;
+  disp->effects.opacity.opaque = e ? e->opacity : 255;
+  if (e)
+    {
+      disp->effects.viewport.psurface_x = e->psurface_x;
+      disp->effects.viewport.psurface_y = e->psurface_y;
+      disp->effects.viewport.psurface_height = e->psurface_height;
+      disp->effects.viewport.psurface_width = e->psurface_width;
+      disp->effects.viewport.monitor_x = e->monitor_x;
+      disp->effects.viewport.monitor_y = e->monitor_y;
+      disp->effects.viewport.monitor_height = e->monitor_height;
+      disp->effects.viewport.monitor_width = e->monitor_width;
+    }
 
   l->len++;
 
@@ -102,8 +121,10 @@ display_list_commit (struct plugin *p, struct display_list *l, int force)
 {
   int rc;
 
+  SURFMAN_TRACE_BEGIN ("plugin_display", p->name);
   rc = PLUGIN_CALL_CAST (p, surfman_display_extra_func_t, display,
                          l->disp, l->len, force);
+  SURFMAN_TRACE_END ("plugin_display", p->name);
 
   return rc;
 }
@@ -141,11 +162,31 @@ prepare_display (struct plugin *p, struct display *d, int monitor_id)
     }
 }
 
+/*
+ * Get the psurface to display and the effect the plugin has to apply on it,
+ * which is none when surfman composites the surface itself.
+ */
 static surfman_psurface_t
-get_psurface (struct plugin *p, struct display *d)
+get_psurface (struct plugin *p, struct display *d, int monitor_id,
+              struct effect **e)
 {
+  *e = NULL;
+
   if (d->display_type == DISPLAY_TYPE_SURFACE)
     {
+      surfman_psurface_t ps;
+
+      if (compositor_needed (p, d->u.surface, monitor_id, &d->effect))
+        {
+          ps = compositor_get_psurface (d->u.surface, p, monitor_id,
+                                        &d->effect);
+          if (ps)
+            return ps;
+          surfman_warning ("Plugin %s: could not composite effect on monitor %d",
+                           p->name, monitor_id);
+        }
+
+      *e = &d->effect;
       return surface_get_psurface (d->u.surface, p);
     }
 
@@ -153,6 +194,69 @@ get_psurface (struct plugin *p, struct display *d)
   return NULL;
 }
 
+/*
+ * A displayed surface got resized: a plugin only showing surfaces of its
+ * monitor's size may now have to be handed a composite, or the surface
+ * itself again. Redisplay the visible domain if so.
+ */
+static void
+display_resize_handler (int fd, short event, void *priv)
+{
+  int i;
+
+  display_resize_pending = 0;
+
+  for (i = 0; i < DISPLAY_MONITOR_MAX; i++)
+    {
+      struct display *d;
+
+      if (!display[i].mon || !display[i].plugin)
+        continue;
+
+      LIST_FOREACH (d, &display[i].current, link)
+        {
+          if (d->display_type == DISPLAY_TYPE_SURFACE &&
+              compositor_stale (display[i].plugin, d->u.surface, i,
+                                &d->effect))
+            {
+              surfman_info ("Surface %p resized on monitor %d, redisplaying",
+                            d->u.surface, i);
+              domain_set_visible (NULL, 0);
+              return;
+            }
+        }
+    }
+}
+
+/*
+ * Deferred to the event loop, so that the device is done updating the
+ * surface (format, then pages) when it is checked.
+ */
+void
+display_surface_resized (struct surface *s)
+{
+  struct timeval tv = { 0, 0 };
+  int i;
+
+  if (display_resize_pending)
+    return;
+
+  for (i = 0; i < DISPLAY_MONITOR_MAX; i++)
+    {
+      struct display *d;
+
+      LIST_FOREACH (d, &display[i].current, link)
+        {
+          if (d->display_type == DISPLAY_TYPE_SURFACE && d->u.surface == s)
+            {
+              display_resize_pending = 1;
+              evtimer_add (&display_resize_event, &tv);
+              return;
+            }
+        }
+    }
+}
+
 void
 display_init (void)
 {
@@ -166,6 +270,8 @@ display_init (void)
       LIST_HEAD_INIT (&display[i].current);
       LIST_HEAD_INIT (&display[i].next);
     }
+
+  evtimer_set (&display_resize_event, display_resize_handler, NULL);
 }
 
 struct monitor_info *
@@ -377,6 +483,8 @@ display_prepare_surface (int monitor_id,
   d->u.surface = s;
   if (e)
     d->effect = *e;
+  else
+    d->effect.opacity = 255;
 
   LIST_INSERT_HEAD (&display[monitor_id].next, d, link);
 
@@ -398,6 +506,8 @@ display_commit (struct plugin *p, int force)
       return rc;
     }
 
+  SURFMAN_TRACE_BEGIN ("display_commit", p->name);
+
   for (i = 0; i < DISPLAY_MONITOR_MAX; i++)
     {
       if (!display[i].mon)
@@ -418,11 +528,14 @@ display_commit (struct plugin *p, int force)
               LIST_FOREACH_SAFE (d, tmp, &display[i].next, link)
                 {
                   surfman_psurface_t ps;
+                  struct effect *e;
 
                   LIST_REMOVE (d, link);
-                  ps = get_psurface (p, d);
+                  SURFMAN_TRACE_BEGIN ("get_psurface", p->name);
+                  ps = get_psurface (p, d, i, &e);
+                  SURFMAN_TRACE_END ("get_psurface", p->name);
                   prepare_display (p, d, i);
-                  rc |= display_list_append (&dlist, display[i].mon, ps, &d->effect);
+                  rc |= display_list_append (&dlist, display[i].mon, ps, e);
                   LIST_INSERT_HEAD (&display[i].current, d, link);
                 }
             }
@@ -437,6 +550,7 @@ display_commit (struct plugin *p, int force)
     surfman_error ("Plugin %s display() method failed", p->name);
 
   display_list_cleanup (&dlist);
+  SURFMAN_TRACE_END ("display_commit", p->name);
 
   return rc;
 }
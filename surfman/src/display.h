@@ -83,6 +83,9 @@ struct monitor
 
   LIST_HEAD (, struct display) current;
   LIST_HEAD (, struct display) next;
+
+  int vblank_pending;           /* A vblank event has been requested */
+  struct timeval vblank_tv;     /* When it has been requested */
 };
 
 #endif /* DISPLAY_H_ */
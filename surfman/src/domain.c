@@ -202,7 +202,9 @@ domain_set_visible (struct domain *d, int force)
 
       if (dev)
         {
+          SURFMAN_TRACE_BEGIN ("device_set_visible", dev->ops->name);
           rc = dev->ops->set_visible (dev);
+          SURFMAN_TRACE_END ("device_set_visible", dev->ops->name);
           if (rc)
             surfman_warning("Failed to display domain %d on device %s",
                             d->domid, dev->ops->name);
@@ -332,3 +334,34 @@ dump_all_screens (const char *directory)
 
   return ret;
 }
+
+void
+dump_all_stats (void)
+{
+  struct domain *d;
+  struct device *dev;
+  surfman_map_stats_t map;
+
+  surface_map_stats (&map);
+  surfman_info ("surface mappings: %llu maps (%llu hits), %llu created, "
+                "%llu kept across page updates, %llu remapped in place, "
+                "%llu released, %llu bytes mapped (%llu since startup), "
+                "%llu pages mapped in %llums",
+                (unsigned long long) map.maps, (unsigned long long) map.hits,
+                (unsigned long long) map.remaps,
+                (unsigned long long) map.reuses,
+                (unsigned long long) map.partial,
+                (unsigned long long) map.unmaps,
+                (unsigned long long) map.bytes_mapped,
+                (unsigned long long) map.bytes_total,
+                (unsigned long long) map.pages_mapped,
+                (unsigned long long) map.map_us / 1000);
+
+  surface_refresh_dump_stats ();
+  plugin_dump_stats ();
+
+  LIST_FOREACH (d, &domain_list, link)
+    LIST_FOREACH (dev, &(d->devices), link)
+      if (dev->ops && dev->ops->dump_stats)
+        dev->ops->dump_stats (dev);
+}
@@ -32,6 +32,7 @@ struct device_ops
   void            (*takedown)        (struct device *dev);
   struct surface *(*get_surface)     (struct device *dev, int monitor_id);
   int             (*is_active)       (struct device *dev);
+  void            (*dump_stats)      (struct device *dev);
 };
 
 struct device
@@ -26,6 +26,10 @@ struct ioemugfx_device
   size_t lfb_len;
   uint8_t *dirty_buffer;
 
+  /* Optional sub-page damage (ioemugfx.subpage_damage in surfman.conf). */
+  struct damage_shadow damage;
+  surfman_rect_t damage_rects[DAMAGE_RECTS_MAX];
+
   /* For now, only the availability of each monitor this backend is aware of.
    * Index is a /monitor_id/ in display[] (so, the index). */
   int monitors[DISPLAY_MONITOR_MAX];
@@ -52,6 +56,7 @@ ioemugfx_display_resize(void *priv,
         }
       if (dev->dirty_buffer)
         free (dev->dirty_buffer);
+      damage_release (&dev->damage);
 
       dev->dirty_buffer = NULL;
       dev->lfb_addr = 0;
@@ -155,19 +160,40 @@ ioemugfx_refresh_surface (struct device *device, struct surface *s)
 {
   struct ioemugfx_device *dev = (struct ioemugfx_device *)device;
   size_t len = DIV_ROUND_UP(surface_length(s), XC_PAGE_SIZE);
-  int rc;
+  uint8_t *fb;
+  int rc, count;
 
   if (!dev->dirty_buffer)
     surface_refresh(s, NULL);
   else
     {
       rc = xc_hvm_get_dirty_vram (device->d->domid,
-                                  dev->lfb_addr, len,
+                                  dev->lfb_addr >> XC_PAGE_SHIFT, len,
                                   (void*)dev->dirty_buffer);
-      if (!rc)
+      if (rc)
+        {
+          if (errno == ENODATA)
+            {
+              /* Tracking restarted, the shadow may have missed changes. */
+              damage_release (&dev->damage);
+              surface_refresh (s, NULL);
+            }
+          return;
+        }
+
+      if (!dev->damage.enabled || !(fb = surface_map (s->surface)))
+        {
+          surface_refresh (s, dev->dirty_buffer);
+          return;
+        }
+
+      count = damage_refine (&dev->damage, s->surface, fb, dev->dirty_buffer,
+                             dev->damage_rects, DAMAGE_RECTS_MAX);
+      surface_unmap (s->surface);
+      if (count < 0)
         surface_refresh (s, dev->dirty_buffer);
-      else if (errno == ENODATA)
-        surface_refresh (s, NULL);
+      else
+        surface_refresh_rects (s, dev->dirty_buffer, dev->damage_rects, count);
   }
 }
 
@@ -208,6 +234,7 @@ ioemugfx_takedown (struct device *device)
 
   if (dev->dirty_buffer)
     free (dev->dirty_buffer);
+  damage_release (&dev->damage);
   if (dev->s)
     surface_destroy (dev->s);
 }
@@ -220,6 +247,22 @@ ioemugfx_is_active (struct device *device)
   return 1;
 }
 
+static void
+ioemugfx_dump_stats (struct device *device)
+{
+  struct ioemugfx_device *dev = (struct ioemugfx_device *)device;
+
+  if (!dev->damage.enabled)
+    return;
+
+  surfman_info ("ioemugfx dom%d: %llu dirty pages compared, %llu unchanged, "
+                "%llu passes past the compare threshold",
+                device->d->domid,
+                (unsigned long long) dev->damage.pages_compared,
+                (unsigned long long) dev->damage.pages_clean,
+                (unsigned long long) dev->damage.passes_skipped);
+}
+
 static struct device_ops ioemugfx_device_ops = {
   .name = "ioemugfx",
   .refresh_surface = ioemugfx_refresh_surface,
@@ -228,6 +271,7 @@ static struct device_ops ioemugfx_device_ops = {
   .takedown = ioemugfx_takedown,
   .get_surface = ioemugfx_get_surface,
   .is_active = ioemugfx_is_active,
+  .dump_stats = ioemugfx_dump_stats,
 };
 
 struct device *
@@ -241,6 +285,7 @@ ioemugfx_device_create(struct domain *d, struct dmbus_rpc_ops **ops)
   if (!dev)
     return NULL;
 
+  damage_init (&dev->damage, ioemugfx_device_ops.name);
   *ops = &ioemugfx_rpc_ops;
 
   return &dev->device;
@@ -19,7 +19,16 @@
 
 #define PLUGIN_VERSION_SUPPORTED(v) (SURFMAN_VERSION_MAJOR(v) == VERSION_MAJOR)
 
+/*
+ * Plugin notifications (monitor rescans).
+ *
+ * Plugins providing get_notify_fd (API 2.1.4) signal a file descriptor after
+ * setting their notify field, and are serviced as soon as it is readable.
+ * The others are polled every second. surfman.conf can keep the poll for
+ * every plugin with [surfman] plugin_poll = 1.
+ */
 static struct event plugin_poll_event;
+static int plugin_poll_all;
 
 static
 LIST_HEAD (, struct plugin)
@@ -47,6 +56,63 @@ name_from_path (char *d, char *path, size_t len)
   return len;
 }
 
+static int
+plugin_notify_supported (struct plugin *p)
+{
+  /* get_notify_fd has been implemented from 2.1.4 */
+  return PLUGIN_CHECK_VERSION (p, 2, 1, 4) &&
+         PLUGIN_HAS_METHOD (p, get_notify_fd);
+}
+
+static int
+plugin_refresh_thread_supported (struct plugin *p)
+{
+  /* Threaded refreshes have been allowed from 2.2.1 */
+  return PLUGIN_CHECK_VERSION (p, 2, 2, 1) &&
+         (PLUGIN_GET_OPTION (p, features) & SURFMAN_FEATURE_THREADED_REFRESH);
+}
+
+static void
+plugin_notify_handler (int fd, short event, void *priv)
+{
+  struct plugin *p = priv;
+  uint64_t count;
+
+  while (read (fd, &count, sizeof (count)) > 0)
+    continue;
+
+  SURFMAN_TRACE_BEGIN ("plugin_notify", p->name);
+  plugin_handle_notification (p);
+  SURFMAN_TRACE_END ("plugin_notify", p->name);
+}
+
+static void
+plugin_notify_setup (struct plugin *p)
+{
+  int fd;
+
+  p->notify_fd = -1;
+  if (!plugin_notify_supported (p))
+    return;
+
+  fd = PLUGIN_CALL (p, get_notify_fd);
+  if (fd < 0)
+    {
+      surfman_warning ("%s: no notification fd, polling instead", p->name);
+      return;
+    }
+
+  event_set (&p->notify_event, fd, EV_READ | EV_PERSIST,
+             plugin_notify_handler, p);
+  if (event_add (&p->notify_event, NULL))
+    {
+      surfman_warning ("%s: could not watch notification fd %d, polling instead",
+                       p->name, fd);
+      return;
+    }
+  p->notify_fd = fd;
+}
+
 struct plugin *
 load_plugin (char *path)
 {
@@ -104,6 +170,11 @@ load_plugin (char *path)
 
   LIST_INSERT_HEAD (&plugin_list, ret, link);
 
+  plugin_notify_setup (ret);
+
+  if (plugin_refresh_thread_supported (ret))
+    refresh_thread_start (ret);
+
   plugin_scan_monitors (ret);
 
   return ret;
@@ -119,7 +190,11 @@ sym_fail:
 static void
 unload_plugin (struct plugin *p)
 {
+  if (p->notify_fd >= 0)
+    event_del (&p->notify_event);
+  vblank_plugin_takedown (p);
   display_plugin_takedown (p);
+  refresh_thread_stop (p);
   PLUGIN_CALL (p, shutdown);
 
   dlclose (p->handle);
@@ -238,16 +313,23 @@ plugin_poll (int fd, short event, void *priv)
   struct plugin *p;
   struct domain *d;
   struct timeval tv = {1, 0};
+  int polled = 0;
 
   (priv);
 
   LIST_FOREACH (p, &plugin_list, link)
     {
+      if (p->notify_fd >= 0 && !plugin_poll_all)
+        continue;
+
       plugin_handle_notification (p);
       resolution_refresh_current (p);
+      polled++;
     }
 
-  event_add (&plugin_poll_event, &tv);
+  /* Nothing left to poll: no more wake-ups. */
+  if (polled)
+    event_add (&plugin_poll_event, &tv);
 }
 
 void
@@ -255,6 +337,7 @@ plugin_init (const char *plugin_path, int safe_graphics)
 {
   int n = 0;
   struct timeval tv = {1, 0};
+  struct plugin *p;
   const char *plugins;
   const char *fallback;
 
@@ -262,6 +345,7 @@ plugin_init (const char *plugin_path, int safe_graphics)
 
   plugins = config_get ("surfman", "plugins");
   fallback = config_get ("surfman", "fallback");
+  plugin_poll_all = config_get_uint ("surfman", "plugin_poll", 0);
 
   if (safe_graphics)
     {
@@ -281,7 +365,14 @@ plugin_init (const char *plugin_path, int safe_graphics)
 
   event_set (&plugin_poll_event, -1, EV_TIMEOUT,
              plugin_poll, NULL);
-  event_add (&plugin_poll_event, &tv);
+  LIST_FOREACH (p, &plugin_list, link)
+    {
+      if (p->notify_fd < 0 || plugin_poll_all)
+        {
+          event_add (&plugin_poll_event, &tv);
+          break;
+        }
+    }
 }
 
 void
@@ -289,7 +380,9 @@ plugin_cleanup (void)
 {
   struct plugin *p, *tmp;
 
-  event_del (&plugin_poll_event);
+  /* Unset if plugin_init() was not called, e.g. in surfman-bench. */
+  if (event_initialized (&plugin_poll_event))
+    event_del (&plugin_poll_event);
 
   LIST_FOREACH_SAFE (p, tmp, &plugin_list, link)
     {
@@ -358,6 +451,180 @@ plugin_handle_notification (struct plugin *plugin)
   return ret;
 }
 
+static uint64_t
+clock_us (clockid_t clock)
+{
+  struct timespec ts;
+
+  clock_gettime (clock, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static size_t
+dirty_bytes (const uint8_t *dirty, size_t len)
+{
+  size_t npages = (len + XC_PAGE_SIZE - 1) >> XC_PAGE_SHIFT;
+  size_t i, n = 0;
+
+  if (!dirty)
+    return len;
+
+  for (i = 0; i < npages / 8; i++)
+    n += __builtin_popcount (dirty[i]);
+  if (npages % 8)
+    n += __builtin_popcount (dirty[i] & ((1 << (npages % 8)) - 1));
+
+  n <<= XC_PAGE_SHIFT;
+  return n < len ? n : len;
+}
+
+/*
+ * Call the refresh method of /p/ fitting the damage (see
+ * plugin_refresh_psurface()) and account for what it cost. Runs in the thread
+ * refreshing the plugin, the caller serializes the accounting with
+ * plugin_dump_stats().
+ */
+void
+plugin_refresh_call (struct plugin *p, surfman_psurface_t psurface,
+                     uint8_t *dirty, size_t len,
+                     const surfman_rect_t *rects, unsigned int count,
+                     struct plugin_refresh_cost *cost)
+{
+  cost->wall_us = clock_us (CLOCK_MONOTONIC);
+  cost->cpu_us = clock_us (CLOCK_THREAD_CPUTIME_ID);
+
+  if (rects)
+    PLUGIN_CALL (p, refresh_psurface_rects, psurface, rects, count);
+  else
+    PLUGIN_CALL (p, refresh_psurface, psurface, dirty);
+
+  cost->cpu_us = clock_us (CLOCK_THREAD_CPUTIME_ID) - cost->cpu_us;
+  cost->wall_us = clock_us (CLOCK_MONOTONIC) - cost->wall_us;
+  cost->damage_bytes = dirty_bytes (dirty, len);
+}
+
+void
+plugin_refresh_account (struct plugin *p,
+                        const struct plugin_refresh_cost *cost)
+{
+  struct plugin_refresh_stats *st = &p->stats;
+
+  if (!st->since_us)
+    st->since_us = clock_us (CLOCK_MONOTONIC);
+  st->frames++;
+  st->damage_bytes += cost->damage_bytes;
+  st->cpu_us += cost->cpu_us;
+  st->wall_us += cost->wall_us;
+  if (cost->wall_us > st->wall_max_us)
+    st->wall_max_us = cost->wall_us;
+}
+
+/*
+ * Hand the damage of a surface /len/ bytes long to the plugin, and account
+ * for what it cost. The damage is /dirty/ (NULL for all of it) and, when the
+ * caller has them, the /count/ rectangles /rects/ covering the same pixels;
+ * plugins taking rectangles get those. Plugins with a refresh thread get it
+ * queued there.
+ */
+void
+plugin_refresh_psurface (struct plugin *p, surfman_psurface_t psurface,
+                         uint8_t *dirty, size_t len,
+                         const surfman_rect_t *rects, unsigned int count)
+{
+  struct plugin_refresh_cost cost;
+
+  if (!rects || !plugin_refresh_rects_supported (p))
+    rects = NULL;
+  else if (!count)
+    return;                     /* Nothing changed */
+
+  if (p->thread)
+    {
+      refresh_thread_queue (p, psurface, dirty, len, rects, count);
+      return;
+    }
+
+  plugin_refresh_call (p, psurface, dirty, len, rects, count, &cost);
+  plugin_refresh_account (p, &cost);
+}
+
+/*
+ * The plugin is about to be handed a new state of /psurface/, or to free it:
+ * make sure no refresh of it is pending or running.
+ */
+void
+plugin_refresh_sync (struct plugin *p, surfman_psurface_t psurface)
+{
+  if (p->thread)
+    refresh_thread_sync (p, psurface);
+}
+
+/* Log the refresh cost of /p/ since the last call. */
+void
+plugin_refresh_dump_stats (struct plugin *p, uint64_t now)
+{
+  struct plugin_refresh_stats *st = &p->stats;
+  double secs;
+
+  if (!st->frames)
+    return;
+
+  secs = (now - st->since_us) / 1000000.;
+  if (secs <= 0)
+    secs = 1;
+
+  surfman_info ("plugin %s: %llu refreshes in %.1fs, %.1f frames/s, "
+                "%.1f MB/s of damage, %llu us CPU and %llu us "
+                "(max %llu us) per frame",
+                p->name, (unsigned long long) st->frames, secs,
+                st->frames / secs, st->damage_bytes / secs / 1048576.,
+                (unsigned long long) (st->cpu_us / st->frames),
+                (unsigned long long) (st->wall_us / st->frames),
+                (unsigned long long) st->wall_max_us);
+
+  memset (st, 0, sizeof (*st));
+  st->since_us = now;
+}
+
+/*
+ * Copy the refresh cost of /p/ since the last call, or the last
+ * plugin_dump_stats(), to /st/ and start a new window. The caller serializes
+ * with the thread refreshing the plugin, see plugin_take_stats().
+ */
+void
+plugin_refresh_take_stats (struct plugin *p, struct plugin_refresh_stats *st)
+{
+  *st = p->stats;
+  memset (&p->stats, 0, sizeof (p->stats));
+  p->stats.since_us = clock_us (CLOCK_MONOTONIC);
+}
+
+/* Same as plugin_refresh_take_stats(), from the event loop. */
+void
+plugin_take_stats (struct plugin *p, struct plugin_refresh_stats *st)
+{
+  if (p->thread)
+    refresh_thread_take_stats (p, st);
+  else
+    plugin_refresh_take_stats (p, st);
+}
+
+/* Log the refresh cost of each plugin since the last call. */
+void
+plugin_dump_stats (void)
+{
+  uint64_t now = clock_us (CLOCK_MONOTONIC);
+  struct plugin *p;
+
+  LIST_FOREACH (p, &plugin_list, link)
+    {
+      if (p->thread)
+        refresh_thread_dump_stats (p, now);
+      else
+        plugin_refresh_dump_stats (p, now);
+    }
+}
+
 void
 plugin_pre_s3 (void)
 {
@@ -465,6 +732,15 @@ plugin_need_refresh (struct plugin *p)
   return PLUGIN_GET_OPTION(p, features) & SURFMAN_FEATURE_NEED_REFRESH;
 }
 
+int
+plugin_refresh_rects_supported (struct plugin *p)
+{
+  /* refresh_psurface_rects has been implemented from 2.2.0 */
+  return PLUGIN_CHECK_VERSION (p, 2, 2, 0) &&
+         (PLUGIN_GET_OPTION (p, features) & SURFMAN_FEATURE_REFRESH_RECTS) &&
+         PLUGIN_HAS_METHOD (p, refresh_psurface_rects);
+}
+
 
 int
 plugin_display_commit (int force)
@@ -472,10 +748,12 @@ plugin_display_commit (int force)
   struct plugin *p;
   int rc = 0;
 
+  SURFMAN_TRACE_BEGIN ("plugin_display_commit", NULL);
   LIST_FOREACH (p, &plugin_list, link)
     {
       rc |= display_commit (p, force);
     }
+  SURFMAN_TRACE_END ("plugin_display_commit", NULL);
 
   return rc;
 }
@@ -24,9 +24,35 @@
 
 #define PLUGIN_MONITOR_MAX 16
 
+struct refresh_thread;
+
 /* Default plugin version if we can't find version in the plugin library */
 # define PLUGIN_DEFAULT_VERSION SURFMAN_VERSION(2, 0, 0)
 
+/*
+ * Cost of the refresh_psurface calls of a plugin, since the last dump_stats.
+ * CPU time is the one of the thread refreshing the plugin (see
+ * refresh_thread.c): work the plugin hands to its own threads is not in it.
+ * Only that thread writes the counters.
+ */
+struct plugin_refresh_stats
+{
+  uint64_t since_us;            /* Start of the window */
+  uint64_t frames;              /* refresh_psurface calls */
+  uint64_t damage_bytes;        /* Bytes of the dirty pages handed over */
+  uint64_t cpu_us;
+  uint64_t wall_us;
+  uint64_t wall_max_us;
+};
+
+/* Cost of one refresh_psurface call. */
+struct plugin_refresh_cost
+{
+  uint64_t damage_bytes;
+  uint64_t cpu_us;
+  uint64_t wall_us;
+};
+
 struct plugin
 {
   LIST_ENTRY (struct plugin) link;
@@ -38,6 +64,12 @@ struct plugin
 
   int monitor_count;
   surfman_monitor_t monitors[PLUGIN_MONITOR_MAX];
+
+  int notify_fd;                /* Watched notification fd, or -1 to poll */
+  struct event notify_event;
+
+  struct plugin_refresh_stats stats;
+  struct refresh_thread *thread; /* Refreshes run there, or NULL */
 };
 
 #define PLUGIN_CALL(p,method,...) \
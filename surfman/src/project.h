@@ -70,6 +70,7 @@
 #include "plugin.h"
 #include "xenstore-helper.h"
 #include "display.h"
+#include "compositor.h"
 #include "splashscreen.h"
 
 #include "prototypes.h"
@@ -30,10 +30,13 @@ extern void domain_monitor_update(int monitor_id, int enable);
 extern void *device_create(struct domain *d, struct device_ops *ops, size_t size);
 extern void device_destroy(struct device *device);
 extern int dump_all_screens(const char *directory);
+extern void dump_all_stats(void);
 /* dbus_glue.c */
 extern dbus_bool_t dbus_display_text(DBusMessage *msg, DBusMessage *reply);
 extern dbus_bool_t dbus_display_image(DBusMessage *msg, DBusMessage *reply);
 extern dbus_bool_t dbus_dump_all_screens(DBusMessage *msg, DBusMessage *reply);
+extern dbus_bool_t dbus_dump_stats(DBusMessage *msg, DBusMessage *reply);
+extern dbus_bool_t dbus_dump_trace(DBusMessage *msg, DBusMessage *reply);
 extern dbus_bool_t dbus_increase_brightness(DBusMessage *msg, DBusMessage *reply);
 extern dbus_bool_t dbus_decrease_brightness(DBusMessage *msg, DBusMessage *reply);
 extern dbus_bool_t dbus_dpms_on(DBusMessage *msg, DBusMessage *reply);
@@ -65,7 +68,10 @@ extern int surface_unregister_onscreen(struct surface *s, display_handler_t h);
 extern int surface_register_offscreen(struct surface *s, display_handler_t h, void *priv);
 extern int surface_unregister_offscreen(struct surface *s, display_handler_t h);
 extern int surface_need_refresh(struct surface *s);
+extern void surface_refresh_rects(struct surface *s, uint8_t *dirty, const surfman_rect_t *rects, unsigned int count);
 extern void surface_refresh(struct surface *s, uint8_t *dirty);
+extern int surface_refresh_vblank(struct surface *s, int monitor_id);
+extern void surface_refresh_dump_stats(void);
 extern struct surface *surface_create(struct device *dev, void *priv);
 extern surfman_psurface_t surface_get_psurface(struct surface *s, struct plugin *p);
 extern void surface_destroy(struct surface *s);
@@ -112,6 +118,14 @@ extern void plugin_cleanup(void);
 extern struct plugin *plugin_lookup(char *name);
 extern void plugin_scan_monitors(struct plugin *plugin);
 extern int plugin_handle_notification(struct plugin *plugin);
+extern void plugin_refresh_call(struct plugin *p, surfman_psurface_t psurface, uint8_t *dirty, size_t len, const surfman_rect_t *rects, unsigned int count, struct plugin_refresh_cost *cost);
+extern void plugin_refresh_account(struct plugin *p, const struct plugin_refresh_cost *cost);
+extern void plugin_refresh_psurface(struct plugin *p, surfman_psurface_t psurface, uint8_t *dirty, size_t len, const surfman_rect_t *rects, unsigned int count);
+extern void plugin_refresh_sync(struct plugin *p, surfman_psurface_t psurface);
+extern void plugin_refresh_dump_stats(struct plugin *p, uint64_t now);
+extern void plugin_refresh_take_stats(struct plugin *p, struct plugin_refresh_stats *st);
+extern void plugin_take_stats(struct plugin *p, struct plugin_refresh_stats *st);
+extern void plugin_dump_stats(void);
 extern void plugin_pre_s3(void);
 extern void plugin_post_s3(void);
 extern void plugin_increase_brightness(void);
@@ -121,6 +135,7 @@ extern void plugin_dpms_off(void);
 extern void plugin_restore_brightness(void);
 extern unsigned int plugin_stride_align(void);
 extern int plugin_need_refresh(struct plugin *p);
+extern int plugin_refresh_rects_supported(struct plugin *p);
 extern int plugin_display_commit(int force);
 /* resolution.c */
 extern void resolution_refresh_current(struct plugin *plugin);
@@ -135,6 +150,7 @@ extern int surface_snapshot(surfman_surface_t *surf, const char *filename);
 /* display.c */
 extern struct monitor display[16];
 extern struct monitor *display_get_monitor(int display_id);
+extern void display_surface_resized(struct surface *s);
 extern void display_init(void);
 extern struct monitor_info *get_monitor_info(struct plugin *plugin, surfman_monitor_t m);
 extern int get_monitor_slot(surfman_monitor_t m);
@@ -160,3 +176,26 @@ extern int splash_picture(const char *fname);
 extern void fbtap_takedown(struct device *surf_dev);
 extern int fbtap_device_fd(struct device *surf_dev);
 extern struct device *fbtap_device_create(struct domain *d, int monitor_id, struct fbdim *dims);
+/* vblank.c */
+extern int vblank_supported(struct plugin *p);
+extern int vblank_request(int monitor_id);
+extern void vblank_plugin_takedown(struct plugin *p);
+/* compositor.c */
+extern int compositor_needed(struct plugin *p, struct surface *s, int monitor_id, const struct effect *e);
+extern int compositor_stale(struct plugin *p, struct surface *s, int monitor_id, const struct effect *e);
+extern int compositor_active(struct surface *s, struct plugin *p);
+extern surfman_psurface_t compositor_get_psurface(struct surface *s, struct plugin *p, int monitor_id, const struct effect *e);
+extern void compositor_refresh(struct surface *s, uint8_t *dirty);
+extern void compositor_offscreen(struct surface *s, struct plugin *p, int monitor_id);
+extern void compositor_surface_takedown(struct surface *s);
+/* damage.c */
+extern void damage_init(struct damage_shadow *d, const char *prefix);
+extern void damage_release(struct damage_shadow *d);
+extern int damage_refine(struct damage_shadow *d, surfman_surface_t *surface, const uint8_t *fb, uint8_t *dirty, surfman_rect_t *rects, unsigned int max);
+/* refresh_thread.c */
+extern int refresh_thread_start(struct plugin *p);
+extern void refresh_thread_stop(struct plugin *p);
+extern void refresh_thread_queue(struct plugin *p, surfman_psurface_t psurface, const uint8_t *dirty, size_t len, const surfman_rect_t *rects, unsigned int count);
+extern void refresh_thread_sync(struct plugin *p, surfman_psurface_t psurface);
+extern void refresh_thread_dump_stats(struct plugin *p, uint64_t now);
+extern void refresh_thread_take_stats(struct plugin *p, struct plugin_refresh_stats *st);
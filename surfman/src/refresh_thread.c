@@ -0,0 +1,471 @@
+/*
+ * Copyright (c) 2014 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include <pthread.h>
+
+#include "project.h"
+
+/*
+ * Per-plugin refresh threads.
+ *
+ * Refreshes of a plugin with SURFMAN_FEATURE_THREADED_REFRESH are queued for
+ * a thread of its own instead of being run in the event loop, so a slow sink
+ * (e.g. a remote encoder) does not delay the other plugins showing the same
+ * surface. There is one job per psurface at most: damage queued while a job
+ * is pending is merged into it, so a sink that cannot keep up skips frames
+ * rather than lagging behind. The queue is bounded; a psurface that finds it
+ * full is remembered, and gets a full refresh queued once a slot frees.
+ *
+ * The event loop only waits for the thread before a psurface is updated or
+ * freed (refresh_thread_sync()), pending jobs of that psurface are dropped
+ * then.
+ *
+ * surfman.conf, section of the plugin:
+ *   refresh_thread: 0 refreshes in the event loop even if the plugin allows
+ *                   otherwise (default: 1).
+ */
+
+#define REFRESH_QUEUE_MAX 16
+#define REFRESH_JOB_RECTS_MAX SURFMAN_DIRTY_RECTS_MAX
+
+struct refresh_job
+{
+  surfman_psurface_t psurface;
+  size_t len;                   /* Length of the surface */
+  int use_rects;                /* The plugin takes rectangles */
+
+  /* All plugins, rectangle ones for accounting */
+  int full;                     /* Whole surface damaged */
+  uint8_t *dirty;
+  size_t dirty_size;            /* Bytes allocated */
+
+  /* Rectangle plugins, unless /full/ */
+  surfman_rect_t rects[REFRESH_JOB_RECTS_MAX];
+  unsigned int count;
+};
+
+struct refresh_overflow
+{
+  surfman_psurface_t psurface;
+  size_t len;
+};
+
+struct refresh_thread
+{
+  struct plugin *plugin;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t work;          /* A job was queued, or quit */
+  pthread_cond_t idle;          /* A job was completed */
+  int quit;
+
+  struct refresh_job jobs[REFRESH_QUEUE_MAX];   /* FIFO */
+  unsigned int head;
+  unsigned int count;
+
+  struct refresh_job current;
+  int running;                  /* /current/ is being refreshed */
+
+  /* Psurfaces that found the queue full, oldest first. */
+  struct refresh_overflow *overflow;
+  unsigned int overflow_count;
+  unsigned int overflow_size;
+
+  unsigned long queued;
+  unsigned long merged;
+  unsigned long deferred;
+};
+
+static size_t
+dirty_size (size_t len)
+{
+  return (((len + XC_PAGE_SIZE - 1) >> XC_PAGE_SHIFT) + 7) / 8;
+}
+
+static void
+job_set_dirty (struct refresh_job *j, const uint8_t *dirty, size_t len)
+{
+  size_t n = dirty_size (len);
+
+  j->len = len;
+  j->full = !dirty;
+  if (!dirty)
+    return;
+
+  if (j->dirty_size < n)
+    {
+      j->dirty = xrealloc (j->dirty, n);
+      j->dirty_size = n;
+    }
+  memcpy (j->dirty, dirty, n);
+}
+
+static void
+job_merge_dirty (struct refresh_job *j, const uint8_t *dirty, size_t len)
+{
+  size_t i, n = dirty_size (len);
+
+  if (j->full)
+    return;
+  if (!dirty || len != j->len)
+    {
+      j->full = 1;
+      j->len = len;
+      return;
+    }
+
+  for (i = 0; i < n; i++)
+    j->dirty[i] |= dirty[i];
+}
+
+/* Past REFRESH_JOB_RECTS_MAX rectangles, the last one absorbs the others. */
+static void
+job_merge_rects (struct refresh_job *j, const surfman_rect_t *rects,
+                 unsigned int count)
+{
+  unsigned int i;
+
+  for (i = 0; i < count; i++)
+    {
+      surfman_rect_t *last;
+      unsigned int x1, y1;
+
+      if (j->count < REFRESH_JOB_RECTS_MAX)
+        {
+          j->rects[j->count++] = rects[i];
+          continue;
+        }
+
+      last = &j->rects[j->count - 1];
+      x1 = last->x + last->w;
+      y1 = last->y + last->h;
+      if (rects[i].x + rects[i].w > x1)
+        x1 = rects[i].x + rects[i].w;
+      if (rects[i].y + rects[i].h > y1)
+        y1 = rects[i].y + rects[i].h;
+      if (rects[i].x < last->x)
+        last->x = rects[i].x;
+      if (rects[i].y < last->y)
+        last->y = rects[i].y;
+      last->w = x1 - last->x;
+      last->h = y1 - last->y;
+    }
+}
+
+/* Take a free slot at the end of the queue for /psurface/. */
+static struct refresh_job *
+job_queue (struct refresh_thread *t, surfman_psurface_t psurface)
+{
+  struct refresh_job *j;
+
+  j = &t->jobs[(t->head + t->count) % REFRESH_QUEUE_MAX];
+  j->psurface = psurface;
+  j->use_rects = 0;
+  j->count = 0;
+  t->count++;
+  t->queued++;
+
+  return j;
+}
+
+static void
+overflow_add (struct refresh_thread *t, surfman_psurface_t psurface,
+              size_t len)
+{
+  unsigned int i;
+
+  for (i = 0; i < t->overflow_count; i++)
+    if (t->overflow[i].psurface == psurface)
+      {
+        t->overflow[i].len = len;
+        return;
+      }
+
+  if (t->overflow_count == t->overflow_size)
+    {
+      t->overflow_size = t->overflow_size ? t->overflow_size * 2 : 4;
+      t->overflow = xrealloc (t->overflow,
+                              t->overflow_size * sizeof (*t->overflow));
+    }
+  t->overflow[t->overflow_count].psurface = psurface;
+  t->overflow[t->overflow_count].len = len;
+  t->overflow_count++;
+  t->deferred++;
+}
+
+static void
+overflow_remove (struct refresh_thread *t, surfman_psurface_t psurface)
+{
+  unsigned int i, n = 0;
+
+  for (i = 0; i < t->overflow_count; i++)
+    if (t->overflow[i].psurface != psurface)
+      t->overflow[n++] = t->overflow[i];
+  t->overflow_count = n;
+}
+
+/*
+ * Queue a full refresh for the psurfaces that found the queue full, as long
+ * as there are free slots. Their damage is unknown: all of it is refreshed.
+ */
+static void
+overflow_requeue (struct refresh_thread *t)
+{
+  struct refresh_job *j;
+  unsigned int n = 0;
+
+  for (; n < t->overflow_count && t->count < REFRESH_QUEUE_MAX; n++)
+    {
+      j = job_queue (t, t->overflow[n].psurface);
+      job_set_dirty (j, NULL, t->overflow[n].len);
+    }
+
+  if (!n)
+    return;
+  t->overflow_count -= n;
+  memmove (t->overflow, t->overflow + n,
+           t->overflow_count * sizeof (*t->overflow));
+  pthread_cond_signal (&t->work);
+}
+
+static void *
+refresh_thread_main (void *opaque)
+{
+  struct refresh_thread *t = opaque;
+  struct refresh_job *j, *cur = &t->current;
+  struct plugin_refresh_cost cost;
+  uint8_t *dirty;
+  size_t size;
+
+  pthread_mutex_lock (&t->lock);
+  for (;;)
+    {
+      while (!t->count && !t->quit)
+        pthread_cond_wait (&t->work, &t->lock);
+      if (t->quit)
+        break;
+
+      /* Take the oldest job, its slot gets the buffer of the last one. */
+      j = &t->jobs[t->head];
+      dirty = cur->dirty;
+      size = cur->dirty_size;
+      *cur = *j;
+      j->dirty = dirty;
+      j->dirty_size = size;
+      t->head = (t->head + 1) % REFRESH_QUEUE_MAX;
+      t->count--;
+      overflow_requeue (t);
+      t->running = 1;
+      pthread_mutex_unlock (&t->lock);
+
+      /* Damage merged from a full refresh voids the rectangles. */
+      plugin_refresh_call (t->plugin, cur->psurface,
+                           cur->full ? NULL : cur->dirty, cur->len,
+                           cur->use_rects && !cur->full ? cur->rects : NULL,
+                           cur->count, &cost);
+
+      pthread_mutex_lock (&t->lock);
+      plugin_refresh_account (t->plugin, &cost);
+      t->running = 0;
+      pthread_cond_broadcast (&t->idle);
+    }
+  pthread_mutex_unlock (&t->lock);
+
+  return NULL;
+}
+
+int
+refresh_thread_start (struct plugin *p)
+{
+  struct refresh_thread *t;
+  int rc;
+
+  if (!config_get_uint (p->name, "refresh_thread", 1))
+    return 0;
+
+  t = xcalloc (1, sizeof (*t));
+  t->plugin = p;
+  pthread_mutex_init (&t->lock, NULL);
+  pthread_cond_init (&t->work, NULL);
+  pthread_cond_init (&t->idle, NULL);
+
+  rc = pthread_create (&t->thread, NULL, refresh_thread_main, t);
+  if (rc)
+    {
+      surfman_warning ("%s: cannot start refresh thread: %s, refreshing "
+                       "in the event loop", p->name, strerror (rc));
+      pthread_cond_destroy (&t->idle);
+      pthread_cond_destroy (&t->work);
+      pthread_mutex_destroy (&t->lock);
+      free (t);
+      return -1;
+    }
+
+  p->thread = t;
+  surfman_info ("%s: refreshing from a dedicated thread", p->name);
+
+  return 0;
+}
+
+void
+refresh_thread_stop (struct plugin *p)
+{
+  struct refresh_thread *t = p->thread;
+  unsigned int i;
+
+  if (!t)
+    return;
+
+  pthread_mutex_lock (&t->lock);
+  t->quit = 1;
+  pthread_cond_signal (&t->work);
+  pthread_mutex_unlock (&t->lock);
+  pthread_join (t->thread, NULL);
+
+  for (i = 0; i < REFRESH_QUEUE_MAX; i++)
+    free (t->jobs[i].dirty);
+  free (t->current.dirty);
+  free (t->overflow);
+  pthread_cond_destroy (&t->idle);
+  pthread_cond_destroy (&t->work);
+  pthread_mutex_destroy (&t->lock);
+  free (t);
+  p->thread = NULL;
+}
+
+/*
+ * Queue the damage of /psurface/, see plugin_refresh_psurface() for the
+ * arguments. Never waits for the thread.
+ */
+void
+refresh_thread_queue (struct plugin *p, surfman_psurface_t psurface,
+                      const uint8_t *dirty, size_t len,
+                      const surfman_rect_t *rects, unsigned int count)
+{
+  struct refresh_thread *t = p->thread;
+  struct refresh_job *j = NULL;
+  unsigned int i;
+
+  pthread_mutex_lock (&t->lock);
+
+  /* Psurfaces waiting for a slot go first, this one may be among them. */
+  overflow_requeue (t);
+
+  for (i = 0; i < t->count; i++)
+    {
+      j = &t->jobs[(t->head + i) % REFRESH_QUEUE_MAX];
+      if (j->psurface == psurface)
+        break;
+    }
+
+  /*
+   * Rectangle jobs keep the bitmap too: it accounts for the damage, and a
+   * full refresh merged in overrides the rectangles.
+   */
+  if (i < t->count)
+    {
+      if (j->use_rects)
+        job_merge_rects (j, rects, count);
+      job_merge_dirty (j, dirty, len);
+      t->merged++;
+    }
+  else if (t->count == REFRESH_QUEUE_MAX)
+    {
+      if (!t->deferred)
+        surfman_warning ("%s: refresh queue full, deferring refreshes",
+                         p->name);
+      overflow_add (t, psurface, len);
+    }
+  else
+    {
+      j = job_queue (t, psurface);
+      j->use_rects = !!rects;
+      job_set_dirty (j, dirty, len);
+      if (rects)
+        job_merge_rects (j, rects, count);
+      pthread_cond_signal (&t->work);
+    }
+
+  pthread_mutex_unlock (&t->lock);
+}
+
+/*
+ * Drop the pending refreshes of /psurface/ and wait for the one in progress,
+ * if any, to complete.
+ */
+void
+refresh_thread_sync (struct plugin *p, surfman_psurface_t psurface)
+{
+  struct refresh_thread *t = p->thread;
+  unsigned int i, n = 0;
+
+  pthread_mutex_lock (&t->lock);
+
+  /* Compact the FIFO, keeping the order of the other jobs. */
+  for (i = 0; i < t->count; i++)
+    {
+      struct refresh_job *src = &t->jobs[(t->head + i) % REFRESH_QUEUE_MAX];
+      struct refresh_job *dst = &t->jobs[(t->head + n) % REFRESH_QUEUE_MAX];
+
+      if (src->psurface == psurface)
+        continue;
+      if (src != dst)
+        {
+          struct refresh_job tmp = *dst;
+
+          *dst = *src;
+          *src = tmp;
+        }
+      n++;
+    }
+  t->count = n;
+  overflow_remove (t, psurface);
+  overflow_requeue (t);
+
+  while (t->running && t->current.psurface == psurface)
+    pthread_cond_wait (&t->idle, &t->lock);
+
+  pthread_mutex_unlock (&t->lock);
+}
+
+/* Log the refresh cost of /p/ and what happened to its queue since the last call. */
+void
+refresh_thread_dump_stats (struct plugin *p, uint64_t now)
+{
+  struct refresh_thread *t = p->thread;
+
+  pthread_mutex_lock (&t->lock);
+  plugin_refresh_dump_stats (p, now);
+  if (t->queued)
+    surfman_info ("plugin %s: refresh thread: %lu jobs, %lu refreshes merged "
+                  "into pending ones, %lu deferred to a full refresh, "
+                  "%u pending",
+                  p->name, t->queued, t->merged, t->deferred, t->count);
+  t->queued = t->merged = t->deferred = 0;
+  pthread_mutex_unlock (&t->lock);
+}
+
+/* Take the refresh cost of /p/, see plugin_take_stats(). */
+void
+refresh_thread_take_stats (struct plugin *p, struct plugin_refresh_stats *st)
+{
+  struct refresh_thread *t = p->thread;
+
+  pthread_mutex_lock (&t->lock);
+  plugin_refresh_take_stats (p, st);
+  pthread_mutex_unlock (&t->lock);
+}
@@ -48,7 +48,6 @@ surface_snapshot (surfman_surface_t *surf, const char *filename)
   void *fb;
   size_t mapping_len;
   unsigned int h = 0;
-  unsigned int w = 0;
   uint32_t *row;
   int ret = SURFMAN_ERROR;
 
@@ -60,7 +59,8 @@ surface_snapshot (surfman_surface_t *surf, const char *filename)
 
   /* Don't care about complex surface format */
   if (surf->format != SURFMAN_FORMAT_BGRX8888 &&
-      surf->format != SURFMAN_FORMAT_RGBX8888)
+      surf->format != SURFMAN_FORMAT_RGBX8888 &&
+      surf->format != SURFMAN_FORMAT_BGR565)
     {
       surfman_error ("Unsupported format: %x", surf->format);
       return SURFMAN_ERROR;
@@ -111,18 +111,15 @@ surface_snapshot (surfman_surface_t *surf, const char *filename)
 
   for (h = 0; h < surf->height; h++)
     {
-      uint32_t *pix = (uint32_t *)((char *)fb + h * surf->stride);
+      void *pix = (char *)fb + h * surf->stride;
 
-      for (w = 0; w < surf->width; w++)
-        {
-          row[w] = pix[w] | 0xff000000;
-
-          /* Swap B and R channel */
-          if (surf->format == SURFMAN_FORMAT_BGRX8888)
-            row[w] = (row[w] & 0xff00ff00) |
-                     ((row[w] & 0xff0000) >> 16) |
-                     ((row[w] & 0xff) << 16);
-        }
+      /* PNG wants RGBA: expand or force alpha, then swap B and R channel */
+      if (surf->format == SURFMAN_FORMAT_BGR565)
+        blit_expand_565 (row, pix, surf->width);
+      else
+        blit_force_alpha (row, pix, surf->width);
+      if (surf->format != SURFMAN_FORMAT_RGBX8888)
+        blit_swizzle (row, row, surf->width);
 
       png_write_row (png, (png_bytep)row);
     }
@@ -133,9 +130,7 @@ surface_snapshot (surfman_surface_t *surf, const char *filename)
   ret = SURFMAN_SUCCESS;
 
 fail_2:
-  /* do not unmap as this causes the surface to be unmapped (no ref counting)
-     see XC-8638
-  surface_unmap (surf); */
+  surface_unmap (surf);
 
 fail_1:
   fclose (output);
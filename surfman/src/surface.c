@@ -19,13 +19,6 @@
 
 #define __min(x, y) ((x) > (y) ? (y) : (x))
 
-/* libsurfman's secret functions */
-int surfman_surface_init(surfman_surface_t *surface);
-void surfman_surface_cleanup(surfman_surface_t *surface);
-void surfman_surface_update_mmap(surfman_surface_t *surface, int fd, size_t off);
-void surfman_surface_update_pfn_arr(surfman_surface_t *surface, const xen_pfn_t *pfns);
-void surfman_surface_update_pfn_linear(surfman_surface_t *surface, xen_pfn_t base);
-
 static int register_display_handler(display_handler_t handler,
                                     void *priv, struct handler_list_head *list)
 {
@@ -120,52 +113,329 @@ surface_need_refresh (struct surface *s)
         return 1;
     }
 
-  return 0;
+  return compositor_active (s, NULL);
+}
+
+/*
+ * Refresh scheduling policy, overridable per plugin in surfman.conf:
+ *   <plugin>.refresh_idle_hz      rate once the surface went idle (0 disables)
+ *   <plugin>.refresh_idle_passes  clean passes before going idle
+ *   <plugin>.dirty_merge_gap      clean lines coalesced into damage rectangles
+ * A surface shown by several plugins follows the most demanding of them:
+ * the fastest idle rate, the most clean passes and the smallest merge gap.
+ */
+#define REFRESH_DEFAULT_HZ      60
+#define REFRESH_MAX_HZ          240
+#define REFRESH_IDLE_HZ         4
+#define REFRESH_IDLE_PASSES     30
+
+/* Scheduler activity of all surfaces since the last dump_stats. */
+static uint64_t refresh_ticks;
+static uint64_t refresh_skipped;
+
+static unsigned int
+mode_refresh_usec (const surfman_monitor_mode_t *mode)
+{
+  uint64_t total;
+  uint64_t usec;
+
+  if (!mode || !mode->pix_clock_hz)
+    return 1000000 / REFRESH_DEFAULT_HZ;
+
+  total = (uint64_t) mode->htimings[SURFMAN_TIMING_TOTAL] *
+          mode->vtimings[SURFMAN_TIMING_TOTAL];
+  if (!total)
+    return 1000000 / REFRESH_DEFAULT_HZ;
+
+  usec = (total * 1000000) / mode->pix_clock_hz;
+  if (usec < 1000000 / REFRESH_MAX_HZ)
+    usec = 1000000 / REFRESH_MAX_HZ;
+  if (usec > 1000000)
+    usec = 1000000;
+
+  return usec;
+}
+
+static void
+surface_refresh_policy (struct surface *s, struct plugin *p, int monitor_id)
+{
+  struct refresh_sched *r = &s->sched;
+  struct monitor *m = display_get_monitor (monitor_id);
+  unsigned int active, idle_hz, idle_usec, idle_passes, merge_gap;
+  int first = !r->active_usec;
+
+  active = mode_refresh_usec (m ? m->info->i.current_mode : NULL);
+
+  /* Follow the fastest monitor the surface is shown on. */
+  if (first || active < r->active_usec)
+    r->active_usec = active;
+
+  idle_hz = config_get_uint (p->name, "refresh_idle_hz", REFRESH_IDLE_HZ);
+  idle_usec = idle_hz ? 1000000 / idle_hz : r->active_usec;
+  idle_passes = config_get_uint (p->name, "refresh_idle_passes",
+                                 REFRESH_IDLE_PASSES);
+  merge_gap = rects_merge_gap (p->name);
+
+  /* And the most demanding policy of the plugins showing it. */
+  if (first || idle_usec < r->idle_usec)
+    r->idle_usec = idle_usec;
+  if (first || idle_passes > r->idle_passes)
+    r->idle_passes = idle_passes;
+  if (first || merge_gap < r->merge_gap)
+    r->merge_gap = merge_gap;
+  if (r->idle_usec < r->active_usec)
+    r->idle_usec = r->active_usec;
+}
+
+static void
+surface_refresh_arm (struct surface *s, unsigned int period)
+{
+  struct timeval tv;
+
+  s->sched.period_usec = period;
+
+  tv.tv_sec = period / 1000000;
+  tv.tv_usec = period % 1000000;
+
+  event_add (&s->refresh, &tv);
+}
+
+static int
+dirty_bitmap_clean (const uint8_t *dirty, size_t npages)
+{
+  size_t i;
+
+  for (i = 0; i < npages / 8; i++)
+    if (dirty[i])
+      return 0;
+
+  if ((npages % 8) && (dirty[i] & ((1 << (npages % 8)) - 1)))
+    return 0;
+
+  return 1;
+}
+
+/*
+ * Refresh with the exact damage: /rects/ covers every pixel that changed and
+ * /dirty/ every page holding one (NULL meaning the whole surface).
+ */
+void
+surface_refresh_rects (struct surface *s, uint8_t *dirty,
+                       const surfman_rect_t *rects, unsigned int count)
+{
+  s->damage_rects = rects;
+  s->damage_count = count;
+  surface_refresh (s, dirty);
+  s->damage_rects = NULL;
+  s->damage_count = 0;
 }
 
 void
 surface_refresh (struct surface *s, uint8_t *dirty)
 {
+  struct refresh_sched *r = &s->sched;
+  surfman_rect_t damage[SURFMAN_DIRTY_RECTS_MAX];
+  const surfman_rect_t *rects = s->damage_rects;
+  unsigned int count = s->damage_count;
   struct psurface *ps;
+  size_t npages;
+  int clean;
+
+  npages = (surface_length (s) + XC_PAGE_SIZE - 1) >> XC_PAGE_SHIFT;
+
+  clean = s->damage_rects ? !s->damage_count :
+          dirty && dirty_bitmap_clean (dirty, npages);
+  if (clean)
+    r->clean_passes++;
+  else
+    {
+      /*
+       * Damage while idling: get back to the monitor rate straight away, the
+       * next tick hands over to vblank again.
+       */
+      if (!s->vblank_driven && r->period_usec > r->active_usec &&
+          event_pending (&s->refresh, EV_TIMEOUT, NULL))
+        surface_refresh_arm (s, r->active_usec);
+      r->clean_passes = 0;
+    }
+
+  /* Plugins showing a composite of the surface get the composite instead. */
+  compositor_refresh (s, dirty);
+
+  /* Nothing changed, the plugins have nothing to refresh. */
+  if (clean)
+    return;
 
   LIST_FOREACH (ps, &s->cache, link)
     {
-      if (plugin_need_refresh (ps->plugin))
-        PLUGIN_CALL (ps->plugin, refresh_psurface, ps->psurface, dirty);
+      if (!plugin_need_refresh (ps->plugin) ||
+          compositor_active (s, ps->plugin))
+        continue;
+
+      /* Rectangles are computed once, for the first plugin wanting them. */
+      if (!rects && plugin_refresh_rects_supported (ps->plugin))
+        {
+          count = rects_from_dirty_bitmap (dirty, s->surface->width,
+                                           s->surface->height,
+                                           s->surface->stride,
+                                           s->surface->format,
+                                           r->merge_gap, damage,
+                                           SURFMAN_DIRTY_RECTS_MAX);
+          rects = damage;
+        }
+
+      plugin_refresh_psurface (ps->plugin, ps->psurface, dirty,
+                               surface_length (s), rects, count);
     }
 }
 
+/*
+ * Service one refresh pass, return the period until the next one.
+ */
+static unsigned int
+surface_refresh_tick (struct surface *s)
+{
+  struct refresh_sched *r = &s->sched;
+
+  r->ticks++;
+  refresh_ticks++;
+  s->dev->ops->refresh_surface(s->dev, s);
+
+  if (r->clean_passes >= r->idle_passes && r->idle_usec > r->active_usec)
+    return r->idle_usec;
+
+  return r->active_usec;
+}
+
+/*
+ * While vblank driven, the timer is only kept as a watchdog in case the
+ * vblank events stop coming.
+ */
+static void
+surface_refresh_watchdog (struct surface *s)
+{
+  struct timeval tv;
+
+  tv.tv_sec = 1 + s->sched.idle_usec / 1000000;
+  tv.tv_usec = s->sched.idle_usec % 1000000;
+
+  event_add (&s->refresh, &tv);
+}
+
 static void
 surface_refresh_timer (int fd, short event, void *opaque)
 {
   struct surface *s = opaque;
-  uint8_t *dirty = NULL;
-  int async = 0;
-  struct timeval tv;
+  struct refresh_sched *r = &s->sched;
+  unsigned int period;
 
   if (!surface_need_refresh(s))
     return; /* Exit without rearming */
 
-  s->dev->ops->refresh_surface(s->dev, s);
+  if (!s->vblank_driven && r->period_usec > r->active_usec)
+    {
+      r->skipped += r->period_usec / r->active_usec - 1;
+      refresh_skipped += r->period_usec / r->active_usec - 1;
+    }
 
-rearm:
-  tv.tv_sec = 0;
-  tv.tv_usec = 16667; /* 1/60 s */
+  period = surface_refresh_tick (s);
 
-  event_add (&s->refresh, &tv);
+  /*
+   * Hand over to the vblank clock of the monitor when there is one, unless
+   * idle: the timer then wakes up less often.
+   */
+  if (s->vblank_monitor >= 0 && period == r->active_usec)
+    {
+      if (!vblank_request (s->vblank_monitor))
+        {
+          s->vblank_driven = 1;
+          surface_refresh_watchdog (s);
+          return;
+        }
+      s->vblank_monitor = -1;
+    }
+
+  s->vblank_driven = 0;
+  surface_refresh_arm (s, period);
+}
+
+/*
+ * Called on each vblank of monitor_id.
+ * Return non-zero if the surface wants the next vblank of that monitor.
+ */
+int
+surface_refresh_vblank (struct surface *s, int monitor_id)
+{
+  struct refresh_sched *r = &s->sched;
+  unsigned int period;
+
+  if (!s->vblank_driven || s->vblank_monitor != monitor_id)
+    return 0;
+
+  if (!surface_need_refresh (s))
+    {
+      surface_refresh_stall (s);
+      return 0;
+    }
+
+  period = surface_refresh_tick (s);
+  if (period > r->active_usec)
+    {
+      /* Idle: stop waking up on every vblank, until damage comes back. */
+      s->vblank_driven = 0;
+      surface_refresh_arm (s, period);
+      return 0;
+    }
+  surface_refresh_watchdog (s);
+
+  return 1;
 }
 
 static void surface_onscreen(struct plugin *p, struct surface *s,
                              int monitor_id, void *priv)
 {
-    if (plugin_need_refresh (p))
-      surface_refresh_resume (s);
+    surface_refresh_policy (s, p, monitor_id);
+
+    if (plugin_need_refresh (p) || compositor_active (s, p))
+      {
+        /* Follow the vblank of the first monitor showing the surface. */
+        if (vblank_supported (p) &&
+            (s->vblank_monitor < 0 || monitor_id < s->vblank_monitor))
+          s->vblank_monitor = monitor_id;
+
+        surface_refresh_resume (s);
+      }
 }
 
 static void surface_offscreen(struct plugin *p, struct surface *s,
                               int monitor_id, void *priv)
 {
+    struct refresh_sched *r = &s->sched;
+
     surface_refresh_stall (s);
+    compositor_offscreen (s, p, monitor_id);
+    s->vblank_monitor = -1;
+
+    if (r->ticks)
+      surfman_debug ("Surface %p: %llu refresh ticks, %llu skipped while idle",
+                     s, (unsigned long long) r->ticks,
+                     (unsigned long long) r->skipped);
+    r->active_usec = 0;
+}
+
+/* Log the refresh ticks serviced and skipped since the last call. */
+void
+surface_refresh_dump_stats (void)
+{
+  uint64_t total = refresh_ticks + refresh_skipped;
+
+  surfman_info ("surface refresh: %llu ticks serviced, %llu skipped while "
+                "idle (%llu%%)",
+                (unsigned long long) refresh_ticks,
+                (unsigned long long) refresh_skipped,
+                (unsigned long long) (total ? refresh_skipped * 100 / total
+                                      : 0));
+  refresh_ticks = refresh_skipped = 0;
 }
 
 struct surface *
@@ -178,6 +448,7 @@ surface_create (struct device *dev, void *priv)
     return NULL;
 
   LIST_INIT(&s->cache);
+  LIST_INIT(&s->composites);
   s->surface = calloc (1, sizeof (surfman_surface_t));
 
   if (!s->surface)
@@ -187,6 +458,9 @@ surface_create (struct device *dev, void *priv)
       goto fail_surface2;
 
   event_set (&s->refresh, -1, EV_TIMEOUT, surface_refresh_timer, s);
+  s->sched.active_usec = 1000000 / REFRESH_DEFAULT_HZ;
+  s->sched.idle_usec = s->sched.active_usec;
+  s->vblank_monitor = -1;
   s->dev = dev;
   s->priv = priv;
 
@@ -239,6 +513,16 @@ surface_get_psurface (struct surface *s, struct plugin *p)
   return ps->psurface;
 }
 
+/* Refresh threads must be done with the psurfaces of /s/ before it changes. */
+static void
+surface_refresh_sync (struct surface *s)
+{
+  struct psurface *ps;
+
+  LIST_FOREACH (ps, &s->cache, link)
+    plugin_refresh_sync (ps->plugin, ps->psurface);
+}
+
 void
 surface_destroy (struct surface *s)
 {
@@ -246,9 +530,11 @@ surface_destroy (struct surface *s)
   struct display_handler *h, *hn;
 
   display_surface_takedown (s);
+  compositor_surface_takedown (s);
 
   LIST_FOREACH_SAFE (ps, psn, &s->cache, link)
     {
+      plugin_refresh_sync (ps->plugin, ps->psurface);
       PLUGIN_CALL (ps->plugin, free_psurface, ps->psurface);
       LIST_REMOVE (ps, link);
       free (ps);
@@ -300,6 +586,8 @@ surface_update_pages (struct surface *s,
                       pfn_t *mfns,
                       size_t npages)
 {
+  surface_refresh_sync (s);
+
   if (s->surface->page_count != npages)
     s->surface = realloc (s->surface, sizeof (surfman_surface_t) +
                                       npages * sizeof (pfn_t));
@@ -344,11 +632,10 @@ surface_update_lfb (struct surface *s,
                     unsigned long lfb,
                     size_t len)
 {
-  xen_pfn_t *x;
-  int rc;
-  size_t i;
   size_t npages = (len + (XC_PAGE_SIZE - 1)) >> XC_PAGE_SHIFT;
 
+  surface_refresh_sync (s);
+
   if (s->surface->page_count != npages)
     s->surface = realloc (s->surface, sizeof (surfman_surface_t) +
                           npages * sizeof (pfn_t));
@@ -362,9 +649,6 @@ surface_update_lfb (struct surface *s,
   // reference anymore.  The device-model is supposed to have a reference on
   // those pages to keep the mfns where they are (so DMA is possible).
   surface_update (s, SURFMAN_UPDATE_PAGES);
-
-fail:
-  free (x);
 }
 
 void
@@ -376,6 +660,9 @@ surface_update_format (struct surface *s,
                        int offset)
 {
   surfman_surface_t *surface = s->surface;
+  int resized = surface->width != width || surface->height != height;
+
+  surface_refresh_sync (s);
 
   surface->width = width;
   surface->height = height;
@@ -384,6 +671,9 @@ surface_update_format (struct surface *s,
   surface->offset = offset;
 
   surface_update (s, SURFMAN_UPDATE_FORMAT | SURFMAN_UPDATE_OFFSET);
+
+  if (resized && surface_ready (s))
+    display_surface_resized (s);
 }
 
 void
@@ -392,6 +682,8 @@ surface_update_offset(struct surface *s,
 {
   surfman_surface_t *surface = s->surface;
 
+  surface_refresh_sync (s);
+
   surface->offset = offset;
 
   surface_update (s, SURFMAN_UPDATE_OFFSET);
@@ -401,15 +693,18 @@ void
 surface_refresh_stall (struct surface *s)
 {
   event_del (&s->refresh);
+  s->vblank_driven = 0;
 }
 
 void
 surface_refresh_resume (struct surface *s)
 {
-  struct timeval tv;
+  struct refresh_sched *r = &s->sched;
 
-  tv.tv_sec = 0;
-  tv.tv_usec = 16667; /* 1/60 s */
+  if (!r->active_usec)
+    r->active_usec = 1000000 / REFRESH_DEFAULT_HZ;
 
-  event_add (&s->refresh, &tv);
+  r->clean_passes = 0;
+  s->vblank_driven = 0;
+  surface_refresh_arm (s, r->active_usec);
 }
@@ -46,20 +46,78 @@ struct display_handler
 
 LIST_HEAD(handler_list_head, struct display_handler);
 
+/*
+ * Adaptive refresh scheduling state.
+ * The timer runs at the monitor rate while the surface is damaged and backs
+ * off to idle_usec after idle_passes consecutive clean refresh passes.
+ */
+struct refresh_sched
+{
+  unsigned int active_usec;     /* Period derived from the monitor mode */
+  unsigned int idle_usec;       /* Period once the surface went idle */
+  unsigned int idle_passes;     /* Clean passes before going idle */
+  unsigned int merge_gap;       /* Merge gap of the damage rectangles */
+
+  unsigned int clean_passes;    /* Consecutive passes without damage */
+  unsigned int period_usec;     /* Period currently armed */
+
+  uint64_t ticks;               /* Timer ticks serviced */
+  uint64_t skipped;             /* Ticks skipped compared to active_usec */
+};
+
+/*
+ * Shadow framebuffer for sub-page damage, see damage.c.
+ */
+#define DAMAGE_RECTS_MAX 64     /* Exact damage rectangles per refresh. */
+
+struct damage_shadow
+{
+  int enabled;
+  unsigned int max_dirty;       /* Percent of dirty pages past which to skip */
+
+  uint8_t *shadow;
+  uint8_t *stale;               /* Pages whose shadow is out of date */
+  size_t len;
+  size_t npages;
+  unsigned int width;
+  unsigned int height;
+  unsigned int stride;
+  unsigned int Bpp;
+
+  uint64_t pages_compared;
+  uint64_t pages_clean;         /* Dirty pages found unchanged */
+  uint64_t passes_skipped;      /* Passes taken as they came */
+};
+
 struct surface
 {
   struct device *dev;
   surfman_surface_t *surface;
   int flags;
   LIST_HEAD(, struct psurface) cache;
+  LIST_HEAD(, struct composite) composites;
   void *priv;
   struct event refresh;
+  struct refresh_sched sched;
+  int vblank_monitor;           /* Monitor whose vblank may drive the refresh */
+  int vblank_driven;            /* Refresh currently driven by vblank events */
+
+  /* Exact damage of the refresh in progress, when the device has it. */
+  const surfman_rect_t *damage_rects;
+  unsigned int damage_count;
 
   int handlers_lock;
   struct handler_list_head onscreen_handlers;
   struct handler_list_head offscreen_handlers;
 };
 
+/* libsurfman's secret functions */
+int surfman_surface_init(surfman_surface_t *surface);
+void surfman_surface_cleanup(surfman_surface_t *surface);
+void surfman_surface_update_mmap(surfman_surface_t *surface, int fd, size_t off);
+void surfman_surface_update_pfn_arr(surfman_surface_t *surface, const xen_pfn_t *pfns);
+void surfman_surface_update_pfn_linear(surfman_surface_t *surface, xen_pfn_t base);
+
 static inline size_t
 surface_length (struct surface *s)
 {
@@ -0,0 +1,368 @@
+/*
+ * Copyright (c) 2013 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Offline benchmark of the display pipeline, no Xen needed: the real plugins
+ * are loaded and shown an ioemugfx guest, through the same domain, surface,
+ * display and refresh code as surfman.
+ *
+ * Guest memory comes from libsurfman-memfd (see libsurfman/src/xc-memfd.c),
+ * which replaces libsurfman for the whole process, plugins included.
+ * xenstore, D-Bus and dmbus are the stand-ins of bench-hooks.c; the guest
+ * framebuffer is set up by a display_resize message, as QEMU would send it.
+ * A synthetic guest then draws into the framebuffer at 60Hz and marks the
+ * pages it wrote for xc_hvm_get_dirty_vram(), with each pattern in turn:
+ *
+ *   idle    nothing changes;
+ *   cursor  a text cursor blinks, every half second;
+ *   video   a 640x360 window plays;
+ *   scroll  a terminal half the screen large scrolls a line a frame;
+ *   full    the whole screen is redrawn.
+ *
+ * For each pattern and plugin it reports the refreshes per second, the
+ * damage handed over (the copies the plugin may do), the CPU and wall time
+ * per refresh as plugin_dump_stats() measures them, then the CPU of the
+ * whole process, plugin threads included, per guest frame.
+ *
+ *   surfman-bench [-t seconds] [-r WxH] [-c surfman.conf] plugin.so...
+ *
+ * Without -r, the guest takes the display size surfman advertises. The
+ * plugins need what they drive:
+ *   linuxfb  /dev/fb0, vfb will do;
+ *   drm      a KMS device, e.g. vkms;
+ *   glgfx    an X server on :0, Xvfb with llvmpipe will do;
+ *   vnc      a viewer connected to vnc.port, or nothing is sent.
+ */
+
+#include "project.h"
+#include <surfman-memfd.h>
+
+#define BENCH_DOMID     1
+#define BENCH_PLUGINS_MAX 8
+#define GUEST_HZ        60
+/* Above the first MB, as a VGA LFB would be. */
+#define LFB_PFN         0x100
+
+enum pattern
+{
+  PATTERN_IDLE,
+  PATTERN_CURSOR,
+  PATTERN_VIDEO,
+  PATTERN_SCROLL,
+  PATTERN_FULL,
+  PATTERN_COUNT
+};
+
+static const char *pattern_names[PATTERN_COUNT] = {
+  "idle", "cursor", "video", "scroll", "full",
+};
+
+static struct guest
+{
+  unsigned int width;
+  unsigned int height;
+  unsigned int stride;
+  uint8_t *fb;
+
+  enum pattern pattern;
+  unsigned int frame;
+  uint64_t frames;
+  uint64_t cpu_us;              /* Spent drawing */
+  struct event timer;
+} guest;
+
+static struct plugin *plugins[BENCH_PLUGINS_MAX];
+static unsigned int plugin_count;
+
+static uint64_t
+clock_us (clockid_t clock)
+{
+  struct timespec ts;
+
+  clock_gettime (clock, &ts);
+  return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+static uint64_t
+rusage_us (void)
+{
+  struct rusage ru;
+
+  getrusage (RUSAGE_SELF, &ru);
+  return ru.ru_utime.tv_sec * 1000000ULL + ru.ru_utime.tv_usec +
+         ru.ru_stime.tv_sec * 1000000ULL + ru.ru_stime.tv_usec;
+}
+
+/* Mark the pages of lines y to y + h - 1, columns x to x + w - 1, dirty. */
+static void
+guest_damage (unsigned int x, unsigned int y, unsigned int w, unsigned int h)
+{
+  unsigned int i;
+
+  for (i = y; i < y + h; ++i)
+    {
+      size_t first = ((size_t) i * guest.stride + x * 4) >> XC_PAGE_SHIFT;
+      size_t last = ((size_t) i * guest.stride + (x + w) * 4 - 1) >>
+                    XC_PAGE_SHIFT;
+
+      xc_memfd_dirty (LFB_PFN + first, last - first + 1);
+    }
+}
+
+static void
+guest_fill (unsigned int x, unsigned int y, unsigned int w, unsigned int h,
+            uint32_t seed)
+{
+  unsigned int i, j;
+
+  for (i = y; i < y + h; ++i)
+    {
+      uint32_t *line = (uint32_t *) (guest.fb + (size_t) i * guest.stride);
+
+      for (j = x; j < x + w; ++j)
+        line[j] = (j * 7 + i * 13 + seed) * 0x010101;
+    }
+  guest_damage (x, y, w, h);
+}
+
+/* Draw the next frame of the pattern. */
+static void
+guest_draw (void)
+{
+  unsigned int w = guest.width, h = guest.height;
+  unsigned int f = guest.frame++;
+  unsigned int i, x, y, cw, ch;
+
+  switch (guest.pattern)
+    {
+    case PATTERN_IDLE:
+      break;
+    case PATTERN_CURSOR:
+      if (f % (GUEST_HZ / 2))
+        break;
+      guest_fill (w / 2, h / 2, 8 < w / 2 ? 8 : w / 2, 16 < h / 2 ? 16 : h / 2,
+                  (f / (GUEST_HZ / 2)) % 2 ? 0xff : 0);
+      break;
+    case PATTERN_VIDEO:
+      cw = 640 < w ? 640 : w;
+      ch = 360 < h ? 360 : h;
+      guest_fill ((w - cw) / 2, (h - ch) / 2, cw, ch, f);
+      break;
+    case PATTERN_SCROLL:
+      /* A terminal of 16 pixel lines: up one line, a new one below. */
+      cw = w / 2;
+      ch = h / 2;
+      x = w / 4;
+      y = h / 4;
+      if (ch <= 16)
+        {
+          guest_fill (x, y, cw, ch, f);
+          break;
+        }
+      for (i = y; i < y + ch - 16; ++i)
+        memmove (guest.fb + (size_t) i * guest.stride + x * 4,
+                 guest.fb + (size_t) (i + 16) * guest.stride + x * 4, cw * 4);
+      guest_damage (x, y, cw, ch - 16);
+      guest_fill (x, y + ch - 16, cw, 16, f);
+      break;
+    case PATTERN_FULL:
+      guest_fill (0, 0, w, h, f);
+      break;
+    default:
+      break;
+    }
+}
+
+static void
+guest_tick (int fd, short event, void *opaque)
+{
+  struct timeval tv = { 0, 1000000 / GUEST_HZ };
+  uint64_t t0 = clock_us (CLOCK_THREAD_CPUTIME_ID);
+
+  guest_draw ();
+  guest.cpu_us += clock_us (CLOCK_THREAD_CPUTIME_ID) - t0;
+  guest.frames++;
+
+  evtimer_add (&guest.timer, &tv);
+}
+
+/* Set the framebuffer of /dev/ up, the way QEMU does through dmbus. */
+static int
+guest_resize (struct device *dev, struct dmbus_rpc_ops *ops)
+{
+  struct msg_display_resize msg;
+  struct msg_empty_reply reply;
+  size_t len = (size_t) guest.stride * guest.height;
+  int fd;
+
+  fd = xc_memfd (LFB_PFN + ((len + XC_PAGE_SIZE - 1) >> XC_PAGE_SHIFT));
+  guest.fb = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                   (off_t) LFB_PFN << XC_PAGE_SHIFT);
+  if (guest.fb == MAP_FAILED)
+    {
+      surfman_error ("Failed to map the guest framebuffer (%s).",
+                     strerror (errno));
+      return -1;
+    }
+
+  memset (&msg, 0, sizeof (msg));
+  msg.width = guest.width;
+  msg.height = guest.height;
+  msg.linesize = guest.stride;
+  msg.format = FRAMEBUFFER_FORMAT_BGRX8888;
+  msg.lfb_addr = (uint64_t) LFB_PFN << XC_PAGE_SHIFT;
+  msg.lfb_traceable = 1;
+
+  return ops->display_resize (dev, &msg, sizeof (msg), &reply);
+}
+
+/* Size the guest after what resolution.c advertises, as a guest would. */
+static void
+guest_default_size (void)
+{
+  char *size = xenstore_read ("/xc_tools/switcher/current_display_size");
+
+  if (!size || sscanf (size, "%u %u", &guest.width, &guest.height) != 2 ||
+      !guest.width || !guest.height)
+    {
+      guest.width = 1024;
+      guest.height = 768;
+    }
+  free (size);
+}
+
+static void
+run_pattern (enum pattern p, unsigned int seconds)
+{
+  struct plugin_refresh_stats st;
+  struct timeval tv = { seconds, 0 };
+  uint64_t cpu_us;
+  unsigned int i;
+  double secs = seconds;
+
+  /* Start from a clean slate: a full frame, then fresh counters. */
+  guest.pattern = PATTERN_FULL;
+  guest_draw ();
+  guest.pattern = p;
+  guest.frame = 0;
+  guest.frames = 0;
+  guest.cpu_us = 0;
+  for (i = 0; i < plugin_count; i++)
+    plugin_take_stats (plugins[i], &st);
+  cpu_us = rusage_us ();
+
+  event_loopexit (&tv);
+  event_dispatch ();
+
+  cpu_us = rusage_us () - cpu_us;
+  cpu_us = cpu_us > guest.cpu_us ? cpu_us - guest.cpu_us : 0;
+
+  for (i = 0; i < plugin_count; i++)
+    {
+      plugin_take_stats (plugins[i], &st);
+      printf ("%-8s %-12s %9.1f %9.1f %9llu %9llu %9llu\n",
+              pattern_names[p], plugins[i]->name, st.frames / secs,
+              st.damage_bytes / secs / 1048576.,
+              (unsigned long long) (st.frames ? st.cpu_us / st.frames : 0),
+              (unsigned long long) (st.frames ? st.wall_us / st.frames : 0),
+              (unsigned long long) st.wall_max_us);
+    }
+  printf ("%-8s %-12s %9llu us CPU per guest frame, %.1f%% of a CPU\n",
+          pattern_names[p], "(process)",
+          (unsigned long long) (guest.frames ? cpu_us / guest.frames : 0),
+          cpu_us / (seconds * 10000.));
+}
+
+static void
+usage (const char *progname)
+{
+  fprintf (stderr, "Usage: %s [-t seconds] [-r WxH] [-c surfman.conf] "
+           "plugin.so...\n"
+           "\t-t  Seconds per pattern [default: 5]\n"
+           "\t-r  Guest resolution [default: the advertised display size]\n"
+           "\t-c  Configuration file\n", progname);
+  exit (1);
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct dmbus_rpc_ops *ops;
+  unsigned int seconds = 5;
+  struct device *dev;
+  struct domain *d;
+  enum pattern p;
+  int c;
+
+  while ((c = getopt (argc, argv, "t:r:c:h")) != -1)
+    {
+      switch (c)
+        {
+        case 't':
+          seconds = strtoul (optarg, NULL, 0);
+          break;
+        case 'r':
+          if (sscanf (optarg, "%ux%u", &guest.width, &guest.height) != 2)
+            usage (argv[0]);
+          break;
+        case 'c':
+          config_load_file (optarg);
+          break;
+        default:
+          usage (argv[0]);
+        }
+    }
+  if (optind == argc || argc - optind > BENCH_PLUGINS_MAX || !seconds)
+    usage (argv[0]);
+
+  event_init ();
+  xc_init ();
+  resolution_init ();
+  display_init ();
+
+  for (; optind < argc; optind++)
+    if ((plugins[plugin_count] = load_plugin (argv[optind])))
+      plugin_count++;
+  if (!plugin_count)
+    surfman_fatal ("No plugin loaded.");
+
+  if (!guest.width || !guest.height)
+    guest_default_size ();
+  guest.stride = guest.width * 4;
+
+  d = domain_create (BENCH_DOMID);
+  dev = ioemugfx_device_create (d, &ops);
+  if (!dev || guest_resize (dev, ops) || domain_set_visible (d, 1))
+    surfman_fatal ("Failed to show the guest.");
+
+  evtimer_set (&guest.timer, guest_tick, NULL);
+  guest_tick (-1, EV_TIMEOUT, NULL);
+
+  printf ("%u plugin(s), guest %ux%u at %dHz, %us per pattern\n",
+          plugin_count,
+          guest.width, guest.height, GUEST_HZ, seconds);
+  printf ("%-8s %-12s %9s %9s %9s %9s %9s\n", "pattern", "plugin",
+          "frames/s", "MB/s", "cpu us", "wall us", "max us");
+  for (p = 0; p < PATTERN_COUNT; p++)
+    run_pattern (p, seconds);
+
+  evtimer_del (&guest.timer);
+  plugin_cleanup ();
+
+  return 0;
+}
@@ -87,6 +87,7 @@ int main (int argc, char *argv[])
 
   surfman_info ("Surfman daemon started with PID %d", getpid ());
   surfman_info ("Surfman API version "SURFMAN_VERSION_FMT".", SURFMAN_VERSION_ARGS (SURFMAN_API_VERSION));
+  surfman_info ("Using %s framebuffer blit kernels.", blit_isa ());
 
   event_init ();
 
@@ -100,6 +101,7 @@ int main (int argc, char *argv[])
   lockfile_lock ();
 
   config_load_file ("/etc/surfman.conf");
+  surfman_trace_enable (config_get_uint ("surfman", "trace", 0));
 
   xc_init ();
 
@@ -0,0 +1,198 @@
+/*
+ * Copyright (c) 2013 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#include "project.h"
+
+/*
+ * Vblank clock.
+ *
+ * Plugins providing get_vblank_fd/request_vblank/handle_vblank (API 2.1.3)
+ * give us one-shot vblank events per monitor. Each event services, in one
+ * pass, every surface scanned out on that monitor, and the next event is
+ * only armed while some surface still wants to be refreshed.
+ */
+
+/* A pending request older than this is considered lost. */
+#define VBLANK_STALE_USEC 500000
+
+struct vblank_source
+{
+  LIST_ENTRY (struct vblank_source) link;
+
+  struct plugin *plugin;
+  int fd;
+  struct event event;
+};
+
+static
+LIST_HEAD (, struct vblank_source)
+  vblank_sources = LIST_HEAD_INITIALIZER;
+
+int
+vblank_supported (struct plugin *p)
+{
+  /* vblank methods have been implemented from 2.1.3 */
+  return PLUGIN_CHECK_VERSION (p, 2, 1, 3) &&
+         PLUGIN_HAS_METHOD (p, get_vblank_fd) &&
+         PLUGIN_HAS_METHOD (p, request_vblank) &&
+         PLUGIN_HAS_METHOD (p, handle_vblank);
+}
+
+static void
+vblank_service (int monitor_id)
+{
+  struct display *d, *tmp;
+  int rearm = 0;
+
+  LIST_FOREACH_SAFE (d, tmp, &display[monitor_id].current, link)
+    {
+      if (d->display_type != DISPLAY_TYPE_SURFACE)
+        continue;
+
+      if (surface_refresh_vblank (d->u.surface, monitor_id))
+        rearm = 1;
+    }
+
+  if (!rearm || !vblank_request (monitor_id))
+    return;
+
+  surfman_warning ("Lost vblank source of monitor %d, falling back on timers",
+                   monitor_id);
+
+  LIST_FOREACH (d, &display[monitor_id].current, link)
+    {
+      if (d->display_type == DISPLAY_TYPE_SURFACE &&
+          d->u.surface->vblank_monitor == monitor_id)
+        {
+          d->u.surface->vblank_monitor = -1;
+          surface_refresh_resume (d->u.surface);
+        }
+    }
+}
+
+static void
+vblank_handler (int fd, short event, void *opaque)
+{
+  struct vblank_source *src = opaque;
+  surfman_monitor_t monitors[PLUGIN_MONITOR_MAX];
+  int i, n;
+
+  n = PLUGIN_CALL (src->plugin, handle_vblank, fd, monitors,
+                   PLUGIN_MONITOR_MAX);
+  if (n < 0)
+    {
+      surfman_warning ("Plugin %s: handle_vblank() failed", src->plugin->name);
+      return;
+    }
+
+  for (i = 0; i < n; i++)
+    {
+      int monitor_id = get_monitor_slot (monitors[i]);
+
+      if (monitor_id < 0)
+        continue;
+
+      display[monitor_id].vblank_pending = 0;
+      vblank_service (monitor_id);
+    }
+}
+
+static struct vblank_source *
+vblank_source_get (struct plugin *p, int fd)
+{
+  struct vblank_source *src;
+
+  LIST_FOREACH (src, &vblank_sources, link)
+    {
+      if (src->plugin == p && src->fd == fd)
+        return src;
+    }
+
+  src = xcalloc (1, sizeof (*src));
+  src->plugin = p;
+  src->fd = fd;
+
+  event_set (&src->event, fd, EV_READ | EV_PERSIST, vblank_handler, src);
+  if (event_add (&src->event, NULL))
+    {
+      surfman_error ("Plugin %s: could not watch vblank fd %d", p->name, fd);
+      free (src);
+      return NULL;
+    }
+  LIST_INSERT_HEAD (&vblank_sources, src, link);
+
+  return src;
+}
+
+/*
+ * Arm the next vblank event of a monitor.
+ * Return 0 if an event is (or already was) pending, -1 otherwise.
+ */
+int
+vblank_request (int monitor_id)
+{
+  struct monitor *m = display_get_monitor (monitor_id);
+  struct timeval now, delay;
+  int fd;
+
+  if (!m || !vblank_supported (m->plugin))
+    return -1;
+
+  gettimeofday (&now, NULL);
+  if (m->vblank_pending)
+    {
+      timersub (&now, &m->vblank_tv, &delay);
+      if (!delay.tv_sec && delay.tv_usec < VBLANK_STALE_USEC)
+        return 0;
+      surfman_debug ("Monitor %d: vblank request went stale, re-arming",
+                     monitor_id);
+    }
+
+  fd = PLUGIN_CALL (m->plugin, get_vblank_fd, m->mon);
+  if (fd < 0)
+    return -1;
+
+  if (!vblank_source_get (m->plugin, fd))
+    return -1;
+
+  if (PLUGIN_CALL (m->plugin, request_vblank, m->mon) != SURFMAN_SUCCESS)
+    {
+      m->vblank_pending = 0;
+      return -1;
+    }
+
+  m->vblank_pending = 1;
+  m->vblank_tv = now;
+
+  return 0;
+}
+
+void
+vblank_plugin_takedown (struct plugin *p)
+{
+  struct vblank_source *src, *tmp;
+
+  LIST_FOREACH_SAFE (src, tmp, &vblank_sources, link)
+    {
+      if (src->plugin != p)
+        continue;
+
+      event_del (&src->event);
+      LIST_REMOVE (src, link);
+      free (src);
+    }
+}
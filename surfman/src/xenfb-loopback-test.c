@@ -0,0 +1,639 @@
+/*
+ * Copyright (c) 2013 Citrix Systems, Inc.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+/*
+ * Loopback test of the xenfb dirty bitmap handshake, no guest needed.
+ *
+ * libxenbackend and xc_mmap_foreign are replaced by a simulated frontend:
+ * the shared page and the rings are plain memory, guest frames are pages of
+ * a memfd, and the event channel calls straight into the frontend, which
+ * answers UPDATE_DIRTY like the xenfb2 driver does, a few refreshes later if
+ * asked to. Every bitmap the frontend completes is queued, and each
+ * surface_refresh() must receive the oldest one, in order, with no full
+ * refresh. The double-buffered bitmap must also be consumed on the refresh
+ * tick itself, never from the DIRTY_READY upcall.
+ *
+ *   xenfb-loopback-test [refreshes per scenario]
+ */
+
+#include <sys/syscall.h>
+
+#include "project.h"
+
+#define xc_mmap_foreign loopback_mmap_foreign
+#define backend_register loopback_register
+#define backend_release loopback_release
+#define backend_init loopback_init
+#define backend_print loopback_print
+#define backend_bind_evtchn loopback_bind_evtchn
+#define backend_evtchn_priv loopback_evtchn_priv
+#define backend_evtchn_handler loopback_evtchn_handler
+#define backend_evtchn_notify loopback_evtchn_notify
+#define backend_map_shared_page loopback_map_shared_page
+#define backend_unmap_shared_page loopback_unmap_shared_page
+#define backend_xenstore_fd loopback_xenstore_fd
+#define backend_xenstore_handler loopback_xenstore_handler
+
+static void *loopback_mmap_foreign (void *addr, size_t length, int prot,
+                                    int domid, xen_pfn_t *pages);
+static xen_backend_t loopback_register (const char *type, int domid,
+                                        struct xen_backend_ops *ops,
+                                        void *priv);
+static void loopback_release (xen_backend_t back);
+static int loopback_init (int domid);
+static int loopback_print (xen_backend_t back, int devid, const char *key,
+                           const char *fmt, ...);
+static int loopback_bind_evtchn (xen_backend_t back, int devid);
+static void *loopback_evtchn_priv (xen_backend_t back, int devid);
+static void loopback_evtchn_handler (void *priv);
+static int loopback_evtchn_notify (xen_backend_t back, int devid);
+static void *loopback_map_shared_page (xen_backend_t back, int devid);
+static void loopback_unmap_shared_page (xen_backend_t back, int devid,
+                                        void *page);
+static int loopback_xenstore_fd (void);
+static void loopback_xenstore_handler (void *priv);
+
+/* The handshake is static, test it in place. */
+#include "xenfb.c"
+
+/* Guest frames, all backed by the memfd. */
+#define PFN_DIRTY_0 1
+#define PFN_DIRTY_1 2
+#define PFN_FB2M 3
+#define PFN_FB 16
+#define PFN_COUNT (PFN_FB + FB_PAGES)
+#define PFN_NONE ((xen_pfn_t) -1)
+
+#define FB_PAGES 300                    /* 640x480x32 */
+#define BITMAP_LEN ((FB_PAGES + 7) / 8)
+#define FIFO_LEN 16
+#define MAX_DELAY 8
+
+struct frontend
+{
+  int memfd;
+  int evtchn[2];
+  struct xenfb2_page *page;
+  uint8_t *bitmap[2];           /* The frontend's view of its bitmaps */
+
+  int request_db;               /* Asks for double-buffering */
+  xen_pfn_t unmappable;         /* Frame xc_mmap_foreign fails on */
+  int backend_db;               /* What the backend answered */
+  int double_buffer;            /* Mode the frontend runs in */
+  unsigned int cur;             /* Bitmap being filled */
+  uint8_t accum[BITMAP_LEN];    /* Single bitmap: damage since the last ready */
+
+  unsigned int delay;           /* Refreshes before answering UPDATE_DIRTY */
+  unsigned int due[MAX_DELAY + 1];
+  unsigned int ndue;
+
+  /* Bitmaps completed and not refreshed yet, oldest first. */
+  uint8_t fifo[FIFO_LEN][BITMAP_LEN];
+  unsigned int fifo_head;
+  unsigned int fifo_count;
+
+  struct xenfb_framebuffer *fb;
+  unsigned int tick;
+  int in_refresh;
+
+  unsigned long refreshes;
+  unsigned long on_tick;
+  unsigned long full;
+  unsigned long mismatches;
+  unsigned long overflows;
+};
+
+static struct frontend fe;
+
+/* ------------------------------------------------------------------------- */
+/* Frontend                                                                  */
+/* ------------------------------------------------------------------------- */
+
+static void
+fifo_push (const uint8_t *bitmap)
+{
+  if (fe.fifo_count == FIFO_LEN)
+    {
+      fe.overflows++;
+      return;
+    }
+  memcpy (fe.fifo[(fe.fifo_head + fe.fifo_count) % FIFO_LEN], bitmap,
+          BITMAP_LEN);
+  fe.fifo_count++;
+}
+
+/* Damage a few pages, as the guest driver would. */
+static void
+frontend_draw (uint32_t *seed)
+{
+  uint8_t *bitmap = fe.double_buffer ? fe.bitmap[fe.cur] : fe.accum;
+  unsigned int i, n;
+
+  *seed = *seed * 1103515245 + 12345;
+  n = (*seed >> 8) % 8;
+  for (i = 0; i < n; i++)
+    {
+      unsigned int pfn;
+
+      *seed = *seed * 1103515245 + 12345;
+      pfn = (*seed >> 8) % FB_PAGES;
+      bitmap[pfn / 8] |= 1 << (pfn % 8);
+    }
+}
+
+/* UPDATE_DIRTY: hand a complete bitmap over, answer after fe.delay ticks. */
+static void
+frontend_update_dirty (void)
+{
+  if (fe.double_buffer)
+    {
+      fifo_push (fe.bitmap[fe.cur]);
+      fe.cur ^= 1;
+      memset (fe.bitmap[fe.cur], 0, XC_PAGE_SIZE);
+    }
+  else
+    {
+      memcpy (fe.bitmap[0], fe.accum, BITMAP_LEN);
+      fifo_push (fe.accum);
+      memset (fe.accum, 0, BITMAP_LEN);
+    }
+
+  if (fe.ndue <= MAX_DELAY)
+    fe.due[fe.ndue++] = fe.tick + fe.delay;
+  else
+    fe.overflows++;
+}
+
+/* The frontend's event channel handler, run on each backend notification. */
+static void
+frontend_service (void)
+{
+  struct xenfb2_page *page = fe.page;
+  uint32_t cons;
+
+  for (cons = page->in_cons; cons != page->in_prod; cons++)
+    if (XENFB2_IN_RING_REF (page, cons).type == XENFB2_TYPE_UPDATE_DIRTY)
+      frontend_update_dirty ();
+  page->in_cons = cons;
+}
+
+/* Post the DIRTY_READY events due by now under one upcall. */
+static void
+frontend_deliver (void)
+{
+  struct xenfb2_page *page = fe.page;
+  unsigned int i, n = 0;
+
+  for (i = 0; i < fe.ndue; )
+    if (fe.due[i] <= fe.tick)
+      {
+        union xenfb2_out_event *event = &XENFB2_OUT_RING_REF (page,
+                                                              page->out_prod);
+
+        memset (event, 0, sizeof (*event));
+        event->type = XENFB2_TYPE_DIRTY_READY;
+        page->out_prod++;
+        fe.due[i] = fe.due[--fe.ndue];
+        n++;
+      }
+    else
+      i++;
+
+  if (n)
+    xenfb_event (fe.fb);
+}
+
+/* ------------------------------------------------------------------------- */
+/* libxenbackend and libxc                                                   */
+/* ------------------------------------------------------------------------- */
+
+static void *
+loopback_mmap_foreign (void *addr, size_t length, int prot, int domid,
+                       xen_pfn_t *pages)
+{
+  size_t i, npages = (length + XC_PAGE_SIZE - 1) / XC_PAGE_SIZE;
+  uint8_t *p;
+
+  for (i = 0; i < npages; i++)
+    if (pages[i] == fe.unmappable || pages[i] >= PFN_COUNT)
+      return NULL;
+
+  p = mmap (addr, npages * XC_PAGE_SIZE, prot, MAP_SHARED | MAP_ANONYMOUS,
+            -1, 0);
+  if (p == MAP_FAILED)
+    return NULL;
+  for (i = 0; i < npages; i++)
+    if (mmap (p + i * XC_PAGE_SIZE, XC_PAGE_SIZE, prot, MAP_SHARED | MAP_FIXED,
+              fe.memfd, (off_t) pages[i] * XC_PAGE_SIZE) == MAP_FAILED)
+      {
+        munmap (p, npages * XC_PAGE_SIZE);
+        return NULL;
+      }
+
+  return p;
+}
+
+static xen_backend_t
+loopback_register (const char *type, int domid, struct xen_backend_ops *ops,
+                   void *priv)
+{
+  return NULL;
+}
+
+static void
+loopback_release (xen_backend_t back)
+{
+}
+
+static int
+loopback_init (int domid)
+{
+  return 0;
+}
+
+static int
+loopback_print (xen_backend_t back, int devid, const char *key,
+                const char *fmt, ...)
+{
+  va_list ap;
+  char *val;
+
+  va_start (ap, fmt);
+  if (vasprintf (&val, fmt, ap) < 0)
+    val = NULL;
+  va_end (ap);
+
+  if (val && !strcmp (key, XENFB2_DIRTY_DB))
+    fe.backend_db = strtol (val, NULL, 10);
+  free (val);
+
+  return 0;
+}
+
+static int
+loopback_bind_evtchn (xen_backend_t back, int devid)
+{
+  return fe.evtchn[0];
+}
+
+static void *
+loopback_evtchn_priv (xen_backend_t back, int devid)
+{
+  return NULL;
+}
+
+static void
+loopback_evtchn_handler (void *priv)
+{
+}
+
+static int
+loopback_evtchn_notify (xen_backend_t back, int devid)
+{
+  frontend_service ();
+  return 0;
+}
+
+static void *
+loopback_map_shared_page (xen_backend_t back, int devid)
+{
+  return fe.page;
+}
+
+static void
+loopback_unmap_shared_page (xen_backend_t back, int devid, void *page)
+{
+}
+
+static int
+loopback_xenstore_fd (void)
+{
+  return -1;
+}
+
+static void
+loopback_xenstore_handler (void *priv)
+{
+}
+
+/* ------------------------------------------------------------------------- */
+/* Surfman                                                                   */
+/* ------------------------------------------------------------------------- */
+
+char *
+xenstore_dom_read (unsigned int domid, const char *format, ...)
+{
+  va_list ap;
+  char *path, *val = NULL;
+
+  va_start (ap, format);
+  if (vasprintf (&path, format, ap) < 0)
+    path = NULL;
+  va_end (ap);
+  if (!path)
+    return NULL;
+
+  if (strstr (path, XENFB2_REQUEST_DIRTY_DB) && fe.request_db)
+    val = strdup ("1");
+  else if (strstr (path, XENFB2_DIRTY_PAGE_1) && fe.request_db)
+    {
+      if (asprintf (&val, "%lu", (unsigned long) PFN_DIRTY_1) < 0)
+        val = NULL;
+    }
+  free (path);
+
+  return val;
+}
+
+struct surface *
+surface_create (struct device *dev, void *priv)
+{
+  struct surface *s = xcalloc (1, sizeof (*s));
+
+  s->dev = dev;
+  s->priv = priv;
+
+  return s;
+}
+
+void
+surface_destroy (struct surface *s)
+{
+  free (s);
+}
+
+void
+surface_refresh (struct surface *s, uint8_t *dirty)
+{
+  fe.refreshes++;
+  fe.on_tick += fe.in_refresh;
+
+  if (!dirty)
+    {
+      fe.full++;
+      return;
+    }
+  if (!fe.fifo_count)
+    {
+      fe.mismatches++;
+      return;
+    }
+  if (memcmp (dirty, fe.fifo[fe.fifo_head], BITMAP_LEN))
+    fe.mismatches++;
+  fe.fifo_head = (fe.fifo_head + 1) % FIFO_LEN;
+  fe.fifo_count--;
+}
+
+int
+surface_need_refresh (struct surface *s)
+{
+  return 1;
+}
+
+int
+surface_ready (struct surface *s)
+{
+  return 1;
+}
+
+void
+surface_update_pfns (struct surface *s, int domid, const xen_pfn_t *pfns,
+                     pfn_t *mfns, size_t npages)
+{
+}
+
+void
+surface_update_format (struct surface *s, int width, int height, int stride,
+                       int format, int offset)
+{
+}
+
+void
+surface_update_offset (struct surface *s, size_t offset)
+{
+}
+
+unsigned int
+plugin_stride_align (void)
+{
+  return 0;
+}
+
+int
+domain_visible (struct domain *d)
+{
+  return 0;
+}
+
+int
+domain_set_visible (struct domain *d, int force)
+{
+  return 0;
+}
+
+int
+display_prepare_blank (int monitor_id, struct device *dev)
+{
+  return 0;
+}
+
+int
+display_prepare_surface (int monitor_id, struct device *dev,
+                         struct surface *s, struct effect *e)
+{
+  return 0;
+}
+
+void *
+device_create (struct domain *d, struct device_ops *ops, size_t size)
+{
+  return NULL;
+}
+
+void
+device_destroy (struct device *device)
+{
+}
+
+/* ------------------------------------------------------------------------- */
+/* Scenarios                                                                 */
+/* ------------------------------------------------------------------------- */
+
+struct scenario
+{
+  const char *name;
+  int request_db;
+  xen_pfn_t unmappable;
+  unsigned int delay;
+  int connects;                 /* xenfb_connect() is expected to succeed */
+  int double_buffer;            /* Mode expected after the negotiation */
+};
+
+static const struct scenario scenarios[] = {
+  { "single", 0, PFN_NONE, 0, 1, 0 },
+  { "single-slow", 0, PFN_NONE, 3, 1, 0 },
+  { "double", 1, PFN_NONE, 0, 1, 1 },
+  { "double-slow", 1, PFN_NONE, 3, 1, 1 },
+  { "no-page-1", 1, PFN_DIRTY_1, 1, 1, 0 },
+  { "no-fb2m", 1, PFN_FB2M, 0, 0, 0 },
+};
+
+static void
+frontend_reset (const struct scenario *sc)
+{
+  xen_pfn_t *fb2m;
+  unsigned int i;
+
+  memset (fe.page, 0, XC_PAGE_SIZE);
+  fe.page->fb2m[0] = PFN_FB2M;
+  fe.page->fb2m_nents = FB_PAGES;
+  fe.page->dirty_bitmap_page = PFN_DIRTY_0;
+
+  memset (fe.bitmap[0], 0, XC_PAGE_SIZE);
+  memset (fe.bitmap[1], 0, XC_PAGE_SIZE);
+  fb2m = mmap (NULL, XC_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED,
+               fe.memfd, (off_t) PFN_FB2M * XC_PAGE_SIZE);
+  for (i = 0; i < FB_PAGES; i++)
+    fb2m[i] = PFN_FB + i;
+  munmap (fb2m, XC_PAGE_SIZE);
+
+  fe.request_db = sc->request_db;
+  fe.unmappable = sc->unmappable;
+  fe.backend_db = -1;
+  fe.double_buffer = 0;
+  fe.cur = 0;
+  memset (fe.accum, 0, sizeof (fe.accum));
+  fe.delay = sc->delay;
+  fe.ndue = 0;
+  fe.fifo_head = fe.fifo_count = 0;
+  fe.tick = 0;
+  fe.in_refresh = 0;
+  fe.refreshes = fe.on_tick = fe.full = fe.mismatches = fe.overflows = 0;
+}
+
+static int
+run (const struct scenario *sc, unsigned int ticks)
+{
+  struct xenfb_device dev;
+  struct surface *s;
+  uint32_t seed = 1;
+  unsigned int i;
+  int connected, ok;
+
+  frontend_reset (sc);
+  memset (&dev, 0, sizeof (dev));
+  dev.domid = 1;
+
+  fe.fb = xenfb_alloc (NULL, 0, &dev);
+  xenfb_init (fe.fb);
+  connected = !xenfb_connect (fe.fb);
+  s = fe.fb->s;
+
+  if (!connected)
+    {
+      ok = !sc->connects;
+      printf ("%-12s %8s %8s %8s %8s %8s %s\n", sc->name, "-", "-", "-", "-",
+              "-", ok ? "ok (refused)" : "FAIL");
+      xenfb_free (fe.fb);
+      return ok ? 0 : -1;
+    }
+
+  /* The frontend reads the answer once the backend is connected. */
+  fe.double_buffer = sc->request_db && fe.backend_db == 1;
+
+  /* Then stop refreshing and let the last answers come in. */
+  for (i = 0; i < ticks + MAX_DELAY + 2; i++, fe.tick++)
+    {
+      if (i < ticks)
+        frontend_draw (&seed);
+
+      if (i < ticks + 1)
+        {
+          fe.in_refresh = 1;
+          xenfb_refresh_surface (&dev.device, s);
+          fe.in_refresh = 0;
+        }
+
+      frontend_deliver ();
+    }
+
+  /* A double-buffered bitmap may be waiting for the next refresh. */
+  ok = connected == sc->connects &&
+       fe.double_buffer == sc->double_buffer &&
+       fe.fb->dirty_count == (sc->double_buffer ? 2 : 1) &&
+       fe.refreshes >= ticks / (sc->delay + 2) &&
+       !fe.full && !fe.mismatches && !fe.overflows &&
+       fe.fifo_count <= (unsigned int) fe.double_buffer &&
+       (!fe.double_buffer || fe.on_tick == fe.refreshes);
+
+  printf ("%-12s %8s %8lu %8lu %8lu %8lu %s\n", sc->name,
+          fe.double_buffer ? "double" : "single", fe.refreshes, fe.on_tick,
+          fe.full, fe.mismatches, ok ? "ok" : "FAIL");
+
+  xenfb_free (fe.fb);
+  fe.fb = NULL;
+
+  return ok ? 0 : -1;
+}
+
+int
+main (int argc, char **argv)
+{
+  unsigned int ticks = argc > 1 ? strtoul (argv[1], NULL, 0) : 1000;
+  unsigned int i;
+  int rv = 0;
+
+  if (!ticks)
+    {
+      fprintf (stderr, "usage: %s [refreshes]\n", argv[0]);
+      return 1;
+    }
+
+  event_init ();
+
+  fe.memfd = syscall (SYS_memfd_create, "xenfb-loopback-test", 0);
+  if (fe.memfd < 0 ||
+      ftruncate (fe.memfd, (off_t) PFN_COUNT * XC_PAGE_SIZE) ||
+      pipe (fe.evtchn) ||
+      posix_memalign ((void **) &fe.page, XC_PAGE_SIZE, XC_PAGE_SIZE))
+    {
+      perror ("xenfb-loopback-test");
+      return 1;
+    }
+  for (i = 0; i < 2; i++)
+    {
+      fe.bitmap[i] = mmap (NULL, XC_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                           MAP_SHARED, fe.memfd,
+                           (off_t) (PFN_DIRTY_0 + i) * XC_PAGE_SIZE);
+      if (fe.bitmap[i] == MAP_FAILED)
+        {
+          perror ("mmap");
+          return 1;
+        }
+    }
+
+  printf ("%-12s %8s %8s %8s %8s %8s\n", "scenario", "mode", "refresh",
+          "on tick", "full", "mismatch");
+  for (i = 0; i < sizeof (scenarios) / sizeof (scenarios[0]); i++)
+    if (run (&scenarios[i], ticks))
+      rv = 1;
+
+  printf ("%s\n", rv ? "FAIL" : "PASS");
+
+  return rv;
+}
@@ -46,6 +46,33 @@
     (XENFB2_DEFAULT_WIDTH * XENFB2_DEFAULT_BPP / 8)
 #define XENFB2_DEFAULT_OFFSET 0
 
+/*
+ * Double-buffered dirty bitmap.
+ *
+ * The backend advertises XENFB2_FEATURE_DIRTY_DB. A frontend that supports it
+ * writes XENFB2_REQUEST_DIRTY_DB = 1 and the frame of its second bitmap page
+ * in XENFB2_DIRTY_PAGE_1 before connecting. It then fills one bitmap while
+ * surfman reads the other: on UPDATE_DIRTY it switches to the other bitmap,
+ * clears it and answers DIRTY_READY. The bitmap it left is complete and
+ * belongs to surfman until the next UPDATE_DIRTY. Both ends start on bitmap 0
+ * and alternate, so the events carry no index.
+ *
+ * Surfman consumes the bitmap completed by the previous request and sends the
+ * next request on the same refresh, so refreshes never wait for the guest.
+ * Frontends that do not ask for it keep the request/DIRTY_READY handshake.
+ *
+ * The backend writes XENFB2_DIRTY_DB = 0 or 1 before it reports Connected:
+ * a frontend that asked but reads 0 (e.g. its second page could not be
+ * mapped) must keep the single bitmap handshake too.
+ */
+#define XENFB2_FEATURE_DIRTY_DB "feature-dirty-double-buffer"
+#define XENFB2_REQUEST_DIRTY_DB "request-dirty-double-buffer"
+#define XENFB2_DIRTY_PAGE_1 "dirty-bitmap-page-1"
+#define XENFB2_DIRTY_DB "dirty-double-buffer"
+
+/* Time without DIRTY_READY before refreshing the whole surface. */
+#define XENFB2_DIRTY_TIMEOUT_SEC 10
+
 static struct event backend_xenstore_event;
 
 struct xenfb_device;
@@ -58,18 +85,34 @@ struct xenfb_framebuffer
   int devid;
 
   void *page;
-  union xenfb2_in_event *evt_reply;
+  uint32_t in_prod;             /* Private producer index */
+  unsigned int in_pending;      /* Events queued but not published yet */
 
   unsigned long fb_npages;
   unsigned long *fb2m;
   unsigned long fb2m_size;
 
-  uint8_t *dirty;
-  struct timeval dirty_tv;
+  uint8_t *dirty[2];
+  unsigned int dirty_count;     /* 2 once double-buffering is negotiated */
+  unsigned int dirty_idx;       /* Bitmap the frontend completes next */
+  int dirty_ready;              /* dirty[dirty_idx] complete, not consumed */
+  struct timeval dirty_tv;      /* UPDATE_DIRTY in flight since */
 
   struct event evtchn_event;
 
   int cache_attr;
+
+  /* Ring activity, see xenfb_dump_stats. */
+  struct
+  {
+    unsigned long wakeups;      /* Event channel upcalls */
+    unsigned long spurious;     /* Upcalls with nothing to consume */
+    unsigned long unnotified;   /* Upcalls only consuming, not notified */
+    unsigned long out_events;   /* Events consumed from the out ring */
+    unsigned long in_events;    /* Events published on the in ring */
+    unsigned long notifies;     /* Notifications sent to the frontend */
+    unsigned long ring_full;    /* Events dropped, in ring full */
+  } stats;
 };
 
 struct xenfb_device
@@ -125,6 +168,18 @@ xenfb_dirty_ready (struct xenfb_framebuffer *fb)
 {
   struct surface *s = fb->s;
 
+  /*
+  ** Double-buffered: the frontend switched bitmaps, keep the completed one
+  ** for the next refresh.
+  */
+  if (fb->dirty_count == 2)
+    {
+      if (timerisset (&fb->dirty_tv))
+        fb->dirty_ready = 1;
+      timerclear (&fb->dirty_tv);
+      return;
+    }
+
   /*
   ** Check that the surface timer still exists,
   ** and that the plugin requires an update.
@@ -132,19 +187,17 @@ xenfb_dirty_ready (struct xenfb_framebuffer *fb)
   if ( s && timerisset (&fb->dirty_tv) &&
       surface_need_refresh (s) )
     {
-      surface_refresh (s, fb->dirty);
+      surface_refresh (s, fb->dirty[0]);
 
-      if (!fb->dirty)
+      if (!fb->dirty[0])
         {
           struct xenfb2_page *page = fb->page;
 
-          if (MAP_FAILED == (fb->dirty = xc_mmap_foreign (NULL, XC_PAGE_SIZE, 
-                                       PROT_READ, fb->dev->domid,
-                                       &page->dirty_bitmap_page)))
-            {
-              surfman_error ("could not xc_mmap_foreign. resetting dirty ptr");
-              fb->dirty = NULL;
-            }
+          fb->dirty[0] = xc_mmap_foreign (NULL, XC_PAGE_SIZE, PROT_READ,
+                                          fb->dev->domid,
+                                          &page->dirty_bitmap_page);
+          if (!fb->dirty[0])
+            surfman_error ("could not xc_mmap_foreign the dirty bitmap");
         }
     }
   timerclear(&fb->dirty_tv);
@@ -169,50 +222,91 @@ xenfb_resize (struct xenfb_framebuffer *fb, struct xenfb2_mode *mode)
                              mode->offset);
 }
 
-static void
-xenfb_check_mode (struct xenfb_framebuffer *fb, struct xenfb2_mode *mode)
+/*
+ * Events for the frontend are written to the in ring as they are produced,
+ * but only made visible by xenfb_publish_events, so everything produced while
+ * handling an upcall or a refresh goes out under a single notification.
+ */
+static int
+xenfb_queue_event (struct xenfb_framebuffer *fb, union xenfb2_in_event *event)
 {
-  unsigned int linesize;
+  struct xenfb2_page *page = fb->page;
 
-  fb->evt_reply = xcalloc (1, sizeof (union xenfb2_in_event));
-  fb->evt_reply->type = XENFB2_TYPE_MODE_REPLY;
+  if (!fb->in_pending)
+    fb->in_prod = page->in_prod;
+  mb ();
+  if (fb->in_prod - page->in_cons >= XENFB2_IN_RING_LEN)
+    {
+      fb->stats.ring_full++;
+      return -1;
+    }
 
-  linesize = xenfb_get_linesize (fb, mode->xres, mode->yres, mode->bpp);
+  XENFB2_IN_RING_REF (page, fb->in_prod) = *event;
+  fb->in_prod++;
+  fb->in_pending++;
 
-  fb->evt_reply->mode_reply.pitch = linesize;
-  fb->evt_reply->mode_reply.mode_ok = ! !linesize;
+  return 0;
+}
+
+static unsigned int
+xenfb_publish_events (struct xenfb_framebuffer *fb)
+{
+  struct xenfb2_page *page = fb->page;
+  unsigned int n = fb->in_pending;
+
+  if (!n)
+    return 0;
+
+  wmb ();
+  page->in_prod = fb->in_prod;
+  fb->in_pending = 0;
+  fb->stats.in_events += n;
+
+  return n;
 }
 
 static void
-xenfb_set_pages (struct xenfb_framebuffer *fb)
+xenfb_notify (struct xenfb_framebuffer *fb)
 {
-  surface_update_pfns (fb->s, fb->dev->domid, fb->fb2m, fb->fb2m, fb->fb_npages);
+  fb->stats.notifies++;
+  backend_evtchn_notify (fb->back, fb->devid);
 }
 
 static void
-xenfb_send_event (struct xenfb_framebuffer *fb, union xenfb2_in_event *event)
+xenfb_check_mode (struct xenfb_framebuffer *fb, struct xenfb2_mode *mode)
 {
-  uint32_t prod;
-  struct xenfb2_page *page = fb->page;
+  union xenfb2_in_event reply;
+  unsigned int linesize;
 
-  prod = page->in_prod;
-  mb ();
-  XENFB2_IN_RING_REF (page, prod) = *event;
-  wmb ();
-  page->in_prod = prod + 1;
+  linesize = xenfb_get_linesize (fb, mode->xres, mode->yres, mode->bpp);
 
-  backend_evtchn_notify (fb->back, fb->devid);
+  memset (&reply, 0, sizeof (reply));
+  reply.type = XENFB2_TYPE_MODE_REPLY;
+  reply.mode_reply.pitch = linesize;
+  reply.mode_reply.mode_ok = ! !linesize;
+
+  if (xenfb_queue_event (fb, &reply))
+    surfman_warning ("In ring full, dropping mode reply for dom%d",
+                     fb->dev->domid);
 }
 
 static void
+xenfb_set_pages (struct xenfb_framebuffer *fb)
+{
+  surface_update_pfns (fb->s, fb->dev->domid, fb->fb2m, fb->fb2m, fb->fb_npages);
+}
+
+/* Returns the number of events consumed from the out ring. */
+static unsigned int
 xenfb_handle_events (struct xenfb_framebuffer *fb)
 {
   uint32_t prod, cons;
+  unsigned int n;
   struct xenfb2_page *page = fb->page;
 
   prod = page->out_prod;
   if (prod == page->out_cons)
-    return;
+    return 0;
   rmb ();
   for (cons = page->out_cons; cons != prod; cons++)
     {
@@ -228,12 +322,17 @@ xenfb_handle_events (struct xenfb_framebuffer *fb)
           break;
         case XENFB2_TYPE_DIRTY_READY:
           xenfb_dirty_ready (fb);
+          break;
         default:
           break;
         }
     }
   mb ();
+  n = cons - page->out_cons;
   page->out_cons = cons;
+  fb->stats.out_events += n;
+
+  return n;
 }
 
 /* ------------------------------------------------------------------------- */
@@ -281,6 +380,8 @@ xenfb_init (xen_device_t xendev)
     "default-pitch", "%u", XENFB2_DEFAULT_PITCH);
   backend_print (fb->back, fb->devid,
     "videoram", "%u", XENFB2_DEFAULT_VIDEORAM);
+  backend_print (fb->back, fb->devid,
+    XENFB2_FEATURE_DIRTY_DB, "%u", 1);
 
   surface_update_format (fb->s,
     XENFB2_DEFAULT_WIDTH,
@@ -298,6 +399,68 @@ xenfb_evtchn_handler (int fd, short event, void *priv)
     backend_evtchn_handler (priv);
 }
 
+/*
+ * Map the frontend's second dirty bitmap if it asked for double-buffering.
+ * Anything missing leaves the device on the single bitmap handshake.
+ */
+static void
+xenfb_connect_dirty_db (struct xenfb_framebuffer *fb)
+{
+  char *val;
+  char *end;
+  xen_pfn_t pfn;
+  int enable = 0;
+
+  fb->dirty_count = 1;
+  fb->dirty_idx = 0;
+  fb->dirty_ready = 0;
+
+  if (!fb->dirty[0])
+    return;
+
+  val = xenstore_dom_read (fb->dev->domid, "device/vfb/%d/%s",
+                           fb->devid, XENFB2_REQUEST_DIRTY_DB);
+  if (val)
+    {
+      enable = (strtol (val, NULL, 10) == 1);
+      free (val);
+    }
+  if (!enable)
+    return;
+
+  val = xenstore_dom_read (fb->dev->domid, "device/vfb/%d/%s",
+                           fb->devid, XENFB2_DIRTY_PAGE_1);
+  if (!val)
+    {
+      surfman_warning ("dom%d vfb%d requested a double-buffered dirty bitmap "
+                       "without a second page", fb->dev->domid, fb->devid);
+      return;
+    }
+  pfn = strtoul (val, &end, 0);
+  if (*val == '\0' || *end != '\0')
+    {
+      surfman_warning ("dom%d vfb%d: invalid %s \"%s\"", fb->dev->domid,
+                       fb->devid, XENFB2_DIRTY_PAGE_1, val);
+      free (val);
+      return;
+    }
+  free (val);
+
+  /* xc_mmap_foreign returns NULL on failure, not MAP_FAILED. */
+  fb->dirty[1] = xc_mmap_foreign (NULL, XC_PAGE_SIZE, PROT_READ,
+                                  fb->dev->domid, &pfn);
+  if (!fb->dirty[1])
+    {
+      surfman_error ("dom%d vfb%d: cannot map the second dirty bitmap, "
+                     "staying on a single one", fb->dev->domid, fb->devid);
+      return;
+    }
+
+  fb->dirty_count = 2;
+  surfman_info ("dom%d vfb%d: double-buffered dirty bitmap",
+                fb->dev->domid, fb->devid);
+}
+
 static int
 xenfb_connect (xen_device_t xendev)
 {
@@ -323,22 +486,23 @@ xenfb_connect (xen_device_t xendev)
     (page->fb2m_nents * sizeof (unsigned long) +
      (XENFB_PAGE_SIZE - 1)) & ~(XENFB_PAGE_SIZE - 1);
 
-  if (MAP_FAILED == (fb->fb2m = xc_mmap_foreign (NULL, fb->fb2m_size,
-                              PROT_READ | PROT_WRITE,
-                              fb->dev->domid, page->fb2m)))
+  fb->fb2m = xc_mmap_foreign (NULL, fb->fb2m_size, PROT_READ | PROT_WRITE,
+                              fb->dev->domid, page->fb2m);
+  if (!fb->fb2m)
     {
       surfman_error ("xc_mmap_foreign failed!");
-      fb->fb2m = NULL;
       return -1;
-    }    
+    }
 
-  if (MAP_FAILED == (fb->dirty = xc_mmap_foreign (NULL, XC_PAGE_SIZE,
-                               PROT_READ, fb->dev->domid,
-                               &page->dirty_bitmap_page)))
-    {
-      surfman_error ("xc_mmap_foreign failed!");
-      fb->dirty = NULL;
-    }    
+  fb->dirty[0] = xc_mmap_foreign (NULL, XC_PAGE_SIZE, PROT_READ,
+                                  fb->dev->domid, &page->dirty_bitmap_page);
+  if (!fb->dirty[0])
+    surfman_error ("xc_mmap_foreign failed!");
+
+  xenfb_connect_dirty_db (fb);
+  backend_print (fb->back, fb->devid, XENFB2_DIRTY_DB, "%u",
+                 fb->dirty_count == 2);
+  timerclear (&fb->dirty_tv);
 
   xenfb_set_pages(fb);
 
@@ -353,13 +517,18 @@ xenfb_connect (xen_device_t xendev)
 static void
 xenfb_framebuffer_cleanup (struct xenfb_framebuffer *fb)
 {
+  unsigned int i;
+
   event_del (&fb->evtchn_event);
 
-  if (fb->dirty)
-    {
-      munmap (fb->dirty, XC_PAGE_SIZE);
-      fb->dirty = NULL;
-    }
+  for (i = 0; i < 2; i++)
+    if (fb->dirty[i])
+      {
+        munmap (fb->dirty[i], XC_PAGE_SIZE);
+        fb->dirty[i] = NULL;
+      }
+  fb->dirty_count = 0;
+  fb->dirty_ready = 0;
   if (fb->fb2m)
     {
       munmap (fb->fb2m, fb->fb2m_size);
@@ -371,6 +540,7 @@ xenfb_framebuffer_cleanup (struct xenfb_framebuffer *fb)
       backend_unmap_shared_page (fb->back, fb->devid, fb->page);
       fb->page = NULL;
     }
+  fb->in_pending = 0;
 }
 
 static void
@@ -398,16 +568,26 @@ static void
 xenfb_event (xen_device_t xendev)
 {
   struct xenfb_framebuffer *fb = xendev;
+  struct xenfb2_page *page = fb->page;
+  unsigned int consumed;
+  int out_full;
 
-  xenfb_handle_events (fb);
-  backend_evtchn_notify (fb->back, fb->devid);
+  fb->stats.wakeups++;
+  if (!page)
+    return;
 
-  if (fb->evt_reply)
-    {
-      xenfb_send_event (fb, fb->evt_reply);
-      free (fb->evt_reply);
-      fb->evt_reply = NULL;
-    }
+  /*
+   * Only notify for events produced, or for room made in a full out ring
+   * the frontend may be waiting on. One notification covers both.
+   */
+  out_full = page->out_prod - page->out_cons >= XENFB2_OUT_RING_LEN;
+  consumed = xenfb_handle_events (fb);
+  if (xenfb_publish_events (fb) || (consumed && out_full))
+    xenfb_notify (fb);
+  else if (consumed)
+    fb->stats.unnotified++;
+  else
+    fb->stats.spurious++;
 }
 
 static void
@@ -465,31 +645,74 @@ xenfb_refresh_surface (struct device *device, struct surface *s)
   if (!fb->page)
     return;
 
+  /* Double-buffered: the bitmap completed for the last request is ours. */
+  if (fb->dirty_ready)
+    {
+      surface_refresh (s, fb->dirty[fb->dirty_idx]);
+      fb->dirty_idx ^= 1;
+      fb->dirty_ready = 0;
+    }
+
   if (timerisset (&fb->dirty_tv))
     {
       struct timeval delay;
 
       timersub (&tv, &fb->dirty_tv, &delay);
 
-      if (delay.tv_sec >= 10)
+      if (delay.tv_sec >= XENFB2_DIRTY_TIMEOUT_SEC)
         {
           surfman_warning ("Frontend unresponsive, clearing timer and refreshing manually");
           surface_refresh (s, NULL);
-          timerclear(&fb->dirty_tv);
+          /*
+           * The double-buffered frontend still owes a DIRTY_READY for the
+           * request in flight; asking again would get both ends out of step.
+           */
+          if (fb->dirty_count == 2)
+            fb->dirty_tv = tv;
+          else
+            timerclear(&fb->dirty_tv);
         }
 
       return;
     }
 
-  fb->dirty_tv = tv;
   evt.type = XENFB2_TYPE_UPDATE_DIRTY;
-  xenfb_send_event (fb, (union xenfb2_in_event *)&evt);
+  if (xenfb_queue_event (fb, (union xenfb2_in_event *)&evt))
+    return;
+  fb->dirty_tv = tv;
+  if (xenfb_publish_events (fb))
+    xenfb_notify (fb);
 
   /*
    * We receive the dirty bitmap update asynchronously.
    */
 }
 
+static void
+xenfb_dump_stats (struct device *device)
+{
+  struct xenfb_device *dev = (struct xenfb_device *)device;
+  unsigned int i;
+
+  for (i = 0; i < MAX_DEVID; i++)
+    {
+      struct xenfb_framebuffer *fb = dev->framebuffers[i];
+
+      if (!fb)
+        continue;
+
+      surfman_info ("xenfb dom%d vfb%d: %lu wakeups (%lu spurious, "
+                    "%lu consuming only), "
+                    "%lu events consumed, %lu events sent, %lu notifications, "
+                    "%lu dropped on full ring",
+                    dev->domid, fb->devid,
+                    fb->stats.wakeups, fb->stats.spurious,
+                    fb->stats.unnotified,
+                    fb->stats.out_events, fb->stats.in_events,
+                    fb->stats.notifies, fb->stats.ring_full);
+    }
+}
+
 static void
 xenfb_monitor_update (struct device *device, int monitor_id, int enable)
 {
@@ -567,6 +790,7 @@ static struct device_ops xenfb_device_ops = {
   .takedown = xenfb_takedown,
   .get_surface = xenfb_get_surface,
   .is_active = xenfb_is_active,
+  .dump_stats = xenfb_dump_stats,
 };
 
 struct device *